@@ -0,0 +1,653 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#ifdef AR_GZIP_SUPPORT
+#include <zlib.h>
+#endif
+
+#include "bam.h"
+#include "debug.h"
+#include "fastq.h"
+#include "linereader.h"
+#include "main.h"
+#include "threads.h"
+
+namespace ar
+{
+
+const unsigned char BGZF_EOF_BLOCK[28] = {
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+    0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00
+};
+
+//! Size of BGZF header, including the 'BC' extra sub-field
+const size_t BGZF_HEADER_SIZE = 18;
+//! Size of BGZF footer (CRC32 and ISIZE)
+const size_t BGZF_FOOTER_SIZE = 8;
+
+//! Size of the fixed-length part of BAM records, excluding 'block_size'
+const size_t BAM_FIXED_SIZE = 32;
+//! Maximum length of read names, excluding the terminating NUL
+const size_t BAM_MAX_NAME_LENGTH = 254;
+//! BAI bin for unmapped reads without a position; reg2bin(-1, 0)
+const uint16_t BAM_UNMAPPED_BIN = 4680;
+
+
+//! Decoding of 4-bit nucleotides; ambiguous bases are treated as Ns
+const char BAM_DECODE_NUCLEOTIDE[] = "NACNGNNNTNNNNNNN";
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'bam_error'
+
+bam_error::bam_error(const std::string& message)
+  : fastq_error(message)
+{
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Encoding of BAM records
+
+/** Appends an unsigned integer of 'nbytes' bytes in little-endian order. */
+inline void append_le(std::string& dst, uint32_t value, size_t nbytes)
+{
+    for (size_t i = 0; i < nbytes; ++i) {
+        dst.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+
+
+/** Writes an unsigned integer of 'nbytes' bytes in little-endian order. */
+inline void write_le(unsigned char* dst, uint32_t value, size_t nbytes)
+{
+    for (size_t i = 0; i < nbytes; ++i) {
+        dst[i] = static_cast<unsigned char>((value >> (8 * i)) & 0xff);
+    }
+}
+
+
+/** Reads an unsigned integer of 'nbytes' bytes in little-endian order. */
+inline uint32_t read_le(const char* src, size_t nbytes)
+{
+    uint32_t value = 0;
+    for (size_t i = 0; i < nbytes; ++i) {
+        value |= static_cast<uint32_t>(static_cast<unsigned char>(src[i])) << (8 * i);
+    }
+
+    return value;
+}
+
+
+/** Returns the 4-bit BAM encoding of a nucleotide ("=ACMGRSVTWYHKDBN"). */
+inline unsigned char encode_nucleotide(char nt)
+{
+    switch (nt) {
+        case 'A': return 1;
+        case 'C': return 2;
+        case 'G': return 4;
+        case 'T': return 8;
+        default: return 15;
+    }
+}
+
+
+void bam_encode_record(std::string& dst, const fastq& read, uint16_t flags,
+                       char mate_separator, size_t max_score)
+{
+    std::string name = read.name();
+    if ((flags & BAM_FPAIRED) && name.size() >= 2) {
+        // Mate separators are normalized when PE reads are validated
+        const char separator = name.at(name.size() - 2);
+        const char digit = name.at(name.size() - 1);
+
+        if ((separator == mate_separator || separator == MATE_SEPARATOR)
+                && (digit == '1' || digit == '2')) {
+            name.resize(name.size() - 2);
+        }
+    }
+
+    if (name.size() > BAM_MAX_NAME_LENGTH) {
+        name.resize(BAM_MAX_NAME_LENGTH);
+    }
+
+    const std::string& sequence = read.sequence();
+    const std::string& qualities = read.qualities();
+    const size_t seq_len = sequence.length();
+    const size_t block_size = BAM_FIXED_SIZE + name.size() + 1
+                              + (seq_len + 1) / 2 + seq_len;
+
+    dst.reserve(dst.size() + block_size + 4);
+    append_le(dst, block_size, 4);
+    append_le(dst, 0xffffffff, 4); // refID
+    append_le(dst, 0xffffffff, 4); // pos
+    append_le(dst, name.size() + 1, 1); // l_read_name
+    append_le(dst, 0, 1); // mapq
+    append_le(dst, BAM_UNMAPPED_BIN, 2); // bin
+    append_le(dst, 0, 2); // n_cigar_op
+    append_le(dst, flags, 2); // flag
+    append_le(dst, seq_len, 4); // l_seq
+    append_le(dst, 0xffffffff, 4); // next_refID
+    append_le(dst, 0xffffffff, 4); // next_pos
+    append_le(dst, 0, 4); // tlen
+
+    dst.append(name);
+    dst.push_back('\0');
+
+    for (size_t i = 0; i < seq_len; i += 2) {
+        unsigned char packed = encode_nucleotide(sequence[i]) << 4;
+        if (i + 1 < seq_len) {
+            packed |= encode_nucleotide(sequence[i + 1]);
+        }
+
+        dst.push_back(static_cast<char>(packed));
+    }
+
+    for (size_t i = 0; i < seq_len; ++i) {
+        const size_t score = qualities[i] - PHRED_OFFSET_33;
+        dst.push_back(static_cast<char>(std::min(score, max_score)));
+    }
+}
+
+
+std::string bam_header()
+{
+    // Version is stored as "ver. X.Y.Z"
+    std::string version = VERSION;
+    if (version.find("ver. ") == 0) {
+        version = version.substr(5);
+    }
+
+    const std::string text = "@HD\tVN:1.6\tSO:unsorted\tGO:query\n"
+                             "@PG\tID:" + NAME + "\tPN:" + NAME
+                             + "\tVN:" + version + "\n";
+
+    std::string header = "BAM\1";
+    append_le(header, text.size(), 4); // l_text
+    header.append(text);
+    append_le(header, 0, 4); // n_ref
+
+    return header;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Decoding of SAM / BAM records
+
+/** Returns the name of a read with the mate number added, if paired. */
+std::string add_mate_number(const std::string& name, uint16_t flags,
+                            char mate_separator)
+{
+    if (flags & BAM_FPAIRED) {
+        switch (flags & (BAM_FREAD1 | BAM_FREAD2)) {
+            case BAM_FREAD1:
+                return name + mate_separator + '1';
+
+            case BAM_FREAD2:
+                return name + mate_separator + '2';
+
+            default:
+                break;
+        }
+    }
+
+    return name;
+}
+
+
+bool bam_decode_header(const std::string& data, size_t& offset)
+{
+    size_t pos = offset;
+    if (data.size() < pos + 8) {
+        return false;
+    } else if (data.compare(pos, 4, "BAM\1", 4)) {
+        throw bam_error("input is not a BAM file; magic string not found");
+    }
+
+    const uint32_t l_text = read_le(data.data() + pos + 4, 4);
+    pos += 8 + l_text;
+
+    if (data.size() < pos + 4) {
+        return false;
+    }
+
+    const uint32_t n_ref = read_le(data.data() + pos, 4);
+    pos += 4;
+
+    for (uint32_t i = 0; i < n_ref; ++i) {
+        if (data.size() < pos + 4) {
+            return false;
+        }
+
+        // l_name, name, and l_ref
+        pos += 4 + read_le(data.data() + pos, 4) + 4;
+    }
+
+    if (data.size() < pos) {
+        return false;
+    }
+
+    offset = pos;
+    return true;
+}
+
+
+bool bam_decode_record(const std::string& data, size_t& offset, fastq& read,
+                       uint16_t& flags, const fastq_encoding& encoding,
+                       char mate_separator)
+{
+    if (data.size() < offset + 4) {
+        return false;
+    }
+
+    const size_t block_size = read_le(data.data() + offset, 4);
+    if (data.size() < offset + 4 + block_size) {
+        return false;
+    } else if (block_size < BAM_FIXED_SIZE) {
+        throw bam_error("malformed BAM record; record too short");
+    }
+
+    const char* record = data.data() + offset + 4;
+    const size_t l_read_name = static_cast<unsigned char>(record[8]);
+    const size_t n_cigar_op = read_le(record + 12, 2);
+    const size_t l_seq = read_le(record + 16, 4);
+    flags = read_le(record + 14, 2);
+
+    const size_t seq_offset = BAM_FIXED_SIZE + l_read_name + 4 * n_cigar_op;
+    const size_t qual_offset = seq_offset + (l_seq + 1) / 2;
+    if (!l_read_name || qual_offset + l_seq > block_size) {
+        throw bam_error("malformed BAM record; fields exceed record size");
+    } else if (record[BAM_FIXED_SIZE + l_read_name - 1]) {
+        throw bam_error("malformed BAM record; read name not NUL terminated");
+    }
+
+    const std::string name(record + BAM_FIXED_SIZE, l_read_name - 1);
+
+    std::string sequence(l_seq, 'N');
+    for (size_t i = 0; i < l_seq; ++i) {
+        const unsigned char packed = record[seq_offset + i / 2];
+        sequence[i] = BAM_DECODE_NUCLEOTIDE[(i % 2) ? (packed & 0xf) : (packed >> 4)];
+    }
+
+    std::string qualities(record + qual_offset, l_seq);
+    if (l_seq && static_cast<unsigned char>(qualities[0]) == 0xff) {
+        // Quality scores are missing
+        qualities.assign(l_seq, PHRED_OFFSET_33);
+    } else {
+        for (size_t i = 0; i < l_seq; ++i) {
+            // Clamped using unsigned arithmetic, before the offset is added
+            const size_t score = static_cast<unsigned char>(qualities[i]);
+            const size_t max_score = '~' + 1 - PHRED_OFFSET_33;
+            qualities[i] = static_cast<char>(std::min(score, max_score) + PHRED_OFFSET_33);
+        }
+    }
+
+    read = fastq(add_mate_number(name, flags, mate_separator),
+                 sequence, qualities, encoding);
+    if (flags & BAM_FREVERSE) {
+        read.reverse_complement();
+    }
+
+    offset += 4 + block_size;
+    return true;
+}
+
+
+void sam_decode_record(const std::string& line, fastq& read, uint16_t& flags,
+                       const fastq_encoding& encoding, char mate_separator)
+{
+    // QNAME, FLAG, [..], SEQ, QUAL
+    std::string fields[11];
+    size_t start = 0;
+    for (size_t i = 0; i < 11; ++i) {
+        if (start > line.size()) {
+            throw bam_error("malformed SAM record; expected at least 11 fields");
+        }
+
+        size_t end = line.find('\t', start);
+        if (end == std::string::npos) {
+            end = line.size();
+        }
+
+        if (i <= 1 || i >= 9) {
+            fields[i] = line.substr(start, end - start);
+        }
+
+        start = end + 1;
+    }
+
+    const std::string& flag_str = fields[1];
+    if (flag_str.empty() || flag_str.size() > 5
+            || flag_str.find_first_not_of("0123456789") != std::string::npos) {
+        throw bam_error("malformed SAM record; invalid FLAG field");
+    }
+
+    unsigned value = 0;
+    for (size_t i = 0; i < flag_str.size(); ++i) {
+        value = value * 10 + (flag_str[i] - '0');
+    }
+
+    if (value > 0xffff) {
+        throw bam_error("malformed SAM record; invalid FLAG field");
+    }
+
+    flags = value;
+
+    std::string& sequence = fields[9];
+    std::string& qualities = fields[10];
+    if (sequence == "*") {
+        sequence.clear();
+    }
+
+    if (qualities == "*") {
+        // Quality scores are missing
+        qualities.assign(sequence.size(), PHRED_OFFSET_33);
+    }
+
+    for (std::string::iterator it = sequence.begin(); it != sequence.end(); ++it) {
+        const char nt = *it & ~0x20; // uppercase
+        *it = (nt == 'A' || nt == 'C' || nt == 'G' || nt == 'T') ? nt : 'N';
+    }
+
+    read = fastq(add_mate_number(fields[0], flags, mate_separator),
+                 sequence, qualities, encoding);
+    if (flags & BAM_FREVERSE) {
+        read.reverse_complement();
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'sam_mate_collector'
+
+sam_mate_collector::sam_mate_collector(bool paired)
+  : m_paired(paired)
+  , m_mate_1()
+  , m_has_mate_1(false)
+{
+}
+
+
+void sam_mate_collector::add(fastq_vec& reads_1, fastq_vec& reads_2,
+                             const fastq& read, uint16_t flags)
+{
+    if (flags & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) {
+        return;
+    } else if (!m_paired) {
+        reads_1.push_back(read);
+        return;
+    }
+
+    const uint16_t mate = (flags & BAM_FPAIRED) ? (flags & (BAM_FREAD1 | BAM_FREAD2)) : 0;
+    if (mate == BAM_FREAD1) {
+        if (m_has_mate_1) {
+            throw bam_error("mate 1 read '" + m_mate_1.name() + "' is not "
+                            "followed by a mate 2 read");
+        }
+
+        m_mate_1 = read;
+        m_has_mate_1 = true;
+    } else if (mate == BAM_FREAD2) {
+        if (!m_has_mate_1) {
+            throw bam_error("mate 2 read '" + read.name() + "' is not "
+                            "preceded by a mate 1 read");
+        }
+
+        reads_1.push_back(m_mate_1);
+        reads_2.push_back(read);
+        m_has_mate_1 = false;
+    } else {
+        throw bam_error("read '" + read.name() + "' is not flagged as being "
+                        "either mate 1 or mate 2 of a pair; paired input is "
+                        "expected");
+    }
+}
+
+
+void sam_mate_collector::finalize() const
+{
+    if (m_has_mate_1) {
+        throw bam_error("mate 1 read '" + m_mate_1.name() + "' is not "
+                        "followed by a mate 2 read");
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'bgzf_reader'
+
+bgzf_reader::bgzf_reader(const std::string& fpath)
+  : m_filename(fpath)
+  , m_file(open_input_file(fpath))
+{
+    if (!m_file) {
+        throw io_error("bgzf_reader::open: failed to open file", errno);
+    }
+}
+
+
+bgzf_reader::~bgzf_reader()
+{
+    try {
+        close();
+    } catch (const std::exception& error) {
+        print_locker lock;
+        std::cerr << "Error closing file: " << error.what() << std::endl;
+        std::exit(1);
+    }
+}
+
+
+bool bgzf_reader::read_block(std::string& dst)
+{
+    if (!m_file) {
+        return false;
+    }
+
+    // Fixed gzip header, followed by XLEN
+    dst.resize(BGZF_HEADER_SIZE - 6);
+    const size_t nread = fread(&dst[0], 1, dst.size(), m_file);
+    if (!nread && feof(m_file)) {
+        dst.clear();
+        return false;
+    } else if (nread != dst.size()) {
+        if (ferror(m_file)) {
+            throw io_error("bgzf_reader::read_block: error reading file", errno);
+        }
+
+        throw bam_error("truncated BGZF block in '" + m_filename + "'");
+    } else if (dst.compare(0, 4, "\x1f\x8b\x08\x04", 4)) {
+        throw bam_error("'" + m_filename + "' is not a BGZF (BAM) file");
+    }
+
+    const size_t xlen = read_le(dst.data() + 10, 2);
+    dst.resize(dst.size() + xlen);
+    if (fread(&dst[BGZF_HEADER_SIZE - 6], 1, xlen, m_file) != xlen) {
+        throw bam_error("truncated BGZF block in '" + m_filename + "'");
+    }
+
+    // Locate the 'BC' sub-field containing the total block size
+    size_t block_size = 0;
+    for (size_t pos = BGZF_HEADER_SIZE - 6; pos + 4 <= dst.size(); ) {
+        const size_t slen = read_le(dst.data() + pos + 2, 2);
+        if (dst[pos] == 'B' && dst[pos + 1] == 'C' && slen == 2 && pos + 6 <= dst.size()) {
+            block_size = read_le(dst.data() + pos + 4, 2) + 1;
+            break;
+        }
+
+        pos += 4 + slen;
+    }
+
+    if (block_size < dst.size() + BGZF_FOOTER_SIZE) {
+        throw bam_error("'" + m_filename + "' is not a BGZF (BAM) file");
+    }
+
+    const size_t header_size = dst.size();
+    dst.resize(block_size);
+    if (fread(&dst[header_size], 1, block_size - header_size, m_file) != block_size - header_size) {
+        throw bam_error("truncated BGZF block in '" + m_filename + "'");
+    }
+
+    return true;
+}
+
+
+void bgzf_reader::close()
+{
+    // STDIN is left open, as it is not owned by the reader
+    if (m_file && m_file != stdin && fclose(m_file)) {
+        m_file = NULL;
+        throw io_error("bgzf_reader::close: error closing file", errno);
+    }
+
+    m_file = NULL;
+}
+
+
+bool bgzf_reader::is_open() const
+{
+    return m_file;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// BGZF compression
+
+#ifdef AR_GZIP_SUPPORT
+
+std::pair<size_t, unsigned char*> bgzf_compress(const char* data, size_t size,
+                                                int level)
+{
+    if (size > BGZF_BLOCK_SIZE) {
+        throw std::invalid_argument("bgzf_compress: too much data for block");
+    }
+
+    unsigned char* block = new unsigned char[BGZF_MAX_BLOCK_SIZE];
+
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+
+    // Raw deflate stream; header and footer are written below
+    if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        delete[] block;
+        throw thread_error("bgzf_compress: failed to initialize zlib stream");
+    }
+
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream.avail_in = size;
+    stream.next_out = block + BGZF_HEADER_SIZE;
+    stream.avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+
+    const int returncode = deflate(&stream, Z_FINISH);
+    const size_t compressed_size = stream.total_out;
+    deflateEnd(&stream);
+
+    if (returncode != Z_STREAM_END) {
+        delete[] block;
+        throw thread_error("bgzf_compress: failed to compress block");
+    }
+
+    const size_t block_size = BGZF_HEADER_SIZE + compressed_size + BGZF_FOOTER_SIZE;
+    AR_DEBUG_ASSERT(block_size <= BGZF_MAX_BLOCK_SIZE);
+
+    // GZip header with the BGZF specific 'BC' field; see SAM/BAM specification
+    const unsigned char header[] = {
+        0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+        0x42, 0x43, 0x02, 0x00
+    };
+
+    std::memcpy(block, header, sizeof(header));
+    write_le(block + 16, block_size - 1, 2); // BSIZE
+
+    const uLong crc = crc32(crc32(0L, Z_NULL, 0),
+                            reinterpret_cast<const Bytef*>(data), size);
+    write_le(block + block_size - 8, crc, 4);
+    write_le(block + block_size - 4, size, 4);
+
+    return std::pair<size_t, unsigned char*>(block_size, block);
+}
+
+
+void bgzf_decompress(const std::string& block, std::string& dst)
+{
+    if (block.size() < BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE) {
+        throw bam_error("malformed BGZF block");
+    }
+
+    const size_t data_offset = BGZF_HEADER_SIZE - 6 + read_le(block.data() + 10, 2);
+    const size_t isize = read_le(block.data() + block.size() - 4, 4);
+    if (data_offset + BGZF_FOOTER_SIZE > block.size() || isize > BGZF_MAX_BLOCK_SIZE) {
+        throw bam_error("malformed BGZF block");
+    }
+
+    const size_t dst_offset = dst.size();
+    // One additional byte to ensure that zlib can always make progress
+    dst.resize(dst_offset + isize + 1);
+
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+
+    if (inflateInit2(&stream, -15) != Z_OK) {
+        throw thread_error("bgzf_decompress: failed to initialize zlib stream");
+    }
+
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(block.data() + data_offset));
+    stream.avail_in = block.size() - data_offset - BGZF_FOOTER_SIZE;
+    stream.next_out = reinterpret_cast<Bytef*>(&dst[dst_offset]);
+    stream.avail_out = isize + 1;
+
+    const int returncode = inflate(&stream, Z_FINISH);
+    const size_t decompressed_size = stream.total_out;
+    inflateEnd(&stream);
+
+    if (returncode != Z_STREAM_END || decompressed_size != isize) {
+        throw bam_error("malformed BGZF block; decompression failed");
+    }
+
+    dst.resize(dst_offset + isize);
+
+    const uLong expected_crc = read_le(block.data() + block.size() - 8, 4);
+    const uLong crc = crc32(crc32(0L, Z_NULL, 0),
+                            reinterpret_cast<const Bytef*>(dst.data() + dst_offset), isize);
+    if (crc != expected_crc) {
+        throw bam_error("malformed BGZF block; CRC32 mismatch");
+    }
+}
+
+#endif
+
+} // namespace ar
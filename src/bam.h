@@ -0,0 +1,225 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#ifndef BAM_H
+#define BAM_H
+
+#include <cstdio>
+#include <string>
+#include <utility>
+
+#include <stdint.h>
+
+#include "commontypes.h"
+#include "fastq.h"
+
+namespace ar
+{
+
+/** Represents errors during parsing of SAM / BAM records. */
+class bam_error : public fastq_error
+{
+public:
+    /** Constructor; takes an error-message. */
+    bam_error(const std::string& message);
+};
+
+
+//! SAM flag: Template having multiple segments in sequencing
+const uint16_t BAM_FPAIRED = 0x1;
+//! SAM flag: Segment unmapped
+const uint16_t BAM_FUNMAP = 0x4;
+//! SAM flag: Next segment in the template unmapped
+const uint16_t BAM_FMUNMAP = 0x8;
+//! SAM flag: The first segment in the template
+const uint16_t BAM_FREAD1 = 0x40;
+//! SAM flag: The last segment in the template
+const uint16_t BAM_FREAD2 = 0x80;
+//! SAM flag: SEQ being reverse complemented
+const uint16_t BAM_FREVERSE = 0x10;
+//! SAM flag: Secondary alignment
+const uint16_t BAM_FSECONDARY = 0x100;
+//! SAM flag: Not passing filters, such as platform/vendor quality controls
+const uint16_t BAM_FQCFAIL = 0x200;
+//! SAM flag: Supplementary alignment
+const uint16_t BAM_FSUPPLEMENTARY = 0x800;
+
+//! Flags used for unaligned mate 1 reads with the mate present
+const uint16_t BAM_FLAGS_MATE_1 = BAM_FPAIRED | BAM_FUNMAP | BAM_FMUNMAP | BAM_FREAD1;
+//! Flags used for unaligned mate 2 reads with the mate present
+const uint16_t BAM_FLAGS_MATE_2 = BAM_FPAIRED | BAM_FUNMAP | BAM_FMUNMAP | BAM_FREAD2;
+//! Flags used for unaligned SE reads, singletons, and collapsed reads
+const uint16_t BAM_FLAGS_UNPAIRED = BAM_FUNMAP;
+//! Flags used for unaligned reads that were discarded
+const uint16_t BAM_FLAGS_DISCARDED = BAM_FUNMAP | BAM_FQCFAIL;
+
+//! Maximum number of (uncompressed) bytes stored in a single BGZF block;
+//! chosen such that the compressed block always fits in 64 KiB.
+const size_t BGZF_BLOCK_SIZE = 0xff00;
+//! Maximum size of a (compressed) BGZF block, including header and footer
+const size_t BGZF_MAX_BLOCK_SIZE = 0x10000;
+
+//! Empty BGZF block marking the end of a BGZF file
+extern const unsigned char BGZF_EOF_BLOCK[28];
+
+
+/**
+ * Appends a BAM record representing an unaligned read to 'dst'.
+ *
+ * The record contains the name of the read (excluding meta-information),
+ * the 4-bit encoded sequence, and raw Phred scores truncated to 'max_score';
+ * reference and position fields are set to -1. For paired reads (see
+ * BAM_FPAIRED), the mate number (e.g. "/1") is removed from the name, using
+ * 'mate_separator'.
+ */
+void bam_encode_record(std::string& dst, const fastq& read, uint16_t flags,
+                       char mate_separator, size_t max_score);
+
+/**
+ * Returns the uncompressed header of an unaligned BAM file; this consists of
+ * the magic string, a SAM header with @HD and @PG lines, and an empty list of
+ * reference sequences.
+ */
+std::string bam_header();
+
+
+/**
+ * Decodes the header of a BAM file starting at 'offset' in 'data'.
+ *
+ * If the header is complete, 'offset' is set to the position following the
+ * header and true is returned; otherwise false is returned. Throws bam_error
+ * if the data is not a BAM file.
+ */
+bool bam_decode_header(const std::string& data, size_t& offset);
+
+/**
+ * Decodes a single BAM record starting at 'offset' in 'data'.
+ *
+ * If the record is complete, 'read' and 'flags' are set, 'offset' is set to
+ * the position following the record, and true is returned; otherwise false
+ * is returned. Reverse complemented reads (BAM_FREVERSE) are converted back to
+ * the orientation in which they were sequenced, missing quality scores are
+ * set to 0, and the mate number is added to the names of paired reads using
+ * 'mate_separator' (e.g. "/1"). Quality scores are validated using 'encoding'.
+ * Throws bam_error or fastq_error on malformed records.
+ */
+bool bam_decode_record(const std::string& data, size_t& offset, fastq& read,
+                       uint16_t& flags, const fastq_encoding& encoding,
+                       char mate_separator);
+
+/**
+ * Decodes a single (tab separated) SAM record; see bam_decode_record.
+ */
+void sam_decode_record(const std::string& line, fastq& read, uint16_t& flags,
+                       const fastq_encoding& encoding, char mate_separator);
+
+
+/**
+ * Collects SE reads or pairs of mates decoded from SAM / BAM records.
+ *
+ * Secondary and supplementary records are skipped. In paired mode, mate 1
+ * and mate 2 records must immediately follow each other, as is the case for
+ * unaligned BAM files.
+ */
+class sam_mate_collector
+{
+public:
+    /** Constructor; 'paired' determines if reads are collected in pairs. */
+    sam_mate_collector(bool paired);
+
+    /**
+     * Adds a read to 'reads_1' / 'reads_2', or saves mate 1 reads until the
+     * mate 2 read has been seen. Throws bam_error if mates are not paired.
+     */
+    void add(fastq_vec& reads_1, fastq_vec& reads_2, const fastq& read,
+             uint16_t flags);
+
+    /** Throws bam_error if a mate 1 read is still waiting for its mate. */
+    void finalize() const;
+
+private:
+    //! True if reads are collected in pairs
+    bool m_paired;
+    //! Mate 1 read for which no mate 2 read has been seen
+    fastq m_mate_1;
+    //! True if 'm_mate_1' is set
+    bool m_has_mate_1;
+};
+
+
+/**
+ * Reads raw (compressed) blocks from a BGZF file; the path '-' is taken to
+ * mean STDIN. Errors are reported using io_error or bam_error.
+ */
+class bgzf_reader
+{
+public:
+    /** Constructor; opens file and throws on errors. */
+    bgzf_reader(const std::string& fpath);
+
+    /** Closes the file, if still open. */
+    ~bgzf_reader();
+
+    /** Reads a BGZF block into 'dst', returning false on EOF. */
+    bool read_block(std::string& dst);
+
+    /** Closes the file, if still open. */
+    void close();
+
+    /** Returns true if the file has not been closed. */
+    bool is_open() const;
+
+private:
+    //! Not implemented
+    bgzf_reader(const bgzf_reader&);
+    //! Not implemented
+    bgzf_reader& operator=(const bgzf_reader&);
+
+    //! Path of the file; used for error messages
+    std::string m_filename;
+    //! Input file; NULL if closed
+    FILE* m_file;
+};
+
+
+#ifdef AR_GZIP_SUPPORT
+/**
+ * Compresses at most BGZF_BLOCK_SIZE bytes into a single BGZF block.
+ *
+ * Returns the size of the block, and the block itself, which has been
+ * allocated using new[]. Throws std::invalid_argument if 'size' is greater
+ * than BGZF_BLOCK_SIZE, and thread_error if compression fails.
+ */
+std::pair<size_t, unsigned char*> bgzf_compress(const char* data, size_t size,
+                                                int level);
+
+/**
+ * Decompresses a single BGZF block, appending the data to 'dst'; throws
+ * bam_error if the block is malformed or fails the CRC32 check.
+ */
+void bgzf_decompress(const std::string& block, std::string& dst);
+#endif
+
+} // namespace ar
+
+#endif
@@ -0,0 +1,675 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <algorithm>
+
+#include "barcode_table.h"
+#include "debug.h"
+
+namespace ar
+{
+
+//! Value used for empty entries in the table, and for reads without matches
+const int NO_BARCODE = -1;
+//! Value used for sequences matching several barcodes equally well
+const int AMBIGUOUS_BARCODE = -2;
+//! Max number of bases in keys; 2 bits are used per base
+const size_t MAX_KEY_LENGTH = 32;
+//! Multiplier used for Fibonacci hashing of keys (2^64 / golden ratio)
+const uint64_t HASH_MULTIPLIER = (static_cast<uint64_t>(0x9E3779B9u) << 32) | 0x7F4A7C15u;
+//! The low bit of every 2-bit encoded base in a word
+const uint64_t LOW_BITS = (static_cast<uint64_t>(0x55555555u) << 32) | 0x55555555u;
+//! Number of barcodes for which distances are computed per pass
+const size_t SCAN_BLOCK_SIZE = 64;
+
+
+/**
+ * Adds the 2-bit encoding of the first 'length' bases of a sequence to a key,
+ * starting at base 'offset' of the key; returns false if the sequence is too
+ * short or contains bases other than ACGT.
+ */
+bool encode_bases(const std::string& sequence, size_t length, size_t offset, uint64_t& key)
+{
+    if (sequence.length() < length) {
+        return false;
+    }
+
+    for (size_t i = 0; i < length; ++i) {
+        uint64_t value = 0;
+        switch (sequence[i]) {
+            case 'A': value = 0; break;
+            case 'C': value = 1; break;
+            case 'G': value = 2; break;
+            case 'T': value = 3; break;
+            default:
+                return false;
+        }
+
+        key |= value << (2 * (offset + i));
+    }
+
+    return true;
+}
+
+
+/** Returns the 2-bit encoding of a base, or 4 for bases other than ACGT. */
+size_t encode_base(char nt)
+{
+    switch (nt) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        default:
+            return 4;
+    }
+}
+
+
+/**
+ * Orders barcodes by their packed sequences, each consisting of a fixed
+ * number of words, such that barcodes sharing a prefix are adjacent.
+ */
+class packed_key_order
+{
+public:
+    packed_key_order(const std::vector<uint64_t>& keys, size_t words)
+        : m_keys(keys)
+        , m_words(words)
+    {
+    }
+
+    bool operator()(size_t a, size_t b) const
+    {
+        for (size_t i = 0; i < m_words; ++i) {
+            const uint64_t key_a = m_keys.at(a * m_words + i);
+            const uint64_t key_b = m_keys.at(b * m_words + i);
+
+            if (key_a != key_b) {
+                return key_a < key_b;
+            }
+        }
+
+        return false;
+    }
+
+private:
+    const std::vector<uint64_t>& m_keys;
+    size_t m_words;
+};
+
+
+/**
+ * Packs the first 'length' bases of a sequence into 2-bit encoded words; the
+ * low bits of positions not containing ACGT, including positions past the
+ * end of the sequence, are set in 'mask'.
+ */
+void encode_words(const std::string& sequence, size_t length, uint64_t* words, uint64_t* mask)
+{
+    const size_t n_words = (length + MAX_KEY_LENGTH - 1) / MAX_KEY_LENGTH;
+    std::fill(words, words + n_words, 0);
+    std::fill(mask, mask + n_words, 0);
+
+    for (size_t pos = 0; pos < length; ++pos) {
+        const uint64_t value = (pos < sequence.length()) ? encode_base(sequence[pos]) : 4;
+        const size_t shift = 2 * (pos % MAX_KEY_LENGTH);
+
+        if (value > 3) {
+            mask[pos / MAX_KEY_LENGTH] |= static_cast<uint64_t>(1) << shift;
+        } else {
+            words[pos / MAX_KEY_LENGTH] |= value << shift;
+        }
+    }
+}
+
+
+/**
+ * Adds the number of mismatches between a word of a read and the same word
+ * of 'count' barcodes to 'distances'.
+ */
+inline void add_distances_impl(const uint64_t* keys, uint64_t word, uint64_t mask,
+                               size_t count, unsigned* distances)
+{
+    for (size_t i = 0; i < count; ++i) {
+        const uint64_t diff = keys[i] ^ word;
+
+        distances[i] += __builtin_popcountll(((diff | (diff >> 1)) & LOW_BITS) | mask);
+    }
+}
+
+
+/** Generic implementation of 'add_distances_impl'. */
+void add_distances_generic(const uint64_t* keys, uint64_t word, uint64_t mask,
+                           size_t count, unsigned* distances)
+{
+    add_distances_impl(keys, word, mask, count, distances);
+}
+
+
+#if defined(__GNUC__) && defined(__x86_64__)
+/** Implementation of 'add_distances_impl' using the POPCNT instruction. */
+__attribute__((target("popcnt")))
+void add_distances_popcnt(const uint64_t* keys, uint64_t word, uint64_t mask,
+                          size_t count, unsigned* distances)
+{
+    add_distances_impl(keys, word, mask, count, distances);
+}
+
+
+/** Implementation of 'add_distances_impl' vectorized using AVX-512 VPOPCNTDQ. */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+void add_distances_avx512(const uint64_t* keys, uint64_t word, uint64_t mask,
+                          size_t count, unsigned* distances)
+{
+    add_distances_impl(keys, word, mask, count, distances);
+}
+#endif
+
+
+typedef void (*add_distances_func)(const uint64_t*, uint64_t, uint64_t, size_t, unsigned*);
+
+
+/** Returns the fastest implementation of 'add_distances_impl' supported by the CPU. */
+add_distances_func select_add_distances()
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512vpopcntdq")) {
+        return add_distances_avx512;
+    } else if (__builtin_cpu_supports("popcnt")) {
+        return add_distances_popcnt;
+    }
+#endif
+
+    return add_distances_generic;
+}
+
+
+//! Implementation used by 'barcode_scanner'; selected on startup
+static const add_distances_func ADD_DISTANCES = select_add_distances();
+
+
+/** Returns the number of ways to choose k out of n items, as a double. */
+double choose(size_t n, size_t k)
+{
+    double result = 1.0;
+    for (size_t i = 0; i < k; ++i) {
+        result = result * (n - i) / (i + 1);
+    }
+
+    return result;
+}
+
+
+double barcode_neighbourhood_size(size_t barcodes,
+                                  size_t mate_1_len,
+                                  size_t mate_2_len,
+                                  size_t max_mismatches,
+                                  size_t max_mismatches_r1,
+                                  size_t max_mismatches_r2)
+{
+    double neighbours = 0.0;
+    for (size_t mm_1 = 0; mm_1 <= std::min(max_mismatches_r1, mate_1_len); ++mm_1) {
+        for (size_t mm_2 = 0; mm_2 <= std::min(max_mismatches_r2, mate_2_len); ++mm_2) {
+            if (mm_1 + mm_2 <= max_mismatches) {
+                double count = choose(mate_1_len, mm_1) * choose(mate_2_len, mm_2);
+                for (size_t i = 0; i < mm_1 + mm_2; ++i) {
+                    count *= 3;
+                }
+
+                neighbours += count;
+            }
+        }
+    }
+
+    return neighbours * barcodes;
+}
+
+
+double barcode_trie_cost(size_t barcodes,
+                         size_t mate_1_len,
+                         size_t mate_2_len,
+                         size_t max_mismatches_r1)
+{
+    // Nodes at depth d are visited for (at most) every sequence within the
+    // allowed distance of the first d bases of the read
+    double nodes = 0.0;
+    double sequences = 1.0;
+    for (size_t depth = 1; depth <= mate_1_len; ++depth) {
+        const double neighbours = barcode_neighbourhood_size(1, depth, 0,
+                                                             max_mismatches_r1,
+                                                             max_mismatches_r1, 0);
+
+        sequences *= 4;
+        nodes += std::min<double>(barcodes, neighbours);
+    }
+
+    const double neighbours = barcode_neighbourhood_size(barcodes, mate_1_len, 0,
+                                                         max_mismatches_r1,
+                                                         max_mismatches_r1, 0);
+    const double candidates = std::min<double>(barcodes, neighbours / sequences);
+
+    return 300.0 + 13.0 * nodes + candidates * (10.0 + mate_2_len);
+}
+
+
+double barcode_scan_cost(size_t barcodes,
+                         size_t mate_1_len,
+                         size_t mate_2_len)
+{
+    const size_t words = (mate_1_len + MAX_KEY_LENGTH - 1) / MAX_KEY_LENGTH
+                       + (mate_2_len + MAX_KEY_LENGTH - 1) / MAX_KEY_LENGTH;
+
+    return 100.0 + barcodes * (2.0 + 0.5 * words);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'barcode_table'
+
+barcode_table::table_entry::table_entry()
+  : key(0)
+  , barcode(NO_BARCODE)
+  , mismatches(0)
+{
+}
+
+
+barcode_table::barcode_table(const fastq_pair_vec& barcodes,
+                             size_t max_mismatches,
+                             size_t max_mismatches_r1,
+                             size_t max_mismatches_r2,
+                             bool paired_end)
+  : m_mate_1_len(0)
+  , m_mate_2_len(0)
+  , m_max_mismatches(max_mismatches)
+  , m_max_mismatches_r1(std::min(max_mismatches, max_mismatches_r1))
+  , m_max_mismatches_r2(paired_end ? std::min(max_mismatches, max_mismatches_r2) : 0)
+  , m_entries()
+  , m_size(0)
+  , m_bits(0)
+{
+    if (barcodes.empty()) {
+        return;
+    }
+
+    m_mate_1_len = barcodes.front().first.length();
+    m_mate_2_len = paired_end ? barcodes.front().second.length() : 0;
+    if (!m_mate_1_len || m_mate_1_len + m_mate_2_len > MAX_KEY_LENGTH) {
+        return;
+    }
+
+    const double neighbours = barcode_neighbourhood_size(barcodes.size(),
+                                                         m_mate_1_len,
+                                                         m_mate_2_len,
+                                                         m_max_mismatches,
+                                                         m_max_mismatches_r1,
+                                                         m_max_mismatches_r2);
+    if (neighbours > MAX_BARCODE_TABLE_SIZE) {
+        return;
+    }
+
+    // Keep the table at most half full, to keep probe sequences short
+    m_bits = 4;
+    while ((static_cast<size_t>(1) << m_bits) < 2 * neighbours) {
+        m_bits++;
+    }
+
+    m_entries.resize(static_cast<size_t>(1) << m_bits);
+    for (fastq_pair_vec::const_iterator it = barcodes.begin(); it != barcodes.end(); ++it) {
+        const int barcode = it - barcodes.begin();
+
+        uint64_t key = 0;
+        if (!encode_bases(it->first.sequence(), m_mate_1_len, 0, key) ||
+            !encode_bases(it->second.sequence(), m_mate_2_len, m_mate_1_len, key)) {
+            // Barcodes are expected to consist of ACGT only; use slow path
+            m_entries.clear();
+            m_size = 0;
+            return;
+        }
+
+        add_sequence(key, barcode, 0);
+        add_neighbours(key, barcode, 0, 0, 0);
+    }
+}
+
+
+bool barcode_table::available() const
+{
+    return !m_entries.empty();
+}
+
+
+size_t barcode_table::size() const
+{
+    return m_size;
+}
+
+
+bool barcode_table::lookup(const fastq& read_r1, const fastq& read_r2, int& barcode) const
+{
+    uint64_t key = 0;
+    if (m_entries.empty()
+        || !encode_bases(read_r1.sequence(), m_mate_1_len, 0, key)
+        || !encode_bases(read_r2.sequence(), m_mate_2_len, m_mate_1_len, key)) {
+        return false;
+    }
+
+    barcode = m_entries[find_entry(key)].barcode;
+
+    return true;
+}
+
+
+void barcode_table::add_neighbours(uint64_t key, int barcode, size_t pos,
+                                   size_t mismatches_r1, size_t mismatches_r2)
+{
+    for (; pos < m_mate_1_len + m_mate_2_len; ++pos) {
+        const bool mate_1 = pos < m_mate_1_len;
+        const size_t mm_1 = mismatches_r1 + (mate_1 ? 1 : 0);
+        const size_t mm_2 = mismatches_r2 + (mate_1 ? 0 : 1);
+
+        if (mm_1 <= m_max_mismatches_r1 && mm_2 <= m_max_mismatches_r2
+            && mm_1 + mm_2 <= m_max_mismatches) {
+            // XOR with 1, 2, and 3 yields each of the 3 other bases
+            for (uint64_t nt = 1; nt < 4; ++nt) {
+                const uint64_t neighbour = key ^ (nt << (2 * pos));
+
+                add_sequence(neighbour, barcode, mm_1 + mm_2);
+                add_neighbours(neighbour, barcode, pos + 1, mm_1, mm_2);
+            }
+        }
+    }
+}
+
+
+void barcode_table::add_sequence(uint64_t key, int barcode, unsigned mismatches)
+{
+    table_entry& entry = m_entries[find_entry(key)];
+
+    if (entry.barcode == NO_BARCODE) {
+        entry.key = key;
+        entry.barcode = barcode;
+        entry.mismatches = mismatches;
+        m_size++;
+    } else if (mismatches < entry.mismatches) {
+        entry.barcode = barcode;
+        entry.mismatches = mismatches;
+    } else if (mismatches == entry.mismatches && entry.barcode != barcode) {
+        entry.barcode = AMBIGUOUS_BARCODE;
+    }
+}
+
+
+size_t barcode_table::find_entry(uint64_t key) const
+{
+    const size_t mask = m_entries.size() - 1;
+
+    size_t index = (key * HASH_MULTIPLIER) >> (64 - m_bits);
+    while (m_entries[index].barcode != NO_BARCODE && m_entries[index].key != key) {
+        index = (index + 1) & mask;
+    }
+
+    return index;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'barcode_trie'
+
+barcode_trie::barcode_trie(const fastq_pair_vec& barcodes)
+    : m_length(barcodes.empty() ? 0 : barcodes.front().first.length())
+    , m_words((m_length + MAX_KEY_LENGTH - 1) / MAX_KEY_LENGTH)
+    , m_keys()
+    , m_ids()
+{
+    std::vector<uint64_t> keys(barcodes.size() * m_words);
+    for (size_t id = 0; id < barcodes.size(); ++id) {
+        const std::string& sequence = barcodes.at(id).first.sequence();
+        AR_DEBUG_ASSERT(sequence.length() == m_length);
+
+        for (size_t pos = 0; pos < m_length; ++pos) {
+            const uint64_t value = encode_base(sequence.at(pos));
+            AR_DEBUG_ASSERT(value <= 3);
+
+            const size_t shift = 62 - 2 * (pos % MAX_KEY_LENGTH);
+            keys.at(id * m_words + pos / MAX_KEY_LENGTH) |= value << shift;
+        }
+
+        m_ids.push_back(static_cast<int>(id));
+    }
+
+    std::sort(m_ids.begin(), m_ids.end(), packed_key_order(keys, m_words));
+
+    m_keys.reserve(keys.size());
+    for (std::vector<int>::const_iterator it = m_ids.begin(); it != m_ids.end(); ++it) {
+        const size_t offset = static_cast<size_t>(*it) * m_words;
+
+        m_keys.insert(m_keys.end(), keys.begin() + offset, keys.begin() + offset + m_words);
+    }
+}
+
+
+size_t barcode_trie::size() const
+{
+    return m_ids.size();
+}
+
+
+void barcode_trie::lookup(const std::string& sequence,
+                          size_t max_mismatches,
+                          barcode_candidate_vec& candidates) const
+{
+    if (!m_ids.empty() && sequence.length() >= m_length) {
+        lookup(sequence, max_mismatches, 0, m_ids.size(), 0, 0, candidates);
+    }
+}
+
+
+void barcode_trie::lookup(const std::string& sequence,
+                          size_t max_mismatches,
+                          size_t begin,
+                          size_t end,
+                          size_t pos,
+                          size_t mismatches,
+                          barcode_candidate_vec& candidates) const
+{
+    // Matching bases do not branch, and are therefore handled iteratively
+    for (; pos < m_length; ++pos) {
+        const size_t current_nt = encode_base(sequence[pos]);
+
+        size_t match_begin = end;
+        size_t match_end = end;
+
+        if (mismatches < max_mismatches) {
+            size_t child_begin = begin;
+            for (size_t nt = 0; nt < 4 && child_begin < end; ++nt) {
+                const size_t child_end = (nt < 3) ? upper_bound(child_begin, end, pos, nt) : end;
+
+                if (nt == current_nt) {
+                    match_begin = child_begin;
+                    match_end = child_end;
+                } else if (child_begin != child_end) {
+                    lookup(sequence, max_mismatches, child_begin, child_end,
+                           pos + 1, mismatches + 1, candidates);
+                }
+
+                child_begin = child_end;
+            }
+        } else if (current_nt <= 3) {
+            match_begin = current_nt ? upper_bound(begin, end, pos, current_nt - 1) : begin;
+            match_end = (current_nt < 3) ? upper_bound(match_begin, end, pos, current_nt) : end;
+        }
+
+        if (match_begin == match_end) {
+            return;
+        }
+
+        begin = match_begin;
+        end = match_end;
+    }
+
+    for (size_t i = begin; i < end; ++i) {
+        candidates.push_back(barcode_candidate(m_ids[i], mismatches));
+    }
+}
+
+
+size_t barcode_trie::base_at(size_t nth, size_t pos) const
+{
+    const uint64_t key = m_keys[nth * m_words + pos / MAX_KEY_LENGTH];
+
+    return (key >> (62 - 2 * (pos % MAX_KEY_LENGTH))) & 3;
+}
+
+
+size_t barcode_trie::upper_bound(size_t begin, size_t end, size_t pos, size_t base) const
+{
+    while (begin < end) {
+        const size_t middle = begin + (end - begin) / 2;
+
+        if (base_at(middle, pos) > base) {
+            end = middle;
+        } else {
+            begin = middle + 1;
+        }
+    }
+
+    return begin;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'barcode_scanner'
+
+barcode_scanner::barcode_scanner(const fastq_pair_vec& barcodes,
+                                 size_t max_mismatches,
+                                 size_t max_mismatches_r1,
+                                 size_t max_mismatches_r2,
+                                 bool paired_end)
+  : m_mate_1_len(0)
+  , m_mate_2_len(0)
+  , m_mate_1_words(0)
+  , m_mate_2_words(0)
+  , m_max_mismatches(max_mismatches)
+  , m_max_mismatches_r1(std::min(max_mismatches, max_mismatches_r1))
+  , m_max_mismatches_r2(paired_end ? std::min(max_mismatches, max_mismatches_r2) : 0)
+  , m_size(0)
+  , m_keys()
+{
+    if (barcodes.empty()) {
+        return;
+    }
+
+    m_mate_1_len = barcodes.front().first.length();
+    m_mate_2_len = paired_end ? barcodes.front().second.length() : 0;
+    m_mate_1_words = (m_mate_1_len + MAX_KEY_LENGTH - 1) / MAX_KEY_LENGTH;
+    m_mate_2_words = (m_mate_2_len + MAX_KEY_LENGTH - 1) / MAX_KEY_LENGTH;
+    if (m_mate_1_words + m_mate_2_words > MAX_BARCODE_SCANNER_WORDS) {
+        return;
+    }
+
+    m_size = barcodes.size();
+    m_keys.resize((m_mate_1_words + m_mate_2_words) * m_size);
+
+    for (size_t i = 0; i < m_size; ++i) {
+        uint64_t words[MAX_BARCODE_SCANNER_WORDS];
+        uint64_t mask[MAX_BARCODE_SCANNER_WORDS];
+
+        encode_words(barcodes.at(i).first.sequence(), m_mate_1_len, words, mask);
+        encode_words(barcodes.at(i).second.sequence(), m_mate_2_len,
+                     words + m_mate_1_words, mask + m_mate_1_words);
+
+        for (size_t w = 0; w < m_mate_1_words + m_mate_2_words; ++w) {
+            AR_DEBUG_ASSERT(!mask[w]);
+            m_keys.at(w * m_size + i) = words[w];
+        }
+    }
+}
+
+
+bool barcode_scanner::available() const
+{
+    return m_size;
+}
+
+
+size_t barcode_scanner::size() const
+{
+    return m_size;
+}
+
+
+int barcode_scanner::lookup(const fastq& read_r1, const fastq& read_r2) const
+{
+    AR_DEBUG_ASSERT(available());
+    if (read_r1.length() < m_mate_1_len) {
+        return NO_BARCODE;
+    }
+
+    uint64_t words[MAX_BARCODE_SCANNER_WORDS];
+    uint64_t mask[MAX_BARCODE_SCANNER_WORDS];
+    encode_words(read_r1.sequence(), m_mate_1_len, words, mask);
+    encode_words(read_r2.sequence(), m_mate_2_len,
+                 words + m_mate_1_words, mask + m_mate_1_words);
+
+    int best_barcode = NO_BARCODE;
+    size_t min_mismatches = m_max_mismatches + 1;
+    for (size_t offset = 0; offset < m_size; offset += SCAN_BLOCK_SIZE) {
+        const size_t count = std::min(SCAN_BLOCK_SIZE, m_size - offset);
+
+        unsigned mismatches_r1[SCAN_BLOCK_SIZE];
+        unsigned mismatches_r2[SCAN_BLOCK_SIZE];
+        std::fill(mismatches_r1, mismatches_r1 + count, 0);
+        std::fill(mismatches_r2, mismatches_r2 + count, 0);
+
+        size_t w = 0;
+        for (; w < m_mate_1_words; ++w) {
+            ADD_DISTANCES(&m_keys[w * m_size + offset], words[w], mask[w], count, mismatches_r1);
+        }
+
+        for (; w < m_mate_1_words + m_mate_2_words; ++w) {
+            ADD_DISTANCES(&m_keys[w * m_size + offset], words[w], mask[w], count, mismatches_r2);
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            const size_t mismatches = mismatches_r1[i] + mismatches_r2[i];
+
+            if (mismatches_r1[i] <= m_max_mismatches_r1
+                && mismatches_r2[i] <= m_max_mismatches_r2
+                && mismatches <= std::min(m_max_mismatches, min_mismatches)) {
+                if (mismatches < min_mismatches) {
+                    best_barcode = static_cast<int>(offset + i);
+                    min_mismatches = mismatches;
+                } else {
+                    best_barcode = AMBIGUOUS_BARCODE;
+                }
+            }
+        }
+    }
+
+    return best_barcode;
+}
+
+} // namespace ar
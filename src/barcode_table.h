@@ -0,0 +1,287 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#ifndef BARCODE_TABLE_H
+#define BARCODE_TABLE_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "fastq.h"
+
+namespace ar
+{
+
+//! Max number of sequences stored in a 'barcode_table'
+const size_t MAX_BARCODE_TABLE_SIZE = 1024 * 1024;
+
+//! Max number of 64-bit words (32 bases each) per barcode (pair) in a 'barcode_scanner'
+const size_t MAX_BARCODE_SCANNER_WORDS = 4;
+
+//! ID of a barcode (pair) and the number of mismatches to a sequence
+typedef std::pair<int, size_t> barcode_candidate;
+typedef std::vector<barcode_candidate> barcode_candidate_vec;
+
+
+/**
+ * Hash table mapping every sequence within the allowed number of mismatches
+ * of a barcode (pair) to that barcode, allowing reads to be assigned to a
+ * barcode using a single lookup. Sequences equally close to several barcodes
+ * are marked as ambiguous.
+ *
+ * Keys consist of the 2-bit encoded mate 1 barcode, followed by the mate 2
+ * barcode in paired-end mode. The table is therefore only built if the
+ * barcodes total at most 32 bp, and if the number of sequences to be stored
+ * does not exceed MAX_BARCODE_TABLE_SIZE.
+ */
+class barcode_table
+{
+public:
+    /**
+     * Builds a table for a set of barcodes of identical lengths.
+     *
+     * @param barcodes List of unique barcode (pairs).
+     * @param max_mismatches Max mismatches in total for mate 1 and mate 2.
+     * @param max_mismatches_r1 Max mismatches for the mate 1 barcode.
+     * @param max_mismatches_r2 Max mismatches for the mate 2 barcode.
+     * @param paired_end If false, only the mate 1 barcodes are used.
+     */
+    barcode_table(const fastq_pair_vec& barcodes,
+                  size_t max_mismatches,
+                  size_t max_mismatches_r1,
+                  size_t max_mismatches_r2,
+                  bool paired_end);
+
+    /** Returns true if the table was built; see class description. */
+    bool available() const;
+
+    /** Returns the number of sequences in the table. */
+    size_t size() const;
+
+    /**
+     * Looks up the barcode matching the start of 'read_r1', and of 'read_r2'
+     * in paired-end mode; 'barcode' is set to the ID of the best matching
+     * barcode, to -1 if no barcodes match, or to -2 if several barcodes match
+     * equally well. Returns false if the table was not built, or if a read is
+     * shorter than the barcode or contains bases other than ACGT.
+     */
+    bool lookup(const fastq& read_r1, const fastq& read_r2, int& barcode) const;
+
+private:
+    /** Sequence stored in the table, and the barcode it was assigned to. */
+    struct table_entry
+    {
+        table_entry();
+
+        //! 2-bit encoded sequence
+        uint64_t key;
+        //! ID of closest barcode, -1 for empty entries, or -2 if ambiguous
+        int barcode;
+        //! Number of mismatches between the sequence and the barcode
+        unsigned mismatches;
+    };
+
+    typedef std::vector<table_entry> entry_vec;
+
+    /** Adds the sequences within the allowed distance of a barcode. */
+    void add_neighbours(uint64_t key, int barcode, size_t pos,
+                        size_t mismatches_r1, size_t mismatches_r2);
+
+    /** Adds a sequence with the given distance to a barcode. */
+    void add_sequence(uint64_t key, int barcode, unsigned mismatches);
+
+    /** Returns the index of the entry for a key, or of an empty entry. */
+    size_t find_entry(uint64_t key) const;
+
+    //! Length of mate 1 barcodes
+    size_t m_mate_1_len;
+    //! Length of mate 2 barcodes; 0 unless in paired-end mode
+    size_t m_mate_2_len;
+    //! Maximum number of mismatches in total
+    size_t m_max_mismatches;
+    //! Maximum number of mismatches for mate 1 barcodes
+    size_t m_max_mismatches_r1;
+    //! Maximum number of mismatches for mate 2 barcodes
+    size_t m_max_mismatches_r2;
+    //! Open addressing hash table; the size is a power of two
+    entry_vec m_entries;
+    //! Number of non-empty entries in 'm_entries'
+    size_t m_size;
+    //! Number of bits used to index 'm_entries'
+    size_t m_bits;
+};
+
+
+/**
+ * Trie of the mate 1 sequences of a set of barcodes (pairs), used to find all
+ * barcodes within a given number of mismatches of a read. The trie is stored
+ * implicitly as an array of 2-bit packed barcode sequences, sorted such that
+ * the barcodes sharing a prefix form a contiguous range; the children of a
+ * node are found by binary search within the range of that node. The trie
+ * thereby uses O(N * L) memory for N barcodes of length L.
+ */
+class barcode_trie
+{
+public:
+    /** Builds a trie from barcodes (pairs) with mate 1 barcodes of equal length. */
+    barcode_trie(const fastq_pair_vec& barcodes);
+
+    /** Returns the number of barcodes in the trie. */
+    size_t size() const;
+
+    /**
+     * Adds the IDs of barcodes with at most 'max_mismatches' mismatches to
+     * the start of 'sequence' to 'candidates', along with the number of
+     * mismatches; bases other than ACGT are counted as mismatches. No
+     * barcodes are returned if the sequence is shorter than the barcodes.
+     */
+    void lookup(const std::string& sequence,
+                size_t max_mismatches,
+                barcode_candidate_vec& candidates) const;
+
+private:
+    /** Searches barcodes in the range [begin, end), sharing the first 'pos' bases. */
+    void lookup(const std::string& sequence,
+                size_t max_mismatches,
+                size_t begin,
+                size_t end,
+                size_t pos,
+                size_t mismatches,
+                barcode_candidate_vec& candidates) const;
+
+    /** Returns the 2-bit encoded base at position 'pos' of the nth barcode. */
+    size_t base_at(size_t nth, size_t pos) const;
+
+    /**
+     * Returns the first index in [begin, end) for which the base at 'pos' is
+     * greater than 'base'; barcodes in the range must share the first 'pos'
+     * bases.
+     */
+    size_t upper_bound(size_t begin, size_t end, size_t pos, size_t base) const;
+
+    //! Length of mate 1 barcodes
+    size_t m_length;
+    //! Number of 64-bit words used per barcode; 32 bases are stored per word
+    size_t m_words;
+    //! Sorted, packed barcodes; the first base is stored in the high bits
+    std::vector<uint64_t> m_keys;
+    //! ID of each barcode in 'm_keys'
+    std::vector<int> m_ids;
+};
+
+
+/**
+ * Assigns reads to barcodes by computing the Hamming distance between the
+ * read and every barcode (pair), using XOR and popcount on 2-bit packed
+ * sequences. Barcodes are stored one word-column at a time, so that distances
+ * are computed for a block of barcodes per pass; this loop is vectorized on
+ * CPUs supporting AVX-512 VPOPCNTDQ. The best match and ambiguity are resolved
+ * in the same pass over each block. Unlike 'barcode_table', reads may contain
+ * bases other than ACGT, which are counted as mismatches.
+ *
+ * The scanner is only built if the barcodes fit in MAX_BARCODE_SCANNER_WORDS.
+ */
+class barcode_scanner
+{
+public:
+    /** Builds a scanner; see barcode_table::barcode_table. */
+    barcode_scanner(const fastq_pair_vec& barcodes,
+                    size_t max_mismatches,
+                    size_t max_mismatches_r1,
+                    size_t max_mismatches_r2,
+                    bool paired_end);
+
+    /** Returns true if the scanner was built; see class description. */
+    bool available() const;
+
+    /** Returns the number of barcode (pairs) in the scanner. */
+    size_t size() const;
+
+    /**
+     * Returns the ID of the barcode (pair) closest to the start of 'read_r1',
+     * and of 'read_r2' in paired-end mode, -1 if no barcodes are within the
+     * allowed number of mismatches, or -2 if several barcodes match equally
+     * well. No barcodes match if 'read_r1' is shorter than the mate 1
+     * barcodes, while bases missing from 'read_r2' count as mismatches.
+     */
+    int lookup(const fastq& read_r1, const fastq& read_r2) const;
+
+private:
+    //! Length of mate 1 barcodes
+    size_t m_mate_1_len;
+    //! Length of mate 2 barcodes; 0 unless in paired-end mode
+    size_t m_mate_2_len;
+    //! Number of words used for mate 1 barcodes
+    size_t m_mate_1_words;
+    //! Number of words used for mate 2 barcodes
+    size_t m_mate_2_words;
+    //! Maximum number of mismatches in total
+    size_t m_max_mismatches;
+    //! Maximum number of mismatches for mate 1 barcodes
+    size_t m_max_mismatches_r1;
+    //! Maximum number of mismatches for mate 2 barcodes
+    size_t m_max_mismatches_r2;
+    //! Number of barcode (pairs)
+    size_t m_size;
+    //! Packed barcodes; word 'w' of barcode 'i' is found at w * m_size + i
+    std::vector<uint64_t> m_keys;
+};
+
+
+/**
+ * Returns the estimated number of sequences within the given distance of a
+ * set of barcodes; see 'barcode_table'. The value ignores overlap between
+ * barcodes and is therefore an upper bound.
+ */
+double barcode_neighbourhood_size(size_t barcodes,
+                                  size_t mate_1_len,
+                                  size_t mate_2_len,
+                                  size_t max_mismatches,
+                                  size_t max_mismatches_r1,
+                                  size_t max_mismatches_r2);
+
+
+/**
+ * Returns the estimated cost of assigning a read to a barcode (pair) using a
+ * 'barcode_trie', roughly in nanoseconds; this is based on the number of
+ * nodes visited within the allowed distance of the read, and on the number
+ * of candidates for which the mate 2 barcode must be compared. Set
+ * 'mate_2_len' to 0 in single-end mode.
+ */
+double barcode_trie_cost(size_t barcodes,
+                         size_t mate_1_len,
+                         size_t mate_2_len,
+                         size_t max_mismatches_r1);
+
+
+/**
+ * Returns the estimated cost of assigning a read to a barcode (pair) using a
+ * 'barcode_scanner', in the same units as 'barcode_trie_cost'.
+ */
+double barcode_scan_cost(size_t barcodes,
+                         size_t mate_1_len,
+                         size_t mate_2_len);
+
+} // namespace ar
+
+#endif
@@ -0,0 +1,372 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <algorithm>
+#include <cstring>
+
+#include "checksum.h"
+
+namespace ar
+{
+
+/** Formats a sequence of bytes as lower-case hexadecimal. */
+std::string to_hex(const unsigned char* data, size_t size)
+{
+    const char* digits = "0123456789abcdef";
+
+    std::string result;
+    result.reserve(size * 2);
+    for (size_t i = 0; i < size; ++i) {
+        result.push_back(digits[data[i] >> 4]);
+        result.push_back(digits[data[i] & 0xf]);
+    }
+
+    return result;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'checksum'
+
+checksum::checksum()
+{
+}
+
+
+checksum::~checksum()
+{
+}
+
+
+void checksum::update(const std::string& data)
+{
+    update(data.data(), data.size());
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'crc32c_checksum'
+
+//! Reversed CRC32C (Castagnoli) polynomial
+const uint32_t CRC32C_POLYNOMIAL = 0x82f63b78;
+
+
+/**
+ * Lookup tables for slicing-by-8 CRC32C calculations; table N contains the
+ * CRC of a byte followed by N zero bytes.
+ */
+class crc32c_tables
+{
+public:
+    crc32c_tables()
+    {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (size_t j = 0; j < 8; ++j) {
+                crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : (crc >> 1);
+            }
+
+            table[0][i] = crc;
+        }
+
+        for (size_t i = 0; i < 256; ++i) {
+            for (size_t j = 1; j < 8; ++j) {
+                table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xff];
+            }
+        }
+    }
+
+    uint32_t table[8][256];
+};
+
+
+//! Tables initialized on startup; read-only afterwards
+static const crc32c_tables CRC32C_TABLES;
+
+
+/** Table driven (slicing-by-8) CRC32C implementation. */
+uint32_t crc32c_software(uint32_t crc, const unsigned char* data, size_t size)
+{
+    const uint32_t (&table)[8][256] = CRC32C_TABLES.table;
+
+    for (; size >= 8; size -= 8, data += 8) {
+        const uint32_t low = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16)
+                                    | (static_cast<uint32_t>(data[3]) << 24));
+
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff]
+            ^ table[5][(low >> 16) & 0xff] ^ table[4][low >> 24]
+            ^ table[3][data[4]] ^ table[2][data[5]]
+            ^ table[1][data[6]] ^ table[0][data[7]];
+    }
+
+    for (; size; --size, ++data) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *data) & 0xff];
+    }
+
+    return crc;
+}
+
+
+#if defined(__GNUC__) && defined(__x86_64__)
+/** CRC32C implementation using the SSE4.2 CRC32 instruction. */
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char* data, size_t size)
+{
+    for (; size && (reinterpret_cast<size_t>(data) & 7); --size, ++data) {
+        crc = __builtin_ia32_crc32qi(crc, *data);
+    }
+
+    uint64_t crc64 = crc;
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t value = 0;
+        std::memcpy(&value, data, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, value);
+    }
+
+    crc = static_cast<uint32_t>(crc64);
+    for (; size; --size, ++data) {
+        crc = __builtin_ia32_crc32qi(crc, *data);
+    }
+
+    return crc;
+}
+
+
+/** Returns true if the CPU supports the SSE4.2 CRC32 instruction. */
+bool has_sse42()
+{
+    __builtin_cpu_init();
+
+    return __builtin_cpu_supports("sse4.2");
+}
+
+
+//! Indicates if the SSE4.2 implementation can be used
+static const bool CRC32C_USE_SSE42 = has_sse42();
+#endif
+
+
+crc32c_checksum::crc32c_checksum()
+  : checksum()
+  , m_crc(0xffffffff)
+{
+}
+
+
+void crc32c_checksum::update(const char* data, size_t size)
+{
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (CRC32C_USE_SSE42) {
+        m_crc = crc32c_sse42(m_crc, bytes, size);
+        return;
+    }
+#endif
+
+    m_crc = crc32c_software(m_crc, bytes, size);
+}
+
+
+uint32_t crc32c_checksum::value() const
+{
+    return ~m_crc;
+}
+
+
+std::string crc32c_checksum::hexdigest() const
+{
+    const uint32_t crc = value();
+    const unsigned char bytes[4] = {
+        static_cast<unsigned char>(crc >> 24),
+        static_cast<unsigned char>(crc >> 16),
+        static_cast<unsigned char>(crc >> 8),
+        static_cast<unsigned char>(crc)
+    };
+
+    return to_hex(bytes, 4);
+}
+
+
+std::string crc32c_checksum::name() const
+{
+    return "CRC32C";
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'md5_checksum'
+
+//! Per-round shift amounts
+const uint32_t MD5_SHIFTS[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+//! Per-round constants; floor(abs(sin(i + 1)) * 2^32)
+const uint32_t MD5_CONSTANTS[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+
+md5_checksum::md5_checksum()
+  : checksum()
+  , m_length(0)
+  , m_buffer_used(0)
+{
+    m_state[0] = 0x67452301;
+    m_state[1] = 0xefcdab89;
+    m_state[2] = 0x98badcfe;
+    m_state[3] = 0x10325476;
+}
+
+
+void md5_checksum::update(const char* data, size_t size)
+{
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    m_length += size;
+
+    if (m_buffer_used) {
+        const size_t ncopy = std::min<size_t>(size, 64 - m_buffer_used);
+        std::memcpy(m_buffer + m_buffer_used, bytes, ncopy);
+        m_buffer_used += ncopy;
+        bytes += ncopy;
+        size -= ncopy;
+
+        if (m_buffer_used < 64) {
+            return;
+        }
+
+        process_block(m_state, m_buffer);
+        m_buffer_used = 0;
+    }
+
+    for (; size >= 64; size -= 64, bytes += 64) {
+        process_block(m_state, bytes);
+    }
+
+    std::memcpy(m_buffer, bytes, size);
+    m_buffer_used = size;
+}
+
+
+std::string md5_checksum::hexdigest() const
+{
+    uint32_t state[4];
+    std::memcpy(state, m_state, sizeof(state));
+
+    // Padding: a single 1 bit, zeros, and the message length in bits
+    unsigned char tail[128];
+    std::memset(tail, 0, sizeof(tail));
+    std::memcpy(tail, m_buffer, m_buffer_used);
+    tail[m_buffer_used] = 0x80;
+
+    const size_t tail_size = (m_buffer_used < 56) ? 64 : 128;
+    const uint64_t nbits = m_length * 8;
+    for (size_t i = 0; i < 8; ++i) {
+        tail[tail_size - 8 + i] = static_cast<unsigned char>(nbits >> (8 * i));
+    }
+
+    for (size_t offset = 0; offset < tail_size; offset += 64) {
+        process_block(state, tail + offset);
+    }
+
+    unsigned char digest[16];
+    for (size_t i = 0; i < 16; ++i) {
+        digest[i] = static_cast<unsigned char>(state[i / 4] >> (8 * (i % 4)));
+    }
+
+    return to_hex(digest, 16);
+}
+
+
+std::string md5_checksum::name() const
+{
+    return "MD5";
+}
+
+
+void md5_checksum::process_block(uint32_t* state, const unsigned char* block)
+{
+    uint32_t words[16];
+    for (size_t i = 0; i < 16; ++i) {
+        words[i] = block[i * 4]
+                 | (block[i * 4 + 1] << 8)
+                 | (block[i * 4 + 2] << 16)
+                 | (static_cast<uint32_t>(block[i * 4 + 3]) << 24);
+    }
+
+    uint32_t a = state[0];
+    uint32_t b = state[1];
+    uint32_t c = state[2];
+    uint32_t d = state[3];
+
+    for (size_t i = 0; i < 64; ++i) {
+        uint32_t f = 0;
+        size_t g = 0;
+
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+
+        const uint32_t value = a + f + MD5_CONSTANTS[i] + words[g];
+        a = d;
+        d = c;
+        c = b;
+        b += (value << MD5_SHIFTS[i]) | (value >> (32 - MD5_SHIFTS[i]));
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+} // namespace ar
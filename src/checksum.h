@@ -0,0 +1,127 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <string>
+
+#include <stdint.h>
+
+namespace ar
+{
+
+/**
+ * Base-class for incrementally calculated checksums.
+ */
+class checksum
+{
+public:
+    /** Constructor; does nothing. */
+    checksum();
+    /** Destructor; does nothing. */
+    virtual ~checksum();
+
+    /** Updates the checksum using 'size' bytes from 'data'. */
+    virtual void update(const char* data, size_t size) = 0;
+    /** Updates the checksum using the bytes in the string. */
+    void update(const std::string& data);
+
+    /** Returns the checksum of the data seen so far as a hex string. */
+    virtual std::string hexdigest() const = 0;
+
+    /** Returns the name of the algorithm, e.g. "MD5". */
+    virtual std::string name() const = 0;
+
+private:
+    //! Not implemented
+    checksum(const checksum&);
+    //! Not implemented
+    checksum& operator=(const checksum&);
+};
+
+
+/**
+ * CRC32C (Castagnoli) checksum; uses the SSE4.2 CRC32 instruction when
+ * supported by the CPU, and a table driven implementation otherwise.
+ */
+class crc32c_checksum : public checksum
+{
+public:
+    /** Constructor; initializes the checksum. */
+    crc32c_checksum();
+
+    /** Updates the checksum using 'size' bytes from 'data'. */
+    virtual void update(const char* data, size_t size);
+    using checksum::update;
+
+    /** Returns the CRC32C of the data seen so far as a hex string. */
+    virtual std::string hexdigest() const;
+    /** Returns the CRC32C of the data seen so far. */
+    uint32_t value() const;
+
+    /** Returns "CRC32C". */
+    virtual std::string name() const;
+
+private:
+    //! Current (inverted) CRC
+    uint32_t m_crc;
+};
+
+
+/**
+ * MD5 checksum as described in RFC 1321.
+ */
+class md5_checksum : public checksum
+{
+public:
+    /** Constructor; initializes the checksum. */
+    md5_checksum();
+
+    /** Updates the checksum using 'size' bytes from 'data'. */
+    virtual void update(const char* data, size_t size);
+    using checksum::update;
+
+    /** Returns the MD5 of the data seen so far as a hex string. */
+    virtual std::string hexdigest() const;
+
+    /** Returns "MD5". */
+    virtual std::string name() const;
+
+private:
+    /** Updates the state (A, B, C, D) using a single 64 byte block. */
+    static void process_block(uint32_t* state, const unsigned char* block);
+
+    //! Current state (A, B, C, D)
+    uint32_t m_state[4];
+    //! Total number of bytes processed
+    uint64_t m_length;
+    //! Partial block not yet processed
+    unsigned char m_buffer[64];
+    //! Number of bytes used in 'm_buffer'
+    size_t m_buffer_used;
+};
+
+} // namespace ar
+
+#endif
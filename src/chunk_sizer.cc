@@ -0,0 +1,90 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <algorithm>
+
+#include "chunk_sizer.h"
+
+namespace ar
+{
+
+//! Weight given to new observations in moving averages
+const double CHUNK_SIZER_ALPHA = 0.25;
+
+//! Sizer shared by all pipeline steps
+static chunk_sizer s_shared_sizer;
+
+
+/** Updates an exponentially weighted moving average; 0 is unset. */
+double update_average(double average, double value)
+{
+    if (average <= 0) {
+        return value;
+    }
+
+    return average + CHUNK_SIZER_ALPHA * (value - average);
+}
+
+
+chunk_sizer::chunk_sizer()
+  : m_lock()
+  , m_bytes_per_record(0)
+  , m_records(DEFAULT_CHUNK_RECORDS)
+{
+}
+
+
+size_t chunk_sizer::records() const
+{
+    return __atomic_load_n(&m_records, __ATOMIC_RELAXED);
+}
+
+
+size_t chunk_sizer::bytes() const
+{
+    return TARGET_CHUNK_BYTES;
+}
+
+
+void chunk_sizer::add_read_chunk(size_t records, size_t bytes)
+{
+    if (records) {
+        mutex_locker lock(m_lock);
+        m_bytes_per_record = update_average(m_bytes_per_record,
+                                            static_cast<double>(bytes) / records);
+
+        double target_records = TARGET_CHUNK_BYTES / m_bytes_per_record;
+        target_records = std::max<double>(MIN_CHUNK_RECORDS, target_records);
+        target_records = std::min<double>(MAX_CHUNK_RECORDS, target_records);
+
+        __atomic_store_n(&m_records, static_cast<size_t>(target_records), __ATOMIC_RELAXED);
+    }
+}
+
+
+chunk_sizer& chunk_sizer::shared()
+{
+    return s_shared_sizer;
+}
+
+} // namespace ar
@@ -0,0 +1,94 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#ifndef CHUNK_SIZER_H
+#define CHUNK_SIZER_H
+
+#include <cstddef>
+
+#include "threads.h"
+
+namespace ar
+{
+
+//! Number of records per chunk, until the size of records is known
+const size_t DEFAULT_CHUNK_RECORDS = 2 * 1024;
+//! Lower / upper bounds on the number of records per chunk
+const size_t MIN_CHUNK_RECORDS = 16;
+const size_t MAX_CHUNK_RECORDS = 64 * 1024;
+
+//! Target number of bytes per chunk
+const size_t TARGET_CHUNK_BYTES = 1024 * 1024;
+
+
+/**
+ * Selects the number of records per chunk at runtime.
+ *
+ * Chunks are sized to contain TARGET_CHUNK_BYTES, based on the average size
+ * of records read so far: Small records result in larger chunks, reducing
+ * scheduling overhead, while long records result in smaller chunks, avoiding
+ * memory spikes and poor load balancing.
+ *
+ * Sizes depend only on the records read, and not on processing times, so
+ * that chunk boundaries are the same across runs; output that depends on
+ * chunk boundaries, such as collapsed reads (given a --seed) and BGZF blocks
+ * in BAM files, is therefore reproducible.
+ *
+ * The average record size is maintained as an exponentially weighted moving
+ * average. All functions are thread-safe.
+ */
+class chunk_sizer
+{
+public:
+    /** Constructor; uses the default number of records. */
+    chunk_sizer();
+
+    /** Returns the number of records to read for the next chunk. */
+    size_t records() const;
+
+    /** Returns the target number of bytes per chunk. */
+    size_t bytes() const;
+
+    /** Updates the average record size from a chunk of records. */
+    void add_read_chunk(size_t records, size_t bytes);
+
+    /** Returns the sizer shared by all steps of a pipeline. */
+    static chunk_sizer& shared();
+
+private:
+    //! Not implemented
+    chunk_sizer(const chunk_sizer&);
+    //! Not implemented
+    chunk_sizer& operator=(const chunk_sizer&);
+
+    //! Lock used to control updates of the average
+    mutex m_lock;
+    //! Average number of bytes per record; 0 if unknown
+    double m_bytes_per_record;
+    //! Current number of records per chunk; read atomically
+    size_t m_records;
+};
+
+} // namespace ar
+
+#endif
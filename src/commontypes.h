@@ -76,6 +76,14 @@ enum analyses_id
     //! Step for writing mate 2 reads which were not identified
     ai_write_unidentified_2,
 
+    //! Step for decompressing BGZF blocks read from BAM files
+    ai_decompress_bam,
+    //! Step for decoding SE or PE reads from decompressed BAM records
+    ai_parse_bam,
+
+    //! Step for collecting demultiplexed reads per sample, in input order
+    ai_collect_demultiplexed,
+
     //! Offset for post-demultiplexing analytical steps
     //! If enabled, the demultiplexing step will forward reads to the
     //! nth * ai_analyses_offset analytical step, corresponding to the
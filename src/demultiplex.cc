@@ -24,6 +24,8 @@
 \*************************************************************************/
 #include <iostream>
 
+#include "bam.h"
+#include "chunk_sizer.h"
 #include "debug.h"
 #include "demultiplex.h"
 #include "commontypes.h"
@@ -34,259 +36,84 @@
 namespace ar
 {
 
-typedef std::vector<unsigned> int_vec;
-typedef demux_node_vec::iterator node_vec_iter;
-
-
 ///////////////////////////////////////////////////////////////////////////////
 
-/**
- * Struct representing node in quad-tree; children are referenced using the
- * corresponding indice in the vector representing the tree; -1 is used to
- * represent unasigned children.
- */
-struct demultiplexer_node
+demultiplexed_chunk::demultiplexed_chunk(fastq_read_chunk* reads_)
+    : analytical_chunk()
+    , reads(reads_)
+    , barcodes()
 {
-public:
-    demultiplexer_node()
-        : children()
-        , barcodes()
-    {
-        children[0] = -1;
-        children[1] = -1;
-        children[2] = -1;
-        children[3] = -1;
-    }
-
-    bool has_children() const
-    {
-        for (size_t nt_idx = 0; nt_idx < 4; ++nt_idx) {
-            if (children[nt_idx] != -1) {
-                 return true;
-            }
-        }
-
-        return false;
-    }
-
-    int children[4];
-    int_vec barcodes;
-};
-
-
-///////////////////////////////////////////////////////////////////////////////
-
-/** Fills a quadtree with nodes representing keys of len 'max_key_len' */
-void fill_demux_tree(demux_node_vec& tree, const size_t max_key_len)
-{
-    const size_t n_keys = (1 - (1 << (2 * (max_key_len + 1)))) / (1 - 4);
-    const size_t n_internal = n_keys - (1 << (2 * max_key_len));
-
-    tree.resize(n_keys);
-
-    for (size_t index = 0; index < n_keys; ++index) {
-        demultiplexer_node& node = tree.at(index);
-
-        for (size_t nt_idx = 0; nt_idx < 4; ++nt_idx) {
-            node.children[nt_idx] = (index < n_internal) ? 4 * index + nt_idx + 1 : -1;
-        }
-    }
+    AR_DEBUG_ASSERT(reads);
 }
 
 
-/** Adds a nucleotide sequence with a given ID to a quadtree. */
-void add_sequence_to_tree(demux_node_vec& tree,
-                          const std::string& sequence,
-                          const size_t barcode_id)
+demultiplexed_chunk::~demultiplexed_chunk()
 {
-    demultiplexer_node* parent = &tree.at(0);
-    for (std::string::const_iterator it = sequence.begin(); it != sequence.end(); ++it) {
-        const int child = parent->children[ACGT_TO_IDX(*it)];
-        AR_DEBUG_ASSERT(child != -1);
-
-        parent = &tree.at(child);
-    }
-
-    parent->barcodes.push_back(barcode_id);
+    fastq_read_chunk::recycle(reads);
 }
 
 
-/**
- * Converts a full quad-tree to a sparse quad-tree, by removing any nodes
- * which does not contain any barcodes and which does not have any children.
- * Once these have been removed, the resulting list is compressed such that
- * only populated parts of the tree are included in the vector.
- */
-void prune_tree(demux_node_vec& tree)
+size_t demultiplexed_chunk::memory_usage() const
 {
-    if (tree.empty()) {
-        return;
-    }
-
-    for (size_t idx = tree.size() - 1; idx; --idx) {
-        const demultiplexer_node& node = tree.at(0);
-
-        if (node.barcodes.empty() && !node.has_children()) {
-            tree.at((idx - 1) / 4).children[(idx - 1) % 4] = -1;
-        }
-    }
-
-    size_t last_index = 0;
-    std::vector<int> new_indices(tree.size(), -1);
-    for (size_t idx = 0; idx < tree.size(); ++idx) {
-        const demultiplexer_node& node = tree.at(0);
-
-        if (!node.barcodes.empty() || node.has_children()) {
-            if (idx != last_index) {
-                tree.at(last_index) = node;
-            }
-
-            new_indices.at(idx) = last_index;
-            last_index++;
-        }
-    }
-
-    tree.resize(last_index);
-
-    for (size_t idx = 0; idx < tree.size(); ++idx) {
-        demultiplexer_node& node = tree.at(0);
-
-        for (size_t nt_idx = 0; nt_idx < 4; ++nt_idx) {
-            if (node.children[nt_idx] != -1) {
-                node.children[nt_idx] = new_indices.at(node.children[nt_idx]);
-            }
-        }
-    }
-}
-
-
-/**
- * Builds a sparse quad tree using the first sequence in a set of unique
- * barcodes pairs; duplicate pairs will negatively impact the identification of
- * these, since all hits will be considered ambiguous.
- */
-demux_node_vec build_demux_tree(const fastq_pair_vec& barcodes)
-{
-    demux_node_vec tree;
-
-    if (barcodes.empty()) {
-        return tree;
-    }
-
-    const size_t max_key_1_len = barcodes.front().first.length();
-    const size_t max_key_2_len = barcodes.front().second.length();
-    for (fastq_pair_vec::const_iterator it = barcodes.begin(); it != barcodes.end(); ++it) {
-        AR_DEBUG_ASSERT(it->first.length() == max_key_1_len);
-        AR_DEBUG_ASSERT(it->second.length() == max_key_2_len);
-    }
-
-    fill_demux_tree(tree, max_key_1_len);
-
-    for (fastq_pair_vec::const_iterator it = barcodes.begin(); it != barcodes.end(); ++it) {
-        add_sequence_to_tree(tree, it->first.sequence(), it - barcodes.begin());
-    }
-
-    prune_tree(tree);
-
-    return tree;
+    return reads->memory_usage() + barcodes.size() * sizeof(int);
 }
 
 
 ///////////////////////////////////////////////////////////////////////////////
 
-typedef std::vector<std::pair<int, size_t> > candidate_vec;
-
-
-void rec_lookup_sequence_no_mm(candidate_vec& candidates,
-                               const demux_node_vec& tree,
-                               const std::string& seq,
-                               size_t seq_pos = 0,
-                               int parent = 0,
-                               size_t mismatches = 0)
+/**
+ * Returns true if reads are expected to be assigned to barcodes faster by
+ * scanning all barcodes, than by searching the trie of mate 1 barcodes.
+ */
+bool use_barcode_scanner(const barcode_scanner& scanner,
+                         const fastq_pair_vec& barcodes,
+                         size_t max_mismatches_r1,
+                         bool paired_end)
 {
-    const demultiplexer_node& node = tree.at(parent);
-    for (int_vec::const_iterator it = node.barcodes.begin(); it != node.barcodes.end(); ++it) {
-        candidates.push_back(std::pair<int, size_t>(*it, mismatches));
-    }
-
-    if (seq_pos < seq.length()) {
-        const size_t nt_idx = ACGT_TO_IDX(seq.at(seq_pos));
-
-        if (node.children[nt_idx] != -1) {
-            rec_lookup_sequence_no_mm(candidates, tree, seq, seq_pos + 1,
-                                      node.children[nt_idx], mismatches);
-        }
+    if (!scanner.available()) {
+        return false;
     }
-}
-
 
-void rec_lookup_sequence(candidate_vec& candidates,
-                         const demux_node_vec& tree,
-                         const std::string& seq,
-                         size_t max_mismatches,
-                         size_t seq_pos = 0,
-                         int parent = 0,
-                         size_t mismatches = 0)
-{
-    const demultiplexer_node& node = tree.at(parent);
-    for (int_vec::const_iterator it = node.barcodes.begin(); it != node.barcodes.end(); ++it) {
-        candidates.push_back(std::pair<int, size_t>(*it, mismatches));
-    }
+    const size_t mate_1_len = barcodes.front().first.length();
+    const size_t mate_2_len = paired_end ? barcodes.front().second.length() : 0;
 
-    if (seq_pos < seq.length()) {
-        const size_t current_nt = ACGT_TO_IDX(seq.at(seq_pos));
-
-        for (size_t nt_idx = 0; nt_idx < 4; ++nt_idx) {
-            if (node.children[nt_idx] != -1) {
-                if (nt_idx == current_nt) {
-                    rec_lookup_sequence(candidates, tree, seq, max_mismatches, seq_pos + 1, node.children[nt_idx], mismatches);
-                } else if (mismatches + 1 < max_mismatches) {
-                    rec_lookup_sequence(candidates, tree, seq, max_mismatches, seq_pos + 1, node.children[nt_idx], mismatches + 1);
-                } else if (mismatches + 1 == max_mismatches) {
-                    rec_lookup_sequence_no_mm(candidates, tree, seq, seq_pos + 1, node.children[nt_idx], mismatches + 1);
-                }
-            }
-        }
-    }
+    return barcode_scan_cost(barcodes.size(), mate_1_len, mate_2_len)
+        < barcode_trie_cost(barcodes.size(), mate_1_len, mate_2_len, max_mismatches_r1);
 }
 
 
-///////////////////////////////////////////////////////////////////////////////
-
-
 demultiplex_reads::demultiplex_reads(const userconfig* config)
-    : analytical_step(analytical_step::ordered)
+    : analytical_step(analytical_step::unordered)
     , m_barcodes(config->adapters.get_barcodes())
-    , m_tree(build_demux_tree(m_barcodes))
+    , m_trie(m_barcodes)
     , m_max_mismatches(config->barcode_mm)
     , m_max_mismatches_r1(std::min<size_t>(config->barcode_mm, config->barcode_mm_r1))
     , m_max_mismatches_r2(std::min<size_t>(config->barcode_mm, config->barcode_mm_r2))
     , m_config(config)
-    , m_cache(m_barcodes.size(), NULL)
-    , m_unidentified_1(new fastq_output_chunk())
-    , m_unidentified_2(new fastq_output_chunk())
-    , m_statistics(m_barcodes.size())
+    , m_table(m_barcodes,
+              m_max_mismatches,
+              m_max_mismatches_r1,
+              m_max_mismatches_r2,
+              config->paired_ended_mode)
+    , m_scanner(m_barcodes,
+                m_max_mismatches,
+                m_max_mismatches_r1,
+                m_max_mismatches_r2,
+                config->paired_ended_mode)
+    , m_use_scanner(use_barcode_scanner(m_scanner,
+                                        m_barcodes,
+                                        m_max_mismatches_r1,
+                                        config->paired_ended_mode))
 {
     AR_DEBUG_ASSERT(!m_barcodes.empty());
-
-    for (demultiplexed_cache::iterator it = m_cache.begin(); it != m_cache.end(); ++it) {
-        *it = new fastq_read_chunk();
-    }
 }
 
 
 demultiplex_reads::~demultiplex_reads()
 {
-    for (demultiplexed_cache::iterator it = m_cache.begin(); it != m_cache.end(); ++it) {
-        delete *it;
-    }
-
-    delete m_unidentified_1;
-    delete m_unidentified_2;
 }
 
 
-
 size_t count_mismatches(const std::string& barcode,
                         const std::string& sequence,
                         const size_t max_mismatches)
@@ -315,18 +142,21 @@ size_t count_mismatches(const std::string& barcode,
  * Returns the best matching barcode (pair) for sequences read_r1 and read_r2
  *
  */
-int demultiplex_reads::select_barcode(const fastq& read_r1, const fastq& read_r2)
+int demultiplex_reads::select_barcode(const fastq& read_r1, const fastq& read_r2) const
 {
-    candidate_vec candidates;
-    if (m_max_mismatches_r1) {
-        rec_lookup_sequence(candidates, m_tree, read_r1.sequence(), m_max_mismatches_r1);
-    } else {
-        rec_lookup_sequence_no_mm(candidates, m_tree, read_r1.sequence());
+    int barcode = -1;
+    if (m_table.lookup(read_r1, read_r2, barcode)) {
+        return barcode;
+    } else if (m_use_scanner) {
+        return m_scanner.lookup(read_r1, read_r2);
     }
 
+    barcode_candidate_vec candidates;
+    m_trie.lookup(read_r1.sequence(), m_max_mismatches_r1, candidates);
+
     int best_barcode = -1;
     size_t min_mismatches = m_max_mismatches + 1;
-    for (candidate_vec::iterator it = candidates.begin(); it != candidates.end(); ++it) {
+    for (barcode_candidate_vec::iterator it = candidates.begin(); it != candidates.end(); ++it) {
         if (m_config->paired_ended_mode) {
             const std::string& barcode = m_barcodes.at(it->first).second.sequence();
             const size_t max_mismatches_r2 = std::min(m_max_mismatches - it->second,
@@ -364,101 +194,117 @@ int demultiplex_reads::select_barcode(const fastq& read_r1, const fastq& read_r2
 }
 
 
-chunk_vec demultiplex_reads::flush_cache(bool eof)
-{
-    chunk_vec output;
+///////////////////////////////////////////////////////////////////////////////
 
-    if (eof || m_unidentified_1->count >= FASTQ_CHUNK_SIZE) {
-        output.push_back(chunk_pair(ai_write_unidentified_1, m_unidentified_1));
-        m_unidentified_1->eof = eof;
-        m_unidentified_1 = new fastq_output_chunk();
-    }
+demultiplex_se_reads::demultiplex_se_reads(const userconfig* config)
+    : demultiplex_reads(config)
+{
+}
 
-    if (m_config->paired_ended_mode && (eof || m_unidentified_2->count >= FASTQ_CHUNK_SIZE)) {
-        output.push_back(chunk_pair(ai_write_unidentified_2, m_unidentified_2));
-        m_unidentified_2->eof = eof;
-        m_unidentified_2 = new fastq_output_chunk();
-    }
 
-    for (size_t nth = 0; nth < m_cache.size(); ++nth) {
-        fastq_read_chunk* chunk = m_cache.at(nth);
-        if (eof || chunk->reads_1.size() >= FASTQ_CHUNK_SIZE) {
-            chunk->eof = eof;
+chunk_vec demultiplex_se_reads::process(analytical_chunk* chunk)
+{
+    std::auto_ptr<demultiplexed_chunk> output(new demultiplexed_chunk(dynamic_cast<fastq_read_chunk*>(chunk)));
+    fastq_vec& reads_1 = output->reads->reads_1;
+    output->barcodes.reserve(reads_1.size());
 
-            const size_t step_id = (nth + 1) * ai_analyses_offset;
-            output.push_back(chunk_pair(step_id, chunk));
-            m_cache.at(nth) = new fastq_read_chunk();
+    const fastq empty_read;
+    for (fastq_vec::iterator it = reads_1.begin(); it != reads_1.end(); ++it) {
+        const int best_barcode = select_barcode(*it, empty_read);
+        if (best_barcode >= 0) {
+            it->truncate(m_barcodes.at(best_barcode).first.length());
         }
-    }
 
-    return output;
-}
+        output->barcodes.push_back(best_barcode);
+    }
 
+    chunk_vec chunks;
+    chunks.push_back(chunk_pair(ai_collect_demultiplexed, output.release()));
 
-demux_statistics demultiplex_reads::statistics() const
-{
-    return m_statistics;
+    return chunks;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////////
 
-demultiplex_se_reads::demultiplex_se_reads(const userconfig* config)
+demultiplex_pe_reads::demultiplex_pe_reads(const userconfig* config)
     : demultiplex_reads(config)
 {
 }
 
 
-chunk_vec demultiplex_se_reads::process(analytical_chunk* chunk)
+chunk_vec demultiplex_pe_reads::process(analytical_chunk* chunk)
 {
-    std::auto_ptr<fastq_read_chunk> read_chunk(dynamic_cast<fastq_read_chunk*>(chunk));
-
-    const fastq empty_read;
-    for (fastq_vec::iterator it = read_chunk->reads_1.begin(); it != read_chunk->reads_1.end(); ++it) {
-        const int best_barcode = select_barcode(*it, empty_read);
-
-        if (best_barcode < 0) {
-            m_unidentified_1->add(*m_config->quality_output_fmt, *it);
-
-            if (best_barcode == -1) {
-                m_statistics.unidentified += 1;
-            } else {
-                m_statistics.ambiguous += 1;
-            }
-        } else {
-            fastq_read_chunk* dst = m_cache.at(best_barcode);
-            dst->reads_1.push_back(*it);
-            dst->reads_1.back().truncate(m_barcodes.at(best_barcode).first.length());
-
-           m_statistics.barcodes.at(best_barcode) += 1;
+    std::auto_ptr<demultiplexed_chunk> output(new demultiplexed_chunk(dynamic_cast<fastq_read_chunk*>(chunk)));
+    fastq_vec& reads_1 = output->reads->reads_1;
+    fastq_vec& reads_2 = output->reads->reads_2;
+    AR_DEBUG_ASSERT(reads_1.size() == reads_2.size());
+    output->barcodes.reserve(reads_1.size());
+
+    fastq_vec::iterator it_1 = reads_1.begin();
+    fastq_vec::iterator it_2 = reads_2.begin();
+    for (; it_1 != reads_1.end(); ++it_1, ++it_2) {
+        const int best_barcode = select_barcode(*it_1, *it_2);
+        if (best_barcode >= 0) {
+            it_1->truncate(m_barcodes.at(best_barcode).first.length());
+            it_2->truncate(m_barcodes.at(best_barcode).second.length());
         }
+
+        output->barcodes.push_back(best_barcode);
     }
 
-    return flush_cache(read_chunk->eof);
+    chunk_vec chunks;
+    chunks.push_back(chunk_pair(ai_collect_demultiplexed, output.release()));
+
+    return chunks;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////////
 
-demultiplex_pe_reads::demultiplex_pe_reads(const userconfig* config)
-    : demultiplex_reads(config)
+collect_demultiplexed_reads::collect_demultiplexed_reads(const userconfig* config)
+    : analytical_step(analytical_step::ordered)
+    , m_config(config)
+    , m_cache(config->adapters.barcode_count(), NULL)
+    , m_cache_usage(0)
+    , m_unidentified_1(fastq_output_chunk::create())
+    , m_unidentified_2(fastq_output_chunk::create())
+    , m_statistics(config->adapters.barcode_count())
 {
+    for (demultiplexed_cache::iterator it = m_cache.begin(); it != m_cache.end(); ++it) {
+        *it = fastq_read_chunk::create();
+    }
 }
 
 
-chunk_vec demultiplex_pe_reads::process(analytical_chunk* chunk)
+collect_demultiplexed_reads::~collect_demultiplexed_reads()
 {
-    std::auto_ptr<fastq_read_chunk> read_chunk(dynamic_cast<fastq_read_chunk*>(chunk));
-    AR_DEBUG_ASSERT(read_chunk->reads_1.size() == read_chunk->reads_2.size());
+    for (demultiplexed_cache::iterator it = m_cache.begin(); it != m_cache.end(); ++it) {
+        fastq_read_chunk::recycle(*it);
+    }
 
-    fastq_vec::iterator it_1 = read_chunk->reads_1.begin();
-    fastq_vec::iterator it_2 = read_chunk->reads_2.begin();
-    for (; it_1 != read_chunk->reads_1.end(); ++it_1, ++it_2) {
-        const int best_barcode = select_barcode(*it_1, *it_2);
+    fastq_output_chunk::recycle(m_unidentified_1);
+    fastq_output_chunk::recycle(m_unidentified_2);
+}
+
+
+chunk_vec collect_demultiplexed_reads::process(analytical_chunk* chunk)
+{
+    std::auto_ptr<demultiplexed_chunk> input(dynamic_cast<demultiplexed_chunk*>(chunk));
+    const fastq_vec& reads_1 = input->reads->reads_1;
+    const fastq_vec& reads_2 = input->reads->reads_2;
+    const bool paired_end = m_config->paired_ended_mode;
+
+    for (size_t i = 0; i < input->barcodes.size(); ++i) {
+        const int best_barcode = input->barcodes.at(i);
 
         if (best_barcode < 0) {
-            m_unidentified_1->add(*m_config->quality_output_fmt, *it_1);
-            m_unidentified_2->add(*m_config->quality_output_fmt, *it_2);
+            if (paired_end) {
+                m_unidentified_1->add(*m_config, reads_1.at(i), BAM_FLAGS_MATE_1);
+                m_unidentified_2->add(*m_config, reads_2.at(i), BAM_FLAGS_MATE_2);
+            } else {
+                m_unidentified_1->add(*m_config, reads_1.at(i), BAM_FLAGS_UNPAIRED);
+            }
 
             if (best_barcode == -1) {
                 m_statistics.unidentified += 1;
@@ -468,16 +314,69 @@ chunk_vec demultiplex_pe_reads::process(analytical_chunk* chunk)
         } else {
             fastq_read_chunk* dst = m_cache.at(best_barcode);
 
-            it_1->truncate(m_barcodes.at(best_barcode).first.length());
-            dst->reads_1.push_back(*it_1);
-            it_2->truncate(m_barcodes.at(best_barcode).second.length());
-            dst->reads_2.push_back(*it_2);
+            dst->reads_1.push_back(reads_1.at(i));
+            m_cache_usage += ar::memory_usage(reads_1.at(i));
+            if (paired_end) {
+                dst->reads_2.push_back(reads_2.at(i));
+                m_cache_usage += ar::memory_usage(reads_2.at(i));
+            }
 
             m_statistics.barcodes.at(best_barcode) += 1;
         }
     }
 
-    return flush_cache(read_chunk->eof);
+    // Caches are flushed at the size chosen by the reader for this chunk, rather
+    // than at the current chunk_sizer target, which the reader may be updating
+    const size_t records = std::max(reads_1.size(), MIN_CHUNK_RECORDS);
+
+    return flush_cache(input->reads->eof, records);
+}
+
+
+chunk_vec collect_demultiplexed_reads::flush_cache(bool eof, size_t records)
+{
+    chunk_vec output;
+
+    if (eof || m_unidentified_1->count >= records) {
+        output.push_back(chunk_pair(ai_write_unidentified_1, m_unidentified_1));
+        m_unidentified_1->eof = eof;
+        m_unidentified_1 = fastq_output_chunk::create();
+    }
+
+    if (m_config->paired_ended_mode && (eof || m_unidentified_2->count >= records)) {
+        output.push_back(chunk_pair(ai_write_unidentified_2, m_unidentified_2));
+        m_unidentified_2->eof = eof;
+        m_unidentified_2 = fastq_output_chunk::create();
+    }
+
+    for (size_t nth = 0; nth < m_cache.size(); ++nth) {
+        fastq_read_chunk* chunk = m_cache.at(nth);
+        if (eof || chunk->reads_1.size() >= records) {
+            chunk->eof = eof;
+
+            const size_t step_id = (nth + 1) * ai_analyses_offset;
+            output.push_back(chunk_pair(step_id, chunk));
+            m_cache_usage -= chunk->memory_usage();
+            m_cache.at(nth) = fastq_read_chunk::create();
+        }
+    }
+
+    return output;
+}
+
+
+demux_statistics collect_demultiplexed_reads::statistics() const
+{
+    return m_statistics;
+}
+
+
+size_t collect_demultiplexed_reads::memory_usage() const
+{
+    return m_cache_usage
+        + m_unidentified_1->memory_usage()
+        + m_unidentified_2->memory_usage();
 }
 
+
 } // namespace ar
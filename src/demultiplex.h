@@ -25,6 +25,7 @@
 #ifndef DEMULTIPLEX_H
 #define DEMULTIPLEX_H
 
+#include "barcode_table.h"
 #include "fastq.h"
 #include "scheduler.h"
 #include "statistics.h"
@@ -35,16 +36,44 @@ namespace ar
 class userconfig;
 class fastq_read_chunk;
 class fastq_output_chunk;
-struct demultiplexer_node;
 
-typedef std::vector<demultiplexer_node> demux_node_vec;
 
+/**
+ * Reads assigned to barcodes by 'demultiplex_reads', in the input order; the
+ * barcode sequences have been trimmed from identified reads.
+ */
+class demultiplexed_chunk : public analytical_chunk
+{
+public:
+    /** Constructor; takes ownership of the chunk of reads. */
+    demultiplexed_chunk(fastq_read_chunk* reads_);
+
+    /** Destructor; recycles the chunk of reads. */
+    virtual ~demultiplexed_chunk();
+
+    /** Returns the number of bytes used by reads and barcode assignments. */
+    virtual size_t memory_usage() const;
+
+    //! Demultiplexed reads (pairs)
+    fastq_read_chunk* reads;
+    //! Barcode (pair) assigned to each read (pair), or -1 if no matches were
+    //! found, or -2 if no single best match was found
+    std::vector<int> barcodes;
+
+private:
+    //! Not implemented
+    demultiplexed_chunk(const demultiplexed_chunk&);
+    //! Not implemented
+    demultiplexed_chunk& operator=(const demultiplexed_chunk&);
+};
 
 
 /**
- * Baseclass for demultiplexing of reads; responsible for building the quadtree
- * representing the set of adapter sequences, and for maintaining the cache of
- * demultiplexed reads.
+ * Baseclass for demultiplexing of reads; responsible for building the trie
+ * representing the set of adapter sequences, and for assigning reads to
+ * barcodes. Chunks are processed in any order, by any number of threads, and
+ * the results forwarded to 'collect_demultiplexed_reads' (ID
+ * ai_collect_demultiplexed), which restores the input order.
  */
 class demultiplex_reads : public analytical_step
 {
@@ -52,50 +81,35 @@ public:
     /** Setup demultiplexer; keeps pointer to config object. */
     demultiplex_reads(const userconfig* config);
 
-    /** Frees any unflushed caches. */
+    /** Destructor; does nothing. */
     virtual ~demultiplex_reads();
 
-    /** Returns a statistics object summarizing the results up till now. */
-    demux_statistics statistics() const;
-
 protected:
     /**
      * Returns the id of the best matching barcode(s), or -1 if no matches were
-     * found or if no single best match was found.
+     * found, or -2 if no single best match was found. Reads are looked up in
+     * 'm_table' if possible, and otherwise using 'm_scanner' or 'm_trie'.
      */
-    int select_barcode(const fastq& read_r1, const fastq& read_r2);
+    int select_barcode(const fastq& read_r1, const fastq& read_r2) const;
 
     //! List of barcode (pairs) supplied by caller
     const fastq_pair_vec& m_barcodes;
-    //! Quadtree representing all mate 1 adapters; for search with n mismatches
-    const demux_node_vec m_tree;
+    //! Trie representing all mate 1 barcodes; for search with n mismatches
+    const barcode_trie m_trie;
     //! Maximum number of mismatches allowed between the mate 1 and mate 2 read
     const size_t m_max_mismatches;
     //! Maximum number of mismatches allowed for the mate 1 read
     const size_t m_max_mismatches_r1;
     //! Maximum number of mismatches allowed for the mate 2 read
     const size_t m_max_mismatches_r2;
-    //! Pointer to user settings used for output format for unidentified reads
+    //! Pointer to user settings
     const userconfig* m_config;
-
-    //! Returns a chunk-list with any set of reads exceeding the max cache size
-    //! If 'eof' is true, all chunks are returned, and the 'eof' values in the
-    //! chunks are set to true.
-    chunk_vec flush_cache(bool eof = false);
-
-    typedef std::vector<fastq_read_chunk*> demultiplexed_cache;
-
-    //! Cache of demultiplex reads; used to reduce the number of output chunks
-    //! generated from each processed chunk, which would otherwise increase
-    //! linearly with the number of barcodes.
-    demultiplexed_cache m_cache;
-    //! Cache of unidentified mate 1 reads
-    fastq_output_chunk* m_unidentified_1;
-    //! Cache of unidentified mate 2 reads
-    fastq_output_chunk* m_unidentified_2;
-
-    //! Sink for demultiplexing statistics; used by subclasses.
-    demux_statistics m_statistics;
+    //! Table of sequences near barcodes; used instead of 'm_trie' if possible
+    const barcode_table m_table;
+    //! Brute-force search of barcodes; used instead of 'm_trie' if cheaper
+    const barcode_scanner m_scanner;
+    //! Indicates if reads not found in 'm_table' are looked up in 'm_scanner'
+    const bool m_use_scanner;
 
 private:
     //! Not implemented
@@ -113,9 +127,8 @@ public:
     demultiplex_se_reads(const userconfig* config);
 
     /**
-     * Processes a read chunk, and forwards chunks to downstream steps, with
-     * the IDs corresponding to ai_analyses_offset * (nth + 1) for the nth
-     * barcode (pair). Unidentified reads are sent to ai_write_unidentified_1.
+     * Assigns each read in a chunk to a barcode, and forwards the reads as a
+     * 'demultiplexed_chunk' to ai_collect_demultiplexed.
      */
     chunk_vec process(analytical_chunk* chunk);
 };
@@ -129,12 +142,68 @@ public:
     demultiplex_pe_reads(const userconfig* config);
 
     /**
-     * Processes a read chunk, and forwards chunks to downstream steps, with
-     * the IDs corresponding to ai_analyses_offset * (nth + 1) for the nth
-     * barcode (pair). Unidentified reads are sent to ai_write_unidentified_1
-     * and ai_write_unidentified_2.
+     * Assigns each read pair in a chunk to a barcode pair, and forwards the
+     * reads as a 'demultiplexed_chunk' to ai_collect_demultiplexed.
+     */
+    chunk_vec process(analytical_chunk* chunk);
+};
+
+
+/**
+ * Collects the reads assigned to each barcode (pair) by 'demultiplex_reads',
+ * in the input order, and maintains the cache of demultiplexed reads.
+ */
+class collect_demultiplexed_reads : public analytical_step
+{
+public:
+    /** Constructor; keeps pointer to config object. */
+    collect_demultiplexed_reads(const userconfig* config);
+
+    /** Frees any unflushed caches. */
+    virtual ~collect_demultiplexed_reads();
+
+    /**
+     * Processes a 'demultiplexed_chunk', and forwards chunks to downstream
+     * steps, with the IDs corresponding to ai_analyses_offset * (nth + 1) for
+     * the nth barcode (pair). Unidentified reads are sent to
+     * ai_write_unidentified_1 and (for PE reads) ai_write_unidentified_2.
      */
     chunk_vec process(analytical_chunk* chunk);
+
+    /** Returns a statistics object summarizing the results up till now. */
+    demux_statistics statistics() const;
+
+    /** Returns the number of bytes used by cached reads. */
+    virtual size_t memory_usage() const;
+
+private:
+    //! Not implemented
+    collect_demultiplexed_reads(const collect_demultiplexed_reads&);
+    //! Not implemented
+    collect_demultiplexed_reads& operator=(const collect_demultiplexed_reads&);
+
+    //! Returns a chunk-list with any set of reads of at least 'records' reads
+    //! If 'eof' is true, all chunks are returned, and the 'eof' values in the
+    //! chunks are set to true.
+    chunk_vec flush_cache(bool eof, size_t records);
+
+    typedef std::vector<fastq_read_chunk*> demultiplexed_cache;
+
+    //! Pointer to user settings used for output format for unidentified reads
+    const userconfig* m_config;
+    //! Cache of demultiplex reads; used to reduce the number of output chunks
+    //! generated from each processed chunk, which would otherwise increase
+    //! linearly with the number of barcodes.
+    demultiplexed_cache m_cache;
+    //! Sum of 'memory_usage' for reads in 'm_cache'
+    size_t m_cache_usage;
+    //! Cache of unidentified mate 1 reads
+    fastq_output_chunk* m_unidentified_1;
+    //! Cache of unidentified mate 2 reads
+    fastq_output_chunk* m_unidentified_2;
+
+    //! Demultiplexing statistics
+    demux_statistics m_statistics;
 };
 
 } // namespace ar
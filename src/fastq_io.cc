@@ -21,11 +21,14 @@
  * You should have received a copy of the GNU General Public License     *
  * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
 \*************************************************************************/
+#include <algorithm>
 #include <stdexcept>
 #include <iostream>
 #include <cerrno>
 #include <cstring>
 
+#include "bam.h"
+#include "chunk_sizer.h"
 #include "debug.h"
 #include "fastq_io.h"
 #include "userconfig.h"
@@ -35,15 +38,20 @@ namespace ar
 
 typedef std::auto_ptr<fastq_read_chunk> chunk_ptr;
 
+//! Pools of chunks re-used across pipeline cycles; shared by all steps
+static object_pool<fastq_read_chunk> s_read_chunks;
+static object_pool<bam_block_chunk> s_bam_chunks;
+static object_pool<fastq_output_chunk> s_output_chunks;
+
 
 size_t read_fastq_reads(fastq_vec& dst, line_reader& reader, size_t offset,
-                      const fastq_encoding& encoding)
+                      const fastq_encoding& encoding, size_t records)
 {
-    dst.reserve(FASTQ_CHUNK_SIZE);
+    dst.reserve(records);
 
     try {
         fastq record;
-        for (size_t i = 0; i < FASTQ_CHUNK_SIZE; ++i) {
+        for (size_t i = 0; i < records; ++i) {
             if (record.read(reader, encoding)) {
                 dst.push_back(record);
             } else {
@@ -65,6 +73,13 @@ size_t read_fastq_reads(fastq_vec& dst, line_reader& reader, size_t offset,
 
 
 
+size_t memory_usage(const fastq& read)
+{
+    return sizeof(fastq) + read.header().size() + read.sequence().size()
+        + read.qualities().size();
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // Implementations for 'fastq_read_chunk'
 
@@ -76,6 +91,89 @@ fastq_read_chunk::fastq_read_chunk(bool eof_)
 }
 
 
+fastq_read_chunk* fastq_read_chunk::create(bool eof_)
+{
+    fastq_read_chunk* chunk = s_read_chunks.acquire();
+    chunk->eof = eof_;
+
+    return chunk;
+}
+
+
+void fastq_read_chunk::recycle(fastq_read_chunk* chunk)
+{
+    s_read_chunks.release(chunk);
+}
+
+
+void fastq_read_chunk::clear()
+{
+    eof = false;
+    reads_1.clear();
+    reads_2.clear();
+}
+
+
+size_t fastq_read_chunk::memory_usage() const
+{
+    size_t usage = 0;
+    for (fastq_vec::const_iterator it = reads_1.begin(); it != reads_1.end(); ++it) {
+        usage += ar::memory_usage(*it);
+    }
+
+    for (fastq_vec::const_iterator it = reads_2.begin(); it != reads_2.end(); ++it) {
+        usage += ar::memory_usage(*it);
+    }
+
+    return usage;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'bam_block_chunk'
+
+bam_block_chunk::bam_block_chunk(bool eof_)
+  : eof(eof_)
+  , blocks()
+  , data()
+{
+}
+
+
+bam_block_chunk* bam_block_chunk::create(bool eof_)
+{
+    bam_block_chunk* chunk = s_bam_chunks.acquire();
+    chunk->eof = eof_;
+
+    return chunk;
+}
+
+
+void bam_block_chunk::recycle(bam_block_chunk* chunk)
+{
+    s_bam_chunks.release(chunk);
+}
+
+
+void bam_block_chunk::clear()
+{
+    eof = false;
+    blocks.clear();
+    data.clear();
+}
+
+
+size_t bam_block_chunk::memory_usage() const
+{
+    size_t usage = data.size();
+    for (string_vec::const_iterator it = blocks.begin(); it != blocks.end(); ++it) {
+        usage += it->size();
+    }
+
+    return usage;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // Implementations for 'fastq_output_chunk'
 
@@ -85,15 +183,56 @@ fastq_output_chunk::fastq_output_chunk(bool eof_)
   , reads()
   , buffers()
 {
-    reads.reserve(FASTQ_CHUNK_SIZE);
 }
 
 
 fastq_output_chunk::~fastq_output_chunk()
+{
+    clear();
+}
+
+
+fastq_output_chunk* fastq_output_chunk::create(bool eof_)
+{
+    fastq_output_chunk* chunk = s_output_chunks.acquire();
+    chunk->eof = eof_;
+    chunk->reads.reserve(chunk_sizer::shared().records());
+
+    return chunk;
+}
+
+
+void fastq_output_chunk::recycle(fastq_output_chunk* chunk)
+{
+    s_output_chunks.release(chunk);
+}
+
+
+void fastq_output_chunk::clear()
 {
     for (buffer_vec::iterator it = buffers.begin(); it != buffers.end(); ++it) {
         delete[] it->second;
     }
+
+    eof = false;
+    count = 0;
+    reads.clear();
+    buffers.clear();
+}
+
+
+size_t fastq_output_chunk::memory_usage() const
+{
+    size_t usage = 0;
+    for (string_vec::const_iterator it = reads.begin(); it != reads.end(); ++it) {
+        usage += it->size();
+    }
+
+    for (buffer_vec::const_iterator it = buffers.begin(); it != buffers.end(); ++it) {
+        usage += it->first;
+    }
+
+    return usage;
 }
 
 
@@ -105,6 +244,20 @@ void fastq_output_chunk::add(const fastq_encoding& encoding,
 }
 
 
+void fastq_output_chunk::add(const userconfig& config, const fastq& read,
+                             uint16_t bam_flags, size_t count_)
+{
+    if (config.bam_output) {
+        count += count_;
+        reads.push_back(std::string());
+        bam_encode_record(reads.back(), read, bam_flags, config.mate_separator,
+                          config.quality_output_fmt->max_score());
+    } else {
+        add(*config.quality_output_fmt, read, count_);
+    }
+}
+
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // Implementations for 'read_single_fastq'
@@ -129,10 +282,13 @@ chunk_vec read_single_fastq::process(analytical_chunk* chunk)
         return chunk_vec();
     }
 
-    chunk_ptr file_chunk(new fastq_read_chunk());
+    chunk_ptr file_chunk(fastq_read_chunk::create());
+    chunk_sizer& sizer = chunk_sizer::shared();
 
     const size_t n_read = read_fastq_reads(file_chunk->reads_1, m_io_input,
-                                           m_line_offset, *m_encoding);
+                                           m_line_offset, *m_encoding,
+                                           sizer.records());
+    sizer.add_read_chunk(n_read, file_chunk->memory_usage());
 
     if (!n_read) {
         // EOF is detected by failure to read any lines, not line_reader::eof,
@@ -184,12 +340,15 @@ chunk_vec read_paired_fastq::process(analytical_chunk* chunk)
         return chunk_vec();
     }
 
-    chunk_ptr file_chunk(new fastq_read_chunk());
+    chunk_ptr file_chunk(fastq_read_chunk::create());
+    chunk_sizer& sizer = chunk_sizer::shared();
+    const size_t records = sizer.records();
 
     const size_t n_read_1 = read_fastq_reads(file_chunk->reads_1, m_io_input_1,
-                                             m_line_offset, *m_encoding);
+                                             m_line_offset, *m_encoding, records);
     const size_t n_read_2 = read_fastq_reads(file_chunk->reads_2, m_io_input_2,
-                                             m_line_offset, *m_encoding);
+                                             m_line_offset, *m_encoding, records);
+    sizer.add_read_chunk(std::min(n_read_1, n_read_2), file_chunk->memory_usage());
 
     if (n_read_1 != n_read_2) {
         print_locker lock;
@@ -249,14 +408,16 @@ chunk_vec read_interleaved_fastq::process(analytical_chunk* chunk)
         return chunk_vec();
     }
 
-    chunk_ptr file_chunk(new fastq_read_chunk());
+    chunk_ptr file_chunk(fastq_read_chunk::create());
+    chunk_sizer& sizer = chunk_sizer::shared();
+    const size_t records = sizer.records();
 
-    file_chunk->reads_1.reserve(FASTQ_CHUNK_SIZE);
-    file_chunk->reads_2.reserve(FASTQ_CHUNK_SIZE);
+    file_chunk->reads_1.reserve(records);
+    file_chunk->reads_2.reserve(records);
 
     try {
         fastq record;
-        for (size_t i = 0; i < FASTQ_CHUNK_SIZE; ++i) {
+        for (size_t i = 0; i < records; ++i) {
             // Mate 1 reads
             if (record.read(m_io_input, *m_encoding)) {
                 file_chunk->reads_1.push_back(record);
@@ -286,6 +447,7 @@ chunk_vec read_interleaved_fastq::process(analytical_chunk* chunk)
 
     const size_t n_read_1 = file_chunk->reads_1.size();
     const size_t n_read_2 = file_chunk->reads_2.size();
+    sizer.add_read_chunk(n_read_2, file_chunk->memory_usage());
 
     if (n_read_1 != n_read_2) {
         print_locker lock;
@@ -318,6 +480,310 @@ void read_interleaved_fastq::finalize()
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'read_sam'
+
+read_sam::read_sam(const userconfig& config, const std::string& filename,
+                   size_t next_step)
+  : analytical_step(analytical_step::ordered, true)
+  , m_encoding(PHRED_OFFSET_33, config.quality_input_fmt->max_score())
+  , m_mate_separator(config.mate_separator)
+  , m_collector(config.paired_ended_mode)
+  , m_line_offset(1)
+  , m_io_input(filename)
+  , m_next_step(next_step)
+  , m_eof(false)
+{
+}
+
+
+chunk_vec read_sam::process(analytical_chunk* chunk)
+{
+    AR_DEBUG_ASSERT(chunk == NULL);
+    if (!m_io_input.is_open()) {
+        return chunk_vec();
+    }
+
+    chunk_ptr file_chunk(fastq_read_chunk::create());
+    fastq_vec& reads_1 = file_chunk->reads_1;
+    fastq_vec& reads_2 = file_chunk->reads_2;
+
+    chunk_sizer& sizer = chunk_sizer::shared();
+    const size_t records = sizer.records();
+
+    reads_1.reserve(records);
+    reads_2.reserve(records);
+
+    try {
+        std::string line;
+        fastq record;
+        uint16_t flags = 0;
+
+        while (reads_1.size() < records) {
+            if (!m_io_input.getline(line)) {
+                m_collector.finalize();
+                m_io_input.close();
+                file_chunk->eof = true;
+                m_eof = true;
+                break;
+            }
+
+            // Header lines are skipped
+            if (!line.empty() && line.at(0) != '@') {
+                sam_decode_record(line, record, flags, m_encoding, m_mate_separator);
+                m_collector.add(reads_1, reads_2, record, flags);
+            }
+
+            ++m_line_offset;
+        }
+    } catch (const fastq_error& error) {
+        print_locker lock;
+        std::cerr << "Error reading SAM record at line "
+                  << m_line_offset << "; aborting:\n"
+                  << cli_formatter::fmt(error.what()) << std::endl;
+
+        throw thread_abort();
+    }
+
+    sizer.add_read_chunk(reads_1.size(), file_chunk->memory_usage());
+
+    chunk_vec chunks;
+    chunks.push_back(chunk_pair(m_next_step, file_chunk.release()));
+
+    return chunks;
+}
+
+
+void read_sam::finalize()
+{
+    if (!m_eof) {
+        throw thread_error("read_sam::finalize: terminated before EOF");
+    }
+}
+
+
+#ifdef AR_GZIP_SUPPORT
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'read_bam'
+
+read_bam::read_bam(const std::string& filename, size_t next_step)
+  : analytical_step(analytical_step::ordered, true)
+  , m_io_input(filename)
+  , m_next_step(next_step)
+  , m_eof(false)
+{
+}
+
+
+chunk_vec read_bam::process(analytical_chunk* chunk)
+{
+    AR_DEBUG_ASSERT(chunk == NULL);
+    if (!m_io_input.is_open()) {
+        return chunk_vec();
+    }
+
+    std::auto_ptr<bam_block_chunk> file_chunk(bam_block_chunk::create());
+    string_vec& blocks = file_chunk->blocks;
+
+    // Blocks are decompressed to at most BGZF_BLOCK_SIZE bytes each
+    const size_t max_blocks = std::max<size_t>(1, chunk_sizer::shared().bytes() / BGZF_BLOCK_SIZE);
+
+    try {
+        while (blocks.size() < max_blocks) {
+            blocks.push_back(std::string());
+
+            if (!m_io_input.read_block(blocks.back())) {
+                blocks.pop_back();
+                m_io_input.close();
+                file_chunk->eof = true;
+                m_eof = true;
+                break;
+            }
+        }
+    } catch (const bam_error& error) {
+        print_locker lock;
+        std::cerr << "Error reading BAM file; aborting:\n"
+                  << cli_formatter::fmt(error.what()) << std::endl;
+
+        throw thread_abort();
+    }
+
+    chunk_vec chunks;
+    chunks.push_back(chunk_pair(m_next_step, file_chunk.release()));
+
+    return chunks;
+}
+
+
+void read_bam::finalize()
+{
+    if (!m_eof) {
+        throw thread_error("read_bam::finalize: terminated before EOF");
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'decompress_bam'
+
+decompress_bam::decompress_bam(size_t next_step)
+  : analytical_step(analytical_step::unordered, false)
+  , m_next_step(next_step)
+{
+}
+
+
+chunk_vec decompress_bam::process(analytical_chunk* chunk)
+{
+    std::auto_ptr<bam_block_chunk> file_chunk(dynamic_cast<bam_block_chunk*>(chunk));
+    string_vec& blocks = file_chunk->blocks;
+
+    try {
+        file_chunk->data.reserve(blocks.size() * BGZF_BLOCK_SIZE);
+        for (string_vec::const_iterator it = blocks.begin(); it != blocks.end(); ++it) {
+            bgzf_decompress(*it, file_chunk->data);
+        }
+    } catch (const bam_error& error) {
+        print_locker lock;
+        std::cerr << "Error decompressing BAM file; aborting:\n"
+                  << cli_formatter::fmt(error.what()) << std::endl;
+
+        throw thread_abort();
+    }
+
+    blocks.clear();
+
+    chunk_vec chunks;
+    chunks.push_back(chunk_pair(m_next_step, file_chunk.release()));
+
+    return chunks;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'parse_bam'
+
+parse_bam::parse_bam(const userconfig& config, size_t next_step)
+  : analytical_step(analytical_step::ordered, false)
+  , m_encoding(PHRED_OFFSET_33, config.quality_input_fmt->max_score())
+  , m_mate_separator(config.mate_separator)
+  , m_collector(config.paired_ended_mode)
+  , m_buffer()
+  , m_header_decoded(false)
+  , m_records(0)
+  , m_next_step(next_step)
+  , m_eof(false)
+{
+}
+
+
+chunk_vec parse_bam::process(analytical_chunk* chunk)
+{
+    std::auto_ptr<bam_block_chunk> bam_chunk(dynamic_cast<bam_block_chunk*>(chunk));
+
+    if (m_eof) {
+        throw thread_error("parse_bam::process: received data after EOF");
+    }
+
+    m_eof = bam_chunk->eof;
+    if (m_buffer.empty()) {
+        m_buffer.swap(bam_chunk->data);
+    } else {
+        m_buffer.append(bam_chunk->data);
+    }
+
+    chunk_ptr file_chunk(fastq_read_chunk::create(m_eof));
+    size_t offset = 0;
+
+    try {
+        if (!m_header_decoded) {
+            m_header_decoded = bam_decode_header(m_buffer, offset);
+        }
+
+        if (m_header_decoded) {
+            fastq record;
+            uint16_t flags = 0;
+
+            while (bam_decode_record(m_buffer, offset, record, flags,
+                                     m_encoding, m_mate_separator)) {
+                m_records++;
+                m_collector.add(file_chunk->reads_1, file_chunk->reads_2,
+                                record, flags);
+            }
+        }
+
+        if (m_eof) {
+            if (!m_header_decoded) {
+                throw bam_error("BAM file is empty or truncated");
+            } else if (offset != m_buffer.size()) {
+                throw bam_error("BAM file is truncated");
+            }
+
+            m_collector.finalize();
+        }
+    } catch (const fastq_error& error) {
+        print_locker lock;
+        std::cerr << "Error reading BAM record " << m_records + 1
+                  << "; aborting:\n"
+                  << cli_formatter::fmt(error.what()) << std::endl;
+
+        throw thread_abort();
+    }
+
+    // Incomplete records are kept for the next chunk
+    m_buffer.erase(0, offset);
+    bam_block_chunk::recycle(bam_chunk.release());
+    chunk_sizer::shared().add_read_chunk(file_chunk->reads_1.size(),
+                                         file_chunk->memory_usage());
+
+    chunk_vec chunks;
+    chunks.push_back(chunk_pair(m_next_step, file_chunk.release()));
+
+    return chunks;
+}
+
+
+void parse_bam::finalize()
+{
+    if (!m_eof) {
+        throw thread_error("parse_bam::finalize: terminated before EOF");
+    }
+}
+
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+void add_read_steps(const userconfig& config, scheduler& sch, size_t next_step)
+{
+#ifdef AR_GZIP_SUPPORT
+    if (config.bam_input) {
+        sch.add_step(ai_read_fastq, new read_bam(config.input_file_1, ai_decompress_bam));
+        sch.add_step(ai_decompress_bam, new decompress_bam(ai_parse_bam));
+        sch.add_step(ai_parse_bam, new parse_bam(config, next_step));
+    } else
+#endif
+    if (config.sam_input) {
+        sch.add_step(ai_read_fastq, new read_sam(config, config.input_file_1, next_step));
+    } else if (config.interleaved_input) {
+        sch.add_step(ai_read_fastq, new read_interleaved_fastq(config.quality_input_fmt.get(),
+                                                               config.input_file_1,
+                                                               next_step));
+    } else if (config.paired_ended_mode) {
+        sch.add_step(ai_read_fastq, new read_paired_fastq(config.quality_input_fmt.get(),
+                                                          config.input_file_1,
+                                                          config.input_file_2,
+                                                          next_step));
+    } else {
+        sch.add_step(ai_read_fastq, new read_single_fastq(config.quality_input_fmt.get(),
+                                                          config.input_file_1,
+                                                          next_step));
+    }
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // Utility function used by both gzip and bzip compression steps
 
@@ -349,7 +815,7 @@ std::pair<size_t, unsigned char*> build_input_buffer(const string_vec& lines)
 
 
 bzip2_paired_fastq::bzip2_paired_fastq(const userconfig& config, size_t next_step)
-  : analytical_step(analytical_step::ordered, false)
+  : analytical_step(analytical_step::ordered, false, true)
   , m_buffered_reads(0)
   , m_next_step(next_step)
   , m_stream()
@@ -484,6 +950,7 @@ chunk_vec bzip2_paired_fastq::process(analytical_chunk* chunk)
         m_buffered_reads = 0;
     } else {
         m_buffered_reads += file_chunk->count;
+        fastq_output_chunk::recycle(file_chunk.release());
     }
 
     return chunks;
@@ -498,7 +965,7 @@ chunk_vec bzip2_paired_fastq::process(analytical_chunk* chunk)
 // Implementations for 'gzip_paired_fastq'
 
 gzip_paired_fastq::gzip_paired_fastq(const userconfig& config, size_t next_step)
-  : analytical_step(analytical_step::ordered, false)
+  : analytical_step(analytical_step::ordered, false, true)
   , m_buffered_reads(0)
   , m_next_step(next_step)
   , m_stream()
@@ -634,11 +1101,52 @@ chunk_vec gzip_paired_fastq::process(analytical_chunk* chunk)
         m_buffered_reads = 0;
     } else {
         m_buffered_reads += file_chunk->count;
+        fastq_output_chunk::recycle(file_chunk.release());
     }
 
     return chunks;
 }
 
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'bgzf_compress_bam'
+
+bgzf_compress_bam::bgzf_compress_bam(const userconfig& config, size_t next_step)
+  : analytical_step(analytical_step::unordered, false)
+  , m_level(config.gzip_level)
+  , m_next_step(next_step)
+{
+}
+
+
+chunk_vec bgzf_compress_bam::process(analytical_chunk* chunk)
+{
+    std::auto_ptr<fastq_output_chunk> file_chunk(dynamic_cast<fastq_output_chunk*>(chunk));
+
+    std::pair<size_t, unsigned char*> input_buffer;
+    try {
+        input_buffer = build_input_buffer(file_chunk->reads);
+        file_chunk->reads.clear();
+
+        const char* data = reinterpret_cast<const char*>(input_buffer.second);
+        for (size_t offset = 0; offset < input_buffer.first; offset += BGZF_BLOCK_SIZE) {
+            const size_t size = std::min(BGZF_BLOCK_SIZE, input_buffer.first - offset);
+
+            file_chunk->buffers.push_back(bgzf_compress(data + offset, size, m_level));
+        }
+
+        delete[] input_buffer.second;
+    } catch (...) {
+        delete[] input_buffer.second;
+        throw;
+    }
+
+    chunk_vec chunks;
+    chunks.push_back(chunk_pair(m_next_step, file_chunk.release()));
+
+    return chunks;
+}
+
 #endif
 
 
@@ -653,17 +1161,29 @@ static timer s_timer = timer("reads");
 static bool s_finalized = false;
 
 
-write_fastq::write_fastq(const std::string& filename)
+write_fastq::write_fastq(const userconfig& config, const std::string& filename)
   : analytical_step(analytical_step::ordered, true)
-  , m_output(filename.c_str(), std::ofstream::out)
+  , m_filename(filename)
+  , m_bam(config.bam_output)
+  , m_crc32c(config.checksums ? new crc32c_checksum() : NULL)
+  , m_md5(config.checksums_md5 ? new md5_checksum() : NULL)
+  , m_output(filename)
   , m_eof(false)
 {
-    if (!m_output.is_open()) {
-        std::string message = std::string("Failed to open file '") + filename + "': ";
-        throw std::ofstream::failure(message + std::strerror(errno));
+#ifdef AR_GZIP_SUPPORT
+    if (m_bam) {
+        const std::string header = bam_header();
+        for (size_t offset = 0; offset < header.size(); offset += BGZF_BLOCK_SIZE) {
+            const size_t size = std::min(BGZF_BLOCK_SIZE, header.size() - offset);
+            const buffer_pair block = bgzf_compress(header.data() + offset, size,
+                                                    config.gzip_level);
+
+            update_checksums(reinterpret_cast<char*>(block.second), block.first);
+            // Ownership of the buffer is transferred to the writer
+            m_output.write_buffer(block.second, block.first);
+        }
     }
-
-    m_output.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+#endif
 }
 
 
@@ -679,23 +1199,33 @@ chunk_vec write_fastq::process(analytical_chunk* chunk)
     m_eof = file_chunk->eof;
     if (file_chunk->buffers.empty()) {
         for (string_vec::const_iterator it = lines.begin(); it != lines.end(); ++it) {
-            m_output << *it;
+            write_block(it->data(), it->size());
         }
     } else {
         buffer_vec& buffers = file_chunk->buffers;
         for (buffer_vec::iterator it = buffers.begin(); it != buffers.end(); ++it) {
             if (it->first) {
-                m_output.write(reinterpret_cast<char*>(it->second), it->first);
+                update_checksums(reinterpret_cast<char*>(it->second), it->first);
+                // Ownership is transferred to the writer, even if writing fails
+                unsigned char* buffer = it->second;
+                it->second = NULL;
+                m_output.write_buffer(buffer, it->first);
             }
         }
     }
 
     if (m_eof) {
+        if (m_bam) {
+            write_block(reinterpret_cast<const char*>(BGZF_EOF_BLOCK),
+                        sizeof(BGZF_EOF_BLOCK));
+        }
+
         m_output.flush();
     }
 
     mutex_locker lock(s_timer_lock);
     s_timer.increment(file_chunk->count);
+    fastq_output_chunk::recycle(file_chunk.release());
 
     return chunk_vec();
 }
@@ -713,8 +1243,68 @@ void write_fastq::finalize()
         throw thread_error("write_fastq::finalize: terminated before EOF");
     }
 
-    // Close file to trigger any exceptions due to badbit / failbit
+    // Close file to trigger any exceptions due to failed writes
     m_output.close();
+
+    write_checksums();
+}
+
+
+void write_fastq::update_checksums(const char* data, size_t size)
+{
+    if (m_crc32c.get()) {
+        m_crc32c->update(data, size);
+    }
+
+    if (m_md5.get()) {
+        m_md5->update(data, size);
+    }
+}
+
+
+void write_fastq::write_block(const char* data, size_t size)
+{
+    update_checksums(data, size);
+    m_output.write(data, size);
+}
+
+
+/** Writes a single line to a (new) file, overwriting any existing file. */
+void write_line_to_file(const std::string& filename, const std::string& line)
+{
+    std::ofstream output(filename.c_str(), std::ofstream::out);
+    if (!output.is_open()) {
+        throw io_error("Failed to open file '" + filename + "'", errno);
+    }
+
+    output.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+    output << line << "\n";
+    output.close();
+}
+
+
+void write_fastq::write_checksums() const
+{
+    if (m_filename == "-") {
+        // No sidecar file can be written when writing to STDOUT
+        return;
+    }
+
+    // Checksum files are placed next to the output file, and so only list the
+    // name of that file; 'md5sum -c' may thus be run in the output directory
+    const std::string name = m_filename.substr(m_filename.find_last_of('/') + 1);
+
+    if (m_crc32c.get()) {
+        // BSD style format, e.g. "CRC32C (filename) = checksum"
+        write_line_to_file(m_filename + ".checksums",
+                           m_crc32c->name() + " (" + name + ") = "
+                           + m_crc32c->hexdigest());
+    }
+
+    if (m_md5.get()) {
+        // Format used by 'md5sum', which may be checked using 'md5sum -c'
+        write_line_to_file(m_filename + ".md5", m_md5->hexdigest() + "  " + name);
+    }
 }
 
 } // namespace ar
@@ -28,14 +28,18 @@
 #include <fstream>
 
 #include <zlib.h>
+#include <stdint.h>
 
 #ifdef AR_BZIP2_SUPPORT
 #include <bzlib.h>
 #endif
 
 
+#include "bam.h"
+#include "checksum.h"
 #include "commontypes.h"
 #include "fastq.h"
+#include "filewriter.h"
 #include "scheduler.h"
 #include "timer.h"
 #include "linereader.h"
@@ -50,9 +54,6 @@ typedef std::pair<size_t, unsigned char*> buffer_pair;
 typedef std::vector<buffer_pair> buffer_vec;
 
 
-//! Number of FASTQ records to read for each data-chunk
-const size_t FASTQ_CHUNK_SIZE = 2 * 1024;
-
 #if defined(AR_GZIP_SUPPORT) || defined(AR_BZIP2_SUPPORT)
 //! Size of compressed chunks used to transport compressed data
 const size_t FASTQ_COMPRESSED_CHUNK = 40 * 1024;
@@ -61,6 +62,10 @@ const size_t FASTQ_COMPRESSED_CHUNK = 40 * 1024;
 
 
 
+/** Returns the (approximate) number of bytes used to store a read. */
+size_t memory_usage(const fastq& read);
+
+
 /**
  * Container object for (demultiplexed) reads.
  */
@@ -70,6 +75,20 @@ public:
     /** Create chunk representing lines starting at line offset (1-based). */
     fastq_read_chunk(bool eof_ = false);
 
+    /** Returns an empty chunk, re-using a recycled chunk if possible. */
+    static fastq_read_chunk* create(bool eof_ = false);
+    /**
+     * Returns a chunk to the pool of chunks; the capacity of the vectors is
+     * retained, but the reads themselves are freed.
+     */
+    static void recycle(fastq_read_chunk* chunk);
+
+    /** Removes (frees) all reads and resets the EOF flag. */
+    void clear();
+
+    /** Returns the sum of 'memory_usage' for all reads in the chunk. */
+    virtual size_t memory_usage() const;
+
     //! Indicates that EOF has been reached.
     bool eof;
 
@@ -80,6 +99,39 @@ public:
 };
 
 
+/**
+ * Container object for blocks read from BAM files.
+ */
+class bam_block_chunk : public analytical_chunk
+{
+public:
+    /** Constructor; does nothing. */
+    bam_block_chunk(bool eof_ = false);
+
+    /** Returns an empty chunk, re-using a recycled chunk if possible. */
+    static bam_block_chunk* create(bool eof_ = false);
+    /**
+     * Returns a chunk to the pool of chunks; the capacity of 'data' and of the
+     * list of blocks is retained, but the blocks themselves are freed.
+     */
+    static void recycle(bam_block_chunk* chunk);
+
+    /** Removes all blocks / data and resets the EOF flag. */
+    void clear();
+
+    /** Returns the number of bytes in blocks and decompressed data. */
+    virtual size_t memory_usage() const;
+
+    //! Indicates that EOF has been reached.
+    bool eof;
+
+    //! Raw (compressed) BGZF blocks
+    string_vec blocks;
+    //! Decompressed data; may start / end in the middle of a record
+    std::string data;
+};
+
+
 /**
  * Container object for processed reads.
  */
@@ -92,9 +144,30 @@ public:
     /** Destructor; frees buffers. */
     ~fastq_output_chunk();
 
+    /** Returns an empty chunk, re-using a recycled chunk if possible. */
+    static fastq_output_chunk* create(bool eof_ = false);
+    /**
+     * Returns a chunk to the pool of chunks; the capacity of the vectors is
+     * retained, but the reads and compressed buffers are freed.
+     */
+    static void recycle(fastq_output_chunk* chunk);
+
+    /** Removes all reads, frees buffers, and resets the EOF flag / count. */
+    void clear();
+
+    /** Returns the number of bytes in (compressed) reads. */
+    virtual size_t memory_usage() const;
+
     /** Add FASTQ read, accounting for one or more input reads. */
     void add(const fastq_encoding& encoding, const fastq& read, size_t count = 1);
 
+    /**
+     * Add read using the output format selected by the user; reads are either
+     * written as FASTQ records, or as BAM records using the given SAM flags.
+     */
+    void add(const userconfig& config, const fastq& read, uint16_t bam_flags,
+             size_t count = 1);
+
     //! Indicates that EOF has been reached.
     bool eof;
 
@@ -105,9 +178,11 @@ public:
 private:
     friend class gzip_paired_fastq;
     friend class bzip2_paired_fastq;
+    friend class bgzf_compress_bam;
     friend class write_fastq;
 
-    //! Lines read from the mate 1 and mate 2 files
+    //! Lines read from the mate 1 and mate 2 files, or (uncompressed) BAM
+    //! records if BAM output is enabled
     string_vec reads;
 
     //! Buffers of compressed lines
@@ -250,10 +325,179 @@ private:
 
 
 
+/**
+ * Simple file reading step.
+ *
+ * Reads SE reads or interleaved PE reads from a SAM file (optionally gzip or
+ * bzip2 compressed), storing the reads in a fastq_read_chunk. Header lines are
+ * skipped, as are secondary and supplementary alignments. Once the EOF has
+ * been reached, a single empty chunk will be returned, marked using the 'eof'
+ * property.
+ */
+class read_sam : public analytical_step
+{
+public:
+    /**
+     * Constructor.
+     *
+     * @param config User settings; determines if reads are paired.
+     * @param filename Path to SAM file.
+     * @param next_step The step to which reads are forwarded.
+     */
+    read_sam(const userconfig& config, const std::string& filename,
+             size_t next_step);
+
+    /** Reads N records from the input file and saves them in an fastq_read_chunk. */
+    virtual chunk_vec process(analytical_chunk* chunk);
+
+    /** Finalizer; checks that all input has been processed. */
+    virtual void finalize();
+
+private:
+    //! Not implemented
+    read_sam(const read_sam&);
+    //! Not implemented
+    read_sam& operator=(const read_sam&);
+
+    //! Encoding used to validate quality scores (Phred+33).
+    const fastq_encoding m_encoding;
+    //! Character separating the mate number from read names
+    const char m_mate_separator;
+    //! Pairs mate 1 and mate 2 reads, if input is paired
+    sam_mate_collector m_collector;
+    //! Current line in the input file (1-based)
+    size_t m_line_offset;
+    //! Line reader used to read raw / gzip'd / bzip2'd SAM files.
+    line_reader m_io_input;
+    //! The analytical step following this step
+    const size_t m_next_step;
+    //! Used to track whether an EOF block has been received.
+    bool m_eof;
+};
+
+
+#ifdef AR_GZIP_SUPPORT
+/**
+ * Simple file reading step.
+ *
+ * Reads (compressed) BGZF blocks from a BAM file, storing them in a
+ * bam_block_chunk, which is forwarded to the decompression step. Once the EOF
+ * has been reached, a single empty chunk will be returned, marked using the
+ * 'eof' property.
+ */
+class read_bam : public analytical_step
+{
+public:
+    /** Constructor; 'next_step' should be an decompress_bam step. */
+    read_bam(const std::string& filename, size_t next_step);
+
+    /** Reads N blocks from the input file and saves them in an bam_block_chunk. */
+    virtual chunk_vec process(analytical_chunk* chunk);
+
+    /** Finalizer; checks that all input has been processed. */
+    virtual void finalize();
+
+private:
+    //! Not implemented
+    read_bam(const read_bam&);
+    //! Not implemented
+    read_bam& operator=(const read_bam&);
+
+    //! Reader for raw BGZF blocks
+    bgzf_reader m_io_input;
+    //! The analytical step following this step
+    const size_t m_next_step;
+    //! Used to track whether an EOF block has been received.
+    bool m_eof;
+};
+
+
+/**
+ * BGZF decompression step; decompresses the blocks of a bam_block_chunk into
+ * a single buffer. Since blocks are independent, chunks are decompressed in
+ * parallel. */
+class decompress_bam : public analytical_step
+{
+public:
+    /** Constructor; 'next_step' should be a parse_bam step. */
+    decompress_bam(size_t next_step);
+
+    /** Decompresses the blocks of the chunk, saving the data to chunk->data. */
+    virtual chunk_vec process(analytical_chunk* chunk);
+
+private:
+    //! Not implemented
+    decompress_bam(const decompress_bam&);
+    //! Not implemented
+    decompress_bam& operator=(const decompress_bam&);
+
+    //! The analytical step following this step
+    const size_t m_next_step;
+};
+
+
+/**
+ * BAM decoding step; decodes the BAM header and records from decompressed
+ * bam_block_chunks, storing the reads in a fastq_read_chunk. Records spanning
+ * multiple chunks are carried over to the next chunk. Secondary and
+ * supplementary alignments are skipped.
+ */
+class parse_bam : public analytical_step
+{
+public:
+    /**
+     * Constructor.
+     *
+     * @param config User settings; determines if reads are paired.
+     * @param next_step The step to which reads are forwarded.
+     */
+    parse_bam(const userconfig& config, size_t next_step);
+
+    /** Decodes records in the chunk and saves them in an fastq_read_chunk. */
+    virtual chunk_vec process(analytical_chunk* chunk);
+
+    /** Finalizer; checks that all input has been processed. */
+    virtual void finalize();
+
+private:
+    //! Not implemented
+    parse_bam(const parse_bam&);
+    //! Not implemented
+    parse_bam& operator=(const parse_bam&);
+
+    //! Encoding used to validate quality scores (Phred+33).
+    const fastq_encoding m_encoding;
+    //! Character separating the mate number from read names
+    const char m_mate_separator;
+    //! Pairs mate 1 and mate 2 reads, if input is paired
+    sam_mate_collector m_collector;
+    //! Decompressed data not yet decoded
+    std::string m_buffer;
+    //! Indicates if the BAM header has been decoded
+    bool m_header_decoded;
+    //! Number of records decoded so far
+    size_t m_records;
+    //! The analytical step following this step
+    const size_t m_next_step;
+    //! Used to track whether an EOF block has been received.
+    bool m_eof;
+};
+#endif
+
+
+/**
+ * Adds the step(s) required to read SE or PE reads in the input format
+ * selected by the user (FASTQ, SAM, or BAM), starting with 'ai_read_fastq'.
+ * Reads are forwarded to 'next_step' in the form of fastq_read_chunks.
+ */
+void add_read_steps(const userconfig& config, scheduler& sch, size_t next_step);
+
+
 #ifdef AR_BZIP2_SUPPORT
 /**
  * BZip2 compression step; takes any lines in the input chunk, compresses them,
- * and adds them to the buffer list of the chunk, before forwarding it. */
+ * and adds them to the buffer list of the chunk, before forwarding it. The
+ * step is preferably run by the same thread, as the stream state is large. */
 class bzip2_paired_fastq : public analytical_step
 {
 public:
@@ -288,7 +532,8 @@ private:
 #ifdef AR_GZIP_SUPPORT
 /**
  * GZip compression step; takes any lines in the input chunk, compresses them,
- * and adds them to the buffer list of the chunk, before forwarding it. */
+ * and adds them to the buffer list of the chunk, before forwarding it. The
+ * step is preferably run by the same thread, as the stream state is large. */
 class gzip_paired_fastq : public analytical_step
 {
 public:
@@ -316,6 +561,34 @@ private:
     //! Used to track whether an EOF block has been received.
     bool m_eof;
 };
+
+
+/**
+ * BGZF compression step for BAM records; takes any records in the input
+ * chunk, compresses them into independent BGZF blocks, and adds these to the
+ * buffer list of the chunk, before forwarding it. Since blocks do not depend
+ * on preceding data, chunks may be compressed in parallel, and every chunk
+ * (including empty chunks) is forwarded to the (ordered) writer. */
+class bgzf_compress_bam : public analytical_step
+{
+public:
+    /** Constructor; 'next_step' sets the destination of compressed chunks. */
+    bgzf_compress_bam(const userconfig& config, size_t next_step);
+
+    /** Compresses input records, saving BGZF blocks to chunk->buffers. */
+    virtual chunk_vec process(analytical_chunk* chunk);
+
+private:
+    //! Not implemented
+    bgzf_compress_bam(const bgzf_compress_bam&);
+    //! Not implemented
+    bgzf_compress_bam& operator=(const bgzf_compress_bam&);
+
+    //! GZip compression level used for BGZF blocks
+    const int m_level;
+    //! The analytical step following this step
+    const size_t m_next_step;
+};
 #endif
 
 
@@ -333,12 +606,16 @@ public:
      * Constructor.
      *
      * @param config User settings.
-     * @param read_type The type of reads to write.
+     * @param filename Path to output file.
      *
-     * Based on the read-type specified, and SE / PE mode, the corresponding
-     * output file is opened
+     * If enabled in the user settings, checksums are calculated for the data
+     * written, and saved to 'filename.checksums' (CRC32C) and 'filename.md5'
+     * (MD5) once the file is finalized.
+     * The filename '-' is taken to mean STDOUT. If BAM output is enabled,
+     * the (compressed) BAM header is written upon construction, and the BGZF
+     * EOF block is written once the last chunk has been received.
      */
-    write_fastq(const std::string& filename);
+    write_fastq(const userconfig& config, const std::string& filename);
 
     /** Writes the reads of the type specified in the constructor. */
     virtual chunk_vec process(analytical_chunk* chunk);
@@ -347,8 +624,29 @@ public:
     virtual void finalize();
 
 private:
-    //! Pointer to output file opened using userconfig::open_with_default_filename.
-    std::ofstream m_output;
+    //! Not implemented
+    write_fastq(const write_fastq&);
+    //! Not implemented
+    write_fastq& operator=(const write_fastq&);
+
+    /** Updates checksums (if any) using data about to be written. */
+    void update_checksums(const char* data, size_t size);
+    /** Writes checksums (if any) to 'm_filename.checksums' / '.md5'. */
+    void write_checksums() const;
+    /** Writes a block of data owned by the caller, updating checksums. */
+    void write_block(const char* data, size_t size);
+
+    //! Path to the output file
+    const std::string m_filename;
+    //! True if writing a BAM file
+    const bool m_bam;
+    //! CRC32C checksum of the data written; NULL if disabled
+    std::auto_ptr<crc32c_checksum> m_crc32c;
+    //! MD5 checksum of the data written; NULL if disabled
+    std::auto_ptr<md5_checksum> m_md5;
+
+    //! Unbuffered output file; data is collected and written in large blocks.
+    file_writer m_output;
 
     //! Used to track whether an EOF block has been received.
     bool m_eof;
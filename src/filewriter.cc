@@ -0,0 +1,881 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef AR_IO_URING_SUPPORT
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#include "debug.h"
+#include "filewriter.h"
+#include "linereader.h"
+#include "threads.h"
+
+namespace ar
+{
+
+//! Alignment of coalescing buffers; matches the typical page size.
+const size_t BUFFER_ALIGNMENT = 4096;
+//! Maximum number of idle coalescing buffers kept for reuse.
+const size_t MAX_FREE_BUFFERS = 4;
+
+#ifdef IOV_MAX
+const size_t MAX_IOVECS = IOV_MAX;
+#else
+//! Minimum value of IOV_MAX required by POSIX
+const size_t MAX_IOVECS = 16;
+#endif
+
+
+/** Opens a file for writing; '-' is taken to mean STDOUT. */
+int open_output_file(const std::string& fpath)
+{
+    if (fpath == "-") {
+        // Duplicated, so that closing the writer does not close STDOUT
+        return dup(STDOUT_FILENO);
+    }
+
+    return ::open(fpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+
+/** Creates a list of iovecs corresponding to a range of blocks. */
+template <typename T>
+std::vector<iovec> build_iovecs(T first, const T& last)
+{
+    std::vector<iovec> iov;
+    for (; first != last; ++first) {
+        if (first->size) {
+            iovec entry;
+            entry.iov_base = first->data;
+            entry.iov_len = first->size;
+            iov.push_back(entry);
+        }
+    }
+
+    return iov;
+}
+
+
+/**
+ * Writes all data in the list of iovecs, taking partial writes into account;
+ * if offset is non-negative, data is written at that position in the file.
+ * The filename is only used for error messages.
+ */
+void write_iovecs(const std::string& filename,
+                  int fd,
+                  iovec* iov,
+                  size_t count,
+                  off_t offset = -1)
+{
+    while (count) {
+        const int ncount = static_cast<int>(std::min(count, MAX_IOVECS));
+        const ssize_t nwritten = (offset < 0) ? ::writev(fd, iov, ncount)
+                                              : ::pwritev(fd, iov, ncount, offset);
+
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            throw io_error("Error writing to file '" + filename + "'", errno);
+        } else if (!nwritten) {
+            throw io_error("No data written to file '" + filename + "'");
+        } else if (offset >= 0) {
+            offset += nwritten;
+        }
+
+        size_t remaining = static_cast<size_t>(nwritten);
+        while (count && remaining >= iov->iov_len) {
+            remaining -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+
+        if (remaining) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + remaining;
+            iov->iov_len -= remaining;
+        }
+    }
+}
+
+
+/**
+ * Maps the pages referenced by the iovecs into a pipe, taking partial writes
+ * into account. Returns false if vmsplice is not supported, in which case no
+ * data has been written. The filename is only used for error messages.
+ */
+bool vmsplice_iovecs(const std::string& filename, int fd, iovec* iov, size_t count)
+{
+#ifdef SPLICE_F_GIFT
+    bool any_written = false;
+    while (count) {
+        const size_t ncount = std::min(count, MAX_IOVECS);
+        const ssize_t nwritten = ::vmsplice(fd, iov, ncount, 0);
+
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (!any_written && (errno == EINVAL || errno == ENOSYS)) {
+                return false;
+            }
+
+            throw io_error("Error writing to pipe '" + filename + "'", errno);
+        }
+
+        any_written = true;
+        size_t remaining = static_cast<size_t>(nwritten);
+        while (count && remaining >= iov->iov_len) {
+            remaining -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+
+        if (remaining) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + remaining;
+            iov->iov_len -= remaining;
+        }
+    }
+
+    return true;
+#else
+    (void)filename;
+    (void)fd;
+    (void)iov;
+    (void)count;
+
+    return false;
+#endif
+}
+
+
+#ifdef AR_IO_URING_SUPPORT
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'io_uring_queue'
+
+//! Number of entries in the submission queue; also the max writes in flight.
+const unsigned IO_URING_ENTRIES = 4;
+
+
+/**
+ * Minimal io_uring submission / completion queue, implemented using the raw
+ * system calls to avoid a dependency on liburing. Each submission is a single
+ * IORING_OP_WRITEV at an explicit file offset; the blocks being written are
+ * kept alive until the corresponding completion has been reaped.
+ */
+class io_uring_queue
+{
+public:
+    /** Sets up the queue; throws io_error if io_uring is unavailable. */
+    io_uring_queue(file_writer* writer);
+    /** Unmaps the queues and releases blocks of any outstanding writes. */
+    ~io_uring_queue();
+
+    /** Submits writes for the blocks; ownership is taken by the queue. */
+    void submit(file_writer::block_vec& blocks);
+    /** Waits for all submitted writes to complete. */
+    void wait_all();
+
+private:
+    //! Not implemented
+    io_uring_queue(const io_uring_queue&);
+    //! Not implemented
+    io_uring_queue& operator=(const io_uring_queue&);
+
+    /** A write submitted to the kernel. */
+    struct inflight_write
+    {
+        inflight_write();
+
+        //! Blocks being written
+        file_writer::block_vec blocks;
+        //! iovecs referenced by the submission queue entry
+        std::vector<iovec> iov;
+        //! Number of bytes being written
+        size_t size;
+        //! Offset at which the blocks are written
+        off_t offset;
+        //! True if the write has been submitted and not reaped
+        bool active;
+    };
+
+    /** Submits a single writev of up to MAX_IOVECS blocks. */
+    void submit_one(file_writer::block_vec& blocks);
+    /**
+     * Reaps completions, waiting for at least 'min_complete' of them. If any
+     * write failed, all outstanding writes are waited for before throwing.
+     */
+    void reap(unsigned min_complete);
+    /** Processes available completions; errors are added to 'errors'. */
+    void process_completions(std::vector<io_error>& errors);
+    /** Completes a (possibly short) write; blocks are released by caller. */
+    void complete_write(inflight_write& write, int result);
+    /** Unmaps queues and closes the io_uring file-descriptor. */
+    void unmap();
+    /** Wrapper around io_uring_enter, retrying on EINTR. */
+    void enter(unsigned to_submit, unsigned min_complete);
+
+    //! Writer for which writes are performed
+    file_writer* m_writer;
+    //! The io_uring file-descriptor
+    int m_ring_fd;
+
+    //! Mapped submission queue ring and its size
+    void* m_sq_ring;
+    size_t m_sq_ring_size;
+    //! Mapped completion queue ring and its size; may equal the SQ ring
+    void* m_cq_ring;
+    size_t m_cq_ring_size;
+    //! Mapped submission queue entries
+    io_uring_sqe* m_sqes;
+    size_t m_sqes_size;
+
+    //! Pointers into the mapped submission queue ring
+    unsigned* m_sq_tail;
+    unsigned* m_sq_mask;
+    unsigned* m_sq_array;
+    //! Pointers into the mapped completion queue ring
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned* m_cq_mask;
+    io_uring_cqe* m_cqes;
+
+    //! Writes in flight; indexed by the user_data of the submission
+    std::vector<inflight_write> m_inflight;
+    //! Number of active writes in 'm_inflight'
+    unsigned m_active;
+};
+
+
+io_uring_queue::inflight_write::inflight_write()
+  : blocks()
+  , iov()
+  , size(0)
+  , offset(0)
+  , active(false)
+{
+}
+
+
+template <typename T>
+T* ring_offset(void* ring, unsigned offset)
+{
+    return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+}
+
+
+io_uring_queue::io_uring_queue(file_writer* writer)
+  : m_writer(writer)
+  , m_ring_fd(-1)
+  , m_sq_ring(MAP_FAILED)
+  , m_sq_ring_size(0)
+  , m_cq_ring(MAP_FAILED)
+  , m_cq_ring_size(0)
+  , m_sqes(NULL)
+  , m_sqes_size(0)
+  , m_sq_tail(NULL)
+  , m_sq_mask(NULL)
+  , m_sq_array(NULL)
+  , m_cq_head(NULL)
+  , m_cq_tail(NULL)
+  , m_cq_mask(NULL)
+  , m_cqes(NULL)
+  , m_inflight(IO_URING_ENTRIES)
+  , m_active(0)
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    m_ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params));
+    if (m_ring_fd < 0) {
+        throw io_error("io_uring_queue: io_uring_setup failed", errno);
+    }
+
+    m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+    }
+
+    m_sq_ring = mmap(NULL, m_sq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ring == MAP_FAILED) {
+        const int error_number = errno;
+        ::close(m_ring_fd);
+        throw io_error("io_uring_queue: failed to map SQ ring", error_number);
+    }
+
+    if (single_mmap) {
+        m_cq_ring = m_sq_ring;
+    } else {
+        m_cq_ring = mmap(NULL, m_cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+    }
+
+    void* sqes = mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+
+    if (m_cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        const int error_number = errno;
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, m_sqes_size);
+        }
+
+        unmap();
+        throw io_error("io_uring_queue: failed to map CQ ring", error_number);
+    }
+
+    m_sqes = static_cast<io_uring_sqe*>(sqes);
+    m_sq_tail = ring_offset<unsigned>(m_sq_ring, params.sq_off.tail);
+    m_sq_mask = ring_offset<unsigned>(m_sq_ring, params.sq_off.ring_mask);
+    m_sq_array = ring_offset<unsigned>(m_sq_ring, params.sq_off.array);
+    m_cq_head = ring_offset<unsigned>(m_cq_ring, params.cq_off.head);
+    m_cq_tail = ring_offset<unsigned>(m_cq_ring, params.cq_off.tail);
+    m_cq_mask = ring_offset<unsigned>(m_cq_ring, params.cq_off.ring_mask);
+    m_cqes = ring_offset<io_uring_cqe>(m_cq_ring, params.cq_off.cqes);
+}
+
+
+io_uring_queue::~io_uring_queue()
+{
+    // Closing the ring cancels any writes that could not be waited for
+    unmap();
+
+    for (size_t i = 0; i < m_inflight.size(); ++i) {
+        if (m_inflight.at(i).active) {
+            m_inflight.at(i).active = false;
+            m_writer->release_blocks(m_inflight.at(i).blocks);
+        }
+    }
+
+    m_active = 0;
+}
+
+
+void io_uring_queue::unmap()
+{
+    if (m_sqes) {
+        munmap(m_sqes, m_sqes_size);
+    }
+
+    if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring) {
+        munmap(m_cq_ring, m_cq_ring_size);
+    }
+
+    if (m_sq_ring != MAP_FAILED) {
+        munmap(m_sq_ring, m_sq_ring_size);
+    }
+
+    if (m_ring_fd >= 0) {
+        ::close(m_ring_fd);
+    }
+
+    m_sqes = NULL;
+    m_cq_ring = m_sq_ring = MAP_FAILED;
+    m_ring_fd = -1;
+}
+
+
+void io_uring_queue::submit(file_writer::block_vec& blocks)
+{
+    while (!blocks.empty()) {
+        const size_t nblocks = std::min(blocks.size(), MAX_IOVECS);
+        file_writer::block_vec subset(blocks.begin(), blocks.begin() + nblocks);
+        blocks.erase(blocks.begin(), blocks.begin() + nblocks);
+
+        try {
+            submit_one(subset);
+        } catch (...) {
+            // Blocks not yet handed to the kernel; remaining blocks are
+            // released by the writer along with any other pending blocks
+            m_writer->release_blocks(subset);
+            throw;
+        }
+    }
+}
+
+
+void io_uring_queue::wait_all()
+{
+    while (m_active) {
+        reap(1);
+    }
+}
+
+
+void io_uring_queue::submit_one(file_writer::block_vec& blocks)
+{
+    if (m_active == m_inflight.size()) {
+        reap(1);
+    }
+
+    size_t slot = 0;
+    while (m_inflight.at(slot).active) {
+        ++slot;
+    }
+
+    inflight_write& write = m_inflight.at(slot);
+    write.blocks.swap(blocks);
+    write.iov = build_iovecs(write.blocks.begin(), write.blocks.end());
+    write.size = 0;
+    write.offset = m_writer->m_offset;
+    write.active = true;
+
+    for (size_t i = 0; i < write.iov.size(); ++i) {
+        write.size += write.iov.at(i).iov_len;
+    }
+
+    m_writer->m_offset += write.size;
+    ++m_active;
+
+    const unsigned tail = *m_sq_tail;
+    const unsigned index = tail & *m_sq_mask;
+
+    io_uring_sqe* sqe = m_sqes + index;
+    std::memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = m_writer->m_fd;
+    sqe->off = static_cast<__u64>(write.offset);
+    sqe->addr = reinterpret_cast<__u64>(&write.iov.front());
+    sqe->len = static_cast<__u32>(write.iov.size());
+    sqe->user_data = slot;
+
+    m_sq_array[index] = index;
+    // Entry must be visible to the kernel before the tail is updated
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    enter(1, 0);
+}
+
+
+void io_uring_queue::reap(unsigned min_complete)
+{
+    if (min_complete) {
+        enter(0, min_complete);
+    }
+
+    std::vector<io_error> errors;
+    process_completions(errors);
+
+    if (!errors.empty()) {
+        // Blocks may not be released while the kernel is still reading them
+        while (m_active) {
+            enter(0, 1);
+            process_completions(errors);
+        }
+
+        throw errors.front();
+    }
+}
+
+
+void io_uring_queue::process_completions(std::vector<io_error>& errors)
+{
+    unsigned head = *m_cq_head;
+    const unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+        const io_uring_cqe& cqe = m_cqes[head & *m_cq_mask];
+        inflight_write& write = m_inflight.at(static_cast<size_t>(cqe.user_data));
+        AR_DEBUG_ASSERT(write.active);
+
+        write.active = false;
+        --m_active;
+
+        try {
+            complete_write(write, cqe.res);
+        } catch (const io_error& error) {
+            errors.push_back(error);
+        }
+
+        m_writer->release_blocks(write.blocks);
+    }
+
+    __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+void io_uring_queue::complete_write(inflight_write& write, int result)
+{
+    const std::string& filename = m_writer->m_filename;
+
+    if (result < 0) {
+        throw io_error("Error writing to file '" + filename + "'", -result);
+    } else if (static_cast<size_t>(result) < write.size) {
+        // Short writes are completed synchronously
+        size_t remaining = static_cast<size_t>(result);
+        iovec* iov = &write.iov.front();
+        size_t count = write.iov.size();
+
+        while (count && remaining >= iov->iov_len) {
+            remaining -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+
+        if (remaining) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + remaining;
+            iov->iov_len -= remaining;
+        }
+
+        write_iovecs(filename, m_writer->m_fd, iov, count, write.offset + result);
+    }
+}
+
+
+void io_uring_queue::enter(unsigned to_submit, unsigned min_complete)
+{
+    const unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+    while (true) {
+        const long result = syscall(__NR_io_uring_enter, m_ring_fd, to_submit,
+                                    min_complete, flags, NULL, 0);
+
+        if (result >= 0) {
+            return;
+        } else if (errno != EINTR) {
+            const std::string& filename = m_writer->m_filename;
+            throw io_error("io_uring_enter failed for file '" + filename + "'", errno);
+        }
+    }
+}
+
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'file_writer'
+
+file_writer::output_block::output_block(char* data_, size_t size_, bool aligned_)
+  : data(data_)
+  , size(size_)
+  , aligned(aligned_)
+{
+}
+
+
+file_writer::file_writer(const std::string& fpath)
+  : m_filename(fpath)
+  , m_fd(open_output_file(fpath))
+  , m_pipe(false)
+  , m_vmsplice(false)
+  , m_offset(0)
+  , m_buffer(NULL)
+  , m_buffer_used(0)
+  , m_pending()
+  , m_pending_size(0)
+  , m_free_buffers()
+#ifdef AR_IO_URING_SUPPORT
+  , m_uring(NULL)
+#endif
+{
+    if (m_fd < 0) {
+        throw io_error("Failed to open file '" + fpath + "'", errno);
+    }
+
+    m_pipe = tune_pipe_buffer(m_fd);
+    m_vmsplice = m_pipe;
+
+#ifdef AR_IO_URING_SUPPORT
+    // io_uring writes at explicit offsets, which is only safe for files that
+    // were truncated above; STDOUT may be redirected to a non-empty file and
+    // shares its file position with the parent process.
+    struct stat info;
+    if (fpath != "-" && !fstat(m_fd, &info) && S_ISREG(info.st_mode)) {
+        try {
+            m_uring = new io_uring_queue(this);
+        } catch (const io_error&) {
+            // io_uring not supported by kernel or disallowed; use writev
+            m_uring = NULL;
+        }
+    }
+#endif
+}
+
+
+file_writer::~file_writer()
+{
+    try {
+        close();
+    } catch (const std::exception& error) {
+        {
+            // Must be released before exit, as the print mutex is destroyed
+            print_locker lock;
+            std::cerr << "Error closing file: " << error.what() << std::endl;
+        }
+
+        std::exit(1);
+    }
+}
+
+
+void file_writer::write(const char* data, size_t size)
+{
+    while (size) {
+        if (!m_buffer) {
+            m_buffer = allocate_buffer();
+            m_buffer_used = 0;
+        }
+
+        const size_t ncopy = std::min(size, BUFFER_SIZE - m_buffer_used);
+        std::memcpy(m_buffer + m_buffer_used, data, ncopy);
+        m_buffer_used += ncopy;
+        data += ncopy;
+        size -= ncopy;
+
+        if (m_buffer_used == BUFFER_SIZE) {
+            seal_buffer();
+        }
+    }
+}
+
+
+void file_writer::write(const std::string& data)
+{
+    write(data.data(), data.size());
+}
+
+
+void file_writer::write_buffer(unsigned char* data, size_t size)
+{
+    try {
+        // Data buffered so far must be written before the new block
+        seal_buffer();
+    } catch (...) {
+        delete[] data;
+        throw;
+    }
+
+    queue_block(output_block(reinterpret_cast<char*>(data), size, false));
+}
+
+
+void file_writer::flush()
+{
+    seal_buffer();
+    write_pending();
+
+#ifdef AR_IO_URING_SUPPORT
+    if (m_uring) {
+        m_uring->wait_all();
+    }
+#endif
+}
+
+
+void file_writer::close()
+{
+    if (m_fd < 0) {
+        return;
+    }
+
+    try {
+        flush();
+    } catch (...) {
+        // Ensure that the file is closed, even if writes failed
+        release_blocks(m_pending);
+#ifdef AR_IO_URING_SUPPORT
+        delete m_uring;
+        m_uring = NULL;
+#endif
+        ::close(m_fd);
+        m_fd = -1;
+        throw;
+    }
+
+#ifdef AR_IO_URING_SUPPORT
+    delete m_uring;
+    m_uring = NULL;
+#endif
+
+    if (m_buffer) {
+        m_free_buffers.push_back(m_buffer);
+        m_buffer = NULL;
+    }
+
+    for (size_t i = 0; i < m_free_buffers.size(); ++i) {
+        if (m_pipe) {
+            munmap(m_free_buffers.at(i), BUFFER_SIZE);
+        } else {
+            std::free(m_free_buffers.at(i));
+        }
+    }
+    m_free_buffers.clear();
+
+    const int fd = m_fd;
+    m_fd = -1;
+
+    if (::close(fd)) {
+        throw io_error("Error closing file '" + m_filename + "'", errno);
+    }
+}
+
+
+void file_writer::seal_buffer()
+{
+    if (m_buffer_used) {
+        char* buffer = m_buffer;
+        const size_t size = m_buffer_used;
+
+        m_buffer = NULL;
+        m_buffer_used = 0;
+
+        queue_block(output_block(buffer, size, true));
+    }
+}
+
+
+void file_writer::queue_block(const output_block& block)
+{
+    m_pending.push_back(block);
+    m_pending_size += block.size;
+
+    if (m_pending_size >= WRITE_THRESHOLD) {
+        write_pending();
+    }
+}
+
+
+void file_writer::write_pending()
+{
+    if (m_pending.empty()) {
+        return;
+    }
+
+    m_pending_size = 0;
+
+#ifdef AR_IO_URING_SUPPORT
+    if (m_uring) {
+        m_uring->submit(m_pending);
+        return;
+    }
+#endif
+
+    try {
+        if (m_vmsplice) {
+            write_pending_to_pipe();
+        } else {
+            std::vector<iovec> iov = build_iovecs(m_pending.begin(), m_pending.end());
+            if (!iov.empty()) {
+                write_iovecs(m_filename, m_fd, &iov.front(), iov.size());
+            }
+        }
+    } catch (...) {
+        release_blocks(m_pending);
+        throw;
+    }
+
+    release_blocks(m_pending);
+}
+
+
+void file_writer::write_pending_to_pipe()
+{
+    block_vec::iterator first = m_pending.begin();
+    while (first != m_pending.end()) {
+        // Runs of coalescing buffers are vmspliced; other blocks are written
+        block_vec::iterator last = first;
+        while (last != m_pending.end() && last->aligned == first->aligned) {
+            ++last;
+        }
+
+        std::vector<iovec> iov = build_iovecs(first, last);
+        if (!iov.empty()) {
+            if (!first->aligned ||
+                !vmsplice_iovecs(m_filename, m_fd, &iov.front(), iov.size())) {
+                if (first->aligned) {
+                    // vmsplice is not supported; use regular writes from now on
+                    m_vmsplice = false;
+                }
+
+                write_iovecs(m_filename, m_fd, &iov.front(), iov.size());
+            }
+        }
+
+        first = last;
+    }
+}
+
+
+void file_writer::release_blocks(block_vec& blocks)
+{
+    for (block_vec::iterator it = blocks.begin(); it != blocks.end(); ++it) {
+        if (!it->aligned) {
+            delete[] reinterpret_cast<unsigned char*>(it->data);
+        } else if (m_pipe) {
+            // Pages may still be referenced by the pipe, so they are not reused
+            munmap(it->data, BUFFER_SIZE);
+        } else if (m_free_buffers.size() < MAX_FREE_BUFFERS) {
+            m_free_buffers.push_back(it->data);
+        } else {
+            std::free(it->data);
+        }
+    }
+
+    blocks.clear();
+}
+
+
+char* file_writer::allocate_buffer()
+{
+    if (!m_free_buffers.empty()) {
+        char* buffer = m_free_buffers.back();
+        m_free_buffers.pop_back();
+
+        return buffer;
+    }
+
+    void* buffer = NULL;
+    if (m_pipe) {
+        // Pages are mapped, so that they may be safely released after vmsplice
+        buffer = mmap(NULL, BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (buffer == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+    } else if (posix_memalign(&buffer, BUFFER_ALIGNMENT, BUFFER_SIZE)) {
+        throw std::bad_alloc();
+    }
+
+    return static_cast<char*>(buffer);
+}
+
+} // namespace ar
@@ -0,0 +1,158 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#ifndef FILEWRITER_H
+#define FILEWRITER_H
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace ar
+{
+
+#ifdef AR_IO_URING_SUPPORT
+class io_uring_queue;
+#endif
+
+
+//! Size of each coalescing buffer
+const size_t BUFFER_SIZE = 256 * 1024;
+//! Pending data is written once at least this many bytes have accumulated.
+const size_t WRITE_THRESHOLD = 1024 * 1024;
+
+
+/**
+ * Buffered file writer using a raw file descriptor.
+ *
+ * Small writes are coalesced into large, page-aligned buffers, while buffers
+ * handed over by the caller (e.g. compressed blocks) are queued as is. Once
+ * enough data has accumulated, all pending blocks are written using a single
+ * call to writev (or as few calls as IOV_MAX allows).
+ *
+ * If compiled with AR_IO_URING_SUPPORT, writes to regular files are instead
+ * submitted asynchronously via io_uring; the writer retains ownership of the
+ * buffers until the corresponding completions have been reaped. Should the
+ * kernel not support io_uring, writes fall back to writev.
+ *
+ * The path '-' is taken to mean STDOUT. When writing to pipes or FIFOs, the
+ * pipe buffer is enlarged, and coalescing buffers are mapped directly into
+ * the pipe using vmsplice, instead of being copied; such buffers are unmapped
+ * rather than reused, as the pipe retains references to the pages.
+ */
+class file_writer
+{
+public:
+    /** Opens (creating or truncating) the file at 'fpath' for writing. */
+    file_writer(const std::string& fpath);
+
+    /** Closes the file, if still open; exits on failure. */
+    ~file_writer();
+
+    /** Appends 'size' bytes from 'data' to the output; data is copied. */
+    void write(const char* data, size_t size);
+    /** Appends a string to the output; data is copied. */
+    void write(const std::string& data);
+
+    /**
+     * Appends a buffer allocated using new[] to the output. The writer takes
+     * ownership of the buffer, which is freed once it has been written or if
+     * an error occurs, including errors thrown by this function.
+     */
+    void write_buffer(unsigned char* data, size_t size);
+
+    /** Writes any buffered data and waits for pending writes to complete. */
+    void flush();
+
+    /** Flushes buffered data and closes the file. */
+    void close();
+
+private:
+    //! Not implemented
+    file_writer(const file_writer&);
+    //! Not implemented
+    file_writer& operator=(const file_writer&);
+
+    /** Block of data pending to be written. */
+    struct output_block
+    {
+        output_block(char* data_, size_t size_, bool aligned_);
+
+        //! Start of block
+        char* data;
+        //! Number of bytes in block
+        size_t size;
+        //! True if 'data' is a coalescing buffer, false if allocated by new[]
+        bool aligned;
+    };
+
+    typedef std::vector<output_block> block_vec;
+
+    /** Queues the current coalescing buffer, if it contains any data. */
+    void seal_buffer();
+    /** Queues a block, writing pending blocks if enough data has accumulated. */
+    void queue_block(const output_block& block);
+    /** Writes all pending blocks and releases them. */
+    void write_pending();
+    /** Writes pending blocks to a pipe, using vmsplice where possible. */
+    void write_pending_to_pipe();
+    /** Releases blocks after they have been written. */
+    void release_blocks(block_vec& blocks);
+
+    /** Allocates (or recycles) an aligned coalescing buffer. */
+    char* allocate_buffer();
+
+    friend class io_uring_queue;
+
+    //! Path to the file; used for error messages
+    std::string m_filename;
+    //! Output file descriptor; -1 if closed
+    int m_fd;
+    //! True if the output is a pipe / FIFO
+    bool m_pipe;
+    //! True if vmsplice may be used to write coalescing buffers to the pipe
+    bool m_vmsplice;
+    //! Offset at which the next block will be written
+    off_t m_offset;
+
+    //! Current coalescing buffer; NULL if none is allocated
+    char* m_buffer;
+    //! Number of bytes used in the current coalescing buffer
+    size_t m_buffer_used;
+    //! Blocks queued for writing, in output order
+    block_vec m_pending;
+    //! Total number of bytes in 'm_pending'
+    size_t m_pending_size;
+    //! Coalescing buffers available for reuse
+    std::vector<char*> m_free_buffers;
+
+#ifdef AR_IO_URING_SUPPORT
+    //! Asynchronous writer; NULL if io_uring is unavailable
+    io_uring_queue* m_uring;
+#endif
+};
+
+} // namespace ar
+
+#endif
@@ -28,6 +28,9 @@
 #include <iostream>
 #include <sstream>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
 #include "linereader.h"
 #include "threads.h"
 
@@ -36,6 +39,37 @@ namespace ar
 
 //! Size of compressed and uncompressed buffers.
 const int BUF_SIZE = 10 * BUFSIZ;
+//! Requested size of kernel buffers for pipes / FIFOs
+const int PIPE_BUF_SIZE = 1024 * 1024;
+
+
+bool tune_pipe_buffer(int fd)
+{
+    struct stat info;
+    if (fstat(fd, &info) || !S_ISFIFO(info.st_mode)) {
+        return false;
+    }
+
+#ifdef F_SETPIPE_SZ
+    // Failure is not an error; the size may exceed /proc/sys/fs/pipe-max-size
+    if (fcntl(fd, F_GETPIPE_SZ) < PIPE_BUF_SIZE) {
+        fcntl(fd, F_SETPIPE_SZ, PIPE_BUF_SIZE);
+    }
+#endif
+
+    return true;
+}
+
+
+FILE* open_input_file(const std::string& fpath)
+{
+    FILE* handle = (fpath == "-") ? stdin : fopen(fpath.c_str(), "rb");
+    if (handle) {
+        tune_pipe_buffer(fileno(handle));
+    }
+
+    return handle;
+}
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -95,7 +129,7 @@ bzip2_error::bzip2_error(const std::string& message)
 // Implementations for 'line_reader'
 
 line_reader::line_reader(const std::string& fpath)
-  : m_file(fopen(fpath.c_str(), "rb"))
+  : m_file(open_input_file(fpath))
 #ifdef AR_GZIP_SUPPORT
   , m_gzip_stream(NULL)
 #endif
@@ -161,7 +195,8 @@ void line_reader::close()
     delete[] m_raw_buffer;
     m_raw_buffer = NULL;
 
-    if (m_file && fclose(m_file)) {
+    // STDIN is left open, as it is not owned by the reader
+    if (m_file && m_file != stdin && fclose(m_file)) {
         throw io_error("line_reader::close: error closing file", errno);
     }
 
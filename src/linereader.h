@@ -62,6 +62,21 @@ public:
 };
 
 
+/**
+ * Attempts to increase the size of the kernel buffer for pipes / FIFOs, in
+ * order to reduce the number of context switches needed when streaming data;
+ * returns true if 'fd' is a pipe / FIFO, and false otherwise.
+ */
+bool tune_pipe_buffer(int fd);
+
+
+/**
+ * Opens a file for (binary) reading; the path '-' is taken to mean STDIN.
+ * Returns NULL on failure, in which case errno is set.
+ */
+FILE* open_input_file(const std::string& fpath);
+
+
 /** Base-class for line reading; used by recievers. */
 class line_reader_base
 {
@@ -83,6 +98,11 @@ public:
  * Currently reads
  *  - uncompressed files
  *  - gzip compressed files
+ *  - bzip2 compressed files
+ *
+ * The path '-' is taken to mean STDIN. Compression is detected using the
+ * first block of (buffered) data, and input is never rewound, so that data
+ * may also be read from pipes and FIFOs.
  *
  * Errors are reported using either 'io_error' or 'gzip_error'.
  */
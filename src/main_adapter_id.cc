@@ -33,6 +33,8 @@
 #include "alignment.h"
 #include "debug.h"
 #include "fastq_io.h"
+#include "pipeline_stats.h"
+#include "pipeline_trace.h"
 #include "scheduler.h"
 #include "strutils.h"
 #include "timer.h"
@@ -364,7 +366,7 @@ public:
 
         std::auto_ptr<fastq_read_chunk> file_chunk(dynamic_cast<fastq_read_chunk*>(chunk));
 
-        std::auto_ptr<adapter_stats> sink(m_sinks.get_sink());
+        adapter_stats* sink = m_sinks.get_sink();
         statistics& stats = *sink->stats;
 
         AR_DEBUG_ASSERT(file_chunk->reads_1.size() == file_chunk->reads_2.size());
@@ -375,8 +377,9 @@ public:
             process_reads(adapters, stats, *sink, *read_1++, *read_2++);
         }
 
-        m_sinks.return_sink(sink.release());
+        m_sinks.return_sink(sink);
         m_timer.increment(file_chunk->reads_1.size() * 2);
+        fastq_read_chunk::recycle(file_chunk.release());
 
         return chunk_vec();
     }
@@ -468,16 +471,7 @@ int identify_adapter_sequences(const userconfig& config)
 
     scheduler sch;
     try {
-        if (config.interleaved_input) {
-            sch.add_step(ai_read_fastq, new read_interleaved_fastq(config.quality_input_fmt.get(),
-                                                                   config.input_file_1,
-                                                                   ai_identify_adapters));
-        } else {
-            sch.add_step(ai_read_fastq, new read_paired_fastq(config.quality_input_fmt.get(),
-                                                              config.input_file_1,
-                                                              config.input_file_2,
-                                                              ai_identify_adapters));
-        }
+        add_read_steps(config, sch, ai_identify_adapters);
     } catch (const std::ios_base::failure& error) {
         std::cerr << "IO error opening file; aborting:\n"
                   << cli_formatter::fmt(error.what()) << std::endl;
@@ -486,7 +480,14 @@ int identify_adapter_sequences(const userconfig& config)
 
     sch.add_step(ai_identify_adapters, new adapter_identification(config));
 
-    if (!sch.run(config.max_threads, config.seed)) {
+    sch.enable_tracing(!config.trace.empty());
+    if (!sch.run(config.max_threads, config.seed, config.max_io_threads,
+                 config.max_memory, config.numa, config.lookahead)) {
+        return 1;
+    } else if (!config.pipeline_stats.empty() &&
+               !write_pipeline_stats(config.pipeline_stats, sch.stats())) {
+        return 1;
+    } else if (!config.trace.empty() && !write_pipeline_trace(config.trace, sch.trace())) {
         return 1;
     }
 
@@ -32,11 +32,14 @@
 #include <vector>
 
 #include "alignment.h"
+#include "bam.h"
 #include "debug.h"
 #include "demultiplex.h"
 #include "fastq.h"
 #include "fastq_io.h"
 #include "main.h"
+#include "pipeline_stats.h"
+#include "pipeline_trace.h"
 #include "strutils.h"
 #include "userconfig.h"
 
@@ -163,10 +166,24 @@ void write_settings(const userconfig& config, std::ostream& output, int nth)
 void write_trimming_settings(const userconfig& config,
                              const statistics& stats,
                              size_t nth,
+                             size_t peak_memory,
                              std::ostream& settings)
 {
     write_settings(config, settings, nth);
 
+    if (config.auto_threads) {
+        settings << "\n\n\n[Threads]"
+                 << "\nThreads selected automatically: Yes"
+                 << "\nNumber of threads: " << config.max_threads
+                 << "\nNumber of IO threads: " << config.max_io_threads;
+    }
+
+    if (config.max_memory) {
+        settings << "\n\n\n[Memory usage]"
+                 << "\nMaximum memory usage (bytes): " << config.max_memory
+                 << "\nPeak memory usage (bytes): " << peak_memory;
+    }
+
     const std::string reads_type = (config.paired_ended_mode ? "read pairs: " : "reads: ");
     settings << "\n\n\n[Trimming statistics]"
              << "\nTotal number of " << reads_type << stats.records
@@ -208,23 +225,23 @@ void write_trimming_settings(const userconfig& config,
 
     settings << "Discarded\tAll\n";
 
-    for (size_t length = 0; length < stats.read_lengths.size(); ++length) {
-        const std::vector<size_t>& lengths = stats.read_lengths.at(length);
-        const size_t total = std::accumulate(lengths.begin(), lengths.end(), 0);
+    for (size_t length = 0; length < stats.max_length(); ++length) {
+        const std::vector<size_t>::const_iterator lengths = stats.read_lengths.begin() + length * rt_max;
+        const size_t total = std::accumulate(lengths, lengths + rt_max, 0);
 
-        settings << length << '\t' << lengths.at(rt_mate_1);
+        settings << length << '\t' << lengths[rt_mate_1];
 
         if (config.paired_ended_mode) {
-            settings << '\t' << lengths.at(rt_mate_2)
-                     << '\t' << lengths.at(rt_singleton);
+            settings << '\t' << lengths[rt_mate_2]
+                     << '\t' << lengths[rt_singleton];
         }
 
         if (config.collapse) {
-            settings << '\t' << lengths.at(rt_collapsed)
-                     << '\t' << lengths.at(rt_collapsed_truncated);
+            settings << '\t' << lengths[rt_collapsed]
+                     << '\t' << lengths[rt_collapsed_truncated];
         }
 
-        settings << '\t' << lengths.at(rt_discarded)
+        settings << '\t' << lengths[rt_discarded]
                  << '\t' << total << '\n';
     }
 
@@ -234,7 +251,7 @@ void write_trimming_settings(const userconfig& config,
 
 
 bool write_demux_settings(const userconfig& config,
-                          const demultiplex_reads* step)
+                          const collect_demultiplexed_reads* step)
 {
     if (!step) {
         // Demultiplexing not enabled; nothing to do
@@ -319,17 +336,17 @@ void process_collapsed_read(const userconfig& config, statistics& stats,
                                collapsed_read.length());
 
         if (was_trimmed) {
-            out_collapsed_truncated.add(*config.quality_output_fmt, collapsed_read, read_count);
+            out_collapsed_truncated.add(config, collapsed_read, BAM_FLAGS_UNPAIRED, read_count);
             stats.number_of_truncated_collapsed++;
         } else {
-            out_collapsed.add(*config.quality_output_fmt, collapsed_read, read_count);
+            out_collapsed.add(config, collapsed_read, BAM_FLAGS_UNPAIRED, read_count);
             stats.number_of_full_length_collapsed++;
         }
     } else {
         stats.discard1++;
         stats.discard2++;
         stats.inc_length_count(rt_discarded, collapsed_read.length());
-        out_discarded.add(*config.quality_output_fmt, collapsed_read, read_count);
+        out_discarded.add(config, collapsed_read, BAM_FLAGS_DISCARDED, read_count);
     }
 }
 
@@ -388,17 +405,16 @@ public:
     {
         std::auto_ptr<fastq_read_chunk> read_chunk(dynamic_cast<fastq_read_chunk*>(chunk));
 
-        std::auto_ptr<statistics> stats(m_stats.get_sink());
+        statistics* stats = m_stats.get_sink();
 
-        const fastq_encoding& encoding = *m_config.quality_output_fmt;
-        output_chunk_ptr out_mate_1(new fastq_output_chunk(read_chunk->eof));
+        output_chunk_ptr out_mate_1(fastq_output_chunk::create(read_chunk->eof));
         output_chunk_ptr out_collapsed;
         output_chunk_ptr out_collapsed_truncated;
-        output_chunk_ptr out_discarded(new fastq_output_chunk(read_chunk->eof));
+        output_chunk_ptr out_discarded(fastq_output_chunk::create(read_chunk->eof));
 
         if (m_config.collapse) {
-            out_collapsed.reset(new fastq_output_chunk(read_chunk->eof));
-            out_collapsed_truncated.reset(new fastq_output_chunk(read_chunk->eof));
+            out_collapsed.reset(fastq_output_chunk::create(read_chunk->eof));
+            out_collapsed_truncated.reset(fastq_output_chunk::create(read_chunk->eof));
         }
 
         for (fastq_vec::iterator it = read_chunk->reads_1.begin(); it != read_chunk->reads_1.end(); ++it) {
@@ -431,18 +447,19 @@ public:
                 stats->total_number_of_good_reads++;
                 stats->total_number_of_nucleotides += read.length();
 
-                out_mate_1->add(encoding, read);
+                out_mate_1->add(m_config, read, BAM_FLAGS_UNPAIRED);
                 stats->inc_length_count(rt_mate_1, read.length());
             } else {
                 stats->discard1++;
                 stats->inc_length_count(rt_discarded, read.length());
 
-                out_discarded->add(encoding, read);
+                out_discarded->add(m_config, read, BAM_FLAGS_DISCARDED);
             }
         }
 
         stats->records += read_chunk->reads_1.size();
-        m_stats.return_sink(stats.release());
+        m_stats.return_sink(stats);
+        fastq_read_chunk::recycle(read_chunk.release());
 
         chunk_vec chunks;
         const size_t offset = m_nth * ai_analyses_offset;
@@ -468,23 +485,22 @@ public:
     {
         std::auto_ptr<fastq_read_chunk> read_chunk(dynamic_cast<fastq_read_chunk*>(chunk));
 
-        std::auto_ptr<statistics> stats(m_stats.get_sink());
+        statistics* stats = m_stats.get_sink();
 
-        const fastq_encoding& encoding = *m_config.quality_output_fmt;
-        output_chunk_ptr out_mate_1(new fastq_output_chunk(read_chunk->eof));
+        output_chunk_ptr out_mate_1(fastq_output_chunk::create(read_chunk->eof));
         output_chunk_ptr out_mate_2;
         if (!m_config.interleaved_output) {
-            out_mate_2.reset(new fastq_output_chunk(read_chunk->eof));
+            out_mate_2.reset(fastq_output_chunk::create(read_chunk->eof));
         }
 
-        output_chunk_ptr out_singleton(new fastq_output_chunk(read_chunk->eof));
+        output_chunk_ptr out_singleton(fastq_output_chunk::create(read_chunk->eof));
         output_chunk_ptr out_collapsed;
         output_chunk_ptr out_collapsed_truncated;
-        output_chunk_ptr out_discarded(new fastq_output_chunk(read_chunk->eof));
+        output_chunk_ptr out_discarded(fastq_output_chunk::create(read_chunk->eof));
 
         if (m_config.collapse) {
-            out_collapsed.reset(new fastq_output_chunk(read_chunk->eof));
-            out_collapsed_truncated.reset(new fastq_output_chunk(read_chunk->eof));
+            out_collapsed.reset(fastq_output_chunk::create(read_chunk->eof));
+            out_collapsed_truncated.reset(fastq_output_chunk::create(read_chunk->eof));
         }
 
         AR_DEBUG_ASSERT(read_chunk->reads_1.size() == read_chunk->reads_2.size());
@@ -538,12 +554,12 @@ public:
             stats->total_number_of_good_reads += read_2_acceptable;
 
             if (read_1_acceptable && read_2_acceptable) {
-                out_mate_1->add(encoding, read1);
+                out_mate_1->add(m_config, read1, BAM_FLAGS_MATE_1);
 
                 if (m_config.interleaved_output) {
-                    out_mate_1->add(encoding, read2);
+                    out_mate_1->add(m_config, read2, BAM_FLAGS_MATE_2);
                 } else {
-                    out_mate_2->add(encoding, read2);
+                    out_mate_2->add(m_config, read2, BAM_FLAGS_MATE_2);
                 }
 
                 stats->inc_length_count(rt_mate_1, read1.length());
@@ -558,21 +574,22 @@ public:
                 stats->inc_length_count(read_2_acceptable ? rt_mate_2 : rt_discarded, read2.length());
 
                 if (read_1_acceptable) {
-                    out_singleton->add(encoding, read1);
+                    out_singleton->add(m_config, read1, BAM_FLAGS_UNPAIRED);
                 } else {
-                    out_discarded->add(encoding, read1);
+                    out_discarded->add(m_config, read1, BAM_FLAGS_DISCARDED);
                 }
 
                 if (read_2_acceptable) {
-                    out_singleton->add(encoding, read2);
+                    out_singleton->add(m_config, read2, BAM_FLAGS_UNPAIRED);
                 } else {
-                    out_discarded->add(encoding, read2);
+                    out_discarded->add(m_config, read2, BAM_FLAGS_DISCARDED);
                 }
             }
         }
 
         stats->records += read_chunk->reads_1.size();
-        m_stats.return_sink(stats.release());
+        m_stats.return_sink(stats);
+        fastq_read_chunk::recycle(read_chunk.release());
 
         chunk_vec chunks;
         const size_t offset = m_nth * ai_analyses_offset;
@@ -592,7 +609,9 @@ public:
 };
 
 
-bool write_settings(const userconfig& config, const std::vector<reads_processor*>& processors)
+bool write_settings(const userconfig& config,
+                    const std::vector<reads_processor*>& processors,
+                    size_t peak_memory)
 {
     for (size_t nth = 0; nth < processors.size(); ++nth) {
         const std::string filename = config.get_output_filename("--settings", nth);
@@ -608,7 +627,7 @@ bool write_settings(const userconfig& config, const std::vector<reads_processor*
             }
 
             output.exceptions(std::ofstream::failbit | std::ofstream::badbit);
-            write_trimming_settings(config, *stats, nth, output);
+            write_trimming_settings(config, *stats, nth, peak_memory, output);
         } catch (const std::ios_base::failure& error) {
             std::cerr << "IO error writing settings file; aborting:\n"
                       << cli_formatter::fmt(error.what()) << std::endl;
@@ -627,6 +646,9 @@ void add_write_step(const userconfig& config, scheduler& sch, size_t offset,
     if (config.gzip) {
         sch.add_step(offset + ai_zip_offset, step);
         sch.add_step(offset, new gzip_paired_fastq(config, offset + ai_zip_offset));
+    } else if (config.bam_output) {
+        sch.add_step(offset + ai_zip_offset, step);
+        sch.add_step(offset, new bgzf_compress_bam(config, offset + ai_zip_offset));
     } else
 #endif
 
@@ -648,24 +670,21 @@ int remove_adapter_sequences_se(const userconfig& config)
 
     scheduler sch;
     std::vector<reads_processor*> processors;
-    demultiplex_reads* demultiplexer = NULL;
+    collect_demultiplexed_reads* demultiplexer = NULL;
 
     try {
-        if (config.adapters.barcode_count()) {
-            // Step 1: Read input file
-            sch.add_step(ai_read_fastq, new read_single_fastq(config.quality_input_fmt.get(),
-                                                              config.input_file_1,
-                                                              ai_demultiplex));
+        // Step 1: Read input file
+        const size_t next_step = config.adapters.barcode_count() ? ai_demultiplex : ai_analyses_offset;
+        add_read_steps(config, sch, next_step);
 
+        if (config.adapters.barcode_count()) {
             // Step 2: Parse and demultiplex reads based on single or double indices
-            sch.add_step(ai_demultiplex, demultiplexer = new demultiplex_se_reads(&config));
+            sch.add_step(ai_demultiplex, new demultiplex_se_reads(&config));
+            sch.add_step(ai_collect_demultiplexed,
+                         demultiplexer = new collect_demultiplexed_reads(&config));
 
             add_write_step(config, sch, ai_write_unidentified_1,
-                           new write_fastq(config.get_output_filename("demux_unknown")));
-        } else {
-            sch.add_step(ai_read_fastq, new read_single_fastq(config.quality_input_fmt.get(),
-                                                              config.input_file_1,
-                                                              ai_analyses_offset));
+                           new write_fastq(config, config.get_output_filename("demux_unknown")));
         }
 
         // Step 3 - N: Trim and write demultiplexed readss
@@ -676,15 +695,15 @@ int remove_adapter_sequences_se(const userconfig& config)
             sch.add_step(offset + ai_trim_se, processors.back());
 
             add_write_step(config, sch, offset + ai_write_mate_1,
-                           new write_fastq(config.get_output_filename("--output1", nth)));
+                           new write_fastq(config, config.get_output_filename("--output1", nth)));
             add_write_step(config, sch, offset + ai_write_discarded,
-                         new write_fastq(config.get_output_filename("--discarded", nth)));
+                         new write_fastq(config, config.get_output_filename("--discarded", nth)));
 
             if (config.collapse) {
                 add_write_step(config, sch, offset + ai_write_collapsed,
-                               new write_fastq(config.get_output_filename("--outputcollapsed", nth)));
+                               new write_fastq(config, config.get_output_filename("--outputcollapsed", nth)));
                 add_write_step(config, sch, offset + ai_write_collapsed_truncated,
-                               new write_fastq(config.get_output_filename("--outputcollapsedtruncated", nth)));
+                               new write_fastq(config, config.get_output_filename("--outputcollapsedtruncated", nth)));
             }
         }
     } catch (const std::ios_base::failure& error) {
@@ -693,12 +712,19 @@ int remove_adapter_sequences_se(const userconfig& config)
         return 1;
     }
 
-    if (!sch.run(config.max_threads, config.seed)) {
+    sch.enable_tracing(!config.trace.empty());
+    if (!sch.run(config.max_threads, config.seed, config.max_io_threads,
+                 config.max_memory, config.numa, config.lookahead)) {
         return 1;
-    } else if (!write_settings(config, processors)) {
+    } else if (!write_settings(config, processors, sch.peak_memory())) {
         return 1;
     } else if (!write_demux_settings(config, demultiplexer)) {
         return 1;
+    } else if (!config.pipeline_stats.empty() &&
+               !write_pipeline_stats(config.pipeline_stats, sch.stats())) {
+        return 1;
+    } else if (!config.trace.empty() && !write_pipeline_trace(config.trace, sch.trace())) {
+        return 1;
     }
 
     return 0;
@@ -711,30 +737,23 @@ int remove_adapter_sequences_pe(const userconfig& config)
 
     scheduler sch;
     std::vector<reads_processor*> processors;
-    demultiplex_reads* demultiplexer = NULL;
+    collect_demultiplexed_reads* demultiplexer = NULL;
 
     try {
         // Step 1: Read input file
         const size_t next_step = config.adapters.barcode_count() ? ai_demultiplex : ai_analyses_offset;
-        if (config.interleaved_input) {
-            sch.add_step(ai_read_fastq, new read_interleaved_fastq(config.quality_input_fmt.get(),
-                                                                   config.input_file_1,
-                                                                   next_step));
-        } else {
-            sch.add_step(ai_read_fastq, new read_paired_fastq(config.quality_input_fmt.get(),
-                                                              config.input_file_1,
-                                                              config.input_file_2,
-                                                              next_step));
-        }
+        add_read_steps(config, sch, next_step);
 
         if (config.adapters.barcode_count()) {
             // Step 2: Parse and demultiplex reads based on single or double indices
-            sch.add_step(ai_demultiplex, demultiplexer = new demultiplex_pe_reads(&config));
+            sch.add_step(ai_demultiplex, new demultiplex_pe_reads(&config));
+            sch.add_step(ai_collect_demultiplexed,
+                         demultiplexer = new collect_demultiplexed_reads(&config));
 
             add_write_step(config, sch, ai_write_unidentified_1,
-                           new write_fastq(config.get_output_filename("demux_unknown", 1)));
+                           new write_fastq(config, config.get_output_filename("demux_unknown", 1)));
             add_write_step(config, sch, ai_write_unidentified_2,
-                           new write_fastq(config.get_output_filename("demux_unknown", 2)));
+                           new write_fastq(config, config.get_output_filename("demux_unknown", 2)));
         }
 
         // Step 3 - N: Trim and write demultiplexed reads
@@ -745,24 +764,24 @@ int remove_adapter_sequences_pe(const userconfig& config)
             sch.add_step(offset + ai_trim_pe, processors.back());
 
             add_write_step(config, sch, offset + ai_write_mate_1,
-                           new write_fastq(config.get_output_filename("--output1", nth)));
+                           new write_fastq(config, config.get_output_filename("--output1", nth)));
 
             if (!config.interleaved_output) {
                 add_write_step(config, sch, offset + ai_write_mate_2,
-                               new write_fastq(config.get_output_filename("--output2", nth)));
+                               new write_fastq(config, config.get_output_filename("--output2", nth)));
             }
 
 
             add_write_step(config, sch, offset + ai_write_discarded,
-                           new write_fastq(config.get_output_filename("--discarded", nth)));
+                           new write_fastq(config, config.get_output_filename("--discarded", nth)));
             add_write_step(config, sch, offset + ai_write_singleton,
-                           new write_fastq(config.get_output_filename("--singleton", nth)));
+                           new write_fastq(config, config.get_output_filename("--singleton", nth)));
 
             if (config.collapse) {
                 add_write_step(config, sch, offset + ai_write_collapsed,
-                               new write_fastq(config.get_output_filename("--outputcollapsed", nth)));
+                               new write_fastq(config, config.get_output_filename("--outputcollapsed", nth)));
                 add_write_step(config, sch, offset + ai_write_collapsed_truncated,
-                               new write_fastq(config.get_output_filename("--outputcollapsedtruncated", nth)));
+                               new write_fastq(config, config.get_output_filename("--outputcollapsedtruncated", nth)));
             }
         }
     } catch (const std::ios_base::failure& error) {
@@ -771,12 +790,19 @@ int remove_adapter_sequences_pe(const userconfig& config)
         return 1;
     }
 
-    if (!sch.run(config.max_threads, config.seed)) {
+    sch.enable_tracing(!config.trace.empty());
+    if (!sch.run(config.max_threads, config.seed, config.max_io_threads,
+                 config.max_memory, config.numa, config.lookahead)) {
         return 1;
-    } else if (!write_settings(config, processors)) {
+    } else if (!write_settings(config, processors, sch.peak_memory())) {
         return 1;
     } else if (!write_demux_settings(config, demultiplexer)) {
         return 1;
+    } else if (!config.pipeline_stats.empty() &&
+               !write_pipeline_stats(config.pipeline_stats, sch.stats())) {
+        return 1;
+    } else if (!config.trace.empty() && !write_pipeline_trace(config.trace, sch.trace())) {
+        return 1;
     }
 
     return 0;
@@ -0,0 +1,356 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include <unistd.h>
+
+#include "numa.h"
+
+namespace ar
+{
+
+//! NUMA node assigned to the current thread
+static __thread size_t s_current_node = 0;
+
+//! Mount point of cgroup hierarchies
+const std::string CGROUP_ROOT = "/sys/fs/cgroup";
+
+
+/** Reads the first line of a file; returns an empty string on failure. */
+std::string read_sysfs_line(const std::string& filename)
+{
+    std::ifstream input(filename.c_str());
+    std::string line;
+    std::getline(input, line);
+
+    return line;
+}
+
+
+/** Parses a non-negative integer, throwing std::invalid_argument on error. */
+int parse_cpu_id(const std::string& value)
+{
+    if (value.empty() || value.length() > 9
+        || value.find_first_not_of("0123456789") != std::string::npos) {
+        throw std::invalid_argument("invalid CPU list value: '" + value + "'");
+    }
+
+    return std::atoi(value.c_str());
+}
+
+
+cpu_vec parse_cpu_list(const std::string& value)
+{
+    cpu_vec cpus;
+    std::istringstream stream(value);
+    std::string range;
+
+    while (std::getline(stream, range, ',')) {
+        const size_t dash = range.find('-');
+        if (dash == std::string::npos) {
+            cpus.push_back(parse_cpu_id(range));
+        } else {
+            const int first = parse_cpu_id(range.substr(0, dash));
+            const int last = parse_cpu_id(range.substr(dash + 1));
+            if (first > last) {
+                throw std::invalid_argument("invalid CPU range: '" + range + "'");
+            }
+
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+
+    return cpus;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'numa_topology'
+
+numa_topology::numa_topology()
+  : m_nodes()
+  , m_allowed()
+{
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        return;
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            m_allowed.push_back(cpu);
+        }
+    }
+
+    try {
+        const std::string root = "/sys/devices/system/node/";
+        const cpu_vec nodes = parse_cpu_list(read_sysfs_line(root + "online"));
+
+        for (cpu_vec::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
+            std::ostringstream filename;
+            filename << root << "node" << *it << "/cpulist";
+
+            cpu_vec usable;
+            const cpu_vec cpus = parse_cpu_list(read_sysfs_line(filename.str()));
+            for (cpu_vec::const_iterator cpu = cpus.begin(); cpu != cpus.end(); ++cpu) {
+                if (*cpu < CPU_SETSIZE && CPU_ISSET(*cpu, &allowed)) {
+                    usable.push_back(*cpu);
+                }
+            }
+
+            if (!usable.empty()) {
+                m_nodes.push_back(usable);
+            }
+        }
+    } catch (const std::invalid_argument&) {
+        // Missing or unexpected sysfs entries; topology is unavailable
+        m_nodes.clear();
+    }
+#endif
+}
+
+
+size_t numa_topology::nodes() const
+{
+    return m_nodes.size();
+}
+
+
+const cpu_vec& numa_topology::cpus(size_t node) const
+{
+    return m_nodes.at(node);
+}
+
+
+const cpu_vec& numa_topology::allowed_cpus() const
+{
+    return m_allowed;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool pin_current_thread(const cpu_vec& cpus)
+{
+#ifdef __linux__
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+
+    for (cpu_vec::const_iterator it = cpus.begin(); it != cpus.end(); ++it) {
+        if (*it >= 0 && *it < CPU_SETSIZE) {
+            CPU_SET(*it, &cpu_set);
+        }
+    }
+
+    return !cpus.empty() && !sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+#else
+    (void)cpus;
+
+    return false;
+#endif
+}
+
+
+size_t current_numa_node()
+{
+    return s_current_node;
+}
+
+
+void set_current_numa_node(size_t node)
+{
+    s_current_node = node;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+/** Parses a cgroup quota / period value; throws std::invalid_argument. */
+double parse_cgroup_value(const std::string& value)
+{
+    std::istringstream stream(value);
+    long result = 0;
+    std::string trailing;
+
+    if (!(stream >> result) || (stream >> trailing) || result < -1) {
+        throw std::invalid_argument("invalid cgroup CPU value: '" + value + "'");
+    }
+
+    return static_cast<double>(result);
+}
+
+
+/** Returns the CPU quota given a quota and period; -1 is unlimited. */
+double cgroup_quota(double quota, double period)
+{
+    if (period <= 0) {
+        throw std::invalid_argument("invalid cgroup CPU period");
+    } else if (quota < 0) {
+        return 0.0;
+    }
+
+    return quota / period;
+}
+
+
+double parse_cgroup_cpu_max(const std::string& value)
+{
+    std::istringstream stream(value);
+    std::string quota;
+    std::string period;
+    std::string trailing;
+
+    if (!(stream >> quota >> period) || (stream >> trailing)) {
+        throw std::invalid_argument("invalid cgroup cpu.max value: '" + value + "'");
+    }
+
+    return cgroup_quota(quota == "max" ? -1 : parse_cgroup_value(quota),
+                        parse_cgroup_value(period));
+}
+
+
+double parse_cgroup_cfs_quota(const std::string& quota, const std::string& period)
+{
+    return cgroup_quota(parse_cgroup_value(quota), parse_cgroup_value(period));
+}
+
+
+/** Returns the smallest of two limits, where 0 is unlimited. */
+double min_cpu_limit(double a, double b)
+{
+    if (a <= 0) {
+        return b;
+    } else if (b <= 0) {
+        return a;
+    }
+
+    return std::min(a, b);
+}
+
+
+/**
+ * Returns the smallest CPU limit set for a cgroup or its ancestors, under the
+ * given mount point; 0 if unlimited. Missing files are ignored, since cgroup
+ * namespaces may hide the path of the cgroup (e.g. in containers).
+ */
+double cgroup_cpu_limit(const std::string& root, std::string path, bool v2)
+{
+    double limit = 0;
+
+    while (true) {
+        const std::string dir = root + (path == "/" ? "" : path) + "/";
+
+        try {
+            if (v2) {
+                const std::string value = read_sysfs_line(dir + "cpu.max");
+                if (!value.empty()) {
+                    limit = min_cpu_limit(limit, parse_cgroup_cpu_max(value));
+                }
+            } else {
+                const std::string quota = read_sysfs_line(dir + "cpu.cfs_quota_us");
+                const std::string period = read_sysfs_line(dir + "cpu.cfs_period_us");
+                if (!quota.empty() && !period.empty()) {
+                    limit = min_cpu_limit(limit, parse_cgroup_cfs_quota(quota, period));
+                }
+            }
+        } catch (const std::invalid_argument&) {
+            // Unexpected contents; the limit is ignored
+        }
+
+        const size_t separator = path.rfind('/');
+        if (path.empty() || path == "/" || separator == std::string::npos) {
+            break;
+        }
+
+        path = path.substr(0, separator);
+        if (path.empty()) {
+            path = "/";
+        }
+    }
+
+    return limit;
+}
+
+
+double cgroup_cpu_limit()
+{
+    double limit = 0;
+
+#ifdef __linux__
+    std::ifstream input("/proc/self/cgroup");
+    std::string line;
+
+    // Lines are formatted as "hierarchy-ID:controller-list:cgroup-path"
+    while (std::getline(input, line)) {
+        const size_t first = line.find(':');
+        const size_t second = line.find(':', first + 1);
+        if (first == std::string::npos || second == std::string::npos) {
+            continue;
+        }
+
+        const std::string controllers = line.substr(first + 1, second - first - 1);
+        const std::string path = line.substr(second + 1);
+
+        if (controllers.empty()) {
+            limit = min_cpu_limit(limit, cgroup_cpu_limit(CGROUP_ROOT, path, true));
+        } else if (("," + controllers + ",").find(",cpu,") != std::string::npos) {
+            limit = min_cpu_limit(limit, cgroup_cpu_limit(CGROUP_ROOT + "/" + controllers, path, false));
+            limit = min_cpu_limit(limit, cgroup_cpu_limit(CGROUP_ROOT + "/cpu", path, false));
+        }
+    }
+#endif
+
+    return limit;
+}
+
+
+size_t available_cpus()
+{
+    size_t cpus = numa_topology().allowed_cpus().size();
+    if (!cpus) {
+        const long online = sysconf(_SC_NPROCESSORS_ONLN);
+        cpus = online > 0 ? static_cast<size_t>(online) : 1;
+    }
+
+    const double limit = cgroup_cpu_limit();
+    if (limit > 0) {
+        cpus = std::min(cpus, static_cast<size_t>(std::ceil(limit)));
+    }
+
+    return std::max<size_t>(cpus, 1);
+}
+
+} // namespace ar
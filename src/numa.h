@@ -0,0 +1,114 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <string>
+#include <vector>
+
+namespace ar
+{
+
+//! Max number of NUMA nodes for which separate object pools are kept
+const size_t MAX_NUMA_POOLS = 8;
+
+typedef std::vector<int> cpu_vec;
+typedef std::vector<cpu_vec> node_vec;
+
+
+/**
+ * Parses a Linux CPU / node list (e.g. "0-3,8,10-11") as found in sysfs;
+ * throws std::invalid_argument if the list is malformed.
+ */
+cpu_vec parse_cpu_list(const std::string& value);
+
+
+/**
+ * NUMA topology of the system, as reported in /sys/devices/system/node, and
+ * restricted to the CPUs on which the process is allowed to run. Nodes with
+ * no usable CPUs are omitted. If the topology cannot be determined (e.g. on
+ * systems other than Linux), no nodes are reported.
+ */
+class numa_topology
+{
+public:
+    /** Detects the current topology. */
+    numa_topology();
+
+    /** Returns the number of nodes with usable CPUs. */
+    size_t nodes() const;
+
+    /** Returns the usable CPUs of a node. */
+    const cpu_vec& cpus(size_t node) const;
+
+    /** Returns all CPUs on which the process is allowed to run. */
+    const cpu_vec& allowed_cpus() const;
+
+private:
+    //! Usable CPUs for each node with at least one such CPU
+    node_vec m_nodes;
+    //! CPUs on which the process is allowed to run
+    cpu_vec m_allowed;
+};
+
+
+/** Restricts the calling thread to the given CPUs; returns false on failure. */
+bool pin_current_thread(const cpu_vec& cpus);
+
+/** Returns the NUMA node assigned to the calling thread; 0 by default. */
+size_t current_numa_node();
+
+/** Sets the NUMA node of the calling thread; used to select object pools. */
+void set_current_numa_node(size_t node);
+
+
+/**
+ * Parses the contents of a cgroup v2 'cpu.max' file ("QUOTA PERIOD"), and
+ * returns the number of CPUs worth of time allowed, or 0 if the quota is
+ * "max" (unlimited); throws std::invalid_argument if malformed.
+ */
+double parse_cgroup_cpu_max(const std::string& value);
+
+/**
+ * Parses the contents of cgroup v1 'cpu.cfs_quota_us' / 'cpu.cfs_period_us'
+ * files, and returns the number of CPUs worth of time allowed, or 0 if the
+ * quota is -1 (unlimited); throws std::invalid_argument if malformed.
+ */
+double parse_cgroup_cfs_quota(const std::string& quota, const std::string& period);
+
+/**
+ * Returns the number of CPUs worth of time that the cgroups (v1 or v2) of the
+ * process, or their ancestors, allow it to use; 0 if unlimited or unknown.
+ */
+double cgroup_cpu_limit();
+
+/**
+ * Returns the number of CPUs available to the process; the number of CPUs on
+ * which it is allowed to run, limited by any cgroup CPU quota (rounded up).
+ */
+size_t available_cpus();
+
+} // namespace ar
+
+#endif
@@ -0,0 +1,232 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include "pipeline_stats.h"
+#include "strutils.h"
+
+namespace ar
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'step_stats'
+
+step_stats::step_stats()
+  : step_id(0)
+  , name()
+  , ordered(false)
+  , file_io(false)
+  , chunks(0)
+  , wall_time(0)
+  , cpu_time(0)
+  , total_latency(0)
+  , max_latency(0)
+  , total_queue_depth(0)
+  , max_queue_depth(0)
+{
+}
+
+
+step_stats& step_stats::operator+=(const step_stats& other)
+{
+    chunks += other.chunks;
+    wall_time += other.wall_time;
+    cpu_time += other.cpu_time;
+    total_latency += other.total_latency;
+    max_latency = std::max(max_latency, other.max_latency);
+    total_queue_depth += other.total_queue_depth;
+    max_queue_depth = std::max(max_queue_depth, other.max_queue_depth);
+
+    return *this;
+}
+
+
+void step_stats::add_chunk(double wall, double cpu, double latency, size_t queue_depth)
+{
+    chunks++;
+    wall_time += wall;
+    cpu_time += cpu;
+    total_latency += latency;
+    max_latency = std::max(max_latency, latency);
+    total_queue_depth += queue_depth;
+    max_queue_depth = std::max(max_queue_depth, queue_depth);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'worker_stats'
+
+worker_stats::worker_stats()
+  : idle_time(0)
+  , waits(0)
+{
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'pipeline_stats'
+
+pipeline_stats::pipeline_stats()
+  : wall_time(0)
+  , steps()
+  , workers()
+{
+}
+
+
+/** Returns the mean of a total over a number of chunks; 0 if no chunks. */
+double chunk_mean(double total, size_t chunks)
+{
+    return chunks ? total / chunks : 0.0;
+}
+
+
+void print_pipeline_stats(std::ostream& out, const pipeline_stats& stats)
+{
+    size_t name_width = 4;
+    for (step_stats_vec::const_iterator it = stats.steps.begin(); it != stats.steps.end(); ++it) {
+        name_width = std::max(name_width, it->name.size());
+    }
+
+    std::ostringstream table;
+    table << std::fixed
+          << "Pipeline statistics for run of " << std::setprecision(1)
+          << stats.wall_time << "s:\n"
+          << std::setw(4) << "ID" << "  " << std::left
+          << std::setw(name_width) << "Step" << std::right
+          << std::setw(10) << "Chunks"
+          << std::setw(10) << "Wall(s)"
+          << std::setw(10) << "CPU(s)"
+          << std::setw(13) << "Latency(ms)"
+          << std::setw(13) << "MaxLat(ms)"
+          << std::setw(8) << "Queue"
+          << std::setw(10) << "MaxQueue" << "\n";
+
+    for (step_stats_vec::const_iterator it = stats.steps.begin(); it != stats.steps.end(); ++it) {
+        table << std::setw(4) << it->step_id << "  " << std::left
+              << std::setw(name_width) << it->name << std::right
+              << std::setw(10) << it->chunks
+              << std::setprecision(3)
+              << std::setw(10) << it->wall_time
+              << std::setw(10) << it->cpu_time
+              << std::setw(13) << chunk_mean(it->total_latency, it->chunks) * 1000
+              << std::setw(13) << it->max_latency * 1000
+              << std::setprecision(2)
+              << std::setw(8) << chunk_mean(it->total_queue_depth, it->chunks)
+              << std::setw(10) << it->max_queue_depth << "\n";
+    }
+
+    table << "\n" << std::setw(6) << "Worker"
+          << std::setw(10) << "Idle(s)"
+          << std::setw(10) << "Waits" << "\n";
+
+    for (size_t worker = 0; worker < stats.workers.size(); ++worker) {
+        const worker_stats& info = stats.workers.at(worker);
+
+        table << std::setw(6) << worker
+              << std::setprecision(3)
+              << std::setw(10) << info.idle_time
+              << std::setw(10) << info.waits << "\n";
+    }
+
+    out << table.str();
+    out.flush();
+}
+
+
+void write_pipeline_stats_json(std::ostream& out, const pipeline_stats& stats)
+{
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(6)
+         << "{\n"
+         << "  \"wall_time\": " << stats.wall_time << ",\n"
+         << "  \"steps\": [";
+
+    for (step_stats_vec::const_iterator it = stats.steps.begin(); it != stats.steps.end(); ++it) {
+        json << (it == stats.steps.begin() ? "\n" : ",\n")
+             << "    {\"id\": " << it->step_id
+             << ", \"name\": " << json_string(it->name)
+             << ", \"ordered\": " << (it->ordered ? "true" : "false")
+             << ", \"file_io\": " << (it->file_io ? "true" : "false")
+             << ", \"chunks\": " << it->chunks
+             << ", \"wall_time\": " << it->wall_time
+             << ", \"cpu_time\": " << it->cpu_time
+             << ", \"mean_latency\": " << chunk_mean(it->total_latency, it->chunks)
+             << ", \"max_latency\": " << it->max_latency
+             << ", \"mean_queue_depth\": " << chunk_mean(it->total_queue_depth, it->chunks)
+             << ", \"max_queue_depth\": " << it->max_queue_depth
+             << "}";
+    }
+
+    json << "\n  ],\n"
+         << "  \"workers\": [";
+
+    for (size_t worker = 0; worker < stats.workers.size(); ++worker) {
+        const worker_stats& info = stats.workers.at(worker);
+
+        json << (worker ? ",\n" : "\n")
+             << "    {\"id\": " << worker
+             << ", \"idle_time\": " << info.idle_time
+             << ", \"waits\": " << info.waits
+             << "}";
+    }
+
+    json << "\n  ]\n"
+         << "}\n";
+
+    out << json.str();
+    out.flush();
+}
+
+
+bool write_pipeline_stats(const std::string& filename, const pipeline_stats& stats)
+{
+    std::cerr << "\n";
+    print_pipeline_stats(std::cerr, stats);
+
+    try {
+        std::ofstream output(filename.c_str(), std::ofstream::out);
+
+        if (!output.is_open()) {
+            std::string message = std::string("Failed to open file '") + filename + "': ";
+            throw std::ofstream::failure(message + std::strerror(errno));
+        }
+
+        output.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+        write_pipeline_stats_json(output, stats);
+    } catch (const std::ios_base::failure& error) {
+        std::cerr << "IO error writing pipeline statistics; aborting:\n"
+                  << cli_formatter::fmt(error.what()) << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+} // namespace ar
@@ -0,0 +1,119 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#ifndef PIPELINE_STATS_H
+#define PIPELINE_STATS_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace ar
+{
+
+/** Summary of the chunks processed by a single analytical step. */
+struct step_stats
+{
+    /** Constructor; zeros all counters. */
+    step_stats();
+
+    /** Adds the counters of another object, e.g. one used by another thread. */
+    step_stats& operator+=(const step_stats& other);
+
+    /** Records the processing of a single chunk. */
+    void add_chunk(double wall, double cpu, double latency, size_t queue_depth);
+
+    //! ID of the step, as passed to 'scheduler::add_step'
+    size_t step_id;
+    //! Name of the step; the name of the class implementing the step
+    std::string name;
+    //! True if the step is ordered
+    bool ordered;
+    //! True if the step involves file IO
+    bool file_io;
+
+    //! Number of chunks processed by the step
+    size_t chunks;
+    //! Total wall-clock time (in seconds) spent processing chunks
+    double wall_time;
+    //! Total CPU time (in seconds) spent processing chunks
+    double cpu_time;
+    //! Total time (in seconds) from chunks being queued until processed
+    double total_latency;
+    //! Maximum time (in seconds) from a chunk being queued until processed
+    double max_latency;
+    //! Sum of the number of chunks queued for the step, when processing chunks
+    size_t total_queue_depth;
+    //! Maximum number of chunks queued for the step
+    size_t max_queue_depth;
+};
+
+
+/** Summary of the time a single worker thread spent waiting for work. */
+struct worker_stats
+{
+    /** Constructor; zeros all counters. */
+    worker_stats();
+
+    //! Total wall-clock time (in seconds) spent waiting for work
+    double idle_time;
+    //! Number of times the worker waited for work
+    size_t waits;
+};
+
+
+typedef std::vector<step_stats> step_stats_vec;
+typedef std::vector<worker_stats> worker_stats_vec;
+
+
+/** Summary of a single run of a pipeline. */
+struct pipeline_stats
+{
+    /** Constructor; creates empty summary. */
+    pipeline_stats();
+
+    //! Total wall-clock time (in seconds) of the run
+    double wall_time;
+    //! Statistics for each step, ordered by step ID
+    step_stats_vec steps;
+    //! Statistics for each worker, ordered by worker ID
+    worker_stats_vec workers;
+};
+
+
+/** Prints a human readable summary table of a run. */
+void print_pipeline_stats(std::ostream& out, const pipeline_stats& stats);
+
+/** Writes the summary of a run in JSON format. */
+void write_pipeline_stats_json(std::ostream& out, const pipeline_stats& stats);
+
+/**
+ * Prints the summary table of a run to STDERR, and writes the summary in JSON
+ * format to the given file; returns false (after printing an error message)
+ * if the file could not be written.
+ */
+bool write_pipeline_stats(const std::string& filename, const pipeline_stats& stats);
+
+} // namespace ar
+
+#endif
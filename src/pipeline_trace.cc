@@ -0,0 +1,191 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include "pipeline_trace.h"
+#include "strutils.h"
+
+namespace ar
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'trace_event'
+
+trace_event::trace_event(event_type type_,
+                         size_t step_id_,
+                         unsigned chunk_id_,
+                         double queued_,
+                         double start_,
+                         double end_)
+  : type(type_)
+  , step_id(step_id_)
+  , chunk_id(chunk_id_)
+  , queued(queued_)
+  , start(start_)
+  , end(end_)
+{
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'pipeline_trace'
+
+pipeline_trace::pipeline_trace()
+  : start_time(0)
+  , step_names()
+  , workers()
+{
+}
+
+
+/** Returns the time in microseconds since the start of the trace. */
+double trace_timestamp(const pipeline_trace& trace, double value)
+{
+    return std::max(0.0, value - trace.start_time) * 1e6;
+}
+
+
+/** Returns the name of a step, or a placeholder if not named. */
+std::string trace_step_name(const pipeline_trace& trace, size_t step_id)
+{
+    if (step_id < trace.step_names.size() && !trace.step_names.at(step_id).empty()) {
+        return trace.step_names.at(step_id);
+    }
+
+    std::ostringstream name;
+    name << "step_" << step_id;
+
+    return name.str();
+}
+
+
+/** Writes the arguments shared by the events of a processed chunk. */
+void write_trace_args(std::ostream& out, const trace_event& event)
+{
+    out << "\"args\": {\"step\": " << event.step_id
+        << ", \"chunk\": " << event.chunk_id << "}";
+}
+
+
+void write_pipeline_trace_json(std::ostream& out, const pipeline_trace& trace)
+{
+    // Events are streamed directly to the output, since traces of long runs
+    // may be too large to comfortably buffer in memory
+    const std::ios_base::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+
+    out << std::fixed << std::setprecision(3)
+        << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n"
+        << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+        << "\"args\": {\"name\": \"AdapterRemoval\"}}";
+
+    for (size_t worker = 0; worker < trace.workers.size(); ++worker) {
+        out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            << "\"tid\": " << worker << ", \"args\": {\"name\": \"worker "
+            << worker << "\"}}";
+    }
+
+    // JSON encoded names of steps, indexed by step ID
+    std::vector<std::string> names;
+
+    // IDs linking the begin / end of asynchronous queue events
+    size_t queue_id = 0;
+    for (size_t worker = 0; worker < trace.workers.size(); ++worker) {
+        const trace_event_vec& events = trace.workers.at(worker);
+
+        for (trace_event_vec::const_iterator it = events.begin(); it != events.end(); ++it) {
+            const double start = trace_timestamp(trace, it->start);
+            const double duration = trace_timestamp(trace, it->end) - start;
+
+            if (it->type == trace_event::idle) {
+                out << ",\n{\"name\": \"idle\", \"cat\": \"idle\", \"ph\": \"X\", "
+                    << "\"pid\": 1, \"tid\": " << worker
+                    << ", \"ts\": " << start << ", \"dur\": " << duration << "}";
+                continue;
+            }
+
+            if (it->step_id >= names.size()) {
+                names.resize(it->step_id + 1);
+            }
+
+            std::string& name = names.at(it->step_id);
+            if (name.empty()) {
+                name = json_string(trace_step_name(trace, it->step_id));
+            }
+
+            out << ",\n{\"name\": " << name << ", \"cat\": \"step\", \"ph\": \"X\", "
+                << "\"pid\": 1, \"tid\": " << worker
+                << ", \"ts\": " << start << ", \"dur\": " << duration << ", ";
+            write_trace_args(out, *it);
+            out << "}";
+
+            const double queued = trace_timestamp(trace, it->queued);
+            if (it->queued && queued < start) {
+                ++queue_id;
+                out << ",\n{\"name\": " << name << ", \"cat\": \"queue\", \"ph\": \"b\", "
+                    << "\"id\": " << queue_id << ", \"pid\": 1, \"tid\": " << worker
+                    << ", \"ts\": " << queued << ", ";
+                write_trace_args(out, *it);
+                out << "},\n{\"name\": " << name << ", \"cat\": \"queue\", \"ph\": \"e\", "
+                    << "\"id\": " << queue_id << ", \"pid\": 1, \"tid\": " << worker
+                    << ", \"ts\": " << start << "}";
+            }
+        }
+    }
+
+    out << "\n]}\n";
+    out.flush();
+
+    out.flags(flags);
+    out.precision(precision);
+}
+
+
+bool write_pipeline_trace(const std::string& filename, const pipeline_trace& trace)
+{
+    try {
+        std::ofstream output(filename.c_str(), std::ofstream::out);
+
+        if (!output.is_open()) {
+            std::string message = std::string("Failed to open file '") + filename + "': ";
+            throw std::ofstream::failure(message + std::strerror(errno));
+        }
+
+        output.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+        write_pipeline_trace_json(output, trace);
+    } catch (const std::ios_base::failure& error) {
+        std::cerr << "IO error writing pipeline trace; aborting:\n"
+                  << cli_formatter::fmt(error.what()) << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+} // namespace ar
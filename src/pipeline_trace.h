@@ -0,0 +1,102 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#ifndef PIPELINE_TRACE_H
+#define PIPELINE_TRACE_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace ar
+{
+
+/** Single event recorded by a worker thread while tracing a pipeline. */
+struct trace_event
+{
+    enum event_type {
+        //! A chunk was processed by a step
+        process_chunk,
+        //! The worker was waiting for work
+        idle
+    };
+
+    /** Creates an event; times are in seconds since the epoch. */
+    trace_event(event_type type_ = idle,
+                size_t step_id_ = 0,
+                unsigned chunk_id_ = 0,
+                double queued_ = 0,
+                double start_ = 0,
+                double end_ = 0);
+
+    //! Type of the event
+    event_type type;
+    //! ID of the step processing the chunk; unused for idle events
+    size_t step_id;
+    //! ID of the chunk being processed; unused for idle events
+    unsigned chunk_id;
+    //! Time at which the chunk was queued; unused for idle events
+    double queued;
+    //! Time at which the event started
+    double start;
+    //! Time at which the event ended
+    double end;
+};
+
+
+typedef std::vector<trace_event> trace_event_vec;
+
+
+/** Timeline of the events of a single run of a pipeline. */
+struct pipeline_trace
+{
+    /** Constructor; creates empty trace. */
+    pipeline_trace();
+
+    //! Time at which the run started; events are reported relative to this
+    double start_time;
+    //! Names of steps, indexed by step ID; empty for unused IDs
+    std::vector<std::string> step_names;
+    //! Events recorded by each worker, indexed by worker ID
+    std::vector<trace_event_vec> workers;
+};
+
+
+/**
+ * Writes a trace in the Chrome trace-event JSON format, which may be viewed
+ * using chrome://tracing or https://ui.perfetto.dev. Each worker is shown as
+ * a thread, with the processing of chunks and idle periods as slices, while
+ * the time chunks spent queued (including waits caused by the ordering of
+ * chunks) is shown as asynchronous slices.
+ */
+void write_pipeline_trace_json(std::ostream& out, const pipeline_trace& trace);
+
+/**
+ * Writes a trace to the given file; returns false (after printing an error
+ * message) if the file could not be written.
+ */
+bool write_pipeline_trace(const std::string& filename, const pipeline_trace& trace);
+
+} // namespace ar
+
+#endif
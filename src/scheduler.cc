@@ -22,21 +22,34 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
 \*************************************************************************/
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdlib>
 #include <iostream>
-#include <queue>
 #include <stdexcept>
 #include <unistd.h>
 #include <cstdlib>
+#include <cxxabi.h>
+#include <typeinfo>
 
 #include "debug.h"
 #include "scheduler.h"
 #include "strutils.h"
+#include "timer.h"
+#include "ws_deque.h"
 
 namespace ar
 {
 
+//! Max number of consecutive chunks processed per run of an ordered step
+const size_t MAX_ORDERED_CHUNKS = 8;
+//! Max time (in seconds) that a runnable step is left for its preferred
+//! worker, before other workers may run it; see 'analytical_step::affinity'
+const double AFFINITY_TIMEOUT = 0.001;
+//! Value used for steps that have not yet been run by any worker
+const size_t NO_WORKER = static_cast<size_t>(-1);
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // exceptions
 
@@ -57,13 +70,19 @@ analytical_chunk::~analytical_chunk()
 {
 }
 
+size_t analytical_chunk::memory_usage() const
+{
+    return 0;
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // analytical_step
 
-analytical_step::analytical_step(ordering step_order, bool file_io)
+analytical_step::analytical_step(ordering step_order, bool file_io, bool affinity)
     : m_step_order(step_order)
     , m_file_io(file_io)
+    , m_affinity(affinity)
 {
 }
 
@@ -76,98 +95,91 @@ analytical_step::~analytical_step()
 // scheduler
 
 
-struct data_chunk
+/**
+ * Reference count shared by a chunk passed to the first step of a pipeline,
+ * and by all chunks derived from it; once the last reference is released,
+ * the lineage is re-used for the next chunk passed to the first step.
+ */
+struct chunk_lineage
 {
-    data_chunk(unsigned chunk_id_ = 0,
-               analytical_chunk* data_ = NULL)
-      : chunk_id(chunk_id_)
-      , data(data_)
-      , nrefs(NULL)
+    chunk_lineage()
+      : refs(0)
+      , padding()
     {
-        increment_refs();
     }
 
-    data_chunk(const data_chunk& parent, analytical_chunk* data = NULL)
-      : chunk_id(parent.chunk_id)
-      , data(data ? data : parent.data)
-      , nrefs(parent.nrefs)
-    {
-        increment_refs();
-    }
+    //! Number of live chunks in the lineage
+    atomic_counter refs;
+    //! Avoids false sharing between lineages
+    char padding[CACHE_LINE_SIZE - sizeof(atomic_counter)];
+};
 
-    /** Destructor; simply decrements reference count **/
-    ~data_chunk()
-    {
-        decrement_refs();
-    }
 
-    data_chunk& operator=(const data_chunk& other)
+/**
+ * Chunk queued for processing by a step. A data_chunk is a plain value, and
+ * copying a data_chunk hands over the reference to its lineage; references
+ * are only added explicitly for offspring, and released explicitly once the
+ * chunk has been processed.
+ */
+struct data_chunk
+{
+    data_chunk(unsigned chunk_id_ = 0,
+               analytical_chunk* data_ = NULL,
+               chunk_lineage* lineage_ = NULL)
+      : chunk_id(chunk_id_)
+      , data(data_)
+      , lineage(lineage_)
+      , bytes(0)
+      , queued(0)
     {
-        other.increment_refs();
-        decrement_refs();
-
-        nrefs = other.nrefs;
-        chunk_id = other.chunk_id;
-        data = other.data;
-
-        return *this;
     }
 
-    /** Sorts by counter, data, type, in that order. **/
-    bool operator<(const data_chunk& other) const
+    /** Returns a new chunk in the same lineage, adding a reference. */
+    data_chunk offspring(analytical_chunk* data_) const
     {
-        if (chunk_id > other.chunk_id) {
-            return true;
-        } else if (chunk_id == other.chunk_id) {
-            if (data > other.data) {
-                return true;
-            }
-        }
+        lineage->refs.increment();
 
-        return false;
+        return data_chunk(chunk_id, data_, lineage);
     }
 
-    bool unique()
+    /**
+     * Releases the reference held by this chunk; returns true if this was
+     * the last reference to the lineage, false otherwise.
+     */
+    bool release()
     {
-        return nrefs->current() == 1;
+        return !lineage->refs.decrement();
     }
 
-    //! Strictly increasing counter; used to sort chunks for 'ordered' tasks
+    //! Strictly increasing counter; used to order chunks for 'ordered' steps
     unsigned chunk_id;
     //! Use generated data; is not freed by this struct
     analytical_chunk* data;
-
-private:
-    void increment_refs() const
-    {
-        if (nrefs) {
-            nrefs->increment();
-        } else {
-            nrefs = new atomic_counter(1);
-        }
-    }
-
-    void decrement_refs() const
-    {
-        if (nrefs->decrement() == 0) {
-            delete nrefs;
-            nrefs = NULL;
-        }
-    }
-
-    //! Reference counts
-    mutable atomic_counter* nrefs;
+    //! Lineage of the chunk; not owned by this struct; NULL if unused
+    chunk_lineage* lineage;
+    //! Memory usage of 'data' when queued; 0 if memory usage is not tracked
+    size_t bytes;
+    //! Time at which the chunk was queued for its current step
+    double queued;
 };
 
 
 struct scheduler_step
 {
-    scheduler_step(analytical_step* value)
+    scheduler_step(size_t step_id, analytical_step* value)
       : lock()
+      , id(step_id)
       , ptr(value)
       , current_chunk(0)
       , last_chunk(0)
-      , queue()
+      , window(16)
+      , pending(0)
+      , memory_usage(0)
+      , queued_tasks(0)
+      , queued(false)
+      , depth(0)
+      , worker(NO_WORKER)
+      , queued_at(0)
     {
     }
 
@@ -178,10 +190,20 @@ struct scheduler_step
 
     /** Cleans up after previous runs; deleting any remaining chunks. */
     void reset() {
-        while (!queue.empty()) {
-            delete queue.top().data;
-            queue.pop();
+        for (chunk_window::iterator it = window.begin(); it != window.end(); ++it) {
+            if (it->lineage) {
+                delete it->data;
+                *it = data_chunk();
+            }
         }
+
+        pending = 0;
+        memory_usage = 0;
+        queued_tasks = 0;
+        queued = false;
+        depth = 0;
+        worker = NO_WORKER;
+        queued_at = 0;
     }
 
     bool can_run(size_t next_chunk)
@@ -193,9 +215,82 @@ struct scheduler_step
         return true;
     }
 
+    /** Adds a chunk to the reorder window, growing the window if needed. */
+    void push_chunk(const data_chunk& chunk)
+    {
+        AR_DEBUG_ASSERT(chunk.lineage && chunk.chunk_id >= current_chunk);
+        if (chunk.chunk_id - current_chunk >= window.size()) {
+            grow_window(chunk.chunk_id - current_chunk + 1);
+        }
+
+        data_chunk& slot = window.at(chunk.chunk_id & (window.size() - 1));
+        AR_DEBUG_ASSERT(!slot.lineage);
+
+        slot = chunk;
+        pending++;
+    }
+
+    /** Returns true if the chunk numbered 'current_chunk' is available. */
+    bool ready() const
+    {
+        return window.at(current_chunk & (window.size() - 1)).lineage != NULL;
+    }
+
+    /** Removes and returns the chunk numbered 'current_chunk'. */
+    data_chunk pop_chunk()
+    {
+        data_chunk& slot = window.at(current_chunk & (window.size() - 1));
+        AR_DEBUG_ASSERT(slot.lineage && slot.chunk_id == current_chunk);
+
+        const data_chunk chunk = slot;
+        slot = data_chunk();
+        pending--;
+
+        return chunk;
+    }
+
+    /** Returns the depth of the step; see 'depth'. */
+    size_t get_depth() const
+    {
+        return __atomic_load_n(&depth, __ATOMIC_RELAXED);
+    }
+
+    /** Raises the depth of the step to at least 'min_depth'. */
+    void raise_depth(size_t min_depth)
+    {
+        size_t current = get_depth();
+        while (current < min_depth) {
+            if (__atomic_compare_exchange_n(&depth, &current, min_depth, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+    }
+
+    /** Grows the window to at least 'size' slots (a power of two). */
+    void grow_window(size_t size)
+    {
+        size_t new_size = window.size();
+        while (new_size < size) {
+            new_size *= 2;
+        }
+
+        chunk_window larger(new_size);
+        for (chunk_window::iterator it = window.begin(); it != window.end(); ++it) {
+            if (it->lineage) {
+                larger.at(it->chunk_id & (new_size - 1)) = *it;
+            }
+        }
+
+        window.swap(larger);
+    }
+
+    typedef std::vector<data_chunk> chunk_window;
 
     //! Mutex used to control access to step
     mutex lock;
+    //! ID of the step, as passed to 'add_step'
+    size_t id;
     //! Analytical step implementation
     std::auto_ptr<analytical_step> ptr;
     //! The current chunk to be processed
@@ -203,8 +298,27 @@ struct scheduler_step
     //! The last chunk queued to the step;
     //! Used to correct numbering for sparse output from sequential steps
     unsigned last_chunk;
-    //! (Ordered) vector of chunks to be processed
-    std::priority_queue<data_chunk> queue;
+    //! Reorder window of chunks for ordered steps, indexed by the chunk ID
+    //! modulo the window size; holds chunks 'current_chunk' and onwards
+    chunk_window window;
+    //! Number of chunks in the reorder window
+    size_t pending;
+    //! Last reported memory usage of the step; updated atomically
+    size_t memory_usage;
+    //! Number of tasks queued for an unordered step; updated atomically
+    size_t queued_tasks;
+    //! Set while an ordered step is runnable, but not yet claimed by a
+    //! worker; updated atomically
+    bool queued;
+    //! Longest path from the first step to this step, as observed from the
+    //! chunks queued so far; deeper steps are closer to the end of the
+    //! pipeline and are prioritized. Updated atomically
+    size_t depth;
+    //! Worker that last ran the step; NO_WORKER if not run yet. Used for
+    //! steps with affinity for a worker; updated atomically
+    size_t worker;
+    //! Time at which the step was last queued; updated atomically
+    double queued_at;
 
 private:
     //! Not implemented
@@ -214,17 +328,42 @@ private:
 };
 
 
+/** Chunk queued for processing by an unordered step. */
+struct scheduler_task
+{
+    scheduler_task(scheduler_step* step_, const data_chunk& chunk_)
+      : step(step_)
+      , chunk(chunk_)
+    {
+    }
+
+    //! Unordered step to process the chunk
+    scheduler_step* step;
+    //! The chunk to be processed
+    data_chunk chunk;
+
+private:
+    //! Not implemented
+    scheduler_task(const scheduler_task&);
+    //! Not implemented
+    scheduler_task& operator=(const scheduler_task&);
+};
+
+
 /** Simple structure used to pass parameters to threads. */
 struct thread_info
 {
-    thread_info(unsigned seed_, scheduler* sch_)
+    thread_info(unsigned seed_, size_t worker_, scheduler* sch_)
       : seed(seed_)
+      , worker(worker_)
       , sch(sch_)
     {
     }
 
     //! Per thread seed
     unsigned seed;
+    //! Per thread worker ID; used to select the thread's task deque
+    size_t worker;
     //! Pointer to current scheduler
     scheduler* sch;
 };
@@ -234,16 +373,36 @@ scheduler::scheduler()
   : m_steps()
   , m_running()
   , m_errors(false)
-  , m_condition()
   , m_chunk_counter(0)
 #ifdef AR_PTHREAD_SUPPORT
   , m_threads()
 #endif
-  , m_queue_lock()
-  , m_queue_calc()
-  , m_queue_io()
-  , m_io_active(false)
+  , m_calc_steps()
+  , m_calc_queued(0)
+  , m_task_deques()
+  , m_io_steps()
+  , m_io_queued(0)
+  , m_io_active(0)
+  , m_io_max(1)
+  , m_idle_threads(0)
+  , m_idle_lock()
+  , m_idle_workers()
+  , m_parkers()
   , m_live_chunks(0)
+  , m_lineages()
+  , m_worker_nodes()
+  , m_node_cpus()
+  , m_allowed_cpus()
+  , m_throttled_lineages()
+  , m_active_lineages(0)
+  , m_max_memory(0)
+  , m_memory_usage(0)
+  , m_peak_memory(0)
+  , m_step_stats()
+  , m_worker_stats()
+  , m_stats()
+  , m_tracing(false)
+  , m_trace()
 {
 }
 
@@ -257,6 +416,9 @@ scheduler::~scheduler()
     }
 
     m_steps.clear();
+    clear_task_deques();
+    clear_parkers();
+    clear_lineages();
 }
 
 
@@ -269,41 +431,111 @@ void scheduler::add_step(size_t step_id, analytical_step* step)
 
     AR_DEBUG_ASSERT(step);
     AR_DEBUG_ASSERT(!m_steps.at(step_id));
+    // IO steps are assumed to be run by a single thread at a time
+    AR_DEBUG_ASSERT(!step->file_io() || step->get_ordering() == analytical_step::ordered);
+    // Unordered steps are run by many threads at once
+    AR_DEBUG_ASSERT(!step->affinity() || step->get_ordering() == analytical_step::ordered);
 
-    m_steps.at(step_id) = new scheduler_step(step);
+    m_steps.at(step_id) = new scheduler_step(step_id, step);
 }
 
 
 
-bool scheduler::run(int nthreads, unsigned seed)
+bool scheduler::run(int nthreads, unsigned seed, int nio_threads,
+                    size_t max_memory, bool numa, size_t lookahead)
 {
     AR_DEBUG_ASSERT(!m_steps.empty());
     AR_DEBUG_ASSERT(m_steps.front());
     AR_DEBUG_ASSERT(nthreads >= 1);
+    AR_DEBUG_ASSERT(nio_threads >= 1);
+    // The first step is re-queued with new chunks, which requires ordering
+    AR_DEBUG_ASSERT(m_steps.front()->ptr->get_ordering() == analytical_step::ordered);
     mutex_locker lock(m_running);
 
     m_chunk_counter = 0;
+    m_calc_steps.clear();
+    m_io_steps.clear();
     for (pipeline::iterator it = m_steps.begin(); it != m_steps.end(); ++it) {
         if (*it) {
             (*it)->reset();
+
+            if ((*it)->ptr->file_io()) {
+                m_io_steps.push_back(*it);
+            } else if ((*it)->ptr->get_ordering() == analytical_step::ordered) {
+                m_calc_steps.push_back(*it);
+            }
         }
     }
 
-    for (unsigned task = 3 * nthreads; task; --task) {
-        m_steps.front()->queue.push(data_chunk(m_chunk_counter++));
+    for (int i = 0; i < nthreads; ++i) {
+        m_task_deques.push_back(new task_deque());
+        m_parkers.push_back(new thread_parker());
+    }
+    m_worker_nodes.assign(nthreads, 0);
+    m_node_cpus.clear();
+    if (numa) {
+        initialize_numa_nodes(nthreads);
+    }
+
+    m_calc_queued = 0;
+    m_io_queued = 0;
+    m_idle_threads = 0;
+    m_idle_workers.clear();
+    m_live_chunks = 0;
+    m_max_memory = max_memory;
+    m_memory_usage = 0;
+    m_peak_memory = 0;
+    m_active_lineages = 0;
+    m_step_stats.assign(nthreads, step_stats_vec(m_steps.size()));
+    m_worker_stats.assign(nthreads, worker_stats());
+
+    const double start_time = get_current_time();
+    m_trace = pipeline_trace();
+    if (m_tracing) {
+        m_trace.start_time = start_time;
+        m_trace.workers.resize(nthreads);
+    }
+
+    for (size_t task = lookahead ? lookahead : 3 * nthreads; task; --task) {
+        m_lineages.push_back(new chunk_lineage());
+
+        if (m_max_memory && m_active_lineages) {
+            // Lineages are resumed as long as memory usage is within budget
+            m_throttled_lineages.push_back(m_lineages.back());
+        } else {
+            data_chunk chunk(m_chunk_counter++, NULL, m_lineages.back());
+            chunk.queued = start_time;
+
+            m_lineages.back()->refs.increment();
+            m_steps.front()->push_chunk(chunk);
+            m_active_lineages++;
+        }
     }
 
     queue_analytical_step(m_steps.front(), 0);
 
-    m_io_active = false;
+    m_io_active = 0;
+    m_io_max = nio_threads;
     m_errors = !initialize_threads(nthreads - 1, seed + 1);
 
     // Signal for threads to start, or terminate in case of errors
     signal_threads();
 
-    thread_info* info = new thread_info(seed, this);
+    thread_info* info = new thread_info(seed, 0, this);
     m_errors = !run_wrapper(info) || m_errors;
     m_errors = !join_threads() || m_errors;
+    set_current_worker_id(0);
+    collect_stats(get_current_time() - start_time);
+
+    if (!m_node_cpus.empty()) {
+        // Undo pinning of the calling thread
+        pin_current_thread(m_allowed_cpus);
+        set_current_numa_node(0);
+    }
+
+    const size_t tasks_left = clear_task_deques();
+    clear_parkers();
+    clear_lineages();
 
     if (!m_errors) {
         for (pipeline::iterator it = m_steps.begin(); it != m_steps.end(); ++it) {
@@ -313,13 +545,20 @@ bool scheduler::run(int nthreads, unsigned seed)
         }
 
         for (pipeline::iterator it = m_steps.begin(); it != m_steps.end(); ++it) {
-            if (*it && !(*it)->queue.empty()) {
+            if (*it && (*it)->pending) {
                 print_locker lock;
                 std::cerr << "ERROR: Not all parts run for step " << it - m_steps.begin()
-                          << "; " << (*it)->queue.size() << " left ..." << std::endl;
+                          << "; " << (*it)->pending << " left ..." << std::endl;
                 m_errors = true;
             }
         }
+
+        if (tasks_left) {
+            print_locker lock;
+            std::cerr << "ERROR: Not all parts run for unordered steps; "
+                      << tasks_left << " left ..." << std::endl;
+            m_errors = true;
+        }
     }
 
     return !m_errors;
@@ -333,9 +572,11 @@ void* scheduler::run_wrapper(void* ptr)
 
     // Set seed for RNG; rand is used in collapse_paired_ended_sequences()
     srandom(info->seed);
+    set_current_worker_id(info->worker);
+    sch->pin_worker(info->worker);
 
     try {
-        return sch->do_run();
+        return sch->do_run(info->worker);
     } catch (const thread_abort&) {
         // Error messaging is assumed to have been done by thrower
     } catch (const std::exception& error) {
@@ -354,131 +595,539 @@ void* scheduler::run_wrapper(void* ptr)
 }
 
 
-void* scheduler::do_run()
+void* scheduler::do_run(size_t worker)
 {
     // Wait to allow early termination in case of errors during setup
-    m_condition.wait();
+    m_parkers.at(worker)->park();
 
     while (!m_errors) {
         scheduler_step* current_step = NULL;
+        scheduler_task* current_task = NULL;
+        bool deferred = false;
 
-        {
-            mutex_locker lock(m_queue_lock);
-
-            // Try to keep the disk busy by preferring IO chunks
-            if (m_io_active || m_queue_io.empty()) {
-                if (!m_queue_calc.empty()) {
-                    current_step = m_queue_calc.front();
-                    m_queue_calc.pop_front();
-                } else if (!m_live_chunks) {
+        if (!next_analytical_step(worker, current_step, current_task, deferred)) {
+            // Register as idle before checking again; a thread queuing work
+            // will either see this thread as idle, or this thread its work
+            register_idle_worker(worker);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+            if (!next_analytical_step(worker, current_step, current_task, deferred)) {
+                if (!__atomic_load_n(&m_live_chunks, __ATOMIC_SEQ_CST)) {
                     // Nothing left to do at all
+                    unregister_idle_worker(worker);
                     break;
                 }
-            } else {
-                current_step = m_queue_io.front();
-                m_queue_io.pop_front();
-                m_io_active = true;
+
+                // Nothing to do yet; steps left for their preferred workers
+                // are taken over if not run before the timeout
+                const double wait_start = get_current_time();
+                m_parkers.at(worker)->park(deferred ? AFFINITY_TIMEOUT : 0.0);
+
+                const double wait_end = get_current_time();
+                worker_stats& stats = m_worker_stats.at(worker);
+                stats.idle_time += wait_end - wait_start;
+                stats.waits++;
+
+                if (m_tracing) {
+                    m_trace.workers.at(worker).push_back(trace_event(trace_event::idle, 0, 0, 0, wait_start, wait_end));
+                }
             }
+
+            unregister_idle_worker(worker);
         }
 
-        if (current_step) {
-            execute_analytical_step(current_step);
-        } else {
-            // Nothing to do yet ...
-            m_condition.wait();
+        if (current_step || current_task) {
+            execute_analytical_step(worker, current_step, current_task);
         }
     }
 
-    // Signal any waiting threads
-    m_condition.signal();
+    // Wake an idle worker, which will in turn wake the next idle worker
+    wake_idle_thread();
 
     return reinterpret_cast<void*>(true);
 }
 
 
-void scheduler::execute_analytical_step(scheduler_step* step)
+bool scheduler::next_analytical_step(size_t worker,
+                                     scheduler_step*& step,
+                                     scheduler_task*& task,
+                                     bool& deferred)
 {
-    data_chunk chunk;
+    // Try to keep the disk busy by preferring IO steps; writing output takes
+    // priority over reading input, so that chunks leave the pipeline before
+    // new chunks enter it
+    if (io_step_queued() && acquire_io_slot()) {
+        if ((step = claim_queued_step(worker, m_io_steps, m_io_queued, deferred))) {
+            return true;
+        }
 
-    {
-        mutex_locker lock(step->lock);
-        chunk = step->queue.top();
-        step->queue.pop();
+        // Another thread got there first
+        __atomic_sub_fetch(&m_io_active, 1, __ATOMIC_SEQ_CST);
     }
 
-    chunk_vec chunks = step->ptr->process(chunk.data);
+    // Most recently queued task, for which the data is likely to be cached,
+    // unless an ordered step closer to the end of the pipeline is runnable
+    task_deque* deque = m_task_deques.at(worker);
+    if (deque->pop(task)) {
+        scheduler_step* other_step = find_queued_step(worker, m_calc_steps, deferred);
+        if (!other_step || other_step->get_depth() <= task->step->get_depth()
+            || !claim_step(worker, other_step, m_calc_queued)) {
+            return true;
+        }
 
-    mutex_locker lock(m_queue_lock);
+        // Return the task, allowing it to be stolen while the step is run
+        deque->push(task);
+        task = NULL;
+        wake_idle_thread();
 
-    // Schedule each of the resulting blocks
-    for (chunk_vec::iterator it = chunks.begin(); it != chunks.end(); ++it) {
-        scheduler_step* other_step = m_steps.at(it->first);
-        AR_DEBUG_ASSERT(other_step != NULL);
+        step = other_step;
+        return true;
+    } else if ((step = claim_queued_step(worker, m_calc_steps, m_calc_queued, deferred))) {
+        return true;
+    }
 
-        mutex_locker lock(other_step->lock);
-        // Inherit reference count from source chunk
-        data_chunk next_chunk(chunk, it->second);
-        if (step->ptr->get_ordering() == analytical_step::ordered) {
-            // Ordered steps are allowed to not return results, so the chunk
-            // numbering is remembered for down-stream steps
-            next_chunk.chunk_id = other_step->last_chunk++;
+    // Steal the oldest task from one of the other workers, preferring workers
+    // on the same NUMA node, as their data is more likely to be node-local
+    const size_t node = m_worker_nodes.at(worker);
+    for (size_t pass = 0; pass < 2; ++pass) {
+        for (size_t i = 1; i < m_task_deques.size(); ++i) {
+            const size_t victim = (worker + i) % m_task_deques.size();
+            const bool same_node = (m_worker_nodes.at(victim) == node);
+            if (same_node == !pass && m_task_deques.at(victim)->steal(task)) {
+                return true;
+            }
         }
+    }
+
+    return false;
+}
+
+
+void scheduler::execute_analytical_step(size_t worker,
+                                        scheduler_step* step,
+                                        scheduler_task* task)
+{
+    if (task) {
+        step = task->step;
+        const data_chunk chunk = task->chunk;
+        delete task;
+
+        // The queue depth includes the task being processed
+        const size_t queue_depth = __atomic_fetch_sub(&step->queued_tasks, 1, __ATOMIC_RELAXED);
+        const bool output = process_chunk(worker, step, chunk, queue_depth);
+        release_chunk(step, chunk, output);
+    } else {
+        // Consecutive chunks that are ready are processed in one go, up to a
+        // limit, in order to cut the number of round-trips through the queues
+        bool ready = true;
+        for (size_t nchunks = 1; ready; ++nchunks) {
+            data_chunk chunk;
+            size_t queue_depth = 0;
+
+            {
+                mutex_locker lock(step->lock);
+                queue_depth = step->pending;
+                chunk = step->pop_chunk();
+            }
+
+            const bool output = process_chunk(worker, step, chunk, queue_depth);
 
-        other_step->queue.push(next_chunk);
-        queue_analytical_step(other_step, next_chunk.chunk_id);
+            {
+                mutex_locker lock(step->lock);
+
+                step->current_chunk++;
+                ready = step->ready();
+                if (ready && nchunks >= MAX_ORDERED_CHUNKS) {
+                    // Reschedule current step, since the next chunk is available
+                    queue_analytical_step(step, step->current_chunk);
+                    ready = false;
+                }
+            }
+
+            release_chunk(step, chunk, output);
+        }
     }
 
-    // Unlock use of IO steps after finishing processing
+    // Release IO slot after finishing processing
     if (step->ptr->file_io()) {
-        m_io_active = false;
-        if (!m_queue_io.empty()) {
-            m_condition.signal();
+        __atomic_sub_fetch(&m_io_active, 1, __ATOMIC_SEQ_CST);
+        if (io_step_queued()) {
+            wake_idle_thread();
+        }
+    }
+
+    // Decrement counter only after any offspring have been queued
+    __atomic_sub_fetch(&m_live_chunks, 1, __ATOMIC_SEQ_CST);
+}
+
+
+size_t scheduler::peak_memory() const
+{
+    return m_peak_memory;
+}
+
+
+const pipeline_stats& scheduler::stats() const
+{
+    return m_stats;
+}
+
+
+void scheduler::enable_tracing(bool enabled)
+{
+    mutex_locker lock(m_running);
+    m_tracing = enabled;
+}
+
+
+const pipeline_trace& scheduler::trace() const
+{
+    return m_trace;
+}
+
+
+bool scheduler::process_chunk(size_t worker,
+                              scheduler_step* step,
+                              const data_chunk& chunk,
+                              size_t queue_depth)
+{
+    const bool ordered = step->ptr->get_ordering() == analytical_step::ordered;
+
+    const double start_time = get_current_time();
+    const double start_cpu_time = get_thread_cpu_time();
+    const chunk_vec chunks = step->ptr->process(chunk.data);
+    const double end_time = get_current_time();
+
+    m_step_stats.at(worker).at(step->id).add_chunk(end_time - start_time,
+                                                   get_thread_cpu_time() - start_cpu_time,
+                                                   start_time - chunk.queued,
+                                                   queue_depth);
+
+    if (m_tracing) {
+        m_trace.workers.at(worker).push_back(trace_event(trace_event::process_chunk,
+                                                         step->id,
+                                                         chunk.chunk_id,
+                                                         chunk.queued,
+                                                         start_time,
+                                                         end_time));
+    }
+
+    if (m_max_memory) {
+        // Output is accounted for before the input is released, since both
+        // are (typically) held in memory while the step is running
+        const size_t usage = step->ptr->memory_usage();
+        const size_t last_usage = __atomic_exchange_n(&step->memory_usage, usage, __ATOMIC_RELAXED);
+        if (usage > last_usage) {
+            add_memory_usage(usage - last_usage);
+        } else {
+            sub_memory_usage(last_usage - usage);
         }
     }
 
-    // Reschedule current step if ordered and next chunk is available
-    if (step->ptr->get_ordering() == analytical_step::ordered) {
-        mutex_locker lock(step->lock);
+    // Schedule each of the resulting blocks
+    for (chunk_vec::const_iterator it = chunks.begin(); it != chunks.end(); ++it) {
+        scheduler_step* other_step = m_steps.at(it->first);
+        AR_DEBUG_ASSERT(other_step != NULL);
+        other_step->raise_depth(step->get_depth() + 1);
+
+        // Inherit lineage from source chunk
+        data_chunk next_chunk = chunk.offspring(it->second);
+        next_chunk.queued = end_time;
+        if (m_max_memory) {
+            next_chunk.bytes = it->second->memory_usage();
+            add_memory_usage(next_chunk.bytes);
+        }
+
+        if (other_step->ptr->get_ordering() == analytical_step::unordered) {
+            if (ordered) {
+                next_chunk.chunk_id = __atomic_fetch_add(&other_step->last_chunk, 1, __ATOMIC_RELAXED);
+            }
 
-        step->current_chunk++;
-        if (!step->queue.empty()) {
-            queue_analytical_step(step, step->queue.top().chunk_id);
+            queue_analytical_task(worker, new scheduler_task(other_step, next_chunk));
+        } else {
+            mutex_locker lock(other_step->lock);
+            if (ordered) {
+                // Ordered steps are allowed to not return results, so the chunk
+                // numbering is remembered for down-stream steps
+                next_chunk.chunk_id = other_step->last_chunk++;
+            }
+
+            other_step->push_chunk(next_chunk);
+            queue_analytical_step(other_step, next_chunk.chunk_id);
         }
     }
 
-    // End of the line for this chunk; re-schedule first step
-    if (chunks.empty() && chunk.unique() && step != m_steps.front()) {
-        scheduler_step* other_step = m_steps.front();
+    sub_memory_usage(chunk.bytes);
+
+    return !chunks.empty();
+}
 
-        mutex_locker lock(other_step->lock);
-        other_step->queue.push(data_chunk(m_chunk_counter));
 
-        queue_analytical_step(other_step, m_chunk_counter);
+void scheduler::release_chunk(scheduler_step* step, data_chunk chunk, bool output)
+{
+    // End of the line for this chunk; re-schedule first step. Only the thread
+    // releasing the last reference to a chunk (and its offspring) does so,
+    // except when the first step produces no chunks (end of input)
+    if (chunk.release()) {
+        mutex_locker lock(m_steps.front()->lock);
+
+        if (step == m_steps.front() && !output) {
+            m_active_lineages--;
+        } else if (memory_exceeded() && m_active_lineages > 1) {
+            // Throttle reading until memory has been freed; at least one
+            // lineage is kept in flight, in order to guarantee progress
+            m_throttled_lineages.push_back(chunk.lineage);
+            m_active_lineages--;
+        } else {
+            queue_lineage(chunk.lineage);
 
-        m_chunk_counter++;
+            // Resume one throttled lineage at a time, to avoid bursts of reads
+            if (!m_throttled_lineages.empty() && !memory_exceeded()) {
+                queue_lineage(m_throttled_lineages.back());
+                m_throttled_lineages.pop_back();
+                m_active_lineages++;
+            }
+        }
     }
+}
+
+
+void scheduler::queue_lineage(chunk_lineage* lineage)
+{
+    scheduler_step* other_step = m_steps.front();
+
+    data_chunk chunk(m_chunk_counter, NULL, lineage);
+    chunk.queued = get_current_time();
+
+    lineage->refs.increment();
+    other_step->push_chunk(chunk);
 
-    // Decrement counters before releasing lock
-    chunk = data_chunk(0);
-    m_live_chunks--;
+    queue_analytical_step(other_step, m_chunk_counter);
+
+    m_chunk_counter++;
 }
 
 
 void scheduler::queue_analytical_step(scheduler_step* step, size_t current)
 {
     if (step->can_run(current)) {
+        __atomic_add_fetch(&m_live_chunks, 1, __ATOMIC_SEQ_CST);
+
+        const double now = get_current_time();
+        __atomic_store(&step->queued_at, &now, __ATOMIC_RELAXED);
+
+        // The step is flagged before being counted, so that workers that see
+        // the updated count also see the step
+        __atomic_store_n(&step->queued, true, __ATOMIC_SEQ_CST);
         if (step->ptr->file_io()) {
-            m_queue_io.push_back(step);
+            __atomic_add_fetch(&m_io_queued, 1, __ATOMIC_SEQ_CST);
         } else {
-            m_queue_calc.push_back(step);
+            __atomic_add_fetch(&m_calc_queued, 1, __ATOMIC_SEQ_CST);
         }
 
-        m_live_chunks++;
-        m_condition.signal();
+        const size_t preferred = __atomic_load_n(&step->worker, __ATOMIC_RELAXED);
+        if (!step->ptr->affinity() || preferred == NO_WORKER) {
+            wake_idle_thread();
+        } else if (preferred != current_worker_id() && !wake_idle_worker(preferred)) {
+            // The preferred worker is busy; wake another worker, which may
+            // take over the step should the preferred worker remain busy
+            wake_idle_thread();
+        }
+    }
+}
+
+
+void scheduler::queue_analytical_task(size_t worker, scheduler_task* task)
+{
+    __atomic_add_fetch(&m_live_chunks, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&task->step->queued_tasks, 1, __ATOMIC_RELAXED);
+    m_task_deques.at(worker)->push(task);
+
+    wake_idle_thread();
+}
+
+
+scheduler_step* scheduler::find_queued_step(size_t worker,
+                                            const pipeline& steps,
+                                            bool& deferred) const
+{
+    scheduler_step* best = NULL;
+    size_t best_depth = 0;
+    for (pipeline::const_iterator it = steps.begin(); it != steps.end(); ++it) {
+        if (__atomic_load_n(&(*it)->queued, __ATOMIC_SEQ_CST)) {
+            if ((*it)->ptr->affinity()) {
+                const size_t preferred = __atomic_load_n(&(*it)->worker, __ATOMIC_RELAXED);
+                if (preferred != NO_WORKER && preferred != worker) {
+                    double queued_at = 0;
+                    __atomic_load(&(*it)->queued_at, &queued_at, __ATOMIC_RELAXED);
+
+                    if (get_current_time() - queued_at < AFFINITY_TIMEOUT) {
+                        // Leave the step for the preferred worker for now
+                        deferred = true;
+                        continue;
+                    }
+                }
+            }
+
+            const size_t depth = (*it)->get_depth();
+            if (!best || depth > best_depth) {
+                best = *it;
+                best_depth = depth;
+            }
+        }
+    }
+
+    return best;
+}
+
+
+scheduler_step* scheduler::claim_queued_step(size_t worker,
+                                             const pipeline& steps,
+                                             int& nqueued,
+                                             bool& deferred)
+{
+    while (__atomic_load_n(&nqueued, __ATOMIC_SEQ_CST) > 0) {
+        scheduler_step* step = find_queued_step(worker, steps, deferred);
+        if (!step) {
+            // Steps were claimed by other threads, are still being queued,
+            // or are left for their preferred workers
+            break;
+        } else if (claim_step(worker, step, nqueued)) {
+            return step;
+        }
+    }
+
+    return NULL;
+}
+
+
+bool scheduler::claim_step(size_t worker, scheduler_step* step, int& nqueued)
+{
+    if (__atomic_exchange_n(&step->queued, false, __ATOMIC_SEQ_CST)) {
+        __atomic_sub_fetch(&nqueued, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&step->worker, worker, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    return false;
+}
+
+
+bool scheduler::io_step_queued() const
+{
+    return __atomic_load_n(&m_io_queued, __ATOMIC_SEQ_CST) > 0;
+}
+
+
+bool scheduler::acquire_io_slot()
+{
+    int active = __atomic_load_n(&m_io_active, __ATOMIC_SEQ_CST);
+    while (active < m_io_max) {
+        if (__atomic_compare_exchange_n(&m_io_active, &active, active + 1, true,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+void scheduler::wake_idle_thread()
+{
+    // Pairs with the fence in 'do_run', following registration as idle
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&m_idle_threads, __ATOMIC_SEQ_CST)) {
+        size_t worker = 0;
+
+        {
+            mutex_locker lock(m_idle_lock);
+            if (m_idle_workers.empty()) {
+                // Another thread got there first
+                return;
+            }
+
+            worker = m_idle_workers.back();
+            m_idle_workers.pop_back();
+            __atomic_sub_fetch(&m_idle_threads, 1, __ATOMIC_SEQ_CST);
+        }
+
+        m_parkers.at(worker)->unpark();
+    }
+}
+
+
+bool scheduler::wake_idle_worker(size_t worker)
+{
+    // Pairs with the fence in 'do_run', following registration as idle
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&m_idle_threads, __ATOMIC_SEQ_CST)) {
+        return false;
+    }
+
+    {
+        mutex_locker lock(m_idle_lock);
+        const worker_vec::iterator it = std::find(m_idle_workers.begin(), m_idle_workers.end(), worker);
+        if (it == m_idle_workers.end()) {
+            return false;
+        }
+
+        m_idle_workers.erase(it);
+        __atomic_sub_fetch(&m_idle_threads, 1, __ATOMIC_SEQ_CST);
+    }
+
+    m_parkers.at(worker)->unpark();
+
+    return true;
+}
+
+
+void scheduler::register_idle_worker(size_t worker)
+{
+    mutex_locker lock(m_idle_lock);
+    m_idle_workers.push_back(worker);
+    __atomic_add_fetch(&m_idle_threads, 1, __ATOMIC_SEQ_CST);
+}
+
+
+void scheduler::unregister_idle_worker(size_t worker)
+{
+    mutex_locker lock(m_idle_lock);
+    const worker_vec::iterator it = std::find(m_idle_workers.begin(), m_idle_workers.end(), worker);
+    if (it != m_idle_workers.end()) {
+        // Not woken by another thread
+        m_idle_workers.erase(it);
+        __atomic_sub_fetch(&m_idle_threads, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+
+void scheduler::add_memory_usage(size_t bytes)
+{
+    const size_t usage = __atomic_add_fetch(&m_memory_usage, bytes, __ATOMIC_RELAXED);
+
+    size_t peak = __atomic_load_n(&m_peak_memory, __ATOMIC_RELAXED);
+    while (usage > peak) {
+        if (__atomic_compare_exchange_n(&m_peak_memory, &peak, usage, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
     }
 }
 
 
+void scheduler::sub_memory_usage(size_t bytes)
+{
+    __atomic_sub_fetch(&m_memory_usage, bytes, __ATOMIC_RELAXED);
+}
+
+
+bool scheduler::memory_exceeded() const
+{
+    return m_max_memory && __atomic_load_n(&m_memory_usage, __ATOMIC_RELAXED) >= m_max_memory;
+}
+
+
 bool scheduler::initialize_threads(int nthreads, unsigned seed)
 {
 #ifdef AR_PTHREAD_SUPPORT
@@ -489,7 +1138,7 @@ bool scheduler::initialize_threads(int nthreads, unsigned seed)
         for (int i = 0; i < nthreads; ++i) {
             m_threads.push_back(pthread_t());
             // Each thread is assigned a unique seed, based on the (user) seed
-            thread_info* info = new thread_info(seed + i, this);
+            thread_info* info = new thread_info(seed + i, i + 1, this);
             switch (pthread_create(&m_threads.back(), NULL, &run_wrapper, info)) {
                 case 0:
                     break;
@@ -523,14 +1172,141 @@ bool scheduler::initialize_threads(int nthreads, unsigned seed)
 }
 
 
+void scheduler::initialize_numa_nodes(int nthreads)
+{
+    const numa_topology topology;
+    if (topology.nodes() < 2) {
+        // Nothing to gain from pinning threads
+        return;
+    }
+
+    for (size_t node = 0; node < topology.nodes(); ++node) {
+        m_node_cpus.push_back(topology.cpus(node));
+    }
+
+    // Consecutive workers are placed on the same node
+    for (int worker = 0; worker < nthreads; ++worker) {
+        m_worker_nodes.at(worker) = (worker * topology.nodes()) / nthreads;
+    }
+
+    m_allowed_cpus = topology.allowed_cpus();
+}
+
+
+void scheduler::pin_worker(size_t worker)
+{
+    if (!m_node_cpus.empty()) {
+        const size_t node = m_worker_nodes.at(worker);
+        if (pin_current_thread(m_node_cpus.at(node))) {
+            set_current_numa_node(node);
+        }
+    }
+}
+
+
+void scheduler::clear_parkers()
+{
+    for (parker_vec::iterator it = m_parkers.begin(); it != m_parkers.end(); ++it) {
+        delete *it;
+    }
+
+    m_parkers.clear();
+}
+
+
+size_t scheduler::clear_task_deques()
+{
+    size_t tasks_left = 0;
+    for (task_deque_vec::iterator it = m_task_deques.begin(); it != m_task_deques.end(); ++it) {
+        scheduler_task* task = NULL;
+        while ((*it)->pop(task)) {
+            delete task->chunk.data;
+            delete task;
+            tasks_left++;
+        }
+
+        delete *it;
+    }
+
+    m_task_deques.clear();
+
+    return tasks_left;
+}
+
+
+void scheduler::clear_lineages()
+{
+    for (lineage_vec::iterator it = m_lineages.begin(); it != m_lineages.end(); ++it) {
+        delete *it;
+    }
+
+    m_lineages.clear();
+    m_throttled_lineages.clear();
+}
+
+
+/** Returns the name of the class implementing a step, without namespace. */
+std::string step_name(const analytical_step& step)
+{
+    const char* mangled = typeid(step).name();
+
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(mangled, NULL, NULL, &status);
+    std::string name = demangled ? demangled : mangled;
+    std::free(demangled);
+
+    const size_t separator = name.rfind("::");
+    if (separator != std::string::npos) {
+        name = name.substr(separator + 2);
+    }
+
+    return name;
+}
+
+
+void scheduler::collect_stats(double wall_time)
+{
+    m_stats = pipeline_stats();
+    m_stats.wall_time = wall_time;
+    m_stats.workers = m_worker_stats;
+
+    for (size_t step_id = 0; step_id < m_steps.size(); ++step_id) {
+        const scheduler_step* step = m_steps.at(step_id);
+        if (!step) {
+            continue;
+        }
+
+        step_stats stats;
+        for (size_t worker = 0; worker < m_step_stats.size(); ++worker) {
+            stats += m_step_stats.at(worker).at(step_id);
+        }
+
+        stats.step_id = step_id;
+        stats.name = step_name(*step->ptr);
+        stats.ordered = step->ptr->get_ordering() == analytical_step::ordered;
+        stats.file_io = step->ptr->file_io();
+
+        m_stats.steps.push_back(stats);
+    }
+
+    if (m_tracing) {
+        m_trace.step_names.resize(m_steps.size());
+        for (step_stats_vec::const_iterator it = m_stats.steps.begin(); it != m_stats.steps.end(); ++it) {
+            m_trace.step_names.at(it->step_id) = it->name;
+        }
+    }
+
+    m_step_stats.clear();
+    m_worker_stats.clear();
+}
+
+
 void scheduler::signal_threads()
 {
-#ifdef AR_PTHREAD_SUPPORT
-    // Signal the main and all other threads
-    for (size_t i = 0; i < m_threads.size() + 1; ++i) {
-        m_condition.signal();
+    // Wake the main and all other threads
+    for (parker_vec::iterator it = m_parkers.begin(); it != m_parkers.end(); ++it) {
+        (*it)->unpark();
     }
-#endif
 }
 
 
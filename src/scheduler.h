@@ -29,13 +29,19 @@
 #include <string>
 #include <vector>
 
+#include "numa.h"
+#include "pipeline_stats.h"
+#include "pipeline_trace.h"
 #include "threads.h"
 
 namespace ar
 {
 
+struct chunk_lineage;
 struct data_chunk;
 struct scheduler_step;
+struct scheduler_task;
+template <typename T> class ws_deque;
 
 
 /**
@@ -61,6 +67,12 @@ public:
 
     /** Destructor; does nothing. */
     virtual ~analytical_chunk();
+
+    /**
+     * Returns the (approximate) number of bytes of data held by the chunk;
+     * used to enforce the memory budget of the scheduler. Defaults to 0.
+     */
+    virtual size_t memory_usage() const;
 };
 
 
@@ -74,6 +86,11 @@ typedef std::vector<chunk_pair> chunk_vec;
  * allows multiple threads to collect summary statistics, while the final
  * consumer sees only a single statistics object.
  *
+ * Each worker (see 'current_worker_id') is assigned its own sink, which is
+ * created on first use and kept until 'finalize' is called, so that getting
+ * and returning sinks does not require locking. Workers with IDs beyond
+ * MAX_SINK_WORKERS share a list of sinks protected by a mutex.
+ *
  * The class T must implement the += operator, to allow the reduction of sinks.
  */
 template <typename T>
@@ -86,7 +103,7 @@ public:
     /** Destructor; deletes any remaining sinks. */
     virtual ~statistics_sink();
 
-    /** Returns unused sink, or a new sink if no unused sinks are available. */
+    /** Returns the sink of the calling worker, creating it if needed. */
     virtual T* get_sink();
 
     /** Return a sink after it has been used. */
@@ -103,17 +120,102 @@ protected:
     virtual T* new_sink() const = 0;
 
 private:
+    //! Not implemented
+    statistics_sink(const statistics_sink&);
+    //! Not implemented
+    statistics_sink& operator=(const statistics_sink&);
+
     typedef std::list<T*> sink_list;
     typedef typename sink_list::iterator sink_list_iter;
-    typedef typename sink_list::const_iterator sink_list_citer;
 
+    //! Number of workers that are assigned their own sinks
+    static const size_t MAX_SINK_WORKERS = 128;
+
+    /** Sink owned by a single worker, padded to avoid false sharing. */
+    struct worker_sink
+    {
+        worker_sink()
+          : sink(NULL)
+          , padding()
+        {
+        }
+
+        //! Sink created by and only used by the owning worker
+        T* sink;
+        //! Avoids false sharing between workers
+        char padding[CACHE_LINE_SIZE - sizeof(T*)];
+    };
+
+    //! Sinks of workers with IDs less than MAX_SINK_WORKERS
+    worker_sink m_worker_sinks[MAX_SINK_WORKERS];
     //! Lock used to control access to sink lists
     mutex m_sinks_lock;
-    //! List of inactive sinks
+    //! List of inactive sinks used by remaining workers
     sink_list m_sinks;
 };
 
 
+/**
+ * Pool of objects of type T, allowing objects (and any storage retained by
+ * T::clear, such as the capacity of vectors) to be re-used across pipeline
+ * cycles, rather than being allocated for every chunk. Objects are cleared
+ * using T::clear when returned to the pool; the class T must therefore
+ * implement 'clear' and a default constructor.
+ *
+ * Objects are pooled per NUMA node (see 'current_numa_node'); objects are
+ * preferably taken from the pool of the calling thread's node, and only then
+ * from the pools of other nodes.
+ */
+template <typename T>
+class object_pool
+{
+public:
+    /** Constructor; does nothing. */
+    object_pool();
+
+    /** Destructor; deletes any pooled objects. */
+    ~object_pool();
+
+    /** Returns a pooled object, or a new object if the pool is empty. */
+    T* acquire();
+
+    /** Clears an object and returns it to the pool; NULL is ignored. */
+    void release(T* ptr);
+
+private:
+    //! Not implemented
+    object_pool(const object_pool&);
+    //! Not implemented
+    object_pool& operator=(const object_pool&);
+
+    typedef std::vector<T*> object_vec;
+
+    /** Objects returned by threads on a single NUMA node. */
+    struct pool_shard
+    {
+        pool_shard()
+          : lock()
+          , objects()
+          , size(0)
+        {
+        }
+
+        //! Lock used to control access to the shard
+        mutex lock;
+        //! Objects available for re-use
+        object_vec objects;
+        //! Number of objects in 'objects'; updated atomically
+        size_t size;
+    };
+
+    /** Takes an object from a shard; returns NULL if the shard is empty. */
+    T* acquire(pool_shard& shard);
+
+    //! Per node pools; threads on nodes beyond MAX_NUMA_POOLS share pools
+    pool_shard m_shards[MAX_NUMA_POOLS];
+};
+
+
 /**
  * Base class for analytical steps in a pipeline.
  *
@@ -138,8 +240,12 @@ public:
      *                   ordered in order to ensure that output order matches
      *                   input order.
      * @param file_io Indicates if the step involves the use of file IO.
+     * @param affinity Indicates that an ordered step keeps large amounts of
+     *                 state between chunks (e.g. compression buffers), and
+     *                 that it should preferably be run by the same worker
+     *                 every time, in order to keep this state in cache.
      */
-    analytical_step(ordering step_order, bool file_io = false);
+    analytical_step(ordering step_order, bool file_io = false, bool affinity = false);
 
     /** Destructor; does nothing in base class. **/
     virtual ~analytical_step();
@@ -148,14 +254,11 @@ public:
     /**
      * Function called by pipeline to generate / process / consume data chunks.
      *
-     * Initially, the first step in the pipeline will recieve NULL; during
-     * subsequent cycles, the pipeline will return the value output from the
-     * last step to the initial step, which may re-use it to avoid allocations;
-     * if this is not done, the chunk must be freed by the first step.
-     *
-     * Best performance is therefore obtained if the chunk contains buffers
-     * for all steps, and these can be re-used across cycles, thereby reducing
-     * the number of (de)allocations that must be performed.
+     * The first step in the pipeline always recieves NULL. To avoid having
+     * to (de)allocate chunks and their buffers for every cycle, chunks may be
+     * taken from and returned to an 'object_pool' shared by the producing and
+     * consuming steps; chunks not returned to a pool must be freed by the
+     * step consuming them.
      *
      * To terminate the pipeline, the first step must cease to return chunks;
      * however, any other step MUST return valid chunks, even if no input data
@@ -174,6 +277,13 @@ public:
      */
     virtual void finalize();
 
+    /**
+     * Returns the (approximate) number of bytes held by the step in between
+     * calls to 'process', e.g. reads cached for later output. Called by the
+     * scheduler following each call to 'process'. Defaults to 0.
+     */
+    virtual size_t memory_usage() const;
+
 
     /** Returns the expected ordering (ordered / unordered) for input data. **/
     ordering get_ordering() const;
@@ -181,11 +291,16 @@ public:
     /** Returns true if the step involves file IO. */
     bool file_io() const;
 
+    /** Returns true if the step should be run by the same worker. */
+    bool affinity() const;
+
 private:
     //! Stores the ordering of data chunks expected by the step
     const ordering m_step_order;
     //! True if the step involves file IO (read and / or writes)
     const bool m_file_io;
+    //! True if the step should preferably be run by the same worker
+    const bool m_affinity;
 };
 
 
@@ -214,12 +329,59 @@ public:
      **/
     void add_step(size_t step_id, analytical_step* step);
 
-    /** Runs the pipeline with n threads; return false on error. */
-    bool run(int nthreads, unsigned seed);
+    /**
+     * Runs the pipeline with n threads; return false on error.
+     *
+     * @param nthreads Total number of threads, including the calling thread.
+     * @param seed Seed used for the per-thread RNG state.
+     * @param nio_threads Max number of threads simultanously running steps
+     *                    involving file IO; each such step is only ever run by
+     *                    a single thread at a time.
+     * @param max_memory Budget for the total size of chunks in flight and of
+     *                   data held by steps (see 'memory_usage'); if exceeded,
+     *                   no new chunks are read until usage drops below the
+     *                   budget, or until no other chunks are in flight. If 0,
+     *                   memory usage is neither limited nor tracked.
+     * @param numa If true, workers are spread across NUMA nodes and pinned
+     *             to the CPUs of their node; idle workers then preferably
+     *             steal tasks from workers on the same node.
+     * @param lookahead Max number of chunks passed to the first step, that
+     *                  have yet to be fully processed by the pipeline; this
+     *                  bounds the number of chunks in flight for each step.
+     *                  If 0, this defaults to 3 chunks per thread.
+     *
+     * Runnable work is prioritized by the depth of the step (the number of
+     * steps from the first step), so that chunks already in flight are
+     * moved towards the end of the pipeline before new chunks are read.
+     */
+    bool run(int nthreads, unsigned seed, int nio_threads = 1,
+             size_t max_memory = 0, bool numa = false, size_t lookahead = 0);
+
+    /** Returns the peak memory usage of the last run; 0 if not tracked. */
+    size_t peak_memory() const;
+
+    /** Returns per-step timings, latencies and queue depths of the last run. */
+    const pipeline_stats& stats() const;
+
+    /**
+     * If enabled, subsequent runs record a timeline of the processing of each
+     * chunk by each step, and of periods where workers are idle; disabled by
+     * default, as the timeline grows with the number of chunks processed.
+     */
+    void enable_tracing(bool enabled);
+
+    /** Returns the timeline of the last run; empty unless tracing is enabled. */
+    const pipeline_trace& trace() const;
 
 private:
-    typedef std::list<scheduler_step*> runables;
     typedef std::vector<scheduler_step*> pipeline;
+    typedef ws_deque<scheduler_task*> task_deque;
+    typedef std::vector<task_deque*> task_deque_vec;
+    typedef std::vector<chunk_lineage*> lineage_vec;
+    typedef std::vector<size_t> worker_node_vec;
+    typedef std::vector<step_stats_vec> worker_step_stats_vec;
+    typedef std::vector<thread_parker*> parker_vec;
+    typedef std::vector<size_t> worker_vec;
 
     //! Not implemented
     scheduler(const scheduler&);
@@ -228,20 +390,92 @@ private:
 
     /** Wrapper function which calls do_run on the provided thread. */
     static void* run_wrapper(void*);
-    /** Work function; invoked by each thread. */
-    void* do_run();
+    /** Work function; invoked by each thread with a unique worker ID. */
+    void* do_run(size_t worker);
 
     /** Initializes n threads, returning false if any errors occured. */
     bool initialize_threads(int nthreads, unsigned seed);
-    /** Sends a number of signals corresponding to the number of threads. */
+    /** Assigns workers to NUMA nodes, if more than one node is available. */
+    void initialize_numa_nodes(int nthreads);
+    /** Pins the calling thread to the CPUs of the worker's NUMA node. */
+    void pin_worker(size_t worker);
+    /** Frees per-worker deques; returns the number of unprocessed tasks. */
+    size_t clear_task_deques();
+    /** Frees the per-worker parking spots. */
+    void clear_parkers();
+    /** Frees chunk lineages used during the last run. */
+    void clear_lineages();
+    /** Merges per-worker statistics into 'm_stats' following a run. */
+    void collect_stats(double wall_time);
+    /** Wakes all workers, whether idle or not yet started. */
     void signal_threads();
     /** Joins all threads, returning false if any errors occured. */
     bool join_threads();
 
-    /** Executes an analytical step. */
-    void execute_analytical_step(scheduler_step* step);
-    /** Attempts to queue an analytical step given a current chunk. */
+    /**
+     * Retrieves the next runnable ordered step or unordered task, preferring
+     * IO steps, then the deepest of the task most recently queued by this
+     * worker and other ordered steps, and finally tasks stolen from other
+     * workers; returns false if none. 'deferred' is set if a step was left
+     * for its preferred worker (see 'analytical_step::affinity').
+     */
+    bool next_analytical_step(size_t worker, scheduler_step*& step,
+                              scheduler_task*& task, bool& deferred);
+    /** Executes an ordered step, or a task for an unordered step. */
+    void execute_analytical_step(size_t worker, scheduler_step* step, scheduler_task* task);
+    /**
+     * Processes a chunk and queues the resulting chunks for downstream steps;
+     * returns true if any chunks were produced. The queue depth is the number
+     * of chunks queued for the step, and is recorded in the statistics.
+     */
+    bool process_chunk(size_t worker, scheduler_step* step,
+                       const data_chunk& chunk, size_t queue_depth);
+    /**
+     * Releases a processed chunk; the first step is re-queued with a new
+     * chunk if this was the last chunk in the lineage of the chunk, unless
+     * the memory budget has been exceeded, in which case the lineage may be
+     * set aside until memory has been freed.
+     */
+    void release_chunk(scheduler_step* step, data_chunk chunk, bool output);
+    /** Queues a new chunk in the lineage for the first step; requires lock. */
+    void queue_lineage(chunk_lineage* lineage);
+    /** Attempts to queue an ordered analytical step given a current chunk. */
     void queue_analytical_step(scheduler_step* step, size_t current);
+    /** Queues a chunk for an unordered step on the worker's own deque. */
+    void queue_analytical_task(size_t worker, scheduler_task* task);
+    /**
+     * Returns the deepest queued step among 'steps' that may be run by the
+     * worker; NULL if none. Steps preferring another worker are skipped
+     * until they have been queued for 'AFFINITY_TIMEOUT' seconds, in which
+     * case 'deferred' is set.
+     */
+    scheduler_step* find_queued_step(size_t worker, const pipeline& steps,
+                                     bool& deferred) const;
+    /** Claims the deepest queued step among 'steps'; NULL if none. */
+    scheduler_step* claim_queued_step(size_t worker, const pipeline& steps,
+                                      int& nqueued, bool& deferred);
+    /** Attempts to claim a queued step; fails if claimed by another thread. */
+    bool claim_step(size_t worker, scheduler_step* step, int& nqueued);
+
+    /** Returns true if a runnable step involving IO is queued. */
+    bool io_step_queued() const;
+    /** Attempts to reserve one of the 'm_io_max' IO slots. */
+    bool acquire_io_slot();
+    /** Wakes a single idle worker, if any, following the queuing of work. */
+    void wake_idle_thread();
+    /** Wakes the given worker if it is idle; returns false otherwise. */
+    bool wake_idle_worker(size_t worker);
+    /** Registers a worker as idle, allowing it to be woken. */
+    void register_idle_worker(size_t worker);
+    /** Unregisters a worker as idle, unless it was already woken. */
+    void unregister_idle_worker(size_t worker);
+
+    /** Adds to the current memory usage, updating the peak usage. */
+    void add_memory_usage(size_t bytes);
+    /** Subtracts from the current memory usage. */
+    void sub_memory_usage(size_t bytes);
+    /** Returns true if the memory budget has been set and exceeded. */
+    bool memory_exceeded() const;
 
     //! Analytical steps
     pipeline m_steps;
@@ -249,8 +483,6 @@ private:
     mutex m_running;
     //! Set to indicate if errors have occured
     volatile bool m_errors;
-    //! Condition used to signal the (potential) availability of work
-    conditional m_condition;
 
     //! Counter used for sequential processing of data
     size_t m_chunk_counter;
@@ -261,16 +493,69 @@ private:
     thread_vector m_threads;
 #endif
 
-    //! Lock used to control access to chunks
-    mutex m_queue_lock;
-    //! Queue used for currently runnable steps involving only calculations
-    runables m_queue_calc;
-    //! Queue used for currently runnable steps involving IO
-    runables m_queue_io;
-    //! Indicates if a thread is doing IO; access control through 'm_queue_lock'
-    bool m_io_active;
-    //! Count of currently live chunks
+    //! Ordered steps involving only calculations
+    pipeline m_calc_steps;
+    //! Number of queued steps in 'm_calc_steps'; updated atomically, and may
+    //! briefly be negative while a step is being queued
+    int m_calc_queued;
+    //! Per-worker deques of tasks for unordered steps; tasks are pushed onto
+    //! and popped from the deque of the worker queuing them, but may be
+    //! stolen by idle workers
+    task_deque_vec m_task_deques;
+    //! Steps involving IO; these are always ordered
+    pipeline m_io_steps;
+    //! Number of queued steps in 'm_io_steps'; see 'm_calc_queued'
+    int m_io_queued;
+    //! Number of threads doing IO; updated atomically
+    int m_io_active;
+    //! Maximum number of threads allowed to simultaneously do IO
+    int m_io_max;
+    //! Number of threads waiting for work; updated atomically, while
+    //! holding 'm_idle_lock', but may be read without holding the lock
+    int m_idle_threads;
+    //! Lock protecting 'm_idle_workers'
+    mutex m_idle_lock;
+    //! Idle workers; the most recently idle worker is woken first, as its
+    //! caches are the most likely to still be warm
+    worker_vec m_idle_workers;
+    //! Per-worker parking spots, used by idle workers waiting for work
+    parker_vec m_parkers;
+    //! Count of currently queued or running steps; updated atomically
     size_t m_live_chunks;
+    //! Lineages of chunks passed to the first step; one per chunk in flight
+    lineage_vec m_lineages;
+    //! NUMA node of each worker; all 0 unless NUMA awareness is enabled
+    worker_node_vec m_worker_nodes;
+    //! CPUs of each NUMA node; empty unless NUMA awareness is enabled
+    node_vec m_node_cpus;
+    //! CPUs on which the process was allowed to run, prior to pinning
+    cpu_vec m_allowed_cpus;
+
+    //! Lineages set aside while the memory budget is exceeded; protected by
+    //! the lock of the first step
+    lineage_vec m_throttled_lineages;
+    //! Number of lineages in flight (not set aside or ended); protected by
+    //! the lock of the first step
+    size_t m_active_lineages;
+
+    //! Memory budget in bytes; 0 if unlimited
+    size_t m_max_memory;
+    //! Bytes used by chunks in flight and by steps; updated atomically
+    size_t m_memory_usage;
+    //! Peak value of 'm_memory_usage'; updated atomically
+    size_t m_peak_memory;
+
+    //! Per-worker statistics for each step, indexed by worker and step ID;
+    //! each worker only updates its own statistics
+    worker_step_stats_vec m_step_stats;
+    //! Per-worker idle time; each worker only updates its own statistics
+    worker_stats_vec m_worker_stats;
+    //! Statistics for the last run, merged from the per-worker statistics
+    pipeline_stats m_stats;
+    //! Set if a timeline of events is to be recorded
+    bool m_tracing;
+    //! Timeline of the last run; each worker only adds to its own events
+    pipeline_trace m_trace;
 };
 
 
@@ -279,7 +564,8 @@ private:
 
 template <typename T>
 statistics_sink<T>::statistics_sink()
-  : m_sinks_lock()
+  : m_worker_sinks()
+  , m_sinks_lock()
   , m_sinks()
 {
 }
@@ -288,6 +574,10 @@ statistics_sink<T>::statistics_sink()
 template <typename T>
 statistics_sink<T>::~statistics_sink()
 {
+    for (size_t i = 0; i < MAX_SINK_WORKERS; ++i) {
+        delete m_worker_sinks[i].sink;
+    }
+
     for (sink_list_iter it = m_sinks.begin(); it != m_sinks.end(); ++it) {
         delete *it;
     }
@@ -297,6 +587,16 @@ statistics_sink<T>::~statistics_sink()
 template <typename T>
 T* statistics_sink<T>::get_sink()
 {
+    const size_t worker = current_worker_id();
+    if (worker < MAX_SINK_WORKERS) {
+        T*& sink = m_worker_sinks[worker].sink;
+        if (!sink) {
+            sink = new_sink();
+        }
+
+        return sink;
+    }
+
     mutex_locker lock(m_sinks_lock);
     if (m_sinks.empty()) {
         return new_sink();
@@ -312,8 +612,11 @@ T* statistics_sink<T>::get_sink()
 template <typename T>
 void statistics_sink<T>::return_sink(T* ptr)
 {
-    mutex_locker lock(m_sinks_lock);
-    m_sinks.push_back(ptr);
+    // Sinks owned by workers are kept in place until finalized
+    if (current_worker_id() >= MAX_SINK_WORKERS) {
+        mutex_locker lock(m_sinks_lock);
+        m_sinks.push_back(ptr);
+    }
 }
 
 
@@ -321,6 +624,13 @@ template <typename T>
 T* statistics_sink<T>::finalize()
 {
     mutex_locker lock(m_sinks_lock);
+    for (size_t i = 0; i < MAX_SINK_WORKERS; ++i) {
+        if (m_worker_sinks[i].sink) {
+            m_sinks.push_back(m_worker_sinks[i].sink);
+            m_worker_sinks[i].sink = NULL;
+        }
+    }
+
     if (m_sinks.empty()) {
         return new_sink();
     }
@@ -338,6 +648,78 @@ T* statistics_sink<T>::finalize()
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'object_pool'
+
+template <typename T>
+object_pool<T>::object_pool()
+  : m_shards()
+{
+}
+
+
+template <typename T>
+object_pool<T>::~object_pool()
+{
+    for (size_t i = 0; i < MAX_NUMA_POOLS; ++i) {
+        object_vec& objects = m_shards[i].objects;
+        for (typename object_vec::iterator it = objects.begin(); it != objects.end(); ++it) {
+            delete *it;
+        }
+    }
+}
+
+
+template <typename T>
+T* object_pool<T>::acquire()
+{
+    const size_t node = current_numa_node();
+    for (size_t i = 0; i < MAX_NUMA_POOLS; ++i) {
+        T* ptr = acquire(m_shards[(node + i) % MAX_NUMA_POOLS]);
+        if (ptr) {
+            return ptr;
+        }
+    }
+
+    return new T();
+}
+
+
+template <typename T>
+void object_pool<T>::release(T* ptr)
+{
+    if (ptr) {
+        ptr->clear();
+
+        pool_shard& shard = m_shards[current_numa_node() % MAX_NUMA_POOLS];
+        mutex_locker lock(shard.lock);
+        shard.objects.push_back(ptr);
+        __atomic_add_fetch(&shard.size, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+template <typename T>
+T* object_pool<T>::acquire(pool_shard& shard)
+{
+    // Avoid taking locks for (typically) empty pools of other nodes
+    if (!__atomic_load_n(&shard.size, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    mutex_locker lock(shard.lock);
+    if (shard.objects.empty()) {
+        return NULL;
+    }
+
+    T* ptr = shard.objects.back();
+    shard.objects.pop_back();
+    __atomic_sub_fetch(&shard.size, 1, __ATOMIC_RELAXED);
+
+    return ptr;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // Implementations for 'analytical_step'
 
@@ -357,6 +739,18 @@ inline bool analytical_step::file_io() const
     return m_file_io;
 }
 
+
+inline bool analytical_step::affinity() const
+{
+    return m_affinity;
+}
+
+
+inline size_t analytical_step::memory_usage() const
+{
+    return 0;
+}
+
 } // namespace ar
 
 #endif
@@ -28,6 +28,8 @@
 #include <cstdlib>
 #include <vector>
 
+#include "commontypes.h"
+#include "threads.h"
 #include "vecutils.h"
 
 namespace ar
@@ -51,6 +53,7 @@ struct statistics
       , discard2(0)
       , records(0)
       , read_lengths()
+      , padding()
     {
     }
 
@@ -85,15 +88,22 @@ struct statistics
 
     /** Increment the number of reads with of a given type / length. */
     void inc_length_count(read_type type, size_t length) {
-        if (length >= read_lengths.size()) {
-            read_lengths.resize(length + 1, std::vector<size_t>(rt_max));
+        const size_t idx = length * rt_max + static_cast<size_t>(type);
+        if (idx >= read_lengths.size()) {
+            read_lengths.resize((length + 1) * rt_max);
         }
 
-        ++read_lengths.at(length).at(static_cast<size_t>(type));
+        ++read_lengths[idx];
     }
 
-    //! Per read-type length distributions of reads
-    std::vector<std::vector<size_t> > read_lengths;
+    /** Returns the number of lengths for which reads have been counted. */
+    size_t max_length() const {
+        return read_lengths.size() / rt_max;
+    }
+
+    //! Per read-type length distributions of reads; counts for reads of type
+    //! T and length L are found at index L * rt_max + T
+    std::vector<size_t> read_lengths;
 
     /** Combine statistics objects, e.g. those used by different threads. */
     statistics& operator+=(const statistics& other) {
@@ -113,10 +123,13 @@ struct statistics
         records += other.records;
 
         merge_vectors(number_of_reads_with_adapter, other.number_of_reads_with_adapter);
-        merge_sub_vectors(read_lengths, other.read_lengths);
+        merge_vectors(read_lengths, other.read_lengths);
 
         return *this;
     }
+
+    //! Prevents false sharing between statistics used by different threads
+    char padding[CACHE_LINE_SIZE];
 };
 
 
@@ -21,6 +21,9 @@
  * You should have received a copy of the GNU General Public License     *
  * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
 \*************************************************************************/
+#include <limits>
+#include <stdexcept>
+
 #include "strutils.h"
 
 namespace ar
@@ -41,6 +44,74 @@ std::string toupper(const std::string& str)
 }
 
 
+size_t parse_size(const std::string& value)
+{
+    const std::string uppercase_value = toupper(value);
+
+    size_t result = 0;
+    size_t pos = 0;
+    for (; pos < uppercase_value.length(); ++pos) {
+        const char current = uppercase_value.at(pos);
+        if (current < '0' || current > '9') {
+            break;
+        }
+
+        const size_t digit = current - '0';
+        if (result > (std::numeric_limits<size_t>::max() - digit) / 10) {
+            throw std::invalid_argument("size too large: '" + value + "'");
+        }
+
+        result = result * 10 + digit;
+    }
+
+    if (!pos) {
+        throw std::invalid_argument("invalid size: '" + value + "'");
+    }
+
+    std::string suffix = uppercase_value.substr(pos);
+    if (suffix.length() == 2 && suffix.at(1) == 'B') {
+        suffix.resize(1);
+    }
+
+    size_t shift = 0;
+    if (suffix == "" || suffix == "B") {
+        shift = 0;
+    } else if (suffix == "K") {
+        shift = 10;
+    } else if (suffix == "M") {
+        shift = 20;
+    } else if (suffix == "G") {
+        shift = 30;
+    } else if (suffix == "T") {
+        shift = 40;
+    } else {
+        throw std::invalid_argument("invalid size: '" + value + "'");
+    }
+
+    if (shift >= static_cast<size_t>(std::numeric_limits<size_t>::digits)
+        || result > (std::numeric_limits<size_t>::max() >> shift)) {
+        throw std::invalid_argument("size too large: '" + value + "'");
+    }
+
+    return result << shift;
+}
+
+
+std::string json_string(const std::string& value)
+{
+    std::string result = "\"";
+    for (std::string::const_iterator it = value.begin(); it != value.end(); ++it) {
+        if (*it == '"' || *it == '\\') {
+            result.push_back('\\');
+        }
+
+        result.push_back(*it);
+    }
+
+    return result + "\"";
+}
+
+
 std::string indent_lines(const std::string& lines, size_t n_indent)
 {
     std::string line;
@@ -39,6 +39,19 @@ const size_t DEFAULT_INDENTATION = 4;
 std::string toupper(const std::string& str);
 
 
+/**
+ * Parses a size in bytes, optionally followed by one of the (case-insensitive)
+ * suffixes K, M, G, or T, representing powers of 1024; a trailing 'B' is
+ * allowed (e.g. "512MB"). Throws std::invalid_argument on invalid or
+ * overflowing values.
+ */
+size_t parse_size(const std::string& value);
+
+
+/** Returns the string quoted, with quotes and backslashes escaped, for JSON. */
+std::string json_string(const std::string& value);
+
+
 /** Split text by newlines and add fixed identation following newlines. */
 std::string indent_lines(const std::string& lines, size_t identation = DEFAULT_INDENTATION);
 
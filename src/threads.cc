@@ -22,6 +22,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
 \*************************************************************************/
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdlib>
 #include <iostream>
@@ -30,6 +31,12 @@
 #include <unistd.h>
 
 #include "threads.h"
+#include "timer.h"
+
+#ifdef AR_FUTEX_SUPPORT
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #include <ctime>
 
@@ -126,58 +133,130 @@ mutex::~mutex()
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// conditional
+// thread_parker
 
-conditional::conditional()
-#ifdef AR_PTHREAD_SUPPORT
-  : m_mutex()
+//! Initial number of spins before a parked thread is blocked
+const unsigned PARK_INITIAL_SPINS = 256;
+//! Upper bound on the number of spins before a parked thread is blocked
+const unsigned PARK_MAX_SPINS = 16 * 1024;
+//! Lower bound on the number of spins, once spinning has been enabled
+const unsigned PARK_MIN_SPINS = 16;
+
+
+/** Hints to the CPU that the calling thread is spinning. */
+void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+
+/** Returns true if the process may run on more than one CPU. */
+bool multiple_cpus()
+{
+    return sysconf(_SC_NPROCESSORS_ONLN) > 1;
+}
+
+
+/** Converts a time or duration in seconds to a timespec. */
+struct timespec to_timespec(double seconds)
+{
+    struct timespec result;
+    result.tv_sec = static_cast<time_t>(seconds);
+    result.tv_nsec = static_cast<long>((seconds - result.tv_sec) * 1e9);
+
+    return result;
+}
+
+
+#ifdef AR_FUTEX_SUPPORT
+/**
+ * Blocks while the value at 'addr' equals 'value', or until woken; if
+ * 'timeout' is not NULL, blocks for at most that long. Returns false if the
+ * timeout expired.
+ */
+bool futex_wait(int* addr, int value, const struct timespec* timeout = NULL)
+{
+    if (syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0) == -1) {
+        if (errno == ETIMEDOUT) {
+            return false;
+        } else if (errno != EAGAIN && errno != EINTR) {
+            throw thread_error("thread_parker::park: error waiting on futex");
+        }
+    }
+
+    return true;
+}
+
+
+/** Wakes up to 'count' threads blocked on 'addr'. */
+void futex_wake(int* addr, int count)
+{
+    if (syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0) == -1) {
+        throw thread_error("thread_parker::unpark: error waking futex");
+    }
+}
+#endif
+
+
+thread_parker::thread_parker()
+  : m_state(0)
+  , m_spins(0)
+  , m_max_spins(multiple_cpus() ? PARK_MAX_SPINS : 0)
+#if defined(AR_PTHREAD_SUPPORT) && !defined(AR_FUTEX_SUPPORT)
+  , m_mutex()
   , m_cond()
-  , m_count(0)
 {
     switch (pthread_cond_init(&m_cond, NULL)) {
         case 0:
             break;
 
         case EAGAIN:
-            throw thread_error("conditional::conditional: insufficient resouces to init conditional");
+            throw thread_error("thread_parker::thread_parker: insufficient resouces to init conditional");
 
         case ENOMEM:
-            throw thread_error("conditional::conditional: insufficient memory to init conditional");
+            throw thread_error("thread_parker::thread_parker: insufficient memory to init conditional");
 
         case EBUSY:
-            throw thread_error("conditional::conditional: conditional already initialized");
+            throw thread_error("thread_parker::thread_parker: conditional already initialized");
 
         case EINVAL:
-            throw thread_error("conditional::conditional: invalid attributes");
+            throw thread_error("thread_parker::thread_parker: invalid attributes");
 
         default:
-            throw thread_error("Unknown error in conditional::conditional");
+            throw thread_error("Unknown error in thread_parker::thread_parker");
     }
+
+    m_spins = std::min(PARK_INITIAL_SPINS, m_max_spins);
 }
 #else
 {
+    m_spins = std::min(PARK_INITIAL_SPINS, m_max_spins);
 }
 #endif
 
 
-conditional::~conditional()
+thread_parker::~thread_parker()
 {
-#ifdef AR_PTHREAD_SUPPORT
+#if defined(AR_PTHREAD_SUPPORT) && !defined(AR_FUTEX_SUPPORT)
     const int error = pthread_cond_destroy(&m_cond);
     if (error) {
         print_locker lock;
 
         switch (error) {
             case EBUSY:
-                std::cerr << "conditional::~conditional: conditional busy" << std::endl;
+                std::cerr << "thread_parker::~thread_parker: conditional busy" << std::endl;
                 break;
 
             case EINVAL:
-                std::cerr << "conditional::~conditional: invalid conditional" << std::endl;
+                std::cerr << "thread_parker::~thread_parker: invalid conditional" << std::endl;
                 break;
 
             default:
-                std::cerr << "Unknown error in conditional::~conditional: " << error << std::endl;
+                std::cerr << "Unknown error in thread_parker::~thread_parker: " << error << std::endl;
                 break;
         }
 
@@ -187,50 +266,122 @@ conditional::~conditional()
 }
 
 
-void conditional::wait()
+bool thread_parker::park(double timeout)
 {
 #ifdef AR_PTHREAD_SUPPORT
+    // Spin briefly, since work is often queued shortly after parking
+    for (unsigned i = 0; i < m_spins; ++i) {
+        if (__atomic_load_n(&m_state, __ATOMIC_RELAXED) == 1) {
+            __atomic_store_n(&m_state, 0, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            // Spinning paid off; allow longer spins
+            m_spins = std::min(m_spins * 2, m_max_spins);
+            return true;
+        }
+
+        cpu_relax();
+    }
+
+    // Spinning did not pay off; shorten future spins
+    if (m_max_spins) {
+        m_spins = std::max(m_spins / 2, PARK_MIN_SPINS);
+    }
+
+    const double deadline = timeout > 0.0 ? get_current_time() + timeout : 0.0;
+
+#ifdef AR_FUTEX_SUPPORT
+    int state = 0;
+    if (__atomic_compare_exchange_n(&m_state, &state, -1, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        do {
+            if (timeout > 0.0) {
+                const double remaining = deadline - get_current_time();
+                if (remaining <= 0.0) {
+                    // Timed out, unless unparked in the mean time
+                    state = -1;
+                    if (__atomic_compare_exchange_n(&m_state, &state, 0, false,
+                                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                        return false;
+                    }
+
+                    break;
+                }
+
+                const struct timespec duration = to_timespec(remaining);
+                futex_wait(&m_state, -1, &duration);
+            } else {
+                futex_wait(&m_state, -1);
+            }
+        } while (__atomic_load_n(&m_state, __ATOMIC_ACQUIRE) == -1);
+    }
+
+    // Consume the wake-up
+    __atomic_store_n(&m_state, 0, __ATOMIC_RELAXED);
+#else
+    const struct timespec abs_deadline = to_timespec(deadline);
     mutex_locker lock(m_mutex);
 
-    while (!m_count) {
-        switch (pthread_cond_wait(&m_cond, &m_mutex.m_mutex)) {
+    while (__atomic_load_n(&m_state, __ATOMIC_ACQUIRE) != 1) {
+        const int error = (timeout > 0.0)
+            ? pthread_cond_timedwait(&m_cond, &m_mutex.m_mutex, &abs_deadline)
+            : pthread_cond_wait(&m_cond, &m_mutex.m_mutex);
+
+        switch (error) {
             case 0:
                 break;
 
+            case ETIMEDOUT:
+                if (__atomic_load_n(&m_state, __ATOMIC_ACQUIRE) != 1) {
+                    return false;
+                }
+
+                break;
+
             case EINVAL:
-                throw thread_error("conditional::wait: invalid conditional or mutex");
+                throw thread_error("thread_parker::park: invalid conditional or mutex");
 
             case EPERM:
-                throw thread_error("conditional::wait: mutex not owned by thread");
+                throw thread_error("thread_parker::park: mutex not owned by thread");
 
             default:
-                throw thread_error("Unknown error in conditional::wait");
+                throw thread_error("Unknown error in thread_parker::park");
         }
     }
 
-    --m_count;
+    __atomic_store_n(&m_state, 0, __ATOMIC_RELAXED);
+#endif
+#else
+    (void)timeout;
 #endif
+
+    return true;
 }
 
 
-void conditional::signal()
+void thread_parker::unpark()
 {
 #ifdef AR_PTHREAD_SUPPORT
+#ifdef AR_FUTEX_SUPPORT
+    if (__atomic_exchange_n(&m_state, 1, __ATOMIC_ACQ_REL) == -1) {
+        futex_wake(&m_state, 1);
+    }
+#else
     mutex_locker lock(m_mutex);
-
-    ++m_count;
+    __atomic_store_n(&m_state, 1, __ATOMIC_RELEASE);
 
     switch (pthread_cond_signal(&m_cond)) {
         case 0:
             break;
 
         case EINVAL:
-            throw thread_error("conditional::signal: invalid conditional");
+            throw thread_error("thread_parker::unpark: invalid conditional");
 
         default:
-            throw thread_error("Unknown error in conditional::signal");
+            throw thread_error("Unknown error in thread_parker::unpark");
     }
 #endif
+#endif
 }
 
 
@@ -318,33 +469,45 @@ print_locker::~print_locker()
 // atomic_counter
 
 atomic_counter::atomic_counter(size_t init)
-  : m_lock()
-  , m_count(init)
+  : m_count(init)
 {
 }
 
 
 size_t atomic_counter::current() const
 {
-    mutex_locker locker(m_lock);
-
-    return m_count;
+    return __atomic_load_n(&m_count, __ATOMIC_ACQUIRE);
 }
 
 
 size_t atomic_counter::increment()
 {
-    mutex_locker locker(m_lock);
-
-    return ++m_count;
+    return __atomic_add_fetch(&m_count, 1, __ATOMIC_RELAXED);
 }
 
 
 size_t atomic_counter::decrement()
 {
-    mutex_locker locker(m_lock);
+    return __atomic_sub_fetch(&m_count, 1, __ATOMIC_ACQ_REL);
+}
 
-    return --m_count;
+
+///////////////////////////////////////////////////////////////////////////////
+// worker IDs
+
+//! ID of the worker running on the current thread
+static __thread size_t s_current_worker = 0;
+
+
+size_t current_worker_id()
+{
+    return s_current_worker;
+}
+
+
+void set_current_worker_id(size_t worker)
+{
+    s_current_worker = worker;
 }
 
 } // namespace ar
@@ -28,11 +28,20 @@
 
 #ifdef AR_PTHREAD_SUPPORT
 #include <pthread.h>
+
+#ifdef __linux__
+//! Threads are parked using futexes, rather than conditional variables
+#define AR_FUTEX_SUPPORT
+#endif
 #endif
 
 namespace ar
 {
 
+//! Assumed size of cache-lines; used to avoid false sharing
+const size_t CACHE_LINE_SIZE = 64;
+
+
 /**
  * Exception thrown for threading related errors, including errors with
  * threads, mutexes, and conditionals.
@@ -74,7 +83,7 @@ private:
     mutex& operator=(const mutex&);
 
     friend class mutex_locker;
-    friend class conditional;
+    friend class thread_parker;
 
 #ifdef AR_PTHREAD_SUPPORT
     pthread_mutex_t m_mutex;
@@ -83,33 +92,53 @@ private:
 
 
 /**
- * Simple conditional.
- *
+ * Parking spot for a single thread, which blocks in 'park' until another
+ * thread calls 'unpark'. An 'unpark' preceding a call to 'park' is remembered,
+ * and causes that call to return immediately, so wake-ups cannot be lost.
  *
+ * Since the thread is often unparked shortly after parking, the parked thread
+ * first spins for a short period; the duration of this period adapts to how
+ * often spinning succeeds, and spinning is disabled on single-CPU systems.
+ * The thread is then blocked using a futex on Linux, and a conditional
+ * variable on other systems.
  */
-class conditional
+class thread_parker
 {
 public:
-    /** Constructor; initializes conditional. */
-    conditional();
-    /** Destructor; destroys conditional, exits on error. */
-    ~conditional();
-
-    /** Wait for and consume signal; non-blocking if signals are queued. */
-    void wait();
+    /** Constructor; the parker is initially not unparked. */
+    thread_parker();
+    /** Destructor; exits on error. */
+    ~thread_parker();
 
-    /** Signal a waiting thread, or queue signal if no threads are waiting. */
-    void signal();
+    /**
+     * Blocks until unparked; must only be called by the owning thread. If
+     * 'timeout' is greater than zero, the thread is blocked for at most that
+     * many seconds. Returns false if the timeout expired, true otherwise.
+     */
+    bool park(double timeout = 0.0);
 
+    /** Wakes the owning thread; may be called by any thread. */
+    void unpark();
 
-#ifdef AR_PTHREAD_SUPPORT
 private:
-    //! Mutex assosiated with conditional; not exposed.
+    //! Not implemented
+    thread_parker(const thread_parker&);
+    //! Not implemented
+    thread_parker& operator=(const thread_parker&);
+
+    //! Parking state: 1 if unparked, -1 if the owner is (about to be)
+    //! blocked, and 0 otherwise; only accessed using atomic instructions
+    int m_state;
+    //! Current number of spins before blocking
+    unsigned m_spins;
+    //! Maximum number of spins before blocking; 0 on single-CPU systems
+    unsigned m_max_spins;
+
+#if defined(AR_PTHREAD_SUPPORT) && !defined(AR_FUTEX_SUPPORT)
+    //! Mutex protecting blocking / waking of the owner; not exposed.
     mutex m_mutex;
     //! Raw conditional; not exposed.
     pthread_cond_t m_cond;
-    //! Number of queued signals.
-    volatile unsigned m_count;
 #endif
 };
 
@@ -161,7 +190,11 @@ private:
 
 
 /**
- * Basic atomic counter.
+ * Basic atomic counter, using atomic instructions.
+ *
+ * Increments are relaxed, while decrements have acquire / release semantics,
+ * so that the thread observing a count of zero sees all writes made by other
+ * threads before they decremented the counter.
  */
 class atomic_counter
 {
@@ -179,12 +212,17 @@ public:
     size_t decrement();
 
 private:
-    //! Mutex used to control access to the counter/
-    mutable mutex m_lock;
-    //! Raw counter value; access controlled using m_lock;
+    //! Raw counter value; only accessed using atomic instructions
     size_t m_count;
 };
 
+
+/** Returns the ID of the worker running the calling thread; 0 by default. */
+size_t current_worker_id();
+
+/** Sets the worker ID of the calling thread; used to select per-worker data. */
+void set_current_worker_id(size_t worker);
+
 } // namespace ar
 
 #endif
@@ -28,6 +28,7 @@
 #include <iomanip>
 #include <algorithm>
 #include <sys/time.h>
+#include <time.h>
 
 #include "timer.h"
 #include "threads.h"
@@ -50,6 +51,17 @@ double get_current_time()
 }
 
 
+double get_thread_cpu_time()
+{
+    struct timespec timestamp;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &timestamp)) {
+        return 0.0;
+    }
+
+    return timestamp.tv_sec + timestamp.tv_nsec / 1e9;
+}
+
+
 std::string thousands_sep(size_t number)
 {
     if (!number) {
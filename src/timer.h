@@ -31,6 +31,13 @@
 namespace ar
 {
 
+/** Returns the current (wall-clock) time in seconds. */
+double get_current_time();
+
+/** Returns the CPU time (in seconds) used by the calling thread; 0 on error. */
+double get_thread_cpu_time();
+
+
 /**
  * Simply class for reporting current progress of a run.
  *
@@ -29,10 +29,13 @@
 #include <stdexcept>
 #include <sys/time.h>
 #include <limits>
+#include <sstream>
+#include <algorithm>
 
 #include "userconfig.h"
 #include "fastq.h"
 #include "alignment.h"
+#include "numa.h"
 #include "strutils.h"
 
 namespace ar
@@ -70,6 +73,24 @@ std::auto_ptr<fastq_encoding> select_encoding(const std::string& name,
 }
 
 
+/** Parses a positive or zero number of threads; returns false on failure. */
+bool parse_thread_count(const std::string& value, unsigned& count)
+{
+    std::istringstream stream(value);
+    long temp = 0;
+    std::string trailing;
+
+    if (!(stream >> temp) || (stream >> trailing)) {
+        return false;
+    } else if (temp < 0 || temp > static_cast<long>(std::numeric_limits<unsigned>::max())) {
+        return false;
+    }
+
+    count = static_cast<unsigned>(temp);
+    return true;
+}
+
+
 userconfig::userconfig(const std::string& name,
                        const std::string& version,
                        const std::string& help)
@@ -79,6 +100,8 @@ userconfig::userconfig(const std::string& name,
     , input_file_2()
     , paired_ended_mode(false)
     , interleaved_input(false)
+    , sam_input(false)
+    , bam_input(false)
     , interleaved_output(false)
     , mate_separator(MATE_SEPARATOR)
     , min_genomic_length(15)
@@ -97,8 +120,18 @@ userconfig::userconfig(const std::string& name,
     , seed(get_seed())
     , identify_adapters(false)
     , max_threads(1)
+    , max_io_threads(2)
+    , auto_threads(false)
+    , numa(false)
+    , max_memory(0)
+    , lookahead(0)
+    , pipeline_stats()
+    , trace()
     , gzip(false)
     , gzip_level(6)
+    , checksums(false)
+    , checksums_md5(false)
+    , bam_output(false)
     , bzip2(false)
     , bzip2_level(9)
     , barcode_mm(0)
@@ -114,14 +147,19 @@ userconfig::userconfig(const std::string& name,
     , quality_max(MAX_PHRED_SCORE_DEFAULT)
     , mate_separator_str(1, MATE_SEPARATOR)
     , interleaved(false)
+    , input_format("fastq")
+    , output_format("fastq")
+    , max_memory_str()
+    , max_threads_str("1")
 {
     argparser["--file1"] =
         new argparse::any(&input_file_1, "FILE",
-            "Input file containing mate 1 reads or single-ended reads "
-            "[REQUIRED].");
+            "Input file containing mate 1 reads or single-ended reads; "
+            "use '-' to read from STDIN [REQUIRED].");
     argparser["--file2"] =
         new argparse::any(&input_file_2, "FILE",
-            "Input file containing mate 2 reads [OPTIONAL].");
+            "Input file containing mate 2 reads; use '-' to read from STDIN "
+            "[OPTIONAL].");
 
     argparser.add_header("FASTQ OPTIONS:");
     argparser["--qualitybase"] =
@@ -144,6 +182,13 @@ userconfig::userconfig(const std::string& name,
         new argparse::any(&mate_separator_str, "CHAR",
             "Character separating the mate number (1 or 2) from the read name "
             "in FASTQ records [default: '%default'].");
+    argparser["--input-format"] =
+        new argparse::any(&input_format, "FORMAT",
+            "Format of input files; either 'fastq', 'sam', or 'bam'. SAM and "
+            "BAM files must contain unaligned reads, and are always expected "
+            "to use Phred+33 encoded quality scores; paired reads must be "
+            "read using --interleaved-input, with mates following each other "
+            "[current: %default].");
 
     argparser["--interleaved"] =
         new argparse::flag(&interleaved,
@@ -204,6 +249,24 @@ userconfig::userconfig(const std::string& name,
         new argparse::any(NULL, "FILE",
             "Contains reads discarded due to the --minlength, --maxlength or "
             "--maxns options [default: BASENAME.discarded]");
+    argparser["--checksums"] =
+        new argparse::flag(&checksums,
+            "Calculate CRC32C checksums of output files while they are being "
+            "written, and save these to FILE.checksums for each output "
+            "FILE [current: %default]");
+    argparser["--checksums-md5"] =
+        new argparse::flag(&checksums_md5,
+            "As --checksums, but MD5 checksums are calculated as well, and "
+            "saved to FILE.md5 in the format used by md5sum; these may be "
+            "verified using 'md5sum -c' [current: %default]");
+#ifdef AR_GZIP_SUPPORT
+    argparser["--output-format"] =
+        new argparse::any(&output_format, "FORMAT",
+            "Format of output files; either 'fastq' or 'bam'. BAM files "
+            "contain unaligned reads with raw Phred scores, are BGZF "
+            "compressed using --gzip-level, and are given the extension "
+            "'.bam' [current: %default]");
+#endif
 
 
 #if defined(AR_GZIP_SUPPORT) || defined(AR_BZIP2_SUPPORT)
@@ -352,9 +415,50 @@ userconfig::userconfig(const std::string& name,
 
 #ifdef AR_PTHREAD_SUPPORT
     argparser["--threads"] =
-        new argparse::knob(&max_threads, "THREADS",
-            "Maximum number of threads [current: %default]");
+        new argparse::any(&max_threads_str, "THREADS",
+            "Maximum number of threads, or 'auto' to use one thread per CPU "
+            "available to the process, taking CPU affinity and cgroup CPU "
+            "quotas into account [current: %default]");
+    argparser["--io-threads"] =
+        new argparse::knob(&max_io_threads, "THREADS",
+            "Maximum number of threads simultaneously reading or writing "
+            "files; each file is accessed by at most one thread at a time, "
+            "and writing of output files takes priority over reading "
+            "[current: %default]");
+    argparser["--numa"] =
+        new argparse::flag(&numa,
+            "Spread threads across NUMA nodes, pinning each thread to the "
+            "CPUs of a single node, and preferably process reads on the node "
+            "where they were read; has no effect on systems with a single "
+            "NUMA node [current: %default].");
 #endif
+    argparser["--max-memory"] =
+        new argparse::any(&max_memory_str, "SIZE",
+            "Approximate upper bound on the memory used for reads being "
+            "processed or cached, e.g. '512M' or '4G'; once exceeded, no "
+            "further reads are read until memory has been freed. The peak "
+            "usage is recorded in the settings file [default: no limit].");
+    argparser["--lookahead"] =
+        new argparse::knob(&lookahead, "N",
+            "Maximum number of chunks of reads being processed at any one "
+            "time; lower values reduce memory usage and the time from reads "
+            "being read until they are written, but may leave threads idle "
+            "[default: 3 chunks per thread].");
+    argparser["--pipeline-stats"] =
+        new argparse::any(&pipeline_stats, "FILE",
+            "Print a table of the time spent by each step of the pipeline, "
+            "the latency and queue depth of chunks of reads, and the time "
+            "threads spent idle, and write these statistics to FILE in JSON "
+            "format [default: not written].");
+    argparser["--trace"] =
+        new argparse::any(&trace, "FILE",
+            "Record when each step of the pipeline processed each chunk of "
+            "reads, and when threads were idle, and write this timeline to "
+            "FILE in the Chrome trace-event JSON format, for viewing in e.g. "
+            "chrome://tracing or Perfetto. The timeline is kept in memory "
+            "until the run ends and grows with the length of the run, by "
+            "roughly 40 bytes for each chunk processed by each step; this "
+            "memory is not limited by --max-memory [default: not written].");
 }
 
 
@@ -431,11 +535,68 @@ argparse::parse_result userconfig::parse_args(int argc, char *argv[])
     } else if (file_2_set) {
         paired_ended_mode = true;
         min_adapter_overlap = 0;
+
+        if (input_file_1 == "-" && input_file_2 == "-") {
+            std::cerr << "Error: STDIN ('-') cannot be used for both --file1 "
+                      << "and --file2; use --interleaved-input to read both "
+                      << "mates from STDIN." << std::endl;
+
+            return argparse::pr_error;
+        }
+    }
+
+    {
+        const char* output_keys[] = {"--output1", "--output2", "--singleton",
+                                     "--outputcollapsed",
+                                     "--outputcollapsedtruncated",
+                                     "--discarded"};
+
+        size_t stdout_count = 0;
+        for (size_t i = 0; i < sizeof(output_keys) / sizeof(char*); ++i) {
+            if (argparser.is_set(output_keys[i])
+                    && argparser.at(output_keys[i])->to_str() == "-") {
+                stdout_count++;
+            }
+        }
+
+        if (stdout_count > 1) {
+            std::cerr << "Error: At most one output file may be written to "
+                      << "STDOUT ('-'); use --interleaved-output to write both "
+                      << "mates to a single file." << std::endl;
+
+            return argparse::pr_error;
+        }
     }
 
     interleaved_input |= interleaved;
     interleaved_output |= interleaved;
 
+    const std::string uppercase_input_format = toupper(input_format);
+    if (uppercase_input_format == "SAM") {
+        sam_input = true;
+    } else if (uppercase_input_format == "BAM") {
+#ifdef AR_GZIP_SUPPORT
+        bam_input = true;
+#else
+        std::cerr << "Error: Reading BAM files requires gzip support; please "
+                  << "re-compile AdapterRemoval with gzip support."
+                  << std::endl;
+        return argparse::pr_error;
+#endif
+    } else if (uppercase_input_format != "FASTQ") {
+        std::cerr << "Error: Invalid value for --input-format: '"
+                  << input_format << "'\n"
+                  << "   expected values fastq, sam, or bam." << std::endl;
+        return argparse::pr_error;
+    }
+
+    if ((sam_input || bam_input) && file_2_set) {
+        std::cerr << "Error: --file2 cannot be used with --input-format "
+                  << input_format << "; paired reads must be read from a "
+                  << "single file using --interleaved-input." << std::endl;
+        return argparse::pr_error;
+    }
+
     if (interleaved_input) {
         if (file_2_set) {
             std::cerr << "Error: The option --interleaved cannot be used "
@@ -495,9 +656,56 @@ argparse::parse_result userconfig::parse_args(int argc, char *argv[])
     }
 #endif
 
+    const std::string uppercase_format = toupper(output_format);
+    if (uppercase_format == "BAM") {
+        bam_output = true;
+
+        if (gzip || bzip2) {
+            std::cerr << "Error: --gzip and --bzip2 cannot be used with "
+                      << "--output-format bam; BAM files are always "
+                      << "compressed." << std::endl;
+            return argparse::pr_error;
+        }
+    } else if (uppercase_format != "FASTQ") {
+        std::cerr << "Error: Invalid value for --output-format: '"
+                  << output_format << "'\n"
+                  << "   expected values fastq or bam." << std::endl;
+        return argparse::pr_error;
+    }
+
+    // MD5 checksums are written in addition to CRC32C checksums
+    checksums = checksums || checksums_md5;
+
+    if (toupper(max_threads_str) == "AUTO") {
+        select_thread_counts(argparser.is_set("--io-threads"));
+    } else if (!parse_thread_count(max_threads_str, max_threads)) {
+        std::cerr << "Error: Invalid value for --threads: '"
+                  << max_threads_str << "'; expected a number or 'auto'."
+                  << std::endl;
+        return argparse::pr_error;
+    }
+
     if (!max_threads) {
         std::cerr << "Error: --threads must be at least 1!" << std::endl;
         return argparse::pr_error;
+    } else if (!max_io_threads) {
+        std::cerr << "Error: --io-threads must be at least 1!" << std::endl;
+        return argparse::pr_error;
+    }
+
+    if (argparser.is_set("--max-memory")) {
+        try {
+            max_memory = parse_size(max_memory_str);
+        } catch (const std::invalid_argument& error) {
+            std::cerr << "Error: Invalid value for --max-memory: "
+                      << error.what() << std::endl;
+            return argparse::pr_error;
+        }
+
+        if (!max_memory) {
+            std::cerr << "Error: --max-memory must be greater than 0!" << std::endl;
+            return argparse::pr_error;
+        }
     }
 
     return argparse::pr_ok;
@@ -589,6 +797,8 @@ std::string userconfig::get_output_filename(const std::string& key,
             filename += ".gz";
         } else if (bzip2) {
             filename += ".bz2";
+        } else if (bam_output) {
+            filename += ".bam";
         }
 
         return filename;
@@ -633,6 +843,8 @@ std::string userconfig::get_output_filename(const std::string& key,
         filename += ".gz";
     } else if (bzip2) {
         filename += ".bz2";
+    } else if (bam_output) {
+        filename += ".bam";
     }
 
     return filename;
@@ -671,6 +883,25 @@ bool check_and_set_barcode_mm(const argparse::parser& argparser,
 }
 
 
+void userconfig::select_thread_counts(bool io_threads_set)
+{
+    auto_threads = true;
+    // Threads are shared by all steps, including (de)compression, so every
+    // available CPU is used regardless of the input / output formats
+    max_threads = available_cpus();
+
+    if (!io_threads_set) {
+        // Compressed output (including BAM) is written in small, infrequent
+        // bursts, so a single writer besides the reader suffices; otherwise,
+        // an extra writer allows multiple output files to be written at once
+        const bool compressed_output = gzip || bzip2 || bam_output;
+        const unsigned io_threads = compressed_output ? 2 : 3;
+
+        max_io_threads = std::max(1u, std::min(io_threads, max_threads));
+    }
+}
+
+
 bool userconfig::setup_adapter_sequences()
 {
     const bool pcr_is_set
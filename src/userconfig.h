@@ -105,6 +105,10 @@ public:
     bool paired_ended_mode;
     //! Set to true if --interleaved or --interleaved-input is set.
     bool interleaved_input;
+    //! Set to true if input is read from a SAM file (--input-format sam)
+    bool sam_input;
+    //! Set to true if input is read from a BAM file (--input-format bam)
+    bool bam_input;
     //! Set to true if --interleaved or --interleaved-output is set.
     bool interleaved_output;
 
@@ -155,12 +159,34 @@ public:
 
     //! The maximum number of threads used by the program
     unsigned max_threads;
+    //! The maximum number of threads simultaneously performing file IO
+    unsigned max_io_threads;
+    //! Set if the number of threads was selected using '--threads auto'
+    bool auto_threads;
+    //! If true, worker threads are pinned to NUMA nodes
+    bool numa;
+    //! Memory budget (in bytes) for reads in flight; 0 if unlimited
+    size_t max_memory;
+    //! Max number of chunks of reads in flight; 0 for 3 chunks per thread
+    unsigned lookahead;
+    //! File to which scheduler statistics are written; empty if not set
+    std::string pipeline_stats;
+    //! File to which a timeline of the pipeline is written; empty if not set
+    std::string trace;
 
     //! GZip compression enabled / disabled
     bool gzip;
     //! GZip compression level used for output reads
     unsigned int gzip_level;
 
+    //! Write CRC32C checksums of output files to FILENAME.checksums
+    bool checksums;
+    //! Also write MD5 checksums to FILENAME.md5; implies 'checksums'
+    bool checksums_md5;
+
+    //! Write reads as unaligned BAM records instead of FASTQ records
+    bool bam_output;
+
     //! BZip2 compression enabled / disabled
     bool bzip2;
     //! BZip2 compression level used for output reads
@@ -188,6 +214,13 @@ private:
      */
     bool setup_adapter_sequences();
 
+    /**
+     * Selects the number of threads for '--threads auto', based on the number
+     * of available CPUs; the number of IO threads is also selected, based on
+     * the type of output, unless explicitly set by the user.
+     */
+    void select_thread_counts(bool io_threads_set);
+
 
     //! Sink for --adapter1, adapter sequence expected at 3' of mate 1 reads
     std::string adapter_1;
@@ -209,6 +242,14 @@ private:
     std::string mate_separator_str;
     //! Sink for --interleaved
     bool interleaved;
+    //! Sink for --input-format; use sam_input / bam_input
+    std::string input_format;
+    //! Sink for --output-format; use bam_output
+    std::string output_format;
+    //! Sink for --max-memory; use max_memory
+    std::string max_memory_str;
+    //! Sink for --threads; use max_threads
+    std::string max_threads_str;
 };
 
 } // namespace ar
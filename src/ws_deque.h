@@ -0,0 +1,224 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#ifndef WS_DEQUE_H
+#define WS_DEQUE_H
+
+#include <cstddef>
+#include <vector>
+
+#include "debug.h"
+#include "threads.h"
+
+namespace ar
+{
+
+/**
+ * Unbounded, lock-free work-stealing deque.
+ *
+ * Values are pushed and popped at the bottom of the deque by a single thread
+ * (the owner), in LIFO order, while any other thread may steal values from
+ * the top of the deque, in FIFO order. The owner only has to synchronize with
+ * thieves when a single value remains. See D. Chase and Y. Lev, "Dynamic
+ * circular work-stealing deque" (2005), and N. M. Le et al., "Correct and
+ * efficient work-stealing for weak memory models" (2013).
+ *
+ * The ring-buffer is grown by the owner when full; old ring-buffers are kept
+ * until the deque is destroyed, since thieves may still be reading from them.
+ *
+ * The type T must be a pointer type.
+ */
+template <typename T>
+class ws_deque
+{
+public:
+    /** Creates an empty deque with space for 'capacity' values initially. */
+    ws_deque(size_t capacity = 64);
+
+    /** Destructor; frees ring-buffers but not any remaining values. */
+    ~ws_deque();
+
+    /** Pushes a value onto the bottom of the deque; owner only. */
+    void push(T value);
+
+    /** Pops a value from the bottom of the deque; owner only. */
+    bool pop(T& value);
+
+    /** Steals a value from the top of the deque; may be called by any thread. */
+    bool steal(T& value);
+
+private:
+    //! Not implemented
+    ws_deque(const ws_deque&);
+    //! Not implemented
+    ws_deque& operator=(const ws_deque&);
+
+    /** Fixed size ring-buffer; size is a power of two. */
+    struct ring
+    {
+        ring(size_t size)
+          : mask(size - 1)
+          , values(size)
+        {
+        }
+
+        //! Mask used to convert positions to indices in 'values'
+        const size_t mask;
+        //! Values in the ring-buffer
+        std::vector<T> values;
+    };
+
+    /** Replaces 'current' with a ring twice as large; owner only. */
+    ring* grow(ring* current, ptrdiff_t top, ptrdiff_t bottom);
+
+    //! Current ring-buffer
+    ring* m_ring;
+    //! Previous ring-buffers, which may be read by thieves; owner only
+    std::vector<ring*> m_retired;
+
+    char m_padding_1[CACHE_LINE_SIZE];
+    //! Position of the oldest value; incremented by thieves and the owner
+    ptrdiff_t m_top;
+    char m_padding_2[CACHE_LINE_SIZE - sizeof(ptrdiff_t)];
+    //! Position following the newest value; modified only by the owner
+    ptrdiff_t m_bottom;
+    char m_padding_3[CACHE_LINE_SIZE - sizeof(ptrdiff_t)];
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Implementations for 'ws_deque'
+
+template <typename T>
+ws_deque<T>::ws_deque(size_t capacity)
+  : m_ring(new ring(capacity))
+  , m_retired()
+  , m_padding_1()
+  , m_top(0)
+  , m_padding_2()
+  , m_bottom(0)
+  , m_padding_3()
+{
+    AR_DEBUG_ASSERT(capacity >= 2 && !(capacity & (capacity - 1)));
+}
+
+
+template <typename T>
+ws_deque<T>::~ws_deque()
+{
+    for (size_t i = 0; i < m_retired.size(); ++i) {
+        delete m_retired.at(i);
+    }
+
+    delete m_ring;
+}
+
+
+template <typename T>
+void ws_deque<T>::push(T value)
+{
+    const ptrdiff_t bottom = __atomic_load_n(&m_bottom, __ATOMIC_RELAXED);
+    const ptrdiff_t top = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+    ring* current = __atomic_load_n(&m_ring, __ATOMIC_RELAXED);
+
+    if (bottom - top > static_cast<ptrdiff_t>(current->mask)) {
+        current = grow(current, top, bottom);
+    }
+
+    __atomic_store_n(&current->values[bottom & current->mask], value, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&m_bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+
+template <typename T>
+bool ws_deque<T>::pop(T& value)
+{
+    const ptrdiff_t bottom = __atomic_load_n(&m_bottom, __ATOMIC_RELAXED) - 1;
+    ring* current = __atomic_load_n(&m_ring, __ATOMIC_RELAXED);
+    __atomic_store_n(&m_bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    ptrdiff_t top = __atomic_load_n(&m_top, __ATOMIC_RELAXED);
+    if (top > bottom) {
+        // Deque was empty
+        __atomic_store_n(&m_bottom, bottom + 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    value = __atomic_load_n(&current->values[bottom & current->mask], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // Last value in the deque; race any thieves for it
+        const bool success = __atomic_compare_exchange_n(&m_top, &top, top + 1, false,
+                                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&m_bottom, bottom + 1, __ATOMIC_RELAXED);
+
+        return success;
+    }
+
+    return true;
+}
+
+
+template <typename T>
+bool ws_deque<T>::steal(T& value)
+{
+    while (true) {
+        ptrdiff_t top = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        const ptrdiff_t bottom = __atomic_load_n(&m_bottom, __ATOMIC_ACQUIRE);
+
+        if (top >= bottom) {
+            return false;
+        }
+
+        ring* current = __atomic_load_n(&m_ring, __ATOMIC_ACQUIRE);
+        const T candidate = __atomic_load_n(&current->values[top & current->mask], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&m_top, &top, top + 1, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            value = candidate;
+            return true;
+        }
+
+        // Lost the race to another thief or the owner; try again
+    }
+}
+
+
+template <typename T>
+typename ws_deque<T>::ring* ws_deque<T>::grow(ring* current, ptrdiff_t top, ptrdiff_t bottom)
+{
+    ring* larger = new ring(current->values.size() * 2);
+    for (ptrdiff_t i = top; i < bottom; ++i) {
+        larger->values[i & larger->mask] = current->values[i & current->mask];
+    }
+
+    m_retired.push_back(current);
+    __atomic_store_n(&m_ring, larger, __ATOMIC_RELEASE);
+
+    return larger;
+}
+
+} // namespace ar
+
+#endif
@@ -0,0 +1,473 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <string>
+#include <gtest/gtest.h>
+
+#include <zlib.h>
+
+#include "bam.h"
+#include "fastq.h"
+
+namespace ar
+{
+
+/** Decompresses a single BGZF block, checking the header and footer. */
+std::string bgzf_decompress(const unsigned char* block, size_t size)
+{
+    EXPECT_LE(28u, size);
+    EXPECT_EQ(0x1f, block[0]);
+    EXPECT_EQ(0x8b, block[1]);
+    EXPECT_EQ('B', block[12]);
+    EXPECT_EQ('C', block[13]);
+    EXPECT_EQ(size - 1, static_cast<size_t>(block[16] | (block[17] << 8)));
+
+    std::string output(BGZF_BLOCK_SIZE, '\0');
+
+    z_stream stream = z_stream();
+    EXPECT_EQ(Z_OK, inflateInit2(&stream, 15 + 16));
+    stream.next_in = const_cast<Bytef*>(block);
+    stream.avail_in = size;
+    stream.next_out = reinterpret_cast<Bytef*>(&output[0]);
+    stream.avail_out = output.size();
+
+    EXPECT_EQ(Z_STREAM_END, inflate(&stream, Z_FINISH));
+    EXPECT_EQ(0u, stream.avail_in);
+    output.resize(stream.total_out);
+    inflateEnd(&stream);
+
+    return output;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Encoding of BAM records
+
+TEST(bam_encode_record, unpaired_read)
+{
+    const fastq read("read_1 meta", "ACGTN", "!#5?J");
+    std::string record;
+    bam_encode_record(record, read, BAM_FLAGS_UNPAIRED, '/', 41);
+
+    const char expected[] =
+        "\x2f\x00\x00\x00"  // block_size = 32 + 7 + 3 + 5
+        "\xff\xff\xff\xff"  // refID
+        "\xff\xff\xff\xff"  // pos
+        "\x07"              // l_read_name
+        "\x00"              // mapq
+        "\x48\x12"          // bin = 4680
+        "\x00\x00"          // n_cigar_op
+        "\x04\x00"          // flag
+        "\x05\x00\x00\x00"  // l_seq
+        "\xff\xff\xff\xff"  // next_refID
+        "\xff\xff\xff\xff"  // next_pos
+        "\x00\x00\x00\x00"  // tlen
+        "read_1\x00"        // read_name
+        "\x12\x48\xf0"      // ACGTN
+        "\x00\x02\x14\x1e\x29";
+
+    ASSERT_EQ(std::string(expected, sizeof(expected) - 1), record);
+}
+
+
+TEST(bam_encode_record, paired_read_without_mate_number)
+{
+    const fastq read("read/1", "ACGT", "IIII");
+    std::string record;
+    bam_encode_record(record, read, BAM_FLAGS_MATE_1, '/', 41);
+
+    ASSERT_EQ(32u + 5u + 2u + 4u + 4u, record.size());
+    ASSERT_EQ(5, record.at(12));
+    ASSERT_EQ(BAM_FLAGS_MATE_1, static_cast<unsigned char>(record.at(18)));
+    ASSERT_EQ("read", record.substr(36, 4));
+}
+
+
+TEST(bam_encode_record, custom_mate_separator)
+{
+    const fastq read("read.2", "ACGT", "IIII");
+    std::string record;
+    bam_encode_record(record, read, BAM_FLAGS_MATE_2, '.', 41);
+
+    ASSERT_EQ(5, record.at(12));
+    ASSERT_EQ(std::string("read\0", 5), record.substr(36, 5));
+}
+
+
+TEST(bam_encode_record, mate_number_kept_for_unpaired_reads)
+{
+    const fastq read("read/1", "ACGT", "IIII");
+    std::string record;
+    bam_encode_record(record, read, BAM_FLAGS_UNPAIRED, '/', 41);
+
+    ASSERT_EQ(7, record.at(12));
+    ASSERT_EQ("read/1", record.substr(36, 6));
+}
+
+
+TEST(bam_encode_record, qualities_are_truncated)
+{
+    const fastq read("read", "AC", "!~", FASTQ_ENCODING_SAM);
+    std::string record;
+    bam_encode_record(record, read, BAM_FLAGS_UNPAIRED, '/', 41);
+
+    ASSERT_EQ(std::string("\x00\x29", 2), record.substr(record.size() - 2));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Decoding of BAM records
+
+TEST(bam_decode_record, roundtrip_unpaired_read)
+{
+    const fastq expected("read_1", "ACGTN", "!#5?J");
+    std::string data;
+    bam_encode_record(data, expected, BAM_FLAGS_UNPAIRED, '/', 41);
+
+    fastq read;
+    uint16_t flags = 0;
+    size_t offset = 0;
+    ASSERT_TRUE(bam_decode_record(data, offset, read, flags, FASTQ_ENCODING_SAM, '/'));
+    ASSERT_EQ(data.size(), offset);
+    ASSERT_EQ(BAM_FLAGS_UNPAIRED, flags);
+    ASSERT_EQ(expected, read);
+}
+
+
+TEST(bam_decode_record, roundtrip_mates)
+{
+    std::string data;
+    bam_encode_record(data, fastq("read/1", "ACGT", "IIII"), BAM_FLAGS_MATE_1, '/', 41);
+    bam_encode_record(data, fastq("read/2", "TTGA", "IJII"), BAM_FLAGS_MATE_2, '/', 41);
+
+    fastq read;
+    uint16_t flags = 0;
+    size_t offset = 0;
+    ASSERT_TRUE(bam_decode_record(data, offset, read, flags, FASTQ_ENCODING_SAM, '.'));
+    ASSERT_EQ(BAM_FLAGS_MATE_1, flags);
+    ASSERT_EQ(fastq("read.1", "ACGT", "IIII"), read);
+
+    ASSERT_TRUE(bam_decode_record(data, offset, read, flags, FASTQ_ENCODING_SAM, '.'));
+    ASSERT_EQ(BAM_FLAGS_MATE_2, flags);
+    ASSERT_EQ(fastq("read.2", "TTGA", "IJII"), read);
+
+    ASSERT_EQ(data.size(), offset);
+    ASSERT_FALSE(bam_decode_record(data, offset, read, flags, FASTQ_ENCODING_SAM, '.'));
+}
+
+
+TEST(bam_decode_record, incomplete_record)
+{
+    std::string data;
+    bam_encode_record(data, fastq("read", "ACGTA", "IIIII"), BAM_FLAGS_UNPAIRED, '/', 41);
+
+    fastq read;
+    uint16_t flags = 0;
+    for (size_t i = 0; i < data.size(); ++i) {
+        size_t offset = 0;
+        ASSERT_FALSE(bam_decode_record(data.substr(0, i), offset, read, flags, FASTQ_ENCODING_SAM, '/'));
+        ASSERT_EQ(0u, offset);
+    }
+}
+
+
+TEST(bam_decode_record, reverse_complemented_read)
+{
+    std::string data;
+    bam_encode_record(data, fastq("read", "AACGT", "!#5?J"),
+                      BAM_FLAGS_UNPAIRED | BAM_FREVERSE, '/', 41);
+
+    fastq read;
+    uint16_t flags = 0;
+    size_t offset = 0;
+    ASSERT_TRUE(bam_decode_record(data, offset, read, flags, FASTQ_ENCODING_SAM, '/'));
+    ASSERT_EQ(fastq("read", "ACGTT", "J?5#!"), read);
+}
+
+
+TEST(bam_decode_record, missing_qualities)
+{
+    std::string data;
+    bam_encode_record(data, fastq("read", "ACG", "III"), BAM_FLAGS_UNPAIRED, '/', 41);
+    data.replace(data.size() - 3, 3, "\xff\xff\xff");
+
+    fastq read;
+    uint16_t flags = 0;
+    size_t offset = 0;
+    ASSERT_TRUE(bam_decode_record(data, offset, read, flags, FASTQ_ENCODING_SAM, '/'));
+    ASSERT_EQ(fastq("read", "ACG", "!!!"), read);
+}
+
+
+TEST(bam_decode_record, malformed_record)
+{
+    const std::string data("\x04\x00\x00\x00\x00\x00\x00\x00", 8);
+
+    fastq read;
+    uint16_t flags = 0;
+    size_t offset = 0;
+    ASSERT_THROW(bam_decode_record(data, offset, read, flags, FASTQ_ENCODING_SAM, '/'), bam_error);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Decoding of SAM records
+
+TEST(sam_decode_record, unpaired_read)
+{
+    fastq read;
+    uint16_t flags = 0;
+    sam_decode_record("read\t4\t*\t0\t0\t*\t*\t0\t0\tACGTR\t!#5?J\tRG:Z:foo",
+                      read, flags, FASTQ_ENCODING_SAM, '/');
+
+    ASSERT_EQ(4, flags);
+    ASSERT_EQ(fastq("read", "ACGTN", "!#5?J"), read);
+}
+
+
+TEST(sam_decode_record, paired_reverse_read_without_qualities)
+{
+    fastq read;
+    uint16_t flags = 0;
+    sam_decode_record("read\t157\t*\t0\t0\t*\t*\t0\t0\tacgg\t*",
+                      read, flags, FASTQ_ENCODING_SAM, '/');
+
+    ASSERT_EQ(157, flags);
+    ASSERT_EQ(fastq("read/2", "CCGT", "!!!!"), read);
+}
+
+
+TEST(sam_decode_record, too_few_fields)
+{
+    fastq read;
+    uint16_t flags = 0;
+    ASSERT_THROW(sam_decode_record("read\t4\t*\t0\t0\t*\t*\t0\t0\tACGT",
+                                   read, flags, FASTQ_ENCODING_SAM, '/'),
+                 bam_error);
+}
+
+
+TEST(sam_decode_record, invalid_flag)
+{
+    fastq read;
+    uint16_t flags = 0;
+    ASSERT_THROW(sam_decode_record("read\t4x\t*\t0\t0\t*\t*\t0\t0\tACGT\tIIII",
+                                   read, flags, FASTQ_ENCODING_SAM, '/'),
+                 bam_error);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Pairing of SAM / BAM records
+
+TEST(sam_mate_collector, single_end_reads)
+{
+    sam_mate_collector collector(false);
+    fastq_vec reads_1;
+    fastq_vec reads_2;
+
+    collector.add(reads_1, reads_2, fastq("a/1", "A", "I"), BAM_FLAGS_MATE_1);
+    collector.add(reads_1, reads_2, fastq("b", "A", "I"), BAM_FLAGS_UNPAIRED | BAM_FSECONDARY);
+    collector.add(reads_1, reads_2, fastq("c", "A", "I"), BAM_FLAGS_UNPAIRED);
+    collector.finalize();
+
+    ASSERT_EQ(2u, reads_1.size());
+    ASSERT_EQ(0u, reads_2.size());
+}
+
+
+TEST(sam_mate_collector, paired_reads)
+{
+    sam_mate_collector collector(true);
+    fastq_vec reads_1;
+    fastq_vec reads_2;
+
+    collector.add(reads_1, reads_2, fastq("a/1", "A", "I"), BAM_FLAGS_MATE_1);
+    ASSERT_EQ(0u, reads_1.size());
+    collector.add(reads_1, reads_2, fastq("a/2", "A", "I"), BAM_FLAGS_MATE_2 | BAM_FSUPPLEMENTARY);
+    collector.add(reads_1, reads_2, fastq("a/2", "C", "I"), BAM_FLAGS_MATE_2);
+    collector.finalize();
+
+    ASSERT_EQ(1u, reads_1.size());
+    ASSERT_EQ(1u, reads_2.size());
+    ASSERT_EQ("a/1", reads_1.front().header());
+    ASSERT_EQ("C", reads_2.front().sequence());
+}
+
+
+TEST(sam_mate_collector, unpaired_read_in_paired_mode)
+{
+    sam_mate_collector collector(true);
+    fastq_vec reads_1;
+    fastq_vec reads_2;
+
+    ASSERT_THROW(collector.add(reads_1, reads_2, fastq("a", "A", "I"), BAM_FLAGS_UNPAIRED),
+                 bam_error);
+}
+
+
+TEST(sam_mate_collector, missing_mates)
+{
+    sam_mate_collector collector(true);
+    fastq_vec reads_1;
+    fastq_vec reads_2;
+
+    ASSERT_THROW(collector.add(reads_1, reads_2, fastq("a/2", "A", "I"), BAM_FLAGS_MATE_2),
+                 bam_error);
+
+    collector.add(reads_1, reads_2, fastq("a/1", "A", "I"), BAM_FLAGS_MATE_1);
+    ASSERT_THROW(collector.finalize(), bam_error);
+    ASSERT_THROW(collector.add(reads_1, reads_2, fastq("b/1", "A", "I"), BAM_FLAGS_MATE_1),
+                 bam_error);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// BAM header
+
+TEST(bam_header, magic_and_text)
+{
+    const std::string header = bam_header();
+
+    ASSERT_EQ(std::string("BAM\1", 4), header.substr(0, 4));
+
+    const size_t l_text = static_cast<unsigned char>(header.at(4))
+                          | (static_cast<unsigned char>(header.at(5)) << 8);
+    ASSERT_EQ(header.size(), 4 + 4 + l_text + 4);
+    ASSERT_EQ("@HD\tVN:1.6\t", header.substr(8, 11));
+    ASSERT_EQ(std::string(4, '\0'), header.substr(header.size() - 4));
+}
+
+
+TEST(bam_decode_header, roundtrip)
+{
+    const std::string header = bam_header();
+
+    for (size_t i = 0; i < header.size(); ++i) {
+        size_t offset = 0;
+        ASSERT_FALSE(bam_decode_header(header.substr(0, i), offset));
+        ASSERT_EQ(0u, offset);
+    }
+
+    size_t offset = 0;
+    ASSERT_TRUE(bam_decode_header(header, offset));
+    ASSERT_EQ(header.size(), offset);
+}
+
+
+TEST(bam_decode_header, not_a_bam_file)
+{
+    size_t offset = 0;
+    ASSERT_THROW(bam_decode_header("@HD\tVN:1.6\n", offset), bam_error);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// BGZF compression
+
+TEST(bgzf_compress, empty_block)
+{
+    const std::pair<size_t, unsigned char*> block = bgzf_compress("", 0, 6);
+
+    ASSERT_EQ("", bgzf_decompress(block.second, block.first));
+    delete[] block.second;
+}
+
+
+TEST(bgzf_compress, eof_block)
+{
+    ASSERT_EQ("", bgzf_decompress(BGZF_EOF_BLOCK, sizeof(BGZF_EOF_BLOCK)));
+}
+
+
+TEST(bgzf_compress, roundtrip)
+{
+    const std::string data = bam_header();
+    const std::pair<size_t, unsigned char*> block = bgzf_compress(data.data(), data.size(), 6);
+
+    ASSERT_EQ(data, bgzf_decompress(block.second, block.first));
+    delete[] block.second;
+}
+
+
+TEST(bgzf_compress, max_size_incompressible_block)
+{
+    std::string data(BGZF_BLOCK_SIZE, '\0');
+    unsigned int state = 12345;
+    for (size_t i = 0; i < data.size(); ++i) {
+        state = state * 1103515245u + 12345u;
+        data.at(i) = static_cast<char>(state >> 16);
+    }
+
+    const std::pair<size_t, unsigned char*> block = bgzf_compress(data.data(), data.size(), 0);
+
+    ASSERT_GE(BGZF_MAX_BLOCK_SIZE, block.first);
+    ASSERT_EQ(data, bgzf_decompress(block.second, block.first));
+    delete[] block.second;
+}
+
+
+TEST(bgzf_decompress, roundtrip)
+{
+    const std::string data = bam_header();
+    const std::pair<size_t, unsigned char*> block = bgzf_compress(data.data(), data.size(), 6);
+    const std::string compressed(reinterpret_cast<char*>(block.second), block.first);
+    delete[] block.second;
+
+    std::string output = "prefix";
+    bgzf_decompress(compressed, output);
+    ASSERT_EQ("prefix" + data, output);
+}
+
+
+TEST(bgzf_decompress, eof_block)
+{
+    std::string output;
+    bgzf_decompress(std::string(reinterpret_cast<const char*>(BGZF_EOF_BLOCK),
+                                sizeof(BGZF_EOF_BLOCK)), output);
+    ASSERT_EQ("", output);
+}
+
+
+TEST(bgzf_decompress, crc_mismatch)
+{
+    const std::string data = bam_header();
+    const std::pair<size_t, unsigned char*> block = bgzf_compress(data.data(), data.size(), 6);
+    std::string compressed(reinterpret_cast<char*>(block.second), block.first);
+    delete[] block.second;
+
+    compressed.at(compressed.size() - 8) ^= 1;
+
+    std::string output;
+    ASSERT_THROW(bgzf_decompress(compressed, output), bam_error);
+}
+
+
+TEST(bgzf_compress, too_much_data)
+{
+    const std::string data(BGZF_BLOCK_SIZE + 1, 'A');
+
+    ASSERT_THROW(bgzf_compress(data.data(), data.size(), 6), std::invalid_argument);
+}
+
+} // namespace ar
@@ -0,0 +1,451 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <algorithm>
+#include <gtest/gtest.h>
+
+#include "barcode_table.h"
+
+namespace ar
+{
+
+/** Returns a barcode pair; mate 2 is left empty if not specified. */
+fastq_pair barcode_pair(const std::string& mate_1, const std::string& mate_2 = "")
+{
+    return fastq_pair(fastq("barcode", mate_1), fastq("barcode", mate_2));
+}
+
+
+/** Returns the result of looking up the sequences in the table. */
+int lookup(const barcode_table& table, const std::string& read_1, const std::string& read_2 = "")
+{
+    int barcode = -3;
+    if (!table.lookup(fastq("read", read_1), fastq("read", read_2), barcode)) {
+        return -3;
+    }
+
+    return barcode;
+}
+
+
+/** Returns the sorted (barcode, mismatches) pairs found in the trie. */
+barcode_candidate_vec lookup(const barcode_trie& trie, const std::string& read, size_t max_mismatches)
+{
+    barcode_candidate_vec candidates;
+    trie.lookup(read, max_mismatches, candidates);
+    std::sort(candidates.begin(), candidates.end());
+
+    return candidates;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'barcode_neighbourhood_size'
+
+TEST(barcode_neighbourhood_size, single_end)
+{
+    ASSERT_EQ(1.0, barcode_neighbourhood_size(1, 4, 0, 0, 0, 0));
+    ASSERT_EQ(13.0, barcode_neighbourhood_size(1, 4, 0, 1, 1, 0));
+    ASSERT_EQ(67.0, barcode_neighbourhood_size(1, 4, 0, 2, 2, 0));
+    ASSERT_EQ(134.0, barcode_neighbourhood_size(2, 4, 0, 2, 2, 0));
+}
+
+
+TEST(barcode_neighbourhood_size, paired_end)
+{
+    // 1 + 4 * 3 mismatches in mate 1, and 2 * 3 mismatches in mate 2
+    ASSERT_EQ(19.0, barcode_neighbourhood_size(1, 4, 2, 1, 1, 1));
+    ASSERT_EQ(13.0, barcode_neighbourhood_size(1, 4, 2, 1, 1, 0));
+    ASSERT_EQ(7.0, barcode_neighbourhood_size(1, 4, 2, 1, 0, 1));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'barcode_table'
+
+TEST(barcode_table, exact_matches)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("ACGT"));
+    barcodes.push_back(barcode_pair("TTTT"));
+
+    const barcode_table table(barcodes, 0, 0, 0, false);
+    ASSERT_TRUE(table.available());
+    ASSERT_EQ(2, table.size());
+
+    ASSERT_EQ(0, lookup(table, "ACGTAAAA"));
+    ASSERT_EQ(1, lookup(table, "TTTTGGGG"));
+    ASSERT_EQ(-1, lookup(table, "ACGAAAAA"));
+}
+
+
+TEST(barcode_table, mismatches)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("AAAA"));
+    barcodes.push_back(barcode_pair("CCCC"));
+
+    const barcode_table table(barcodes, 1, 1, 0, false);
+    ASSERT_EQ(2 * 13, table.size());
+
+    ASSERT_EQ(0, lookup(table, "AAGA"));
+    ASSERT_EQ(1, lookup(table, "CCCT"));
+    ASSERT_EQ(-1, lookup(table, "AACC"));
+}
+
+
+TEST(barcode_table, ambiguous_matches)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("AAAA"));
+    barcodes.push_back(barcode_pair("AACC"));
+
+    const barcode_table table(barcodes, 2, 2, 0, false);
+
+    ASSERT_EQ(0, lookup(table, "AAAA"));
+    ASSERT_EQ(0, lookup(table, "AAAG"));
+    ASSERT_EQ(-2, lookup(table, "AAAC"));
+    ASSERT_EQ(1, lookup(table, "AACC"));
+}
+
+
+TEST(barcode_table, paired_end_mismatches)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("AAAA", "GG"));
+    barcodes.push_back(barcode_pair("CCCC", "TT"));
+
+    const barcode_table table(barcodes, 2, 1, 1, true);
+
+    ASSERT_EQ(0, lookup(table, "AAAA", "GG"));
+    ASSERT_EQ(0, lookup(table, "AAAT", "GT"));
+    ASSERT_EQ(-1, lookup(table, "AATT", "GG"));
+    ASSERT_EQ(-1, lookup(table, "AAAA", "TT"));
+    ASSERT_EQ(1, lookup(table, "CCCC", "TA"));
+}
+
+
+TEST(barcode_table, mate_2_ignored_in_single_end_mode)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("AAAA", "GG"));
+
+    const barcode_table table(barcodes, 0, 0, 0, false);
+
+    ASSERT_EQ(0, lookup(table, "AAAA", "TT"));
+}
+
+
+TEST(barcode_table, unsupported_reads)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("AAAA", "GG"));
+
+    const barcode_table table(barcodes, 1, 1, 1, true);
+
+    ASSERT_EQ(-3, lookup(table, "AANA", "GG"));
+    ASSERT_EQ(-3, lookup(table, "AAA", "GG"));
+    ASSERT_EQ(-3, lookup(table, "AAAA", "G"));
+}
+
+
+TEST(barcode_table, too_long_barcodes)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair(std::string(20, 'A'), std::string(13, 'C')));
+
+    const barcode_table table(barcodes, 0, 0, 0, true);
+    ASSERT_FALSE(table.available());
+    ASSERT_EQ(-3, lookup(table, std::string(20, 'A'), std::string(13, 'C')));
+}
+
+
+TEST(barcode_table, too_many_neighbours)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair(std::string(16, 'A'), std::string(16, 'C')));
+
+    const barcode_table table(barcodes, 6, 6, 6, true);
+    ASSERT_FALSE(table.available());
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'barcode_trie'
+
+TEST(barcode_trie, empty_trie)
+{
+    const barcode_trie trie = barcode_trie(fastq_pair_vec());
+
+    ASSERT_EQ(0, trie.size());
+    ASSERT_TRUE(lookup(trie, "ACGT", 2).empty());
+}
+
+
+TEST(barcode_trie, exact_matches)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("TTTT"));
+    barcodes.push_back(barcode_pair("ACGT"));
+    barcodes.push_back(barcode_pair("ACGA"));
+
+    const barcode_trie trie(barcodes);
+    ASSERT_EQ(3, trie.size());
+
+    barcode_candidate_vec expected;
+    expected.push_back(barcode_candidate(1, 0));
+    ASSERT_EQ(expected, lookup(trie, "ACGTAAAA", 0));
+
+    expected.clear();
+    expected.push_back(barcode_candidate(0, 0));
+    ASSERT_EQ(expected, lookup(trie, "TTTT", 0));
+
+    ASSERT_TRUE(lookup(trie, "ACGG", 0).empty());
+    ASSERT_TRUE(lookup(trie, "CCCC", 0).empty());
+}
+
+
+TEST(barcode_trie, mismatches)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("AAAA"));
+    barcodes.push_back(barcode_pair("AACC"));
+    barcodes.push_back(barcode_pair("GGGG"));
+
+    const barcode_trie trie(barcodes);
+
+    barcode_candidate_vec expected;
+    expected.push_back(barcode_candidate(0, 1));
+    expected.push_back(barcode_candidate(1, 1));
+    ASSERT_EQ(expected, lookup(trie, "AAAC", 1));
+    ASSERT_EQ(expected, lookup(trie, "AAAC", 2));
+
+    expected.clear();
+    expected.push_back(barcode_candidate(0, 2));
+    expected.push_back(barcode_candidate(1, 0));
+    ASSERT_EQ(expected, lookup(trie, "AACC", 2));
+
+    ASSERT_TRUE(lookup(trie, "TTTT", 3).empty());
+}
+
+
+TEST(barcode_trie, duplicate_mate_1_barcodes)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("ACGT", "AA"));
+    barcodes.push_back(barcode_pair("ACGT", "CC"));
+
+    const barcode_trie trie(barcodes);
+
+    barcode_candidate_vec expected;
+    expected.push_back(barcode_candidate(0, 1));
+    expected.push_back(barcode_candidate(1, 1));
+    ASSERT_EQ(expected, lookup(trie, "ACTT", 1));
+}
+
+
+TEST(barcode_trie, ambiguous_bases_are_mismatches)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("ACGT"));
+
+    const barcode_trie trie(barcodes);
+
+    barcode_candidate_vec expected;
+    expected.push_back(barcode_candidate(0, 1));
+    ASSERT_EQ(expected, lookup(trie, "ACNT", 1));
+    ASSERT_TRUE(lookup(trie, "ACNT", 0).empty());
+    ASSERT_TRUE(lookup(trie, "NNGT", 1).empty());
+}
+
+
+TEST(barcode_trie, short_reads)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("ACGT"));
+
+    const barcode_trie trie(barcodes);
+
+    ASSERT_TRUE(lookup(trie, "ACG", 2).empty());
+    ASSERT_TRUE(lookup(trie, "", 2).empty());
+}
+
+
+TEST(barcode_trie, long_barcodes)
+{
+    const std::string barcode_1 = std::string(40, 'A') + "C";
+    const std::string barcode_2 = std::string(40, 'A') + "G";
+
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair(barcode_1));
+    barcodes.push_back(barcode_pair(barcode_2));
+
+    const barcode_trie trie(barcodes);
+
+    barcode_candidate_vec expected;
+    expected.push_back(barcode_candidate(1, 0));
+    ASSERT_EQ(expected, lookup(trie, barcode_2, 0));
+
+    expected.clear();
+    expected.push_back(barcode_candidate(0, 1));
+    expected.push_back(barcode_candidate(1, 1));
+    ASSERT_EQ(expected, lookup(trie, std::string(41, 'A'), 1));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'barcode_scanner'
+
+TEST(barcode_scanner, exact_matches)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("ACGT"));
+    barcodes.push_back(barcode_pair("TTTT"));
+
+    const barcode_scanner scanner(barcodes, 0, 0, 0, false);
+    ASSERT_TRUE(scanner.available());
+    ASSERT_EQ(2, scanner.size());
+
+    ASSERT_EQ(0, scanner.lookup(fastq("read", "ACGTAAAA"), fastq()));
+    ASSERT_EQ(1, scanner.lookup(fastq("read", "TTTTGGGG"), fastq()));
+    ASSERT_EQ(-1, scanner.lookup(fastq("read", "ACGAAAAA"), fastq()));
+}
+
+
+TEST(barcode_scanner, ambiguous_matches)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("AAAA"));
+    barcodes.push_back(barcode_pair("AACC"));
+
+    const barcode_scanner scanner(barcodes, 2, 2, 0, false);
+
+    ASSERT_EQ(0, scanner.lookup(fastq("read", "AAAG"), fastq()));
+    ASSERT_EQ(-2, scanner.lookup(fastq("read", "AAAC"), fastq()));
+    ASSERT_EQ(1, scanner.lookup(fastq("read", "AACC"), fastq()));
+    ASSERT_EQ(-1, scanner.lookup(fastq("read", "TTTT"), fastq()));
+}
+
+
+TEST(barcode_scanner, paired_end_mismatches)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("AAAA", "GG"));
+    barcodes.push_back(barcode_pair("CCCC", "TT"));
+
+    const barcode_scanner scanner(barcodes, 2, 1, 1, true);
+
+    ASSERT_EQ(0, scanner.lookup(fastq("read", "AAAA"), fastq("read", "GG")));
+    ASSERT_EQ(0, scanner.lookup(fastq("read", "AAAT"), fastq("read", "GT")));
+    ASSERT_EQ(-1, scanner.lookup(fastq("read", "AATT"), fastq("read", "GG")));
+    ASSERT_EQ(-1, scanner.lookup(fastq("read", "AAAA"), fastq("read", "TT")));
+    ASSERT_EQ(1, scanner.lookup(fastq("read", "CCCC"), fastq("read", "TA")));
+}
+
+
+TEST(barcode_scanner, total_mismatches_limit)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("AAAA", "GG"));
+    barcodes.push_back(barcode_pair("CCCC", "GG"));
+
+    const barcode_scanner scanner(barcodes, 1, 1, 1, true);
+
+    // Exceeding the total for both barcodes is not an ambiguous match
+    ASSERT_EQ(-1, scanner.lookup(fastq("read", "AACC"), fastq("read", "GT")));
+}
+
+
+TEST(barcode_scanner, ambiguous_bases_and_short_reads)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair("AAAA", "GG"));
+
+    const barcode_scanner scanner(barcodes, 2, 1, 1, true);
+
+    ASSERT_EQ(0, scanner.lookup(fastq("read", "AANA"), fastq("read", "GN")));
+    ASSERT_EQ(-1, scanner.lookup(fastq("read", "ANNA"), fastq("read", "GG")));
+    ASSERT_EQ(0, scanner.lookup(fastq("read", "AAAA"), fastq("read", "G")));
+    ASSERT_EQ(-1, scanner.lookup(fastq("read", "AAA"), fastq("read", "GG")));
+}
+
+
+TEST(barcode_scanner, many_barcodes)
+{
+    const char nts[] = "ACGT";
+
+    // More barcodes than are processed per block
+    fastq_pair_vec barcodes;
+    for (size_t i = 0; i < 256; ++i) {
+        std::string sequence;
+        for (size_t j = 0; j < 4; ++j) {
+            sequence.push_back(nts[(i >> (2 * j)) & 3]);
+        }
+
+        barcodes.push_back(barcode_pair(sequence + "GT" + std::string(34, 'A')));
+    }
+
+    const barcode_scanner scanner(barcodes, 1, 1, 0, false);
+    ASSERT_TRUE(scanner.available());
+
+    for (size_t i = 0; i < barcodes.size(); ++i) {
+        ASSERT_EQ(static_cast<int>(i), scanner.lookup(barcodes.at(i).first, fastq()));
+    }
+
+    ASSERT_EQ(-2, scanner.lookup(fastq("read", "NAAAGT" + std::string(34, 'A')), fastq()));
+}
+
+
+TEST(barcode_scanner, too_long_barcodes)
+{
+    fastq_pair_vec barcodes;
+    barcodes.push_back(barcode_pair(std::string(100, 'A'), std::string(40, 'C')));
+
+    const barcode_scanner scanner(barcodes, 0, 0, 0, true);
+    ASSERT_FALSE(scanner.available());
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'barcode_trie_cost' and 'barcode_scan_cost'
+
+TEST(barcode_scan_cost, exact_matches_prefer_trie)
+{
+    ASSERT_LT(barcode_trie_cost(384, 8, 8, 0), barcode_scan_cost(384, 8, 8));
+}
+
+
+TEST(barcode_scan_cost, mismatches_prefer_scan)
+{
+    ASSERT_GT(barcode_trie_cost(384, 8, 8, 1), barcode_scan_cost(384, 8, 8));
+    ASSERT_GT(barcode_trie_cost(96, 6, 6, 2), barcode_scan_cost(96, 6, 6));
+}
+
+
+TEST(barcode_scan_cost, scan_cost_grows_with_barcodes)
+{
+    ASSERT_LT(barcode_scan_cost(96, 8, 8), barcode_scan_cost(384, 8, 8));
+    ASSERT_LT(barcode_scan_cost(96, 8, 0), barcode_scan_cost(96, 40, 0));
+}
+
+} // namespace ar
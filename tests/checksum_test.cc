@@ -0,0 +1,140 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * XX
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <algorithm>
+#include <string>
+#include <gtest/gtest.h>
+
+#include "checksum.h"
+
+namespace ar
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'crc32c_checksum'
+
+TEST(crc32c, empty_input)
+{
+    crc32c_checksum crc;
+    ASSERT_EQ(0u, crc.value());
+    ASSERT_EQ("00000000", crc.hexdigest());
+}
+
+
+TEST(crc32c, check_value)
+{
+    crc32c_checksum crc;
+    crc.update("123456789");
+    ASSERT_EQ(0xe3069283u, crc.value());
+    ASSERT_EQ("e3069283", crc.hexdigest());
+}
+
+
+TEST(crc32c, zeros_32_bytes)
+{
+    crc32c_checksum crc;
+    crc.update(std::string(32, '\0'));
+    ASSERT_EQ(0x8a9136aau, crc.value());
+}
+
+
+TEST(crc32c, incremental_updates)
+{
+    std::string data;
+    for (size_t i = 0; i < 1000; ++i) {
+        data.push_back(static_cast<char>(i * 7 + 3));
+    }
+
+    crc32c_checksum expected;
+    expected.update(data);
+
+    // Uneven and unaligned pieces
+    crc32c_checksum crc;
+    for (size_t i = 0, size = 1; i < data.size(); i += size, size = size * 2 + 1) {
+        crc.update(data.data() + i, std::min(size, data.size() - i));
+    }
+
+    ASSERT_EQ(expected.value(), crc.value());
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'md5_checksum'
+
+TEST(md5, empty_input)
+{
+    md5_checksum md5;
+    ASSERT_EQ("d41d8cd98f00b204e9800998ecf8427e", md5.hexdigest());
+}
+
+
+TEST(md5, rfc_1321_test_suite)
+{
+    const char* values[7][2] = {
+        {"a", "0cc175b9c0f1b6a831c399e269772661"},
+        {"abc", "900150983cd24fb0d6963f7d28e17f72"},
+        {"message digest", "f96b697d7cb7938d525a2f31aaf161d0"},
+        {"abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b"},
+        {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+         "d174ab98d277d9f5a5611c2c9f419d9f"},
+        {"1234567890123456789012345678901234567890"
+         "1234567890123456789012345678901234567890",
+         "57edf4a22be3c955ac49da2e2107b67a"},
+        {"The quick brown fox jumps over the lazy dog",
+         "9e107d9d372bb6826bd81d3542a419d6"}
+    };
+
+    for (size_t i = 0; i < 7; ++i) {
+        md5_checksum md5;
+        md5.update(values[i][0]);
+        ASSERT_EQ(values[i][1], md5.hexdigest());
+    }
+}
+
+
+TEST(md5, incremental_updates)
+{
+    const std::string data = "1234567890123456789012345678901234567890"
+                             "1234567890123456789012345678901234567890";
+
+    md5_checksum md5;
+    for (size_t i = 0; i < data.size(); i += 7) {
+        md5.update(data.substr(i, 7));
+    }
+
+    ASSERT_EQ("57edf4a22be3c955ac49da2e2107b67a", md5.hexdigest());
+}
+
+
+TEST(md5, hexdigest_does_not_modify_state)
+{
+    md5_checksum md5;
+    md5.update("ab");
+    md5.hexdigest();
+    md5.update("c");
+
+    ASSERT_EQ("900150983cd24fb0d6963f7d28e17f72", md5.hexdigest());
+}
+
+} // namespace ar
@@ -0,0 +1,84 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <gtest/gtest.h>
+
+#include "chunk_sizer.h"
+
+namespace ar
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'chunk_sizer'
+
+TEST(chunk_sizer, defaults)
+{
+    const chunk_sizer sizer;
+
+    ASSERT_EQ(DEFAULT_CHUNK_RECORDS, sizer.records());
+    ASSERT_EQ(TARGET_CHUNK_BYTES, sizer.bytes());
+}
+
+
+TEST(chunk_sizer, records_follow_record_size)
+{
+    chunk_sizer sizer;
+    sizer.add_read_chunk(100, 100 * 512);
+
+    ASSERT_EQ(TARGET_CHUNK_BYTES / 512, sizer.records());
+    ASSERT_EQ(TARGET_CHUNK_BYTES, sizer.bytes());
+}
+
+
+TEST(chunk_sizer, empty_chunks_are_ignored)
+{
+    chunk_sizer sizer;
+    sizer.add_read_chunk(0, 0);
+
+    ASSERT_EQ(DEFAULT_CHUNK_RECORDS, sizer.records());
+    ASSERT_EQ(TARGET_CHUNK_BYTES, sizer.bytes());
+}
+
+
+TEST(chunk_sizer, records_are_bounded)
+{
+    chunk_sizer sizer;
+    sizer.add_read_chunk(1000, 1000);
+    ASSERT_EQ(MAX_CHUNK_RECORDS, sizer.records());
+
+    sizer.add_read_chunk(1, 100 * 1024 * 1024);
+    ASSERT_EQ(MIN_CHUNK_RECORDS, sizer.records());
+}
+
+
+TEST(chunk_sizer, moving_average)
+{
+    chunk_sizer sizer;
+    sizer.add_read_chunk(1, 1024);
+    sizer.add_read_chunk(1, 2048);
+
+    // 1024 + 0.25 * (2048 - 1024)
+    ASSERT_EQ(TARGET_CHUNK_BYTES / 1280, sizer.records());
+}
+
+} // namespace ar
@@ -0,0 +1,508 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "commontypes.h"
+#include "demultiplex.h"
+#include "fastq_io.h"
+#include "threads.h"
+#include "userconfig.h"
+
+namespace ar
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Helper functions
+
+//! Number of read pairs in the input
+const size_t INPUT_READS = 2900;
+//! Number of read pairs in each input chunk
+const size_t INPUT_CHUNK_SIZE = 250;
+//! Number of threads running 'demultiplex_pe_reads'
+const size_t DEMUX_THREADS = 4;
+
+//! Barcode pairs; samples 2 and 3 differ by two mismatches in mate 1
+const char* const BARCODES[][3] = {
+    {"sample_0", "AAAAAA", "CCCCCC"},
+    {"sample_1", "GGGGGG", "TTTTTT"},
+    {"sample_2", "ACACAC", "GTGTGT"},
+    {"sample_3", "ACACGG", "GTGTGT"},
+};
+
+//! Number of barcode pairs in 'BARCODES'
+const size_t BARCODE_COUNT = 4;
+//! Expected assignment of reads not matching any barcode
+const int UNIDENTIFIED = -1;
+//! Expected assignment of reads matching multiple barcodes
+const int AMBIGUOUS = -2;
+
+
+/** Temporary file that is removed when the object goes out of scope. */
+class temp_file
+{
+public:
+    temp_file(const std::string& content = std::string())
+      : m_filename("/tmp/ar_demultiplex_test.XXXXXX")
+    {
+        std::vector<char> buffer(m_filename.begin(), m_filename.end());
+        buffer.push_back('\0');
+
+        const int fd = mkstemp(&buffer.front());
+        if (fd < 0) {
+            throw std::runtime_error("could not create temporary file");
+        }
+
+        m_filename = &buffer.front();
+        if (::write(fd, content.data(), content.size()) != static_cast<ssize_t>(content.size())) {
+            ::close(fd);
+            throw std::runtime_error("could not write temporary file");
+        }
+
+        ::close(fd);
+    }
+
+    ~temp_file()
+    {
+        unlink(m_filename.c_str());
+    }
+
+    const std::string& filename() const
+    {
+        return m_filename;
+    }
+
+    /** Returns the current content of the file. */
+    std::string read() const
+    {
+        std::string result;
+        FILE* handle = fopen(m_filename.c_str(), "rb");
+        if (handle) {
+            char buffer[4096];
+            size_t nread = 0;
+            while ((nread = fread(buffer, 1, sizeof(buffer), handle))) {
+                result.append(buffer, nread);
+            }
+
+            fclose(handle);
+        }
+
+        return result;
+    }
+
+private:
+    //! Not implemented
+    temp_file(const temp_file&);
+    //! Not implemented
+    temp_file& operator=(const temp_file&);
+
+    std::string m_filename;
+};
+
+
+/** Returns the barcode table listing the barcodes in 'BARCODES'. */
+std::string barcode_table()
+{
+    std::ostringstream table;
+    for (size_t i = 0; i < BARCODE_COUNT; ++i) {
+        table << BARCODES[i][0] << " " << BARCODES[i][1] << " " << BARCODES[i][2] << "\n";
+    }
+
+    return table.str();
+}
+
+
+/** Returns the barcode (pair) that the nth read (pair) is expected to match. */
+int expected_barcode(size_t nth)
+{
+    switch (nth % 7) {
+        case 0:
+        case 1:
+        case 2:
+            return static_cast<int>(nth % 7);
+        case 3:
+            // Sample 3 is rare, so its cache is only flushed at EOF
+            return (nth % 140 == 3) ? 3 : 1;
+        case 4:
+            // Sample 0 with a single mismatch
+            return 0;
+        case 5:
+            return UNIDENTIFIED;
+        default:
+            return AMBIGUOUS;
+    }
+}
+
+
+/** Returns the name of the nth read (pair). */
+std::string read_name(size_t nth)
+{
+    std::ostringstream name;
+    name << "read_" << nth;
+
+    return name.str();
+}
+
+
+/** Returns the sequence following the barcode in the nth read (pair). */
+std::string insert_sequence(size_t nth)
+{
+    std::string sequence;
+    for (size_t i = 0; i < 30; ++i) {
+        sequence.push_back("ACGT"[(nth * 7 + i * (nth % 5 + 1)) % 4]);
+    }
+
+    return sequence;
+}
+
+
+/** Returns the nth read (pair), with barcodes matching 'expected_barcode'. */
+fastq_pair create_read_pair(size_t nth)
+{
+    std::string barcode_1;
+    std::string barcode_2;
+
+    switch (nth % 7) {
+        case 4:
+            barcode_1 = "AAAAAT";
+            barcode_2 = BARCODES[0][2];
+            break;
+        case 5:
+            barcode_1 = "TATATA";
+            barcode_2 = "ATATAT";
+            break;
+        case 6:
+            // One mismatch from both sample 2 and sample 3
+            barcode_1 = "ACACAG";
+            barcode_2 = "GTGTGT";
+            break;
+        default:
+            barcode_1 = BARCODES[expected_barcode(nth)][1];
+            barcode_2 = BARCODES[expected_barcode(nth)][2];
+            break;
+    }
+
+    const std::string insert = insert_sequence(nth);
+    const std::string sequence_1 = barcode_1 + insert;
+    const std::string sequence_2 = barcode_2 + insert;
+
+    return fastq_pair(fastq(read_name(nth), sequence_1, std::string(sequence_1.size(), 'I')),
+                      fastq(read_name(nth), sequence_2, std::string(sequence_2.size(), 'I')));
+}
+
+
+/** Returns the input split into chunks; the last chunk is marked as EOF. */
+std::vector<fastq_read_chunk*> create_input_chunks()
+{
+    std::vector<fastq_read_chunk*> chunks;
+    for (size_t nth = 0; nth < INPUT_READS; ++nth) {
+        if (nth % INPUT_CHUNK_SIZE == 0) {
+            chunks.push_back(fastq_read_chunk::create());
+        }
+
+        const fastq_pair pair = create_read_pair(nth);
+        chunks.back()->reads_1.push_back(pair.first);
+        chunks.back()->reads_2.push_back(pair.second);
+    }
+
+    chunks.back()->eof = true;
+
+    return chunks;
+}
+
+
+/** Parses the arguments for demultiplexing paired-end reads. */
+void setup_config(userconfig& config, const temp_file& barcodes)
+{
+    const std::string filename = barcodes.filename();
+    const char* args[] = {"AdapterRemoval",
+                          "--file1", "reads_1.fastq",
+                          "--file2", "reads_2.fastq",
+                          "--barcode-list", filename.c_str(),
+                          "--barcode-mm", "1"};
+    const int nargs = sizeof(args) / sizeof(args[0]);
+
+    std::vector<char*> argv;
+    std::vector<std::string> strings(args, args + nargs);
+    for (std::vector<std::string>::iterator it = strings.begin(); it != strings.end(); ++it) {
+        argv.push_back(&(*it)[0]);
+    }
+
+    ASSERT_EQ(argparse::pr_ok, config.parse_args(nargs, &argv.front()));
+    ASSERT_TRUE(config.paired_ended_mode);
+    ASSERT_EQ(BARCODE_COUNT, config.adapters.barcode_count());
+}
+
+
+/** State shared by the threads running 'demultiplex_pe_reads'. */
+struct demux_state
+{
+    demux_state(demultiplex_pe_reads& step_, const std::vector<fastq_read_chunk*>& input_)
+      : step(step_)
+      , input(input_)
+      , output(input_.size())
+      , lock()
+      , next(input_.size())
+    {
+    }
+
+    //! Step shared by all threads
+    demultiplex_pe_reads& step;
+    //! Input chunks; processed from last to first by the threads
+    const std::vector<fastq_read_chunk*>& input;
+    //! Output of 'step' for each input chunk
+    std::vector<chunk_vec> output;
+
+    //! Lock protecting 'next'
+    mutex lock;
+    //! Number of input chunks not yet claimed by a thread
+    size_t next;
+
+private:
+    //! Not implemented
+    demux_state(const demux_state&);
+    //! Not implemented
+    demux_state& operator=(const demux_state&);
+};
+
+
+void* demux_thread(void* ptr)
+{
+    demux_state* state = reinterpret_cast<demux_state*>(ptr);
+
+    while (true) {
+        size_t nth = 0;
+        {
+            mutex_locker locker(state->lock);
+            if (!state->next) {
+                break;
+            }
+
+            nth = --state->next;
+        }
+
+        state->output.at(nth) = state->step.process(state->input.at(nth));
+    }
+
+    return NULL;
+}
+
+
+/** Collected output of 'collect_demultiplexed_reads'. */
+struct demux_output
+{
+    demux_output()
+      : names()
+      , eof_chunks()
+      , last_step_ids()
+    {
+    }
+
+    //! Names of identified reads for each step ID, in the order received
+    std::map<size_t, std::vector<std::string> > names;
+    //! Number of chunks marked as EOF for each step ID
+    std::map<size_t, size_t> eof_chunks;
+    //! Step IDs of chunks returned when processing the last input chunk
+    std::vector<size_t> last_step_ids;
+};
+
+
+/**
+ * Runs 'collect_demultiplexed_reads' on the output of the demultiplexer, in
+ * the input order. Unidentified reads are written using 'write_fastq' to the
+ * files 'unidentified_1' and 'unidentified_2'.
+ */
+demux_statistics collect_reads(const userconfig& config,
+                               std::vector<chunk_vec>& demultiplexed,
+                               demux_output& output,
+                               const temp_file& unidentified_1,
+                               const temp_file& unidentified_2)
+{
+    collect_demultiplexed_reads collector(&config);
+    write_fastq writer_1(config, unidentified_1.filename());
+    write_fastq writer_2(config, unidentified_2.filename());
+
+    for (size_t i = 0; i < demultiplexed.size(); ++i) {
+        const chunk_vec& input = demultiplexed.at(i);
+        EXPECT_EQ(1, input.size());
+        EXPECT_EQ(static_cast<size_t>(ai_collect_demultiplexed), input.front().first);
+
+        output.last_step_ids.clear();
+        const chunk_vec chunks = collector.process(input.front().second);
+        for (chunk_vec::const_iterator it = chunks.begin(); it != chunks.end(); ++it) {
+            output.last_step_ids.push_back(it->first);
+
+            if (it->first == ai_write_unidentified_1 || it->first == ai_write_unidentified_2) {
+                if (dynamic_cast<fastq_output_chunk*>(it->second)->eof) {
+                    output.eof_chunks[it->first]++;
+                }
+
+                // Ownership of the chunk is taken by the writer
+                (it->first == ai_write_unidentified_1 ? writer_1 : writer_2).process(it->second);
+            } else {
+                fastq_read_chunk* reads = dynamic_cast<fastq_read_chunk*>(it->second);
+                EXPECT_EQ(reads->reads_1.size(), reads->reads_2.size());
+
+                std::vector<std::string>& names = output.names[it->first];
+                for (size_t j = 0; j < reads->reads_1.size(); ++j) {
+                    EXPECT_EQ(reads->reads_1.at(j).header(), reads->reads_2.at(j).header());
+                    names.push_back(reads->reads_1.at(j).header());
+                }
+
+                if (reads->eof) {
+                    output.eof_chunks[it->first]++;
+                }
+
+                fastq_read_chunk::recycle(reads);
+            }
+        }
+    }
+
+    // Throws if the writers did not receive a chunk marked as EOF
+    writer_1.finalize();
+    writer_2.finalize();
+
+    return collector.statistics();
+}
+
+
+/** Returns the names of the reads in a FASTQ file, in order. */
+std::vector<std::string> read_fastq_names(const temp_file& file)
+{
+    std::vector<std::string> names;
+    std::istringstream lines(file.read());
+
+    std::string line;
+    for (size_t nth = 0; std::getline(lines, line); ++nth) {
+        if (nth % 4 == 0) {
+            names.push_back(line.substr(1));
+        }
+    }
+
+    return names;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'demultiplex_pe_reads' / 'collect_demultiplexed_reads'
+
+TEST(demultiplex, multiple_workers_preserve_order)
+{
+    const temp_file barcodes(barcode_table());
+    userconfig config("AdapterRemoval", "test", "test");
+    ASSERT_NO_FATAL_FAILURE(setup_config(config, barcodes));
+
+    // Reference run; chunks are processed one at a time and in order
+    demux_statistics expected_stats(BARCODE_COUNT);
+    {
+        demultiplex_pe_reads step(&config);
+        std::vector<fastq_read_chunk*> input = create_input_chunks();
+        std::vector<chunk_vec> demultiplexed;
+        for (size_t i = 0; i < input.size(); ++i) {
+            demultiplexed.push_back(step.process(input.at(i)));
+        }
+
+        const temp_file unidentified_1;
+        const temp_file unidentified_2;
+        demux_output output;
+        expected_stats = collect_reads(config, demultiplexed, output,
+                                       unidentified_1, unidentified_2);
+    }
+
+    // Chunks are demultiplexed by multiple threads, in reverse order
+    demultiplex_pe_reads step(&config);
+    std::vector<fastq_read_chunk*> input = create_input_chunks();
+    demux_state state(step, input);
+
+    std::vector<pthread_t> threads(DEMUX_THREADS);
+    for (size_t i = 0; i < threads.size(); ++i) {
+        ASSERT_EQ(0, pthread_create(&threads.at(i), NULL, &demux_thread, &state));
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i) {
+        ASSERT_EQ(0, pthread_join(threads.at(i), NULL));
+    }
+
+    const temp_file unidentified_1;
+    const temp_file unidentified_2;
+    demux_output output;
+    const demux_statistics stats = collect_reads(config, state.output, output,
+                                                 unidentified_1, unidentified_2);
+
+    // Statistics match those of the single-threaded run
+    ASSERT_EQ(expected_stats.barcodes, stats.barcodes);
+    ASSERT_EQ(expected_stats.unidentified, stats.unidentified);
+    ASSERT_EQ(expected_stats.ambiguous, stats.ambiguous);
+    ASSERT_EQ(INPUT_READS, stats.total());
+
+    // Reads for each sample and unidentified reads are in the input order
+    std::vector<std::vector<std::string> > expected_names(BARCODE_COUNT);
+    std::vector<std::string> expected_unidentified;
+    for (size_t nth = 0; nth < INPUT_READS; ++nth) {
+        const int barcode = expected_barcode(nth);
+        if (barcode >= 0) {
+            expected_names.at(barcode).push_back(read_name(nth));
+        } else {
+            expected_unidentified.push_back(read_name(nth));
+        }
+    }
+
+    for (size_t nth = 0; nth < BARCODE_COUNT; ++nth) {
+        const size_t step_id = (nth + 1) * ai_analyses_offset;
+        ASSERT_EQ(expected_names.at(nth), output.names[step_id]) << "barcode " << nth;
+        ASSERT_EQ(expected_names.at(nth).size(), stats.barcodes.at(nth));
+    }
+
+    ASSERT_EQ(expected_unidentified, read_fastq_names(unidentified_1));
+    ASSERT_EQ(expected_unidentified, read_fastq_names(unidentified_2));
+
+    // The final flush sends every cache exactly once, and only then is EOF set
+    std::vector<size_t> step_ids;
+    step_ids.push_back(ai_write_unidentified_1);
+    step_ids.push_back(ai_write_unidentified_2);
+    for (size_t nth = 0; nth < BARCODE_COUNT; ++nth) {
+        step_ids.push_back((nth + 1) * ai_analyses_offset);
+    }
+
+    std::sort(step_ids.begin(), step_ids.end());
+    std::sort(output.last_step_ids.begin(), output.last_step_ids.end());
+    ASSERT_EQ(step_ids, output.last_step_ids);
+
+    ASSERT_EQ(step_ids.size(), output.eof_chunks.size());
+    for (size_t i = 0; i < step_ids.size(); ++i) {
+        ASSERT_EQ(1, output.eof_chunks[step_ids.at(i)]) << "step " << step_ids.at(i);
+    }
+}
+
+} // namespace ar
@@ -0,0 +1,422 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "filewriter.h"
+#include "linereader.h"
+
+namespace ar
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Helper functions
+
+/** Temporary file that is removed when the object goes out of scope. */
+class temp_file
+{
+public:
+    temp_file()
+      : m_filename("/tmp/ar_filewriter_test.XXXXXX")
+    {
+        std::vector<char> buffer(m_filename.begin(), m_filename.end());
+        buffer.push_back('\0');
+
+        const int fd = mkstemp(&buffer.front());
+        if (fd < 0) {
+            throw std::runtime_error("could not create temporary file");
+        }
+
+        ::close(fd);
+        m_filename = &buffer.front();
+    }
+
+    ~temp_file()
+    {
+        unlink(m_filename.c_str());
+    }
+
+    const std::string& filename() const
+    {
+        return m_filename;
+    }
+
+    /** Returns the current content of the file. */
+    std::string read() const
+    {
+        std::string result;
+        FILE* handle = fopen(m_filename.c_str(), "rb");
+        if (handle) {
+            char buffer[4096];
+            size_t nread = 0;
+            while ((nread = fread(buffer, 1, sizeof(buffer), handle))) {
+                result.append(buffer, nread);
+            }
+
+            fclose(handle);
+        }
+
+        return result;
+    }
+
+    /** Returns the current size of the file. */
+    size_t size() const
+    {
+        struct stat info;
+        if (stat(m_filename.c_str(), &info)) {
+            return 0;
+        }
+
+        return static_cast<size_t>(info.st_size);
+    }
+
+    /**
+     * Returns the size of the file, once it reaches 'expected' bytes or after
+     * a timeout; writes submitted via io_uring may complete asynchronously.
+     */
+    size_t wait_for_size(size_t expected) const
+    {
+        for (size_t i = 0; i < 1000 && size() < expected; ++i) {
+            usleep(1000);
+        }
+
+        return size();
+    }
+
+    /** Replaces the content of the file. */
+    void write(const std::string& data) const
+    {
+        FILE* handle = fopen(m_filename.c_str(), "wb");
+        ASSERT_TRUE(handle != NULL);
+        ASSERT_EQ(data.size(), fwrite(data.data(), 1, data.size(), handle));
+        fclose(handle);
+    }
+
+private:
+    //! Not implemented
+    temp_file(const temp_file&);
+    //! Not implemented
+    temp_file& operator=(const temp_file&);
+
+    std::string m_filename;
+};
+
+
+/** Returns a string of 'size' bytes with a repeating, non-trivial pattern. */
+std::string make_data(size_t size, size_t seed = 0)
+{
+    std::string result(size, '\0');
+    for (size_t i = 0; i < size; ++i) {
+        result.at(i) = static_cast<char>('!' + (i * 7 + seed) % 90);
+    }
+
+    return result;
+}
+
+
+/** Returns a buffer allocated using new[] containing a copy of 'data'. */
+unsigned char* make_buffer(const std::string& data)
+{
+    unsigned char* buffer = new unsigned char[data.size()];
+    std::memcpy(buffer, data.data(), data.size());
+
+    return buffer;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Buffering of writes
+
+TEST(file_writer, small_writes_are_coalesced)
+{
+    temp_file output;
+    const std::string data = make_data(BUFFER_SIZE * 2 + BUFFER_SIZE / 2);
+
+    file_writer writer(output.filename());
+    // Writes of varying sizes straddle the boundaries between buffers
+    for (size_t offset = 0, size = 1; offset < data.size(); size = size % 97 + 1) {
+        size = std::min(size, data.size() - offset);
+        writer.write(data.data() + offset, size);
+        offset += size;
+    }
+
+    // Nothing is written before the write threshold has been reached
+    ASSERT_EQ(0, output.size());
+    writer.close();
+
+    ASSERT_EQ(data, output.read());
+}
+
+
+TEST(file_writer, pending_data_is_written_at_threshold)
+{
+    temp_file output;
+    const std::string data = make_data(WRITE_THRESHOLD + 1);
+
+    file_writer writer(output.filename());
+    writer.write(data.data(), WRITE_THRESHOLD - 1);
+    ASSERT_EQ(0, output.size());
+
+    // Filling the last coalescing buffer triggers a write of all pending data
+    writer.write(data.data() + WRITE_THRESHOLD - 1, 1);
+    ASSERT_EQ(WRITE_THRESHOLD, output.wait_for_size(WRITE_THRESHOLD));
+
+    writer.write(data.data() + WRITE_THRESHOLD, 1);
+    writer.close();
+
+    ASSERT_EQ(data, output.read());
+}
+
+
+TEST(file_writer, flush_writes_buffered_data)
+{
+    temp_file output;
+    const std::string data = make_data(1024);
+
+    file_writer writer(output.filename());
+    writer.write(data);
+    ASSERT_EQ(0, output.size());
+
+    writer.flush();
+    ASSERT_EQ(data, output.read());
+    writer.close();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Buffers handed over to the writer
+
+TEST(file_writer, write_buffer_preserves_order)
+{
+    temp_file output;
+    std::string expected;
+
+    file_writer writer(output.filename());
+    for (size_t i = 0; i < 20; ++i) {
+        const std::string small = make_data(i * 1000 + 1, i);
+        writer.write(small);
+        expected += small;
+
+        // Large enough that some buffers are queued while others are pending
+        const std::string large = make_data(BUFFER_SIZE / 3 + i, i + 1);
+        writer.write_buffer(make_buffer(large), large.size());
+        expected += large;
+    }
+
+    writer.close();
+
+    ASSERT_EQ(expected, output.read());
+}
+
+
+TEST(file_writer, write_buffer_batches_exceed_iov_max)
+{
+    temp_file output;
+    std::string expected;
+
+    // More blocks than may be passed to a single writev call
+    file_writer writer(output.filename());
+    for (size_t i = 0; i < 5000; ++i) {
+        const std::string data = make_data(i % 13 + 1, i);
+        writer.write_buffer(make_buffer(data), data.size());
+        expected += data;
+    }
+
+    ASSERT_EQ(0, output.size());
+    writer.close();
+
+    ASSERT_EQ(expected, output.read());
+}
+
+
+TEST(file_writer, write_buffer_takes_ownership_on_error)
+{
+    file_writer writer("/dev/full");
+    writer.write(make_data(WRITE_THRESHOLD - 1));
+
+    // Sealing the pending data triggers the failing write; the buffer must
+    // be freed by the writer, as the caller has already given it up
+    const std::string data = make_data(BUFFER_SIZE);
+    ASSERT_THROW(writer.write_buffer(make_buffer(data), data.size()), io_error);
+    // Failed blocks are discarded, so nothing is left to be written
+    writer.close();
+}
+
+
+#ifdef AR_PTHREAD_SUPPORT
+///////////////////////////////////////////////////////////////////////////////
+// Writing to pipes
+
+/** State shared with the thread reading from a pipe. */
+struct pipe_reader
+{
+    pipe_reader()
+      : fd(-1)
+      , data()
+    {
+    }
+
+    //! Read end of the pipe
+    int fd;
+    //! Data read from the pipe
+    std::string data;
+};
+
+
+void* pipe_reader_thread(void* ptr)
+{
+    pipe_reader* reader = reinterpret_cast<pipe_reader*>(ptr);
+
+    // Small reads ensure that the pipe fills up, resulting in partial writes
+    char buffer[1000];
+    ssize_t nread = 0;
+    while ((nread = ::read(reader->fd, buffer, sizeof(buffer))) != 0) {
+        if (nread > 0) {
+            reader->data.append(buffer, static_cast<size_t>(nread));
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+TEST(file_writer, pipe_with_partial_writes)
+{
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+
+    pipe_reader reader;
+    reader.fd = fds[0];
+    pthread_t thread;
+    ASSERT_EQ(0, pthread_create(&thread, NULL, &pipe_reader_thread, &reader));
+
+    std::string expected;
+    {
+        std::ostringstream path;
+        path << "/dev/fd/" << fds[1];
+
+        file_writer writer(path.str());
+        ::close(fds[1]);
+
+        // Coalesced writes are vmspliced, while buffers are written as is
+        for (size_t i = 0; i < 50; ++i) {
+            const std::string small = make_data(i * 1001 + 1, i);
+            writer.write(small);
+            expected += small;
+
+            const std::string large = make_data(BUFFER_SIZE / 2 + i, i + 1);
+            writer.write_buffer(make_buffer(large), large.size());
+            expected += large;
+        }
+
+        writer.close();
+    }
+
+    ASSERT_EQ(0, pthread_join(thread, NULL));
+    ::close(fds[0]);
+
+    ASSERT_EQ(expected.size(), reader.data.size());
+    ASSERT_TRUE(expected == reader.data);
+}
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Writing to STDOUT
+
+TEST(file_writer, stdout_appends_to_redirected_file)
+{
+    temp_file output;
+    output.write("HEADER\n");
+
+    const std::string data = make_data(3 * 1024 * 1024);
+
+    // Redirect STDOUT to the end of a non-empty file, as in '(echo; cmd) > x'
+    const int fd = open(output.filename().c_str(), O_WRONLY);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(7, lseek(fd, 0, SEEK_END));
+    fflush(stdout);
+    const int original_stdout = dup(STDOUT_FILENO);
+    ASSERT_GE(original_stdout, 0);
+    ASSERT_GE(dup2(fd, STDOUT_FILENO), 0);
+    ::close(fd);
+
+    {
+        file_writer writer("-");
+        writer.write(data);
+        writer.close();
+    }
+
+    ASSERT_GE(dup2(original_stdout, STDOUT_FILENO), 0);
+    ::close(original_stdout);
+
+    ASSERT_EQ("HEADER\n" + data, output.read());
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Error handling
+
+TEST(file_writer, write_errors_include_filename)
+{
+    file_writer writer("/dev/full");
+    writer.write(make_data(1024));
+
+    try {
+        writer.close();
+        FAIL() << "expected io_error";
+    } catch (const io_error& error) {
+        ASSERT_NE(std::string::npos, std::string(error.what()).find("'/dev/full'"));
+    }
+}
+
+
+TEST(file_writer, open_errors_include_filename)
+{
+    try {
+        file_writer writer("/non-existent/directory/file.txt");
+        FAIL() << "expected io_error";
+    } catch (const io_error& error) {
+        const std::string message = error.what();
+        ASSERT_NE(std::string::npos, message.find("'/non-existent/directory/file.txt'"));
+    }
+}
+
+} // namespace ar
@@ -0,0 +1,159 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <algorithm>
+#include <stdexcept>
+#include <gtest/gtest.h>
+
+#include "numa.h"
+
+namespace ar
+{
+
+cpu_vec make_cpus(int first, int last)
+{
+    cpu_vec cpus;
+    for (int cpu = first; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+    }
+
+    return cpus;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'parse_cpu_list'
+
+TEST(numa_cpu_list, empty_list)
+{
+    ASSERT_EQ(cpu_vec(), parse_cpu_list(""));
+}
+
+
+TEST(numa_cpu_list, single_cpus)
+{
+    cpu_vec expected;
+    expected.push_back(0);
+    expected.push_back(4);
+    expected.push_back(17);
+
+    ASSERT_EQ(make_cpus(3, 3), parse_cpu_list("3"));
+    ASSERT_EQ(expected, parse_cpu_list("0,4,17"));
+}
+
+
+TEST(numa_cpu_list, ranges)
+{
+    cpu_vec expected = make_cpus(0, 3);
+    const cpu_vec upper = make_cpus(8, 11);
+    expected.push_back(6);
+    expected.insert(expected.end(), upper.begin(), upper.end());
+
+    ASSERT_EQ(make_cpus(0, 7), parse_cpu_list("0-7"));
+    ASSERT_EQ(make_cpus(5, 5), parse_cpu_list("5-5"));
+    ASSERT_EQ(expected, parse_cpu_list("0-3,6,8-11"));
+}
+
+
+TEST(numa_cpu_list, invalid_lists)
+{
+    ASSERT_THROW(parse_cpu_list("a"), std::invalid_argument);
+    ASSERT_THROW(parse_cpu_list("1,,2"), std::invalid_argument);
+    ASSERT_THROW(parse_cpu_list("-3"), std::invalid_argument);
+    ASSERT_THROW(parse_cpu_list("3-"), std::invalid_argument);
+    ASSERT_THROW(parse_cpu_list("4-2"), std::invalid_argument);
+    ASSERT_THROW(parse_cpu_list("1-2-3"), std::invalid_argument);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'numa_topology'
+
+TEST(numa_topology, nodes_are_subsets_of_allowed_cpus)
+{
+    const numa_topology topology;
+    const cpu_vec& allowed = topology.allowed_cpus();
+
+    for (size_t node = 0; node < topology.nodes(); ++node) {
+        const cpu_vec& cpus = topology.cpus(node);
+        ASSERT_FALSE(cpus.empty());
+
+        for (cpu_vec::const_iterator it = cpus.begin(); it != cpus.end(); ++it) {
+            ASSERT_NE(allowed.end(), std::find(allowed.begin(), allowed.end(), *it));
+        }
+    }
+}
+
+
+TEST(numa_thread_node, set_and_get)
+{
+    ASSERT_EQ(0u, current_numa_node());
+    set_current_numa_node(3);
+    ASSERT_EQ(3u, current_numa_node());
+    set_current_numa_node(0);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for cgroup CPU quotas
+
+TEST(numa_cgroup_quota, cpu_max)
+{
+    ASSERT_DOUBLE_EQ(0.0, parse_cgroup_cpu_max("max 100000"));
+    ASSERT_DOUBLE_EQ(2.0, parse_cgroup_cpu_max("200000 100000"));
+    ASSERT_DOUBLE_EQ(1.5, parse_cgroup_cpu_max("150000 100000"));
+}
+
+
+TEST(numa_cgroup_quota, invalid_cpu_max)
+{
+    ASSERT_THROW(parse_cgroup_cpu_max(""), std::invalid_argument);
+    ASSERT_THROW(parse_cgroup_cpu_max("max"), std::invalid_argument);
+    ASSERT_THROW(parse_cgroup_cpu_max("max 0"), std::invalid_argument);
+    ASSERT_THROW(parse_cgroup_cpu_max("1x 100000"), std::invalid_argument);
+    ASSERT_THROW(parse_cgroup_cpu_max("1 2 3"), std::invalid_argument);
+}
+
+
+TEST(numa_cgroup_quota, cfs_quota)
+{
+    ASSERT_DOUBLE_EQ(0.0, parse_cgroup_cfs_quota("-1", "100000"));
+    ASSERT_DOUBLE_EQ(4.0, parse_cgroup_cfs_quota("400000", "100000"));
+    ASSERT_DOUBLE_EQ(0.5, parse_cgroup_cfs_quota("50000", "100000"));
+}
+
+
+TEST(numa_cgroup_quota, invalid_cfs_quota)
+{
+    ASSERT_THROW(parse_cgroup_cfs_quota("", "100000"), std::invalid_argument);
+    ASSERT_THROW(parse_cgroup_cfs_quota("-2", "100000"), std::invalid_argument);
+    ASSERT_THROW(parse_cgroup_cfs_quota("100000", "-1"), std::invalid_argument);
+}
+
+
+TEST(numa_available_cpus, at_least_one_cpu)
+{
+    ASSERT_GE(available_cpus(), 1u);
+}
+
+} // namespace ar
@@ -0,0 +1,135 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <sstream>
+
+#include <gtest/gtest.h>
+
+#include "pipeline_stats.h"
+
+namespace ar
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'step_stats'
+
+TEST(step_stats, defaults)
+{
+    const step_stats stats;
+
+    ASSERT_EQ(0u, stats.chunks);
+    ASSERT_DOUBLE_EQ(0.0, stats.wall_time);
+    ASSERT_DOUBLE_EQ(0.0, stats.max_latency);
+    ASSERT_EQ(0u, stats.max_queue_depth);
+}
+
+
+TEST(step_stats, add_chunk)
+{
+    step_stats stats;
+    stats.add_chunk(1.0, 0.5, 0.25, 3);
+    stats.add_chunk(2.0, 1.5, 0.125, 5);
+
+    ASSERT_EQ(2u, stats.chunks);
+    ASSERT_DOUBLE_EQ(3.0, stats.wall_time);
+    ASSERT_DOUBLE_EQ(2.0, stats.cpu_time);
+    ASSERT_DOUBLE_EQ(0.375, stats.total_latency);
+    ASSERT_DOUBLE_EQ(0.25, stats.max_latency);
+    ASSERT_EQ(8u, stats.total_queue_depth);
+    ASSERT_EQ(5u, stats.max_queue_depth);
+}
+
+
+TEST(step_stats, merge)
+{
+    step_stats stats_1;
+    stats_1.add_chunk(1.0, 0.5, 0.25, 3);
+    step_stats stats_2;
+    stats_2.add_chunk(2.0, 1.5, 0.125, 5);
+
+    stats_1 += stats_2;
+
+    ASSERT_EQ(2u, stats_1.chunks);
+    ASSERT_DOUBLE_EQ(3.0, stats_1.wall_time);
+    ASSERT_DOUBLE_EQ(2.0, stats_1.cpu_time);
+    ASSERT_DOUBLE_EQ(0.25, stats_1.max_latency);
+    ASSERT_EQ(5u, stats_1.max_queue_depth);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'write_pipeline_stats_json'
+
+TEST(pipeline_stats, json_empty)
+{
+    const pipeline_stats stats;
+    std::ostringstream json;
+    write_pipeline_stats_json(json, stats);
+
+    ASSERT_EQ("{\n"
+              "  \"wall_time\": 0.000000,\n"
+              "  \"steps\": [\n"
+              "  ],\n"
+              "  \"workers\": [\n"
+              "  ]\n"
+              "}\n", json.str());
+}
+
+
+TEST(pipeline_stats, json_steps_and_workers)
+{
+    pipeline_stats stats;
+    stats.wall_time = 2.0;
+
+    step_stats step;
+    step.step_id = 3;
+    step.name = "read_\"fastq\"";
+    step.ordered = true;
+    step.add_chunk(1.0, 0.5, 0.25, 2);
+    step.add_chunk(1.0, 0.5, 0.75, 4);
+    stats.steps.push_back(step);
+
+    worker_stats worker;
+    worker.idle_time = 0.5;
+    worker.waits = 7;
+    stats.workers.push_back(worker);
+
+    std::ostringstream json;
+    write_pipeline_stats_json(json, stats);
+
+    ASSERT_EQ("{\n"
+              "  \"wall_time\": 2.000000,\n"
+              "  \"steps\": [\n"
+              "    {\"id\": 3, \"name\": \"read_\\\"fastq\\\"\", \"ordered\": true, "
+              "\"file_io\": false, \"chunks\": 2, \"wall_time\": 2.000000, "
+              "\"cpu_time\": 1.000000, \"mean_latency\": 0.500000, "
+              "\"max_latency\": 0.750000, \"mean_queue_depth\": 3.000000, "
+              "\"max_queue_depth\": 4}\n"
+              "  ],\n"
+              "  \"workers\": [\n"
+              "    {\"id\": 0, \"idle_time\": 0.500000, \"waits\": 7}\n"
+              "  ]\n"
+              "}\n", json.str());
+}
+
+} // namespace ar
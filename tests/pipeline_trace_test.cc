@@ -0,0 +1,115 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <sstream>
+
+#include <gtest/gtest.h>
+
+#include "pipeline_trace.h"
+
+namespace ar
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'write_pipeline_trace_json'
+
+TEST(pipeline_trace, empty_trace)
+{
+    const pipeline_trace trace;
+    std::ostringstream json;
+    write_pipeline_trace_json(json, trace);
+
+    ASSERT_EQ("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n"
+              "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+              "\"args\": {\"name\": \"AdapterRemoval\"}}\n"
+              "]}\n", json.str());
+}
+
+
+TEST(pipeline_trace, idle_event)
+{
+    pipeline_trace trace;
+    trace.start_time = 10.0;
+    trace.workers.resize(1);
+    trace.workers.back().push_back(trace_event(trace_event::idle, 0, 0, 0, 10.5, 10.75));
+
+    std::ostringstream json;
+    write_pipeline_trace_json(json, trace);
+
+    ASSERT_EQ("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n"
+              "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+              "\"args\": {\"name\": \"AdapterRemoval\"}},\n"
+              "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+              "\"args\": {\"name\": \"worker 0\"}},\n"
+              "{\"name\": \"idle\", \"cat\": \"idle\", \"ph\": \"X\", \"pid\": 1, "
+              "\"tid\": 0, \"ts\": 500000.000, \"dur\": 250000.000}\n"
+              "]}\n", json.str());
+}
+
+
+TEST(pipeline_trace, process_event_with_queue_wait)
+{
+    pipeline_trace trace;
+    trace.start_time = 10.0;
+    trace.step_names.push_back("");
+    trace.step_names.push_back("write_fastq");
+    trace.workers.resize(2);
+    trace.workers.back().push_back(trace_event(trace_event::process_chunk, 1, 7, 10.25, 10.5, 11.0));
+
+    std::ostringstream json;
+    write_pipeline_trace_json(json, trace);
+
+    ASSERT_EQ("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n"
+              "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+              "\"args\": {\"name\": \"AdapterRemoval\"}},\n"
+              "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+              "\"args\": {\"name\": \"worker 0\"}},\n"
+              "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, "
+              "\"args\": {\"name\": \"worker 1\"}},\n"
+              "{\"name\": \"write_fastq\", \"cat\": \"step\", \"ph\": \"X\", \"pid\": 1, "
+              "\"tid\": 1, \"ts\": 500000.000, \"dur\": 500000.000, "
+              "\"args\": {\"step\": 1, \"chunk\": 7}},\n"
+              "{\"name\": \"write_fastq\", \"cat\": \"queue\", \"ph\": \"b\", \"id\": 1, "
+              "\"pid\": 1, \"tid\": 1, \"ts\": 250000.000, "
+              "\"args\": {\"step\": 1, \"chunk\": 7}},\n"
+              "{\"name\": \"write_fastq\", \"cat\": \"queue\", \"ph\": \"e\", \"id\": 1, "
+              "\"pid\": 1, \"tid\": 1, \"ts\": 500000.000}\n"
+              "]}\n", json.str());
+}
+
+
+TEST(pipeline_trace, unnamed_step)
+{
+    pipeline_trace trace;
+    trace.workers.resize(1);
+    trace.workers.back().push_back(trace_event(trace_event::process_chunk, 3, 0, 0, 1.0, 2.0));
+
+    std::ostringstream json;
+    write_pipeline_trace_json(json, trace);
+
+    ASSERT_NE(std::string::npos, json.str().find("\"name\": \"step_3\""));
+    // No queue events are written if the time of queuing is unknown
+    ASSERT_EQ(std::string::npos, json.str().find("\"queue\""));
+}
+
+} // namespace ar
@@ -156,4 +156,59 @@ TEST(strutils_columnize, ljust)
     ASSERT_EQ("foo\n  bar\n  zood", columnize_text("foo bar\nzood", 0, 2));
 }
 
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'parse_size'
+
+TEST(strutils_parse_size, plain_numbers)
+{
+    ASSERT_EQ(0u, parse_size("0"));
+    ASSERT_EQ(1234u, parse_size("1234"));
+    ASSERT_EQ(1234u, parse_size("1234B"));
+}
+
+
+TEST(strutils_parse_size, suffixes)
+{
+    ASSERT_EQ(2u * 1024, parse_size("2K"));
+    ASSERT_EQ(2u * 1024, parse_size("2kb"));
+    ASSERT_EQ(512u * 1024 * 1024, parse_size("512M"));
+    ASSERT_EQ(512u * 1024 * 1024, parse_size("512mB"));
+    ASSERT_EQ(static_cast<size_t>(3) << 30, parse_size("3G"));
+}
+
+
+TEST(strutils_parse_size, invalid_values)
+{
+    ASSERT_THROW(parse_size(""), std::invalid_argument);
+    ASSERT_THROW(parse_size("M"), std::invalid_argument);
+    ASSERT_THROW(parse_size("-1"), std::invalid_argument);
+    ASSERT_THROW(parse_size("1.5G"), std::invalid_argument);
+    ASSERT_THROW(parse_size("10X"), std::invalid_argument);
+    ASSERT_THROW(parse_size("10KK"), std::invalid_argument);
+}
+
+
+TEST(strutils_parse_size, overflow)
+{
+    ASSERT_THROW(parse_size("99999999999999999999999"), std::invalid_argument);
+    ASSERT_THROW(parse_size("99999999999999999999T"), std::invalid_argument);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'json_string'
+
+TEST(strutils_json_string, plain_string)
+{
+    ASSERT_EQ("\"\"", json_string(""));
+    ASSERT_EQ("\"read_fastq\"", json_string("read_fastq"));
+}
+
+
+TEST(strutils_json_string, escaped_characters)
+{
+    ASSERT_EQ("\"a\\\"b\\\\c\"", json_string("a\"b\\c"));
+}
+
 } // namespace ar
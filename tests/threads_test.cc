@@ -0,0 +1,118 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <gtest/gtest.h>
+
+#include "threads.h"
+
+namespace ar
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'thread_parker'
+
+TEST(thread_parker, unpark_before_park)
+{
+    thread_parker parker;
+    parker.unpark();
+    parker.park();
+}
+
+
+TEST(thread_parker, park_and_unpark_repeatedly)
+{
+    thread_parker parker;
+    for (size_t i = 0; i < 1000; ++i) {
+        parker.unpark();
+        parker.park();
+    }
+}
+
+
+#ifdef AR_PTHREAD_SUPPORT
+TEST(thread_parker, park_with_timeout)
+{
+    thread_parker parker;
+    ASSERT_FALSE(parker.park(0.001));
+    ASSERT_FALSE(parker.park(0.001));
+}
+
+
+TEST(thread_parker, unpark_before_park_with_timeout)
+{
+    thread_parker parker;
+    parker.unpark();
+    ASSERT_TRUE(parker.park(0.001));
+    ASSERT_FALSE(parker.park(0.001));
+}
+
+
+/** State shared by the threads in 'unpark_from_other_thread'. */
+struct ping_pong
+{
+    ping_pong()
+      : ping()
+      , pong()
+      , rounds(0)
+    {
+    }
+
+    //! Parker of the main thread
+    thread_parker ping;
+    //! Parker of the other thread
+    thread_parker pong;
+    //! Number of rounds completed by the other thread
+    size_t rounds;
+};
+
+
+void* ping_pong_thread(void* ptr)
+{
+    ping_pong* state = reinterpret_cast<ping_pong*>(ptr);
+    for (size_t i = 0; i < 100; ++i) {
+        state->pong.park();
+        state->rounds++;
+        state->ping.unpark();
+    }
+
+    return NULL;
+}
+
+
+TEST(thread_parker, unpark_from_other_thread)
+{
+    ping_pong state;
+    pthread_t thread;
+    ASSERT_EQ(0, pthread_create(&thread, NULL, &ping_pong_thread, &state));
+
+    for (size_t i = 0; i < 100; ++i) {
+        state.pong.unpark();
+        state.ping.park();
+        ASSERT_EQ(i + 1, state.rounds);
+    }
+
+    ASSERT_EQ(0, pthread_join(thread, NULL));
+}
+#endif
+
+} // namespace ar
@@ -0,0 +1,105 @@
+/*************************************************************************\
+ * AdapterRemoval - cleaning next-generation sequencing reads            *
+ *                                                                       *
+ * Copyright (C) 2015 by Mikkel Schubert - mikkelsch@gmail.com           *
+ *                                                                       *
+ * If you use the program, please cite the paper:                        *
+ * S. Lindgreen (2012): AdapterRemoval: Easy Cleaning of Next Generation *
+ * Sequencing Reads, BMC Research Notes, 5:337                           *
+ * http://www.biomedcentral.com/1756-0500/5/337/                         *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+\*************************************************************************/
+#include <gtest/gtest.h>
+
+#include "ws_deque.h"
+
+namespace ar
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests for 'ws_deque'
+
+TEST(ws_deque, empty_deque)
+{
+    ws_deque<int*> deque;
+    int* value = NULL;
+
+    ASSERT_FALSE(deque.pop(value));
+    ASSERT_FALSE(deque.steal(value));
+}
+
+
+TEST(ws_deque, pop_is_last_in_first_out)
+{
+    int values[3] = { 1, 2, 3 };
+    ws_deque<int*> deque;
+    int* value = NULL;
+
+    deque.push(values);
+    deque.push(values + 1);
+    deque.push(values + 2);
+
+    ASSERT_TRUE(deque.pop(value));
+    ASSERT_EQ(values + 2, value);
+    ASSERT_TRUE(deque.pop(value));
+    ASSERT_EQ(values + 1, value);
+    ASSERT_TRUE(deque.pop(value));
+    ASSERT_EQ(values, value);
+    ASSERT_FALSE(deque.pop(value));
+}
+
+
+TEST(ws_deque, steal_is_first_in_first_out)
+{
+    int values[3] = { 1, 2, 3 };
+    ws_deque<int*> deque;
+    int* value = NULL;
+
+    deque.push(values);
+    deque.push(values + 1);
+    deque.push(values + 2);
+
+    ASSERT_TRUE(deque.steal(value));
+    ASSERT_EQ(values, value);
+    ASSERT_TRUE(deque.pop(value));
+    ASSERT_EQ(values + 2, value);
+    ASSERT_TRUE(deque.steal(value));
+    ASSERT_EQ(values + 1, value);
+    ASSERT_FALSE(deque.steal(value));
+    ASSERT_FALSE(deque.pop(value));
+}
+
+
+TEST(ws_deque, grows_when_full)
+{
+    int values[100];
+    ws_deque<int*> deque(2);
+    int* value = NULL;
+
+    for (size_t i = 0; i < 100; ++i) {
+        deque.push(values + i);
+    }
+
+    ASSERT_TRUE(deque.steal(value));
+    ASSERT_EQ(values, value);
+    for (size_t i = 99; i > 0; --i) {
+        ASSERT_TRUE(deque.pop(value));
+        ASSERT_EQ(values + i, value);
+    }
+
+    ASSERT_FALSE(deque.pop(value));
+}
+
+} // namespace ar